@@ -183,6 +183,8 @@ class FmiNetCdfQueryData
   std::vector<NFmiQueryData *> CreateQueryDatas(const std::string &theNcFileName);
   void Producer(const NFmiProducer &theProducer) { itsProducer = theProducer; }
   const std::string &ErrorMessage(void) const { return itsErrorMessage; }
+  // kuinko monella threadilla parametreja tytetn, tiedoston luku on silti sarjallinen
+  void ThreadCount(unsigned int theThreadCount) { itsThreadCount = theThreadCount; }
  private:
   void InitMetaInfo(NcFile &theNcFile);  // throws exceptions!
   void MakeAllMetaInfos(void);
@@ -222,4 +224,5 @@ class FmiNetCdfQueryData
 
   std::string itsErrorMessage;  // talletetaan thn mahdollinen virheilmoitus
   std::map<std::string, FmiParameterName> itsKnownParameterMap;
+  unsigned int itsThreadCount;  // 1 = tytetn parametrit jrjestyksess ilman threadeja
 };
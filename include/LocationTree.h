@@ -0,0 +1,87 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of the LocationTree class
+ */
+// ======================================================================
+/*!
+ * \class LocationTree
+ *
+ * A k-d tree of locations on the unit sphere. The locations are
+ * identified by their position in the vector given to the constructor,
+ * which normally is the location index of the querydata.
+ *
+ * Distances are great circle distances in meters on a sphere of
+ * radius kRearth. The distances are compared with a small tolerance,
+ * hence callers requiring an exact limit should recheck the distances
+ * of the returned locations.
+ *
+ */
+// ======================================================================
+
+#ifndef LOCATIONTREE_H
+#define LOCATIONTREE_H
+
+#include <newbase/NFmiPoint.h>
+
+#include <cstddef>
+#include <queue>
+#include <vector>
+
+class LocationTree
+{
+ public:
+  explicit LocationTree(const std::vector<NFmiPoint> &theLonLats);
+
+  std::size_t size() const { return itsPoints.size(); }
+  std::vector<std::size_t> within(const NFmiPoint &theLonLat, double theMaxDistance) const;
+  std::vector<std::size_t> nearest(const NFmiPoint &theLonLat,
+                                   std::size_t theMaxNumber,
+                                   double theMaxDistance) const;
+
+  // Incremental search returning the locations in increasing distance order,
+  // equally distant locations in increasing index order.
+
+  class Search
+  {
+   public:
+    Search(const LocationTree &theTree, const NFmiPoint &theLonLat, double theMaxDistance);
+    bool next(std::size_t &theIndex);
+
+   private:
+    struct Entry
+    {
+      double dist;       // squared chord length, or a lower bound for nodes
+      bool point;        // a location or a node
+      std::size_t item;  // location index or node number
+      bool operator<(const Entry &theOther) const;
+    };
+
+    const LocationTree &itsTree;
+    double itsPoint[3];
+    double itsMaxDist;
+    std::priority_queue<Entry> itsQueue;
+  };
+
+ private:
+  struct Node
+  {
+    std::size_t begin;  // range of itsOrder
+    std::size_t end;
+    std::size_t left;   // 0 for leaves
+    std::size_t right;
+    double min[3];      // bounding box
+    double max[3];
+  };
+
+  std::size_t build(std::size_t theBegin, std::size_t theEnd);
+
+  std::vector<double> itsPoints;     // x,y,z triplets
+  std::vector<std::size_t> itsOrder;  // location indexes ordered by node
+  std::vector<Node> itsNodes;
+
+};  // class LocationTree
+
+#endif  // LOCATIONTREE_H
+
+// ======================================================================
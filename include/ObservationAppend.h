@@ -0,0 +1,46 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of namespace ObservationAppend
+ *
+ * Helpers for converters which update a rolling observation window
+ * incrementally: a manifest of already consumed input files and the
+ * merge of newly decoded observations into the previous output.
+ */
+// ======================================================================
+
+#ifndef OBSERVATIONAPPEND_H
+#define OBSERVATIONAPPEND_H
+
+#include <newbase/NFmiMetTime.h>
+
+#include <set>
+#include <string>
+#include <utility>
+
+class NFmiQueryData;
+
+namespace ObservationAppend
+{
+// Observations whose new values replace the old ones even if new values
+// otherwise only fill in missing values. The station is identified by its
+// ident converted to a string, or by its name when matching by name.
+typedef std::set<std::pair<std::string, NFmiMetTime> > Corrections;
+
+std::set<std::string> ReadManifest(const std::string& theFile);
+
+void WriteManifest(const std::string& theFile, const std::set<std::string>& theFiles);
+
+NFmiQueryData* ReadPreviousData(const std::string& theFile);
+
+NFmiQueryData* Merge(NFmiQueryData* theOldData,
+                     NFmiQueryData* theNewData,
+                     int theWindowHours,
+                     bool fNewOverrides,
+                     bool fMatchByName,
+                     const Corrections& theCorrections = Corrections());
+}
+
+#endif  // OBSERVATIONAPPEND_H
+
+// ======================================================================
@@ -0,0 +1,68 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of the ParallelJobs class
+ */
+// ======================================================================
+/*!
+ * \class ParallelJobs
+ *
+ * Processes a fixed number of indexed jobs in parallel. Each thread
+ * takes the next unprocessed index from a shared counter until all
+ * jobs have been taken, hence the jobs are started in index order.
+ *
+ * The job function is given the index of the thread and the index
+ * of the job. Per-thread state such as a querydata info can then be
+ * allocated for threads() threads before calling run().
+ *
+ * An exception thrown by a job is stored, and no new jobs are started
+ * after it. Once all threads have finished, run() throws the error of
+ * the failed job with the smallest index. Since the jobs are started
+ * in index order, the reported error does not depend on timing.
+ *
+ * With a single thread the jobs are processed in the calling thread.
+ */
+// ======================================================================
+
+#ifndef PARALLELJOBS_H
+#define PARALLELJOBS_H
+
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+class ParallelJobs
+{
+ public:
+  typedef boost::function<void(unsigned int theThread, std::size_t theJob)> Job;
+
+  ParallelJobs(std::size_t theJobs, unsigned int theThreads);
+
+  std::size_t size() const { return itsErrors.size(); }
+  unsigned int threads() const { return itsThreads; }
+  boost::mutex &mutex() { return itsMutex; }
+
+  void run(const Job &theJob);
+
+ private:
+  ParallelJobs(const ParallelJobs &theJobs);
+  ParallelJobs &operator=(const ParallelJobs &theJobs);
+
+  void worker(const Job *theJob, unsigned int theThread);
+  bool next(std::size_t &theJob);
+  void fail(std::size_t theJob, const std::string &theError);
+
+  unsigned int itsThreads;
+  std::size_t itsNextJob;
+  bool itsFailed;
+  std::vector<std::string> itsErrors;
+  boost::mutex itsMutex;
+
+};  // class ParallelJobs
+
+#endif  // PARALLELJOBS_H
+
+// ======================================================================
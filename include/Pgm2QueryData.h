@@ -8,8 +8,14 @@
 #ifndef FMI_RADCONTOUR_PGM2QUERYDATA_H
 #define FMI_RADCONTOUR_PGM2QUERYDATA_H
 
+#include <newbase/NFmiDataIdent.h>
+#include <newbase/NFmiHPlaceDescriptor.h>
+#include <newbase/NFmiLevel.h>
+#include <newbase/NFmiMetTime.h>
+
 #include <string>
 
+class NFmiFastQueryInfo;
 class NFmiQueryData;
 
 namespace FMI
@@ -50,6 +56,51 @@ struct PgmReadOptions
   }
 };
 
+// The header information of a PGM file, enough to place its raster
+// into a querydata without reading the raster itself
+
+struct PgmFileInfo
+{
+  std::string filename;
+  int width;
+  int height;
+  int bytes;           // 255 or 65535
+  int header_end_pos;  // start of the raster in the file
+  float scale;
+  float base;
+  NFmiDataIdent param;
+  NFmiLevel level;  // missing if the header has no level
+  NFmiMetTime origintime;
+  NFmiMetTime validtime;
+  NFmiHPlaceDescriptor hdesc;
+
+  PgmFileInfo()
+      : filename(),
+        width(0),
+        height(0),
+        bytes(0),
+        header_end_pos(0),
+        scale(1.0f),
+        base(0.0f),
+        param(),
+        level(),
+        origintime(),
+        validtime(),
+        hdesc()
+  {
+  }
+};
+
+bool ReadPgmFileInfo(const std::string &theFileName,
+                     const PgmReadOptions &theOptions,
+                     std::ostream &theReportStream,
+                     PgmFileInfo &theFileInfo);
+
+bool FillQueryData(NFmiFastQueryInfo &theInfo,
+                   const PgmFileInfo &theFileInfo,
+                   const PgmReadOptions &theOptions,
+                   std::ostream &theReportStream);
+
 NFmiQueryData *Pgm2QueryData(const std::string &theFileName,
                              const PgmReadOptions &theOptions,
                              std::ostream &theReportStream);
@@ -11,6 +11,17 @@
  * querydata sources simultaneously, and to return the queryinfo
  * containing the desired station number or coordinate.
  *
+ * The files are opened lazily. Station and coordinate searches
+ * read only the headers of the files, and the data itself is
+ * memory mapped only when values are needed. If a memory limit
+ * is set, the least recently used datas are closed when the
+ * total size of the open files exceeds it. The info returned
+ * by info() remains valid until the location is changed, the data
+ * returned by data() for as long as it is referenced.
+ *
+ * A long lived manager should call refresh() before each query so
+ * that files replaced since they were read are read again.
+ *
  */
 // ======================================================================
 
@@ -18,13 +29,18 @@
 #define QUERYDATAMANAGER_H
 
 #include <newbase/NFmiFastQueryInfo.h>
-#include <boost/tuple/tuple.hpp>
 
+#include <boost/shared_ptr.hpp>
+
+#include <cstddef>
+#include <ctime>
 #include <map>
 #include <set>
 #include <string>
 #include <vector>
 
+class LocationTree;
+
 class QueryDataManager
 {
  public:
@@ -32,6 +48,8 @@ class QueryDataManager
   QueryDataManager();
 
   void multimode() { itsMultiMode = true; }
+  void memorylimit(std::size_t theBytes);
+  void refresh();
   std::set<int> stations();
 
   void searchpath(const std::string &theSearchPath);
@@ -43,6 +61,7 @@ class QueryDataManager
 
   bool isset() const;
   NFmiFastQueryInfo &info() const;
+  boost::shared_ptr<NFmiQueryData> data() const;
 
   std::map<double, int> nearest(const NFmiPoint &theLonLat,
                                 int theMaxNumber,
@@ -56,13 +75,38 @@ class QueryDataManager
   std::string itsSearchPath;
   bool itsMultiMode;
 
-  typedef boost::tuple<std::string, NFmiQueryData *, NFmiFastQueryInfo *> value_type;
+  struct value_type
+  {
+    explicit value_type(const std::string &theName);
+
+    std::string name;                       // name given by the user
+    std::string filename;                   // name completed with the search path
+    std::time_t modified;                   // modification time of the file when it was found
+    NFmiQueryInfo *header;                  // descriptors only
+    boost::shared_ptr<NFmiQueryData> data;  // memory mapped data, if open
+    NFmiFastQueryInfo *info;                // info for the open data
+    LocationTree *tree;                     // point locations, if needed
+    std::size_t size;                       // size of the open data
+    unsigned long lastuse;                  // for finding the least recently used data
+  };
 
   typedef std::vector<value_type> storage_type;
   storage_type itsData;
   storage_type::const_iterator itsCurrentData;
 
+  std::set<int> itsStations;
+  bool itsStationsKnown;
+
+  std::size_t itsMemoryLimit;
+  std::size_t itsMemoryUsed;
+  unsigned long itsUseCounter;
+
+  const std::string &filename(storage_type::iterator it);
+  NFmiQueryInfo &header(storage_type::iterator it);
   NFmiFastQueryInfo &require(storage_type::iterator it);
+  const LocationTree &tree(storage_type::iterator it);
+  void release(storage_type::iterator it);
+  void enforcelimit(storage_type::iterator theKept);
 
 };  // class QueryDataManager
 
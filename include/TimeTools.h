@@ -17,6 +17,8 @@ namespace TimeTools
 const NFmiTime toLocalTime(const NFmiTime& theUtcTime);
 
 const NFmiTime timezone_time(const NFmiTime& theUTCTime, const std::string& theZone);
+
+bool is_dst(const NFmiTime& theUTCTime, const std::string& theZone);
 }
 
 #endif  // TIMETOOLS_H
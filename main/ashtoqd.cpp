@@ -23,6 +23,8 @@
  */
 // ======================================================================
 
+#include "ParallelJobs.h"
+
 #include <macgyver/StringConversion.h>
 #include <macgyver/TimeParser.h>
 #include <macgyver/TimeFormatter.h>
@@ -31,8 +33,6 @@
 #include <newbase/NFmiAreaFactory.h>
 #include <newbase/NFmiFastQueryInfo.h>
 #include <newbase/NFmiGrid.h>
-#include <newbase/NFmiIndexMask.h>
-#include <newbase/NFmiIndexMaskTools.h>
 #include <newbase/NFmiHPlaceDescriptor.h>
 #include <newbase/NFmiLevelType.h>
 #include <newbase/NFmiParamDescriptor.h>
@@ -46,6 +46,7 @@
 #include <boost/algorithm/string/classification.hpp>
 #include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string/trim.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
@@ -53,10 +54,13 @@
 #include <boost/regex.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+#include <algorithm>
 #include <cmath>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <string>
+#include <vector>
 
 namespace fs = boost::filesystem;
 
@@ -90,6 +94,7 @@ struct Options
   std::string outfile;                  // -o --outfile
   std::string producername;             // --producername
   long producernumber;                  // --producernumber
+  unsigned int threads;                 // -j --threads
 };
 
 Options options;
@@ -109,7 +114,8 @@ Options::Options()
       indir("."),
       outfile("-"),
       producername("EGRR_VAAC"),
-      producernumber(120)
+      producernumber(120),
+      threads(1)
 {
 }
 // ----------------------------------------------------------------------
@@ -139,7 +145,10 @@ bool parse_options(int argc, char* argv[], Options& options)
       "extract boundary instead of concentrations")(
       "producer,p", po::value(&producerinfo), "producer number,name")(
       "producernumber", po::value(&options.producernumber), "producer number")(
-      "producername", po::value(&options.producername), "producer name");
+      "producername", po::value(&options.producername), "producer name")(
+      "threads,j",
+      po::value(&options.threads),
+      "number of threads processing the files (default: 1, 0 = all cores)");
 
   po::positional_options_description p;
   p.add("indir", 1);
@@ -675,23 +684,156 @@ double extract_concentration(const fs::path& file)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Extract the information from a single ash advisory file
+ * \brief An ash polygon in grid coordinates
+ *
+ * Each ring is a closed subpath of the advisory polygon. The value
+ * is the concentration, or 1 for boundaries. A polygon without rings
+ * still clears its slice to zero.
+ */
+// ----------------------------------------------------------------------
+
+typedef std::vector<NFmiPoint> AshRing;
+
+struct AshPolygon
+{
+  AshPolygon() : rings(), value(0) {}
+  std::vector<AshRing> rings;
+  double value;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The polygons read from a single advisory file
+ */
+// ----------------------------------------------------------------------
+
+struct AshFile
+{
+  explicit AshFile(const fs::path& thePath) : path(thePath), timeindex(0), polygons() {}
+  fs::path path;
+  unsigned long timeindex;
+  std::vector<std::pair<unsigned long, AshPolygon> > polygons;  // level index and polygon
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief All the polygons of a single output time and level
+ */
+// ----------------------------------------------------------------------
+
+struct AshSlice
+{
+  AshSlice() : timeindex(0), levelindex(0), polygons() {}
+  unsigned long timeindex;
+  unsigned long levelindex;
+  std::vector<const AshPolygon*> polygons;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Convert a lonlat edge into grid coordinates
+ *
+ * The edges are straight lines in lonlat space, hence the edge is
+ * subdivided so that the pieces are at most one grid cell long.
+ * The end point is not included. Points which cannot be projected
+ * (NaN or infinite grid coordinates) are dropped.
  */
 // ----------------------------------------------------------------------
 
-void copy_ash_concentration_file(NFmiFastQueryInfo& info, const fs::path& file)
+bool finite_point(const NFmiPoint& p) { return std::isfinite(p.X()) && std::isfinite(p.Y()); }
+
+void add_grid_edge(const NFmiGrid& grid, const NFmiPoint& p1, const NFmiPoint& p2, AshRing& ring)
 {
-  info.First();
-  info.Param(kFmiAshConcentration);
+  NFmiPoint xy1 = grid.LatLonToGrid(p1);
+  NFmiPoint xy2 = grid.LatLonToGrid(p2);
+  if (finite_point(xy1)) ring.push_back(xy1);
+
+  double len = std::max(std::abs(xy2.X() - xy1.X()), std::abs(xy2.Y() - xy1.Y()));
+  double maxparts = grid.XNumber() + grid.YNumber();
+  if (!(len <= maxparts)) len = maxparts;  // also points outside the projection
+  int parts = static_cast<int>(std::ceil(len));
 
-  // The time
+  for (int i = 1; i < parts; i++)
+  {
+    double f = static_cast<double>(i) / parts;
+    NFmiPoint p(p1.X() + f * (p2.X() - p1.X()), p1.Y() + f * (p2.Y() - p1.Y()));
+    NFmiPoint xy = grid.LatLonToGrid(p);
+    if (finite_point(xy)) ring.push_back(xy);
+  }
+}
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Convert a lonlat polygon into grid coordinates
+ *
+ * Unclosed subpaths are closed implicitly.
+ */
+// ----------------------------------------------------------------------
+
+AshPolygon make_grid_polygon(const NFmiGrid& grid, const NFmiSvgPath& path, double value)
+{
+  AshPolygon polygon;
+  polygon.value = value;
+
+  std::vector<std::vector<NFmiPoint> > subpaths;
+  for (NFmiSvgPath::const_iterator it = path.begin(); it != path.end(); ++it)
+  {
+    switch (it->itsType)
+    {
+      case NFmiSvgPath::kElementMoveto:
+        subpaths.push_back(std::vector<NFmiPoint>());
+      // fall through
+      case NFmiSvgPath::kElementLineto:
+        if (subpaths.empty()) subpaths.push_back(std::vector<NFmiPoint>());
+        subpaths.back().push_back(NFmiPoint(it->itsX, it->itsY));
+        break;
+      case NFmiSvgPath::kElementNotValid:
+      case NFmiSvgPath::kElementClosePath:
+        break;
+    }
+  }
+
+  BOOST_FOREACH (const std::vector<NFmiPoint>& points, subpaths)
+  {
+    if (points.size() < 3) continue;
+    AshRing ring;
+    for (std::size_t i = 0; i < points.size(); i++)
+      add_grid_edge(grid, points[i], points[(i + 1) % points.size()], ring);
+    if (ring.size() >= 3) polygon.rings.push_back(ring);
+  }
+
+  return polygon;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the time of the querydata based on the file name
+ */
+// ----------------------------------------------------------------------
+
+unsigned long ash_file_time_index(NFmiFastQueryInfo& info, const fs::path& file)
+{
   std::string stamp = file.filename().string().substr(validtime_position_in_filename, 12);
   boost::posix_time::ptime validtime = Fmi::TimeParser::parse(stamp);
 
   if (!info.Time(tomettime(validtime)))
     throw std::runtime_error("Internal error in setting validtime " + to_simple_string(validtime));
 
+  return info.TimeIndex();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Extract the information from a single ash advisory file
+ */
+// ----------------------------------------------------------------------
+
+void read_ash_concentration_file(NFmiFastQueryInfo& info, AshFile& ashfile)
+{
+  const fs::path& file = ashfile.path;
+
+  ashfile.timeindex = ash_file_time_index(info, file);
+
   // The level from FLaaa-bbb
 
   std::string levelname = file.filename().string().substr(level_position_in_filename, 9);
@@ -703,40 +845,10 @@ void copy_ash_concentration_file(NFmiFastQueryInfo& info, const fs::path& file)
   // Read the polygon
 
   NFmiSvgPath path = read_ash_concentration_polygon(file);
-
-  // Poke the concentration values into the querydata.
-  // High concentrations are inside low concentration areas,
-  // so we do not overwrite old values if they are higher.
-
   double concentration = extract_concentration(file);
 
-#if 0
-  // Slow fool proof way
-  for(info.ResetLocation(); info.NextLocation(); )
-	{
-	  if(info.FloatValue() == kFloatMissing)
-		info.FloatValue(0);
-	  if(concentration > info.FloatValue())
-		{
-		  const NFmiPoint & latlon = info.LatLon();
-		  if(path.IsInside(latlon))
-			info.FloatValue(concentration);
-		}
-	}
-#else
-  // Fast way
-  for (info.ResetLocation(); info.NextLocation();)
-    if (info.FloatValue() == kFloatMissing) info.FloatValue(0);
-
-  NFmiIndexMask mask = NFmiIndexMaskTools::MaskInside(*info.Grid(), path);
-
-  for (NFmiIndexMask::const_iterator it = mask.begin(); it != mask.end(); ++it)
-  {
-    info.LocationIndex(*it);
-    if (concentration > info.FloatValue()) info.FloatValue(concentration);
-  }
-
-#endif
+  ashfile.polygons.push_back(
+      std::make_pair(info.LevelIndex(), make_grid_polygon(*info.Grid(), path, concentration)));
 }
 
 // ----------------------------------------------------------------------
@@ -745,25 +857,16 @@ void copy_ash_concentration_file(NFmiFastQueryInfo& info, const fs::path& file)
  */
 // ----------------------------------------------------------------------
 
-void copy_ash_boundary_file(NFmiFastQueryInfo& info, const fs::path& file)
+void read_ash_boundary_file(NFmiFastQueryInfo& info, AshFile& ashfile)
 {
-  info.First();
-  info.Param(kFmiAshOnOff);
-
-  // The time
-
-  std::string stamp = file.filename().string().substr(validtime_position_in_filename, 12);
-  boost::posix_time::ptime validtime = Fmi::TimeParser::parse(stamp);
+  const fs::path& file = ashfile.path;
 
-  if (!info.Time(tomettime(validtime)))
-    throw std::runtime_error("Internal error in setting validtime " + to_simple_string(validtime));
+  ashfile.timeindex = ash_file_time_index(info, file);
 
   // Read the polygon
 
   std::map<std::string, NFmiSvgPath> paths = read_ash_boundary_polygons(file);
 
-  // Poke the on/off values into the querydata.
-
   // Needed since BOOST_FOREACH does not like templates in it, atleast not with g++
   typedef std::map<std::string, NFmiSvgPath>::value_type value_type;
 
@@ -778,20 +881,232 @@ void copy_ash_boundary_file(NFmiFastQueryInfo& info, const fs::path& file)
     if (!info.Level(NFmiLevel(kFmiFlightLevel, flightlevel, levelvalue)))
       throw std::runtime_error("Internal error in setting level " + flightlevel);
 
-    // Quick way to set values
-    for (info.ResetLocation(); info.NextLocation();)
-      if (info.FloatValue() == kFloatMissing) info.FloatValue(0);
+    ashfile.polygons.push_back(
+        std::make_pair(info.LevelIndex(), make_grid_polygon(*info.Grid(), path, 1)));
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Extract the information from a concentration or boundary file
+ */
+// ----------------------------------------------------------------------
+
+void read_ash_file(NFmiFastQueryInfo& info, AshFile& ashfile)
+{
+  if (!options.boundaries)
+    read_ash_concentration_file(info, ashfile);
+  else
+    read_ash_boundary_file(info, ashfile);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Rasterize a polygon into a grid of values
+ *
+ * Grid points inside the polygon by the even-odd rule are raised to
+ * the value of the polygon. High concentrations are inside low
+ * concentration areas, so higher old values are not overwritten.
+ * Only the rows and columns within the bounding box of the polygon
+ * are visited.
+ *
+ * Grid points exactly on the boundary are decided by half-open
+ * intervals, so that a point shared by two adjacent polygons is
+ * filled by exactly one of them:
+ *
+ *  - an edge covers the rows y with ymin <= y < ymax, hence a vertex
+ *    at the row is counted once and horizontal edges never
+ *  - on each row the point x is inside when x1 <= x < x2 for a pair
+ *    of consecutive crossings x1 and x2
+ *
+ * Thus points on the left and lower boundary are inside, points on
+ * the right and upper boundary are outside. No tolerance is used,
+ * the decision is made on the grid coordinates of the subdivided
+ * edges as computed by add_grid_edge.
+ */
+// ----------------------------------------------------------------------
+
+struct ScanEdge
+{
+  double ymin;
+  double ymax;
+  double x;     // x at ymin
+  double dxdy;  // inverse slope
+  bool operator<(const ScanEdge& other) const { return ymin < other.ymin; }
+};
+
+// Clamp a grid coordinate before converting it to an index
+int clamp_index(double value, int lo, int hi)
+{
+  return static_cast<int>(std::max<double>(lo, std::min<double>(hi, value)));
+}
+
+void rasterize_polygon(const AshPolygon& polygon, int width, int height, std::vector<float>& values)
+{
+  std::vector<ScanEdge> edges;
+
+  BOOST_FOREACH (const AshRing& ring, polygon.rings)
+  {
+    for (std::size_t i = 0; i < ring.size(); i++)
+    {
+      const NFmiPoint& p1 = ring[i];
+      const NFmiPoint& p2 = ring[(i + 1) % ring.size()];
+      if (p1.Y() == p2.Y()) continue;  // horizontal edges never cross a scanline
+
+      const NFmiPoint& lo = (p1.Y() < p2.Y() ? p1 : p2);
+      const NFmiPoint& hi = (p1.Y() < p2.Y() ? p2 : p1);
+      ScanEdge edge;
+      edge.ymin = lo.Y();
+      edge.ymax = hi.Y();
+      edge.x = lo.X();
+      edge.dxdy = (hi.X() - lo.X()) / (hi.Y() - lo.Y());
+      if (std::isfinite(edge.dxdy)) edges.push_back(edge);
+    }
+  }
+
+  if (edges.empty()) return;
+
+  std::sort(edges.begin(), edges.end());
+
+  double ymax = edges[0].ymax;
+  BOOST_FOREACH (const ScanEdge& edge, edges)
+    ymax = std::max(ymax, edge.ymax);
+
+  // Rows y with ymin <= y < ymax, clipped to the grid
+
+  int row1 = clamp_index(std::ceil(edges[0].ymin), 0, height);
+  int row2 = clamp_index(std::ceil(ymax) - 1, -1, height - 1);
+
+  const float value = static_cast<float>(polygon.value);
+  std::size_t next_edge = 0;
+  std::vector<const ScanEdge*> active;
+  std::vector<double> crossings;
+
+  for (int row = row1; row <= row2; row++)
+  {
+    const double y = row;
 
-    NFmiIndexMask mask = NFmiIndexMaskTools::MaskInside(*info.Grid(), path);
+    while (next_edge < edges.size() && edges[next_edge].ymin <= y)
+      active.push_back(&edges[next_edge++]);
 
-    for (NFmiIndexMask::const_iterator it = mask.begin(); it != mask.end(); ++it)
+    crossings.clear();
+    std::size_t n = 0;
+    for (std::size_t i = 0; i < active.size(); i++)
     {
-      info.LocationIndex(*it);
-      info.FloatValue(1);
+      if (active[i]->ymax <= y) continue;  // finished edges are dropped
+      active[n++] = active[i];
+      crossings.push_back(active[i]->x + (y - active[i]->ymin) * active[i]->dxdy);
+    }
+    active.resize(n);
+
+    std::sort(crossings.begin(), crossings.end());
+
+    float* line = &values[static_cast<std::size_t>(row) * width];
+    for (std::size_t i = 0; i + 1 < crossings.size(); i += 2)
+    {
+      // Columns x with x1 <= x < x2, clipped to the grid
+      int col1 = clamp_index(std::ceil(crossings[i]), 0, width);
+      int col2 = clamp_index(std::ceil(crossings[i + 1]) - 1, -1, width - 1);
+      for (int col = col1; col <= col2; col++)
+        if (value > line[col]) line[col] = value;
     }
   }
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Fill a single time and level of the data
+ *
+ * The slice is initialized to zero, since it is covered by an advisory.
+ */
+// ----------------------------------------------------------------------
+
+void fill_ash_slice(NFmiFastQueryInfo& info, AshSlice& slice)
+{
+  const NFmiGrid& grid = *info.Grid();
+  const int width = grid.XNumber();
+  const int height = grid.YNumber();
+
+  std::vector<float> values(static_cast<std::size_t>(width) * height, 0);
+
+  BOOST_FOREACH (const AshPolygon* polygon, slice.polygons)
+    rasterize_polygon(*polygon, width, height, values);
+
+  info.FirstParam();
+  info.TimeIndex(slice.timeindex);
+  info.LevelIndex(slice.levelindex);
+
+  std::size_t i = 0;
+  for (info.ResetLocation(); info.NextLocation();)
+    info.FloatValue(values[i++]);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Process a single task with the info of the thread
+ */
+// ----------------------------------------------------------------------
+
+template <typename Task>
+void process_task(void (*process)(NFmiFastQueryInfo&, Task&),
+                  std::vector<Task>* tasks,
+                  std::vector<NFmiFastQueryInfo>* infos,
+                  unsigned int thread,
+                  std::size_t i)
+{
+  process((*infos)[thread], (*tasks)[i]);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Process the tasks in parallel
+ *
+ * Each thread has its own info. The first failure in processing
+ * order is reported.
+ */
+// ----------------------------------------------------------------------
+
+template <typename Task>
+void process_tasks(void (*process)(NFmiFastQueryInfo&, Task&),
+                   std::vector<Task>& tasks,
+                   NFmiFastQueryInfo& info)
+{
+  ParallelJobs parallel(tasks.size(), options.threads);
+  std::vector<NFmiFastQueryInfo> infos(parallel.threads(), info);
+  parallel.run(boost::bind(process_task<Task>, process, &tasks, &infos, _1, _2));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Group the polygons of all files by output time and level
+ *
+ * The polygons stay in file order within each slice.
+ */
+// ----------------------------------------------------------------------
+
+std::vector<AshSlice> make_ash_slices(const std::vector<AshFile>& ashfiles)
+{
+  typedef std::map<std::pair<unsigned long, unsigned long>, AshSlice> SliceMap;
+  SliceMap slices;
+
+  BOOST_FOREACH (const AshFile& ashfile, ashfiles)
+  {
+    for (std::size_t i = 0; i < ashfile.polygons.size(); i++)
+    {
+      unsigned long levelindex = ashfile.polygons[i].first;
+      AshSlice& slice = slices[std::make_pair(ashfile.timeindex, levelindex)];
+      slice.timeindex = ashfile.timeindex;
+      slice.levelindex = levelindex;
+      slice.polygons.push_back(&ashfile.polygons[i].second);
+    }
+  }
+
+  std::vector<AshSlice> ret;
+  for (SliceMap::const_iterator it = slices.begin(); it != slices.end(); ++it)
+    ret.push_back(it->second);
+  return ret;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Main program without exception handling
@@ -857,15 +1172,14 @@ int run(int argc, char* argv[])
 
   info.SetProducer(NFmiProducer(options.producernumber, options.producername));
 
-  // Add each file to the data
+  // Read the polygons of each file, then fill each time and level
+  // of the data separately. Slices with no files remain missing.
 
-  BOOST_FOREACH (const fs::path& file, files)
-  {
-    if (!options.boundaries)
-      copy_ash_concentration_file(info, file);
-    else
-      copy_ash_boundary_file(info, file);
-  }
+  std::vector<AshFile> ashfiles(files.begin(), files.end());
+  process_tasks(read_ash_file, ashfiles, info);
+
+  std::vector<AshSlice> slices = make_ash_slices(ashfiles);
+  process_tasks(fill_ash_slice, slices, info);
 
   // Output
 
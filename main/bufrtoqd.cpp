@@ -33,6 +33,8 @@ This file is part of libECBUFR.
                                            // warnings that e.g. MSVC++ 2012 generates
 #endif
 
+#include "ParallelJobs.h"
+
 #include <macgyver/StringConversion.h>
 #include <macgyver/CsvReader.h>
 
@@ -61,11 +63,14 @@ This file is part of libECBUFR.
 #include <boost/filesystem/operations.hpp>
 #include <boost/foreach.hpp>
 #include <boost/program_options.hpp>
+#include <boost/thread/mutex.hpp>
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 extern "C" {
 #include <bufr_api.h>
@@ -224,6 +229,7 @@ struct Options
   long producernumber;       // --producernumber
   bool autoproducer;         // -a --autoproducer
   int messagenumber;         // -m --message
+  unsigned int threads;      // -j --threads
 };
 
 Options options;
@@ -256,7 +262,8 @@ Options::Options()
       producername("UNKNOWN"),
       producernumber(0),
       autoproducer(false),
-      messagenumber(0)
+      messagenumber(0),
+      threads(1)
 {
 }
 // ----------------------------------------------------------------------
@@ -292,7 +299,10 @@ bool parse_options(int argc, char *argv[], Options &options)
       "producer,p", po::value(&producerinfo), "producer number,name")(
       "producernumber", po::value(&options.producernumber), "producer number (default: 0)")(
       "producername", po::value(&options.producername), "producer name (default: UNKNOWN)")(
-      "autoproducer,a", po::bool_switch(&options.autoproducer), "guess producer automatically");
+      "autoproducer,a", po::bool_switch(&options.autoproducer), "guess producer automatically")(
+      "threads,j",
+      po::value(&options.threads),
+      "number of threads decoding the files (default: 1, 0 = all cores)");
 
   po::positional_options_description p;
   p.add("infile", 1);
@@ -439,6 +449,47 @@ std::list<std::string> expand_input_files()
   return files;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Interned record names and units
+ *
+ * The same few descriptor names repeat in every message, hence the
+ * records store only an integer id to this table. Decoding threads
+ * intern new names under a mutex, the names are read only after
+ * all decoding is done.
+ */
+// ----------------------------------------------------------------------
+
+struct RecordNames
+{
+  typedef std::pair<std::string, std::string> NameUnits;
+
+  std::vector<NameUnits> names;
+  std::map<NameUnits, int> ids;
+  boost::mutex mutex;
+
+  int intern(const std::string &name, const std::string &units)
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    NameUnits key(name, units);
+    std::map<NameUnits, int>::const_iterator it = ids.find(key);
+    if (it != ids.end()) return it->second;
+    int id = static_cast<int>(names.size());
+    names.push_back(key);
+    ids.insert(std::make_pair(key, id));
+    return id;
+  }
+
+  const std::string &name(int id) const { return names[id].first; }
+  const std::string &units(int id) const { return names[id].second; }
+  std::size_t size() const { return names.size(); }
+};
+
+RecordNames record_names;
+
+// Thread specific cache from descriptors to interned names
+typedef std::map<int, int> DescriptorIds;
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Information collected from the bufr
@@ -447,51 +498,117 @@ std::list<std::string> expand_input_files()
 
 struct record
 {
-  std::string name;
-  std::string units;
-  double value;
-  std::string svalue;
+  int desc;      // the BUFR descriptor
+  int name;      // index to record_names
+  double value;  // NaN for strings
+  int svalue;    // index to Message::strings, -1 if there is no string
+
+  record() : desc(0), name(0), value(std::numeric_limits<double>::quiet_NaN()), svalue(-1) {}
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The records of one message sorted by the descriptor
+ *
+ * Only the first record of each descriptor is kept.
+ */
+// ----------------------------------------------------------------------
+
+struct Message
+{
+  typedef std::vector<record>::const_iterator const_iterator;
+
+  std::vector<record> records;
+  std::vector<std::string> strings;
+
+  const_iterator begin() const { return records.begin(); }
+  const_iterator end() const { return records.end(); }
+  bool empty() const { return records.empty(); }
+
+  void clear()
+  {
+    records.clear();
+    strings.clear();
+  }
+
+  static bool less(const record &rec, int desc) { return rec.desc < desc; }
+
+  const_iterator find(int desc) const
+  {
+    const_iterator it = std::lower_bound(records.begin(), records.end(), desc, less);
+    if (it != records.end() && it->desc == desc) return it;
+    return records.end();
+  }
 
-  record() : name(), units(), value(std::numeric_limits<double>::quiet_NaN()), svalue() {}
+  void insert(record rec, const std::string &svalue)
+  {
+    std::vector<record>::iterator it =
+        std::lower_bound(records.begin(), records.end(), rec.desc, less);
+    if (it != records.end() && it->desc == rec.desc) return;
+    if (!svalue.empty())
+    {
+      rec.svalue = static_cast<int>(strings.size());
+      strings.push_back(svalue);
+    }
+    records.insert(it, rec);
+  }
+
+  const std::string &string_value(const record &rec) const
+  {
+    static const std::string empty_string;
+    return (rec.svalue < 0 ? empty_string : strings[rec.svalue]);
+  }
 };
 
-typedef std::map<int, record> Message;
 typedef std::list<Message> Messages;
 
 // ----------------------------------------------------------------------
 /*!
  * \brief Extract record name and units
+ *
+ * The name depends only on the descriptor and the tables, hence
+ * it is looked up only once per descriptor.
  */
 // ----------------------------------------------------------------------
 
-void extract_record_name_and_units(record &rec, int desc, BufrDescriptor *bufr, BUFR_Tables *tables)
+void extract_record_name_and_units(record &rec,
+                                   int desc,
+                                   BufrDescriptor *bufr,
+                                   BUFR_Tables *tables,
+                                   DescriptorIds &descriptor_ids)
 {
   if (bufr_is_table_b(desc))
   {
+    DescriptorIds::const_iterator it = descriptor_ids.find(desc);
+    if (it != descriptor_ids.end())
+    {
+      rec.name = it->second;
+      return;
+    }
+
+    std::string name, units;
     EntryTableB *tb = bufr_fetch_tableB(tables, desc);
     if (tb)
     {
       /* according to descriptor 13+14=>64 15=>24 */
-      rec.name = tb->description;
-      rec.units = tb->unit;
+      name = tb->description;
+      units = tb->unit;
     }
     else
     {
       std::cerr << "Warning: Descriptor " << desc << " not found in table B" << std::endl;
     }
+    rec.name = record_names.intern(name, units);
+    descriptor_ids.insert(std::make_pair(desc, rec.name));
   }
-  else if (bufr->encoding.type == TYPE_CCITT_IA5)
+  else if (bufr->encoding.type == TYPE_CCITT_IA5 && desc / 1000 == 205)
   {
-    int fx = desc / 1000;
-    if (fx == 205)
-    {
-      rec.name = "Signify character";
-      rec.units = "CCITT_IA5";
-    }
+    rec.name = record_names.intern("Signify character", "CCITT_IA5");
   }
   else
   {
-  }  // unknown
+    rec.name = record_names.intern("", "");  // unknown
+  }
 }
 
 // ----------------------------------------------------------------------
@@ -500,7 +617,7 @@ void extract_record_name_and_units(record &rec, int desc, BufrDescriptor *bufr,
  */
 // ----------------------------------------------------------------------
 
-void extract_record_value(record &rec, BufrDescriptor *bufr)
+void extract_record_value(record &rec, std::string &svalue, BufrDescriptor *bufr)
 {
   if (bufr->value)
   {
@@ -540,7 +657,7 @@ void extract_record_value(record &rec, BufrDescriptor *bufr)
     {
       int len = 0;
       char *str = bufr_descriptor_get_svalue(bufr, &len);
-      if (str && !bufr_is_missing_string(str, len)) rec.svalue = str;
+      if (str && !bufr_is_missing_string(str, len)) svalue = str;
       // rec.value will remain to be NaN
     }
   }  // if(bufr->value)
@@ -564,11 +681,11 @@ bool message_looks_valid(const Message &msg)
   if (yy == msg.end() || mm == msg.end() || dd == msg.end() || hh == msg.end() || mi == msg.end())
     return false;
 
-  if (yy->second.value < 1900 || yy->second.value > 2200) return false;
-  if (mm->second.value < 1 || mm->second.value > 12) return false;
-  if (dd->second.value < 1 || dd->second.value > 31) return false;
-  if (hh->second.value < 0 || hh->second.value > 23) return false;
-  if (mi->second.value < 0 || mi->second.value > 59) return false;
+  if (yy->value < 1900 || yy->value > 2200) return false;
+  if (mm->value < 1 || mm->value > 12) return false;
+  if (dd->value < 1 || dd->value > 31) return false;
+  if (hh->value < 0 || hh->value > 23) return false;
+  if (mi->value < 0 || mi->value > 59) return false;
 
   return true;
 }
@@ -579,7 +696,10 @@ bool message_looks_valid(const Message &msg)
  */
 // ----------------------------------------------------------------------
 
-void append_message(Messages &messages, BUFR_Dataset *dts, BUFR_Tables *tables)
+void append_message(Messages &messages,
+                    BUFR_Dataset *dts,
+                    BUFR_Tables *tables,
+                    DescriptorIds &descriptor_ids)
 {
   int nsubsets = bufr_count_datasubset(dts);
 
@@ -617,10 +737,12 @@ void append_message(Messages &messages, BUFR_Dataset *dts, BUFR_Tables *tables)
 
       // Begin recording the info
       record rec;
-      extract_record_name_and_units(rec, desc, bufr, tables);
-      extract_record_value(rec, bufr);
+      std::string svalue;
+      rec.desc = desc;
+      extract_record_name_and_units(rec, desc, bufr, tables, descriptor_ids);
+      extract_record_value(rec, svalue, bufr);
 
-      // std::cout << desc << " " << rec.name << " = " << rec.value << std::endl;
+      // std::cout << desc << " " << record_names.name(rec.name) << " = " << rec.value << std::endl;
 
       if (replicating && replicating_desc < 0)
       {
@@ -639,7 +761,7 @@ void append_message(Messages &messages, BUFR_Dataset *dts, BUFR_Tables *tables)
         if (!message.empty() && message_looks_valid(message)) messages.push_back(message);
 
         message = replicated_message;
-        message.insert(Message::value_type(desc, rec));
+        message.insert(rec, svalue);
 
         if (--replication_count <= 0)
         {
@@ -649,7 +771,7 @@ void append_message(Messages &messages, BUFR_Dataset *dts, BUFR_Tables *tables)
       }
       else
       {
-        message.insert(Message::value_type(desc, rec));
+        message.insert(rec, svalue);
       }
     }
 
@@ -673,7 +795,9 @@ void read_message(const std::string &filename,
                   Messages &messages,
                   BUFR_Tables *file_tables,
                   LinkedList *tables_list,
-                  std::set<int> &datacategories)
+                  DescriptorIds &descriptor_ids,
+                  std::set<int> &datacategories,
+                  bool &tables_updated)
 {
   // Open the file
 
@@ -681,7 +805,6 @@ void read_message(const std::string &filename,
                      "rb");  // VC++ vaatii ett avataan binrisen (Linuxissa se on default)
   if (bufr == NULL)
   {
-    bufr_free_tables(file_tables);
     throw std::runtime_error("Could not open BUFR file '" + filename + "' reading");
   }
 
@@ -779,10 +902,13 @@ void read_message(const std::string &filename,
       {
         bufr_tables_list_merge(tables_list, tables);
         bufr_free_tables(tables);
+        // The merge may change the names of the descriptors
+        descriptor_ids.clear();
+        tables_updated = true;
       }
     }
 
-    append_message(messages, dts, file_tables);
+    append_message(messages, dts, file_tables, descriptor_ids);
 
     // Done with the current message
 
@@ -793,30 +919,44 @@ void read_message(const std::string &filename,
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Read all bufr messages
+ * \brief BUFR tables used by one decoding thread
+ *
+ * Local table updates found in the messages are merged into the
+ * tables list, hence each thread needs its own copy.
  */
 // ----------------------------------------------------------------------
 
-std::pair<BufrDataCategory, Messages> read_messages(const std::list<std::string> &files)
+struct BufrTables
 {
-  Messages messages;
+  BUFR_Tables *file_tables;
+  LinkedList *tables_list;
+};
 
-  // We verify that there is only one type of message
-  std::set<int> datacategories;
+// ----------------------------------------------------------------------
+/*!
+ * \brief Load the CMC tables and the tables list
+ *
+ * The tables are used until the program exits and are not freed.
+ */
+// ----------------------------------------------------------------------
+
+BufrTables load_bufr_tables()
+{
+  BufrTables tables;
 
   // Load CMC Table B and D
 
-  BUFR_Tables *file_tables = bufr_create_tables();
-  bufr_load_cmc_tables(file_tables);
+  tables.file_tables = bufr_create_tables();
+  bufr_load_cmc_tables(tables.file_tables);
 
   // Load all tables into a list
 
   int tablenos[2] = {13, 0};
-  LinkedList *tables_list = bufr_load_tables_list(getenv("BUFR_TABLES"), tablenos, 1);
+  tables.tables_list = bufr_load_tables_list(getenv("BUFR_TABLES"), tablenos, 1);
 
   // Add version 14 to the list
 
-  lst_addfirst(tables_list, lst_newnode(file_tables));
+  lst_addfirst(tables.tables_list, lst_newnode(tables.file_tables));
 
   // Load local tables to the list (if they are used)
 
@@ -830,26 +970,176 @@ std::pair<BufrDataCategory, Messages> read_messages(const std::list<std::string>
     // This prints a warning if both tableB and tableD are 0.
     // Never tested what happens if only one is given.
 
-    bufr_tables_list_addlocal(tables_list, tableB, tableD);
+    bufr_tables_list_addlocal(tables.tables_list, tableB, tableD);
+  }
+
+  return tables;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Messages decoded from one file
+ */
+// ----------------------------------------------------------------------
+
+struct FileMessages
+{
+  Messages messages;
+  std::set<int> datacategories;
+  bool ok;
+  bool tables_updated;  // the file contained local table updates
+
+  FileMessages() : messages(), datacategories(), ok(false), tables_updated(false) {}
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The tables and descriptor ids of one decoding thread
+ */
+// ----------------------------------------------------------------------
+
+struct BufrDecoder
+{
+  BufrTables tables;
+  DescriptorIds descriptor_ids;
+
+  BufrDecoder(const BufrTables &theTables) : tables(theTables), descriptor_ids() {}
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Decode a single file
+ *
+ * Failed files are only warned about, their messages are kept.
+ */
+// ----------------------------------------------------------------------
+
+void read_file(const std::string &file, FileMessages &result, BufrDecoder &decoder)
+{
+  try
+  {
+    read_message(file,
+                 result.messages,
+                 decoder.tables.file_tables,
+                 decoder.tables.tables_list,
+                 decoder.descriptor_ids,
+                 result.datacategories,
+                 result.tables_updated);
+    result.ok = true;
+  }
+  catch (...)
+  {
+    result.ok = false;
+    std::cerr << "Warning: Failed to interpret message '" << file << "'" << std::endl;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Decode a single file with the decoder of the thread
+ *
+ * If stop_file is given, files after a file with local table updates
+ * are skipped. They must then be decoded again with the updated tables.
+ */
+// ----------------------------------------------------------------------
+
+void read_file_job(const std::vector<std::string> *files,
+                   std::vector<FileMessages> *results,
+                   std::vector<BufrDecoder> *decoders,
+                   std::size_t *stop_file,
+                   ParallelJobs *parallel,
+                   unsigned int thread,
+                   std::size_t i)
+{
+  if (stop_file != NULL)
+  {
+    boost::mutex::scoped_lock lock(parallel->mutex());
+    if (i >= *stop_file) return;
+  }
+
+  FileMessages &result = (*results)[i];
+  read_file((*files)[i], result, (*decoders)[thread]);
+
+  if (result.tables_updated && stop_file != NULL)
+  {
+    boost::mutex::scoped_lock lock(parallel->mutex());
+    *stop_file = std::min(*stop_file, i + 1);
   }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read all bufr messages
+ *
+ * The files are decoded in parallel, and the messages are merged
+ * in the original file order. Local table updates apply to all later
+ * files, hence the files starting from the first one with updates
+ * are decoded again sequentially.
+ */
+// ----------------------------------------------------------------------
+
+std::pair<BufrDataCategory, Messages> read_messages(const std::list<std::string> &files)
+{
+  Messages messages;
+
+  // We verify that there is only one type of message
+  std::set<int> datacategories;
 
   // Process the files
 
+  std::vector<std::string> filevector(files.begin(), files.end());
+  std::vector<FileMessages> results(filevector.size());
+
+  ParallelJobs parallel(filevector.size(), options.threads);
+
+  // Table loading is done before starting the threads
+  std::vector<BufrDecoder> decoders;
+  for (unsigned int i = 0; i < parallel.threads(); i++)
+    decoders.push_back(BufrDecoder(load_bufr_tables()));
+
+  std::size_t stop_file = filevector.size();
+  parallel.run(boost::bind(read_file_job,
+                           &filevector,
+                           &results,
+                           &decoders,
+                           (parallel.threads() > 1 ? &stop_file : NULL),
+                           &parallel,
+                           _1,
+                           _2));
+
+  // Files before the first one with table updates were decoded with
+  // the same tables as in a sequential run, the rest are redone
+
+  for (std::size_t i = 0; i < results.size() && parallel.threads() > 1; i++)
+  {
+    if (!results[i].tables_updated) continue;
+
+    if (options.verbose)
+      std::cout << "Local table updates found in '" << filevector[i]
+                << "', decoding the remaining files sequentially" << std::endl;
+
+    BufrDecoder decoder(load_bufr_tables());
+    for (std::size_t j = i; j < results.size(); j++)
+    {
+      results[j] = FileMessages();
+      read_file(filevector[j], results[j], decoder);
+    }
+    break;
+  }
+
   int succesful_parse_events = 0;
   int errorneous_parse_events = 0;
 
-  BOOST_FOREACH (const std::string &file, files)
+  for (std::size_t i = 0; i < results.size(); i++)
   {
-    try
-    {
-      read_message(file, messages, file_tables, tables_list, datacategories);
+    if (results[i].ok)
       succesful_parse_events++;
-    }
-    catch (...)
-    {
+    else
       errorneous_parse_events++;
-      std::cerr << "Warning: Failed to interpret message '" << file << "'" << std::endl;
-    }
+
+    // Messages from failed files are kept as before
+    messages.splice(messages.end(), results[i].messages);
+    datacategories.insert(results[i].datacategories.begin(), results[i].datacategories.end());
   }
 
   if (datacategories.size() == 0)
@@ -885,12 +1175,16 @@ std::pair<BufrDataCategory, Messages> read_messages(const std::list<std::string>
 
 std::set<std::string> collect_names(const Messages &messages)
 {
-  std::set<std::string> names;
+  std::vector<bool> used(record_names.size(), false);
   BOOST_FOREACH (const Message &msg, messages)
   {
-    BOOST_FOREACH (const Message::value_type &value, msg)
-      names.insert(value.second.name);
+    BOOST_FOREACH (const record &rec, msg)
+      used[rec.name] = true;
   }
+
+  std::set<std::string> names;
+  for (std::size_t id = 0; id < used.size(); id++)
+    if (used[id]) names.insert(record_names.name(static_cast<int>(id)));
   return names;
 }
 
@@ -1039,18 +1333,12 @@ int count_sounding_levels(const Messages &messages)
   {
     ++levels;
 
-    BOOST_FOREACH (const Message::value_type &values, msg)
+    Message::const_iterator it = msg.find(1002);
+    if (it != msg.end() && it->value != wmo_station)  // does wmo station change?
     {
-      if (values.first == 1002)  // does wmo station change?
-      {
-        if (values.second.value != wmo_station)
-        {
-          wmo_station = static_cast<int>(values.second.value);
-          max_levels = std::max(max_levels, levels);
-          levels = 1;  // this message defines one level, so do not go to zero
-          break;
-        }
-      }
+      wmo_station = static_cast<int>(it->value);
+      max_levels = std::max(max_levels, levels);
+      levels = 1;  // this message defines one level, so do not go to zero
     }
   }
 
@@ -1177,17 +1465,17 @@ NFmiHPlaceDescriptor create_hdesc_buoy_ship(const Messages &messages)
 
     if (p_id != msg.end())
     {
-      const std::string name = p_id->second.svalue;
+      const std::string name = msg.string_value(*p_id);
 
       float lon = kFloatMissing, lat = kFloatMissing;
 
       p_id = msg.find(5001);
       if (p_id == msg.end()) p_id = msg.find(5002);
-      if (p_id != msg.end()) lat = static_cast<float>(p_id->second.value);
+      if (p_id != msg.end()) lat = static_cast<float>(p_id->value);
 
       p_id = msg.find(6001);
       if (p_id == msg.end()) p_id = msg.find(6002);
-      if (p_id != msg.end()) lon = static_cast<float>(p_id->second.value);
+      if (p_id != msg.end()) lon = static_cast<float>(p_id->value);
 
       if (lon != kFloatMissing && (lon < -180 || lon > 180))
       {
@@ -1248,11 +1536,11 @@ NFmiStation get_station(const Message &msg)
     return NFmiStation(-1, "", kFloatMissing, kFloatMissing);
   }
 
-  int wmo = static_cast<int>(1000 * wmoblock->second.value + wmonumber->second.value);
+  int wmo = static_cast<int>(1000 * wmoblock->value + wmonumber->value);
 
   float lon =
-      static_cast<float>((longitude == msg.end() ? kFloatMissing : longitude->second.value));
-  float lat = static_cast<float>((latitude == msg.end() ? kFloatMissing : latitude->second.value));
+      static_cast<float>((longitude == msg.end() ? kFloatMissing : longitude->value));
+  float lat = static_cast<float>((latitude == msg.end() ? kFloatMissing : latitude->value));
 
   if (lon != kFloatMissing && (lon < -180 || lon > 180))
   {
@@ -1357,11 +1645,11 @@ NFmiMetTime get_validtime(const Message &msg)
 
   const int timeresolution = 1;
 
-  return NFmiMetTime(static_cast<short>(yy->second.value),
-                     static_cast<short>(mm->second.value),
-                     static_cast<short>(dd->second.value),
-                     static_cast<short>(hh->second.value),
-                     static_cast<short>(mi->second.value),
+  return NFmiMetTime(static_cast<short>(yy->value),
+                     static_cast<short>(mm->value),
+                     static_cast<short>(dd->value),
+                     static_cast<short>(hh->value),
+                     static_cast<short>(mi->value),
                      0,
                      timeresolution);
 }
@@ -1388,13 +1676,9 @@ NFmiMetTime get_validtime_amdar(std::set<NFmiMetTime> &used_times, const Message
   // to be the case in actual messages
   short year = -1, month = -1, day = -1, hour = -1, minute = -1, second = 0;
 
-  BOOST_FOREACH (const Message::value_type &values, message)
+  BOOST_FOREACH (const record &rec, message)
   {
-    // shorthand variables
-    const int descriptor = values.first;
-    const record &rec = values.second;
-
-    switch (descriptor)
+    switch (rec.desc)
     {
       case 4001:
         year = static_cast<short>(rec.value);
@@ -1506,25 +1790,96 @@ NFmiTimeDescriptor create_tdesc(const Messages &messages, BufrDataCategory categ
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Normalize a record value
+ * \brief Unit conversions applied to the record values
+ */
+// ----------------------------------------------------------------------
+
+enum ValueConversion
+{
+  kNoConversion,
+  kKelvinToCelsius,
+  kPascalToHectoPascal,
+  kOctasToPercent
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Querydata parameter of a record name
  */
 // ----------------------------------------------------------------------
 
-float normal_value(const record &rec)
+struct RecordParam
 {
-  if (rec.value == kFloatMissing) return kFloatMissing;
+  bool valid;
+  unsigned long paramindex;
+  ValueConversion conversion;
 
-  // Kelvin to Celsius
-  if (rec.units == "K") return static_cast<float>(rec.value - 273.15);
+  RecordParam() : valid(false), paramindex(0), conversion(kNoConversion) {}
+};
 
-  // Pascal to hecto-Pascal
-  if (rec.units == "PA") return static_cast<float>(rec.value / 100.0);
+typedef std::vector<RecordParam> RecordParams;
 
-  // Cloud 8ths to 0-100%. Note that obs may also be 9, hence a min check is needed
-  if (rec.name == "CLOUD AMOUNT" && rec.units == "CODE TABLE")
-    return static_cast<float>(std::min(100.0, rec.value * 100 / 8));
+// ----------------------------------------------------------------------
+/*!
+ * \brief Map the interned record names to querydata parameter indices
+ *
+ * Done once so that copying the values needs no name lookups.
+ */
+// ----------------------------------------------------------------------
+
+RecordParams map_record_params(NFmiFastQueryInfo &info, const NameMap &namemap)
+{
+  RecordParams params(record_names.size());
+
+  for (std::size_t i = 0; i < params.size(); i++)
+  {
+    int id = static_cast<int>(i);
+    NameMap::const_iterator it = namemap.find(record_names.name(id));
+    if (it == namemap.end()) continue;
+
+    if (!info.Param(it->second.parId))
+      throw std::runtime_error("Internal error in handling parameters of the messages");
+
+    RecordParam &param = params[i];
+    param.valid = true;
+    param.paramindex = info.ParamIndex();
+
+    const std::string &units = record_names.units(id);
+    if (units == "K")
+      param.conversion = kKelvinToCelsius;
+    else if (units == "PA")
+      param.conversion = kPascalToHectoPascal;
+    else if (record_names.name(id) == "CLOUD AMOUNT" && units == "CODE TABLE")
+      param.conversion = kOctasToPercent;
+  }
+
+  return params;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Normalize a record value
+ */
+// ----------------------------------------------------------------------
+
+float normal_value(double value, ValueConversion conversion)
+{
+  if (value == kFloatMissing) return kFloatMissing;
+
+  switch (conversion)
+  {
+    case kKelvinToCelsius:
+      return static_cast<float>(value - 273.15);
+    case kPascalToHectoPascal:
+      return static_cast<float>(value / 100.0);
+    case kOctasToPercent:
+      // Note that obs may also be 9, hence a min check is needed
+      return static_cast<float>(std::min(100.0, value * 100 / 8));
+    case kNoConversion:
+      break;
+  }
 
-  return static_cast<float>(rec.value);
+  return static_cast<float>(value);
 }
 
 // ----------------------------------------------------------------------
@@ -1533,16 +1888,15 @@ float normal_value(const record &rec)
  */
 // ----------------------------------------------------------------------
 
-void copy_params(NFmiFastQueryInfo &info, const Message &msg, const NameMap &namemap)
+void copy_params(NFmiFastQueryInfo &info, const Message &msg, const RecordParams &params)
 {
-  BOOST_FOREACH (const Message::value_type &value, msg)
+  BOOST_FOREACH (const record &rec, msg)
   {
-    NameMap::const_iterator it = namemap.find(value.second.name);
-    if (it != namemap.end())
+    const RecordParam &param = params[rec.name];
+    if (param.valid)
     {
-      if (!info.Param(it->second.parId))
-        throw std::runtime_error("Internal error in handling parameters of the messages");
-      info.FloatValue(normal_value(value.second));
+      info.ParamIndex(param.paramindex);
+      info.FloatValue(normal_value(rec.value, param.conversion));
     }
   }
 }
@@ -1555,7 +1909,7 @@ void copy_params(NFmiFastQueryInfo &info, const Message &msg, const NameMap &nam
 
 void copy_records_sounding(NFmiFastQueryInfo &info,
                            const Messages &messages,
-                           const NameMap &namemap)
+                           const RecordParams &params)
 {
   info.First();
 
@@ -1584,7 +1938,7 @@ void copy_records_sounding(NFmiFastQueryInfo &info,
 
     if (!info.NextLevel()) throw std::runtime_error("Changing to next level failed");
 
-    copy_params(info, msg, namemap);
+    copy_params(info, msg, params);
   }
 }
 
@@ -1597,7 +1951,9 @@ void copy_records_sounding(NFmiFastQueryInfo &info,
  */
 // ----------------------------------------------------------------------
 
-void copy_records_amdar(NFmiFastQueryInfo &info, const Messages &messages, const NameMap &namemap)
+void copy_records_amdar(NFmiFastQueryInfo &info,
+                        const Messages &messages,
+                        const RecordParams &params)
 {
   info.First();
 
@@ -1624,10 +1980,10 @@ void copy_records_amdar(NFmiFastQueryInfo &info, const Messages &messages, const
     Message::const_iterator it;
 
     it = msg.find(5001);
-    if (it != msg.end()) lat = static_cast<float>(it->second.value);
+    if (it != msg.end()) lat = static_cast<float>(it->value);
 
     it = msg.find(6001);
-    if (it != msg.end()) lon = static_cast<float>(it->second.value);
+    if (it != msg.end()) lon = static_cast<float>(it->value);
 
     if (lon != kFloatMissing && (lon < -180 || lon > 180))
     {
@@ -1653,7 +2009,7 @@ void copy_records_amdar(NFmiFastQueryInfo &info, const Messages &messages, const
 
       // Copy regular parameters
 
-      copy_params(info, msg, namemap);
+      copy_params(info, msg, params);
     }
   }
 }
@@ -1674,7 +2030,7 @@ void copy_records_amdar(NFmiFastQueryInfo &info, const Messages &messages, const
 
 void copy_records_buoy_ship(NFmiFastQueryInfo &info,
                             const Messages &messages,
-                            const NameMap &namemap)
+                            const RecordParams &params)
 {
   info.First();
 
@@ -1696,7 +2052,7 @@ void copy_records_buoy_ship(NFmiFastQueryInfo &info,
       if (p_id == msg.end()) continue;
     }
 
-    const std::string &name = p_id->second.svalue;
+    const std::string &name = msg.string_value(*p_id);
 
     if (laststation != name)
     {
@@ -1711,11 +2067,11 @@ void copy_records_buoy_ship(NFmiFastQueryInfo &info,
 
     p_id = msg.find(5001);
     if (p_id == msg.end()) p_id = msg.find(5002);
-    if (p_id != msg.end()) lat = static_cast<float>(p_id->second.value);
+    if (p_id != msg.end()) lat = static_cast<float>(p_id->value);
 
     p_id = msg.find(6001);
     if (p_id == msg.end()) p_id = msg.find(6002);
-    if (p_id != msg.end()) lon = static_cast<float>(p_id->second.value);
+    if (p_id != msg.end()) lon = static_cast<float>(p_id->value);
 
     if (lon != kFloatMissing && (lon < -180 || lon > 180))
     {
@@ -1735,7 +2091,7 @@ void copy_records_buoy_ship(NFmiFastQueryInfo &info,
     {
       laststation = name;
 
-      copy_params(info, msg, namemap);
+      copy_params(info, msg, params);
 
       info.Param(kFmiLongitude);
       info.FloatValue(lon);
@@ -1754,16 +2110,16 @@ void copy_records_buoy_ship(NFmiFastQueryInfo &info,
 
 void copy_records(NFmiFastQueryInfo &info,
                   const Messages &messages,
-                  const NameMap &namemap,
+                  const RecordParams &params,
                   BufrDataCategory category)
 {
   // Handle special cases
 
-  if (category == kBufrSounding) return copy_records_sounding(info, messages, namemap);
+  if (category == kBufrSounding) return copy_records_sounding(info, messages, params);
 
-  if (category == kBufrUpperAirLevel) return copy_records_amdar(info, messages, namemap);
+  if (category == kBufrUpperAirLevel) return copy_records_amdar(info, messages, params);
 
-  if (category == kBufrSeaSurface) return copy_records_buoy_ship(info, messages, namemap);
+  if (category == kBufrSeaSurface) return copy_records_buoy_ship(info, messages, params);
 
   // Normal case with no funny business with levels or times
 
@@ -1779,7 +2135,7 @@ void copy_records(NFmiFastQueryInfo &info,
     // We ignore stations with bad coordinates
     if (!info.Location(station.GetIdent())) continue;
 
-    copy_params(info, msg, namemap);
+    copy_params(info, msg, params);
   }
 }
 
@@ -1884,9 +2240,10 @@ int run(int argc, char *argv[])
     {
       std::cout << std::endl << "Message " << ++i << std::endl << std::endl;
 
-      BOOST_FOREACH (const Message::value_type &value, msg)
-        std::cout << value.first << "," << value.second.name << "," << value.second.units << ","
-                  << value.second.value << "," << value.second.svalue << std::endl;
+      BOOST_FOREACH (const record &rec, msg)
+        std::cout << rec.desc << "," << record_names.name(rec.name) << ","
+                  << record_names.units(rec.name) << "," << rec.value << ","
+                  << msg.string_value(rec) << std::endl;
     }
   }
 
@@ -1914,7 +2271,8 @@ int run(int argc, char *argv[])
 
   // Add each file to the data
 
-  copy_records(info, messages, namemap, category);
+  RecordParams params = map_record_params(info, namemap);
+  copy_records(info, messages, params, category);
 
   // Output
 
@@ -5,21 +5,32 @@
  */
 // ======================================================================
 
+#include "ParallelJobs.h"
 #include "Pgm2QueryData.h"
 
 #include <newbase/NFmiCmdLine.h>
 #include <newbase/NFmiStringTools.h>
 #include <newbase/NFmiFileSystem.h>
+#include <newbase/NFmiFastQueryInfo.h>
 #include <newbase/NFmiQueryData.h>
 #include <newbase/NFmiQueryDataUtil.h>
 #include <newbase/NFmiStreamQueryData.h>
+#include <newbase/NFmiTimeList.h>
 
+#include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
 
+#include <algorithm>
 #include <list>
+#include <map>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <set>
+#include <sstream>
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -43,6 +54,9 @@ void usage()
        << "  -p int,name\tset producer id and name (default = 1014,NRD)" << endl
        << "  -t timestepcount\thow many timesteps in result data (default = 0 (= all possible))"
        << endl
+       << "  -j threads\tnumber of threads used to read the files (default = 1, 0 = all cores)"
+       << endl
+       << "  -O\t\tcreate qdfileout directly as a memory mapped file" << endl
        << endl;
 }
 
@@ -52,9 +66,20 @@ void usage()
  */
 // ----------------------------------------------------------------------
 
-int parse_command_line(int argc, const char *argv[], FMI::RadContour::PgmReadOptions &theOptions)
+struct CombineOptions
+{
+  unsigned int threads;
+  bool mmapped;
+
+  CombineOptions() : threads(1), mmapped(false) {}
+};
+
+int parse_command_line(int argc,
+                       const char *argv[],
+                       FMI::RadContour::PgmReadOptions &theOptions,
+                       CombineOptions &theCombineOptions)
 {
-  NFmiCmdLine cmdline(argc, argv, "hvp!t!");
+  NFmiCmdLine cmdline(argc, argv, "hvp!t!j!O");
 
   if (cmdline.Status().IsError()) throw runtime_error(cmdline.Status().ErrorLog().CharPtr());
 
@@ -85,9 +110,235 @@ int parse_command_line(int argc, const char *argv[], FMI::RadContour::PgmReadOpt
     theOptions.producer_name = tmp[1];
   }
 
+  if (cmdline.isOption('j'))
+    theCombineOptions.threads = NFmiStringTools::Convert<unsigned int>(cmdline.OptionValue('j'));
+
+  if (cmdline.isOption('O')) theCombineOptions.mmapped = true;
+
   return true;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Ordering of levels in the combined data
+ */
+// ----------------------------------------------------------------------
+
+struct LevelLess
+{
+  bool operator()(const NFmiLevel &theLevel1, const NFmiLevel &theLevel2) const
+  {
+    if (theLevel1.LevelType() != theLevel2.LevelType())
+      return theLevel1.LevelType() < theLevel2.LevelType();
+    return theLevel1.LevelValue() < theLevel2.LevelValue();
+  }
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Build the descriptors of the combined data from the pgm headers
+ *
+ * Parameters are in the order they first appear, levels are sorted
+ * and only the last maxtimesteps times are kept. The origin time is
+ * the latest one found.
+ */
+// ----------------------------------------------------------------------
+
+NFmiQueryInfo make_combined_info(const std::vector<FMI::RadContour::PgmFileInfo> &theFiles,
+                                 const FMI::RadContour::PgmReadOptions &theOptions)
+{
+  NFmiParamBag pbag;
+  std::set<unsigned long> params;
+  std::set<NFmiLevel, LevelLess> levels;
+  std::set<NFmiMetTime> times;
+  NFmiMetTime origintime = theFiles.front().origintime;
+  bool haslevels = !theFiles.front().level.IsMissing();
+
+  for (std::size_t i = 0; i < theFiles.size(); i++)
+  {
+    const FMI::RadContour::PgmFileInfo &file = theFiles[i];
+
+    if (!(file.hdesc == theFiles.front().hdesc))
+      throw std::runtime_error("The area or grid size of " + file.filename + " differs from " +
+                               theFiles.front().filename);
+
+    if (file.level.IsMissing() == haslevels)
+      throw std::runtime_error("Cannot combine pgm files with and without level information: " +
+                               file.filename);
+
+    if (params.insert(file.param.GetParamIdent()).second) pbag.Add(file.param);
+    if (haslevels) levels.insert(file.level);
+    times.insert(file.validtime);
+    if (origintime < file.origintime) origintime = file.origintime;
+  }
+
+  NFmiTimeList tlist;
+  std::size_t skip = 0;
+  if (theOptions.maxtimesteps > 0 &&
+      times.size() > static_cast<std::size_t>(theOptions.maxtimesteps))
+    skip = times.size() - theOptions.maxtimesteps;
+  std::set<NFmiMetTime>::const_iterator tit = times.begin();
+  std::advance(tit, skip);
+  for (; tit != times.end(); ++tit)
+    tlist.Add(new NFmiMetTime(*tit));
+
+  NFmiVPlaceDescriptor vdesc;
+  if (haslevels)
+  {
+    NFmiLevelBag levBag;
+    for (std::set<NFmiLevel, LevelLess>::const_iterator it = levels.begin(); it != levels.end();
+         ++it)
+      levBag.AddLevel(*it);
+    vdesc = NFmiVPlaceDescriptor(levBag);
+  }
+
+  return NFmiQueryInfo(NFmiParamDescriptor(pbag),
+                       NFmiTimeDescriptor(origintime, tlist),
+                       theFiles.front().hdesc,
+                       vdesc);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A pgm file and its place in the combined data
+ */
+// ----------------------------------------------------------------------
+
+struct FillJob
+{
+  const FMI::RadContour::PgmFileInfo *file;
+  std::vector<const FMI::RadContour::PgmFileInfo *> previous;  // replaced files, oldest first
+  unsigned long paramindex;
+  unsigned long levelindex;
+  unsigned long timeindex;
+  bool ok;
+  std::string report;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Fill a pgm file into its own slice of the combined data
+ *
+ * Each job writes to a separate slice, hence the threads need to
+ * synchronize only when picking the next job.
+ */
+// ----------------------------------------------------------------------
+
+void fill_job(std::vector<NFmiFastQueryInfo> *theInfos,
+              std::vector<FillJob> *theJobs,
+              const FMI::RadContour::PgmReadOptions *theOptions,
+              unsigned int theThread,
+              std::size_t theJob)
+{
+  NFmiFastQueryInfo &info = (*theInfos)[theThread];
+  FillJob &job = (*theJobs)[theJob];
+  info.ParamIndex(job.paramindex);
+  info.LevelIndex(job.levelindex);
+  info.TimeIndex(job.timeindex);
+
+  std::ostringstream report;
+  job.ok = FMI::RadContour::FillQueryData(info, *job.file, *theOptions, report);
+  job.report = report.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Create the combined data and fill the pgm files into it
+ */
+// ----------------------------------------------------------------------
+
+NFmiQueryData *make_combined_data(const std::vector<FMI::RadContour::PgmFileInfo> &theFiles,
+                                  const FMI::RadContour::PgmReadOptions &theOptions,
+                                  const CombineOptions &theCombineOptions)
+{
+  NFmiQueryInfo qi = make_combined_info(theFiles, theOptions);
+
+  NFmiQueryData *data = (theCombineOptions.mmapped
+                             ? NFmiQueryDataUtil::CreateEmptyData(qi, theOptions.outdata, true)
+                             : NFmiQueryDataUtil::CreateEmptyData(qi));
+  if (data == 0) throw std::runtime_error("Error, unable to create combined queryData");
+
+  NFmiFastQueryInfo info(data);
+
+  // Later files take precedence if several files have the same
+  // parameter, level and time, as in combining them one by one
+
+  typedef std::map<unsigned long, std::size_t> SlotMap;
+  SlotMap slots;
+  std::vector<FillJob> jobs;
+
+  for (std::size_t i = 0; i < theFiles.size(); i++)
+  {
+    const FMI::RadContour::PgmFileInfo &file = theFiles[i];
+    info.First();
+    if (!info.Param(file.param) || !info.Time(file.validtime)) continue;  // dropped by -t
+    if (!file.level.IsMissing() && !info.Level(file.level)) continue;
+
+    FillJob job;
+    job.file = &file;
+    job.paramindex = info.ParamIndex();
+    job.levelindex = info.LevelIndex();
+    job.timeindex = info.TimeIndex();
+    job.ok = false;
+
+    unsigned long slot =
+        (job.timeindex * info.SizeLevels() + job.levelindex) * info.SizeParams() + job.paramindex;
+
+    SlotMap::iterator it = slots.find(slot);
+    if (it != slots.end())
+    {
+      if (theOptions.verbose)
+        cout << "Replacing " << jobs[it->second].file->filename << " with " << file.filename
+             << endl;
+      job.previous.swap(jobs[it->second].previous);
+      job.previous.push_back(jobs[it->second].file);
+      jobs[it->second] = job;
+    }
+    else
+    {
+      slots.insert(std::make_pair(slot, jobs.size()));
+      jobs.push_back(job);
+    }
+  }
+
+  ParallelJobs parallel(jobs.size(), theCombineOptions.threads);
+  std::vector<NFmiFastQueryInfo> infos(parallel.threads(), info);
+  parallel.run(boost::bind(fill_job, &infos, &jobs, &theOptions, _1, _2));
+
+  // If a file could not be read, fall back to the file it replaced as
+  // combining the files one by one would have done
+
+  for (std::size_t i = 0; i < jobs.size(); i++)
+  {
+    FillJob &job = jobs[i];
+    while (!job.ok && !job.previous.empty())
+    {
+      std::ostringstream report;
+      report << job.report;
+      if (theOptions.verbose)
+        report << "Using " << job.previous.back()->filename << " instead of "
+               << job.file->filename << endl;
+      job.file = job.previous.back();
+      job.previous.pop_back();
+
+      info.ParamIndex(job.paramindex);
+      info.LevelIndex(job.levelindex);
+      info.TimeIndex(job.timeindex);
+      job.ok = FMI::RadContour::FillQueryData(info, *job.file, theOptions, report);
+      job.report = report.str();
+    }
+    cout << job.report;
+    if (!job.ok)
+      cerr << "Warning: failed to read " << job.file->filename << ", its values are left missing"
+           << endl;
+  }
+
+  // Finally set the desired producer
+  info.SetProducer(NFmiProducer(theOptions.producer_number, theOptions.producer_name));
+
+  return data;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * The main program
@@ -101,42 +352,43 @@ int parse_command_line(int argc, const char *argv[], FMI::RadContour::PgmReadOpt
 int domain(int argc, const char *argv[])
 {
   FMI::RadContour::PgmReadOptions options;
+  CombineOptions combineOptions;
 
   // Parse the command line arguments
-  if (!parse_command_line(argc, argv, options)) return 0;
+  if (!parse_command_line(argc, argv, options, combineOptions)) return 0;
 
   std::list<std::string> infiles = NFmiFileSystem::PatternFiles(options.indata);
   if (infiles.empty())
     throw std::runtime_error(std::string("There were no files from given file-pattern \n") +
                              options.indata + "\n, check the inputfilepattern, ending here...");
 
-  // Now convert all files in the list to queryDatas and combine them
+  // Read only the headers first, the rasters are read directly into the combined data
   std::string dirName = NFmiQueryDataUtil::GetFileFilterDirectory(
       options.indata);  // fileFilterist pit ottaa hakemisto irti, koska PatternFiles-funktio
                         // palautta vain tiedostojen nimet, ei polkua mukana
-  std::vector<boost::shared_ptr<NFmiQueryData> > qDataList;
+  std::vector<FMI::RadContour::PgmFileInfo> fileInfos;
   std::list<std::string>::const_iterator it;
   for (it = infiles.begin(); it != infiles.end(); ++it)
   {
-    NFmiQueryData *data = FMI::RadContour::Pgm2QueryData(dirName + *it, options, cout);
-    if (data) qDataList.push_back(boost::shared_ptr<NFmiQueryData>(data));
+    FMI::RadContour::PgmFileInfo fileInfo;
+    if (FMI::RadContour::ReadPgmFileInfo(dirName + *it, options, cout, fileInfo))
+      fileInfos.push_back(fileInfo);
   }
 
-  // create combined qinfo
-  boost::shared_ptr<NFmiQueryData> dummyBaseData;  // tt ei kytet, eli luodaan '0'-pointteri,
-                                                   // koska NFmiQueryDataUtil::CombineQueryDatas
-                                                   // vaatii tllist mahd. pohjadataa
-  NFmiQueryData *data = NFmiQueryDataUtil::CombineQueryDatas(
-      false,
-      dummyBaseData,
-      qDataList,
-      false,
-      options.maxtimesteps,
-      0);  // false = yhdistely sliceista, 0 = ei lopetus funktoria kytss
-  if (data == 0)
+  if (fileInfos.empty())
     throw std::runtime_error(std::string("Error, unable to create combined queryData"));
 
+  NFmiQueryData *data = make_combined_data(fileInfos, options, combineOptions);
+
   std::auto_ptr<NFmiQueryData> dataPtr(data);  // tuhoaa automaattisesti datan lopuksi
+
+  if (combineOptions.mmapped)
+  {
+    if (options.verbose)
+      cout << std::string("Wrote memory mapped file: ") + options.outdata << endl;
+    return 0;
+  }
+
   NFmiStreamQueryData sQData;
   if (sQData.WriteData(options.outdata, data, static_cast<long>(data->InfoVersion())) == false)
     throw std::runtime_error(std::string("Error, unable to store combined queryData to file:\n") +
@@ -16,6 +16,8 @@
  */
 // ======================================================================
 
+#include "ParallelJobs.h"
+
 #include <macgyver/CsvReader.h>
 #include <macgyver/TimeParser.h>
 #include <macgyver/TimeZoneFactory.h>
@@ -38,7 +40,15 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/program_options.hpp>
 #include <boost/filesystem/operations.hpp>
-
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <list>
 #include <set>
@@ -65,6 +75,7 @@ struct Options
   Options();
 
   bool verbose;
+  bool mmap;
 
   string order;
   int timecolumn;
@@ -87,6 +98,7 @@ struct Options
   string timezone;
 
   int leveltype;
+  unsigned int threads;
 };
 
 Options options;
@@ -99,6 +111,7 @@ Options options;
 
 Options::Options()
     : verbose(false),
+      mmap(false),
       order("idtime"),
       timecolumn(1),
       stationcolumn(0),
@@ -115,7 +128,8 @@ Options::Options()
       stationsfile(default_stationsfile),
       origintime(),
       timezone("UTC"),
-      leveltype(5000)
+      leveltype(5000),
+      threads(1)
 {
 }
 // ----------------------------------------------------------------------
@@ -162,7 +176,13 @@ bool parse_options(int argc, char* argv[], Options& options)
       ("station configuration file (" + default_stationsfile + ")").c_str())(
       "origintime", po::value(&options.origintime), "origin time")("timezone,t",
                                                                    po::value(&options.timezone))(
-      "leveltype", po::value(&options.leveltype), "leveltype as number");
+      "leveltype", po::value(&options.leveltype), "leveltype as number")(
+      "mmap",
+      po::bool_switch(&options.mmap),
+      "read the input files in two passes through memory maps instead of into memory")(
+      "threads,j",
+      po::value(&options.threads),
+      "number of threads parsing the files with --mmap (default: 1, 0 = all cores)");
 
   po::positional_options_description p;
   p.add("files", -1);
@@ -212,6 +232,8 @@ bool parse_options(int argc, char* argv[], Options& options)
     if (options.files.empty()) throw runtime_error("Output file not specified");
   }
 
+  if (options.threads == 0) options.threads = boost::thread::hardware_concurrency();
+
   if (!fs::exists(options.paramsfile))
     throw runtime_error("Parameters file '" + options.paramsfile + "' does not exist");
 
@@ -443,6 +465,32 @@ Stations parse_stations(const CsvTable& csv)
   return stations;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Create HPlaceDescriptor from the used station ids
+ */
+// ----------------------------------------------------------------------
+
+NFmiHPlaceDescriptor make_hdesc(const set<string>& used, const Stations& stations)
+{
+  if (options.verbose) cout << "Found " << used.size() << " stations from input" << endl;
+
+  // Build LocationBag
+
+  NFmiLocationBag lbag;
+  BOOST_FOREACH (const string& id, used)
+  {
+    Stations::const_iterator it = stations.find(id);
+    if (it == stations.end())
+      throw runtime_error("No information found for station id '" + id + "'");
+
+    NFmiStation station(it->second.number, it->second.name, it->second.lon, it->second.lat);
+    lbag.AddLocation(station);
+  }
+
+  return NFmiHPlaceDescriptor(lbag);
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Create HPlaceDescriptor
@@ -468,22 +516,34 @@ NFmiHPlaceDescriptor create_hdesc(const CsvTable& csv, const Stations& stations)
     }
   }
 
-  if (options.verbose) cout << "Found " << used.size() << " stations from input" << endl;
+  return make_hdesc(used, stations);
+}
 
-  // Build LocationBag
+// ----------------------------------------------------------------------
+/*!
+ * \brief Create VPlaceDescriptor from the used levels
+ */
+// ----------------------------------------------------------------------
 
-  NFmiLocationBag lbag;
-  BOOST_FOREACH (const string& id, used)
-  {
-    Stations::const_iterator it = stations.find(id);
-    if (it == stations.end())
-      throw runtime_error("No information found for station id '" + id + "'");
+NFmiVPlaceDescriptor make_vdesc(const set<int>& used)
+{
+  // default is sufficient for point data
 
-    NFmiStation station(it->second.number, it->second.name, it->second.lon, it->second.lat);
-    lbag.AddLocation(station);
+  if (options.levelcolumn < 0) return NFmiVPlaceDescriptor();
+
+  if (options.verbose) cout << "Found " << used.size() << " levels from input" << endl;
+
+  // Build LevelBag
+
+  FmiLevelType ltype = static_cast<FmiLevelType>(options.leveltype);
+  NFmiLevelBag lbag;
+  BOOST_FOREACH (int value, used)
+  {
+    NFmiLevel tmp(ltype, value);
+    lbag.AddLevel(tmp);
   }
 
-  return NFmiHPlaceDescriptor(lbag);
+  return NFmiVPlaceDescriptor(lbag);
 }
 
 // ----------------------------------------------------------------------
@@ -494,8 +554,6 @@ NFmiHPlaceDescriptor create_hdesc(const CsvTable& csv, const Stations& stations)
 
 NFmiVPlaceDescriptor create_vdesc(const CsvTable& csv)
 {
-  // default is sufficient for point data
-
   if (options.levelcolumn < 0) return NFmiVPlaceDescriptor();
 
   // List all unique levels
@@ -514,19 +572,7 @@ NFmiVPlaceDescriptor create_vdesc(const CsvTable& csv)
     }
   }
 
-  if (options.verbose) cout << "Found " << used.size() << " levels from input" << endl;
-
-  // Build LevelBag
-
-  FmiLevelType ltype = static_cast<FmiLevelType>(options.leveltype);
-  NFmiLevelBag lbag;
-  BOOST_FOREACH (int value, used)
-  {
-    NFmiLevel tmp(ltype, value);
-    lbag.AddLevel(tmp);
-  }
-
-  return NFmiVPlaceDescriptor(lbag);
+  return make_vdesc(used);
 }
 
 // ----------------------------------------------------------------------
@@ -591,28 +637,15 @@ NFmiMetTime tomettime(const boost::posix_time::ptime& t)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Create TimeDescriptor
+ * \brief Create TimeDescriptor from the used times
  */
 // ----------------------------------------------------------------------
 
-NFmiTimeDescriptor create_tdesc(const CsvTable& csv, const boost::local_time::time_zone_ptr& tz)
+NFmiTimeDescriptor make_tdesc(const set<boost::posix_time::ptime>& used,
+                              const boost::local_time::time_zone_ptr& tz)
 {
   using boost::posix_time::ptime;
 
-  // List all times
-
-  set<ptime> used;
-  string last_t = "";
-  BOOST_FOREACH (const CsvTable::value_type& row, csv)
-  {
-    const string& t = row[options.timecolumn];
-    if (t != last_t)
-    {
-      used.insert(Fmi::TimeParser::parse(t, tz).utc_time());
-      last_t = t;
-    }
-  }
-
   if (options.verbose) cout << "Found " << used.size() << " unique times from input" << endl;
 
   // Build TimeList
@@ -634,6 +667,33 @@ NFmiTimeDescriptor create_tdesc(const CsvTable& csv, const boost::local_time::ti
   return NFmiTimeDescriptor(origintime, tlist);
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Create TimeDescriptor
+ */
+// ----------------------------------------------------------------------
+
+NFmiTimeDescriptor create_tdesc(const CsvTable& csv, const boost::local_time::time_zone_ptr& tz)
+{
+  using boost::posix_time::ptime;
+
+  // List all times
+
+  set<ptime> used;
+  string last_t = "";
+  BOOST_FOREACH (const CsvTable::value_type& row, csv)
+  {
+    const string& t = row[options.timecolumn];
+    if (t != last_t)
+    {
+      used.insert(Fmi::TimeParser::parse(t, tz).utc_time());
+      last_t = t;
+    }
+  }
+
+  return make_tdesc(used, tz);
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Make location index
@@ -729,18 +789,30 @@ void copy_values(NFmiFastQueryInfo& info,
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Basic error checking
+ * \brief Number of columns each row must have
  */
 // ----------------------------------------------------------------------
 
-void validate_csv(const CsvTable& csv)
+unsigned int csv_columns()
 {
-  // Each row must contain time,id and params
-
   unsigned int columns = options.params.size();
   if (options.levelcolumn >= 0) ++columns;
   if (options.timecolumn >= 0) ++columns;
   if (options.stationcolumn >= 0) ++columns;
+  return columns;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Basic error checking
+ */
+// ----------------------------------------------------------------------
+
+void validate_csv(const CsvTable& csv)
+{
+  // Each row must contain time,id and params
+
+  unsigned int columns = csv_columns();
 
   int rownum = 0;
   BOOST_FOREACH (const CsvTable::value_type& row, csv)
@@ -785,6 +857,639 @@ void write_querydata(const CsvTable& csv, const Params& params, const Stations&
   out << *data;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief A field in a memory mapped CSV file
+ *
+ * Quotes are not included in the range. Doubled quotes inside a quoted
+ * field are left as is, and are removed only by str().
+ */
+// ----------------------------------------------------------------------
+
+struct CsvField
+{
+  const char* begin;
+  const char* end;
+  bool escaped;
+
+  CsvField() : begin(0), end(0), escaped(false) {}
+
+  string str() const
+  {
+    string ret(begin, end);
+    if (escaped) boost::algorithm::replace_all(ret, "\"\"", "\"");
+    return ret;
+  }
+
+  bool equals(const string& value) const
+  {
+    if (escaped) return str() == value;
+    return (static_cast<size_t>(end - begin) == value.size() &&
+            memcmp(begin, value.data(), value.size()) == 0);
+  }
+};
+
+typedef vector<CsvField> CsvRow;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Split a CSV line into fields without copying
+ */
+// ----------------------------------------------------------------------
+
+void split_csv_line(const char* begin, const char* end, CsvRow& row)
+{
+  row.clear();
+
+  const char* p = begin;
+  while (true)
+  {
+    CsvField field;
+    if (p < end && *p == '"')
+    {
+      field.begin = ++p;
+      while (p < end)
+      {
+        if (*p == '"')
+        {
+          if (p + 1 == end || p[1] != '"') break;
+          field.escaped = true;
+          ++p;
+        }
+        ++p;
+      }
+      field.end = p;
+      while (p < end && *p != ',')
+        ++p;
+    }
+    else
+    {
+      field.begin = p;
+      while (p < end && *p != ',')
+        ++p;
+      field.end = p;
+    }
+
+    row.push_back(field);
+    if (p == end) break;
+    ++p;  // skip the comma
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Parse a number from a field without allocating memory
+ *
+ * Like boost::lexical_cast, the whole field must be a valid number.
+ */
+// ----------------------------------------------------------------------
+
+bool parse_number(const CsvField& field, double& value)
+{
+  char buffer[64];
+  size_t n = field.end - field.begin;
+  if (n == 0 || n >= sizeof(buffer) || field.escaped || isspace(*field.begin)) return false;
+
+  memcpy(buffer, field.begin, n);
+  buffer[n] = '\0';
+
+  char* endptr;
+  value = strtod(buffer, &endptr);
+  return (endptr == buffer + n);
+}
+
+bool parse_number(const CsvField& field, int& value)
+{
+  char buffer[32];
+  size_t n = field.end - field.begin;
+  if (n == 0 || n >= sizeof(buffer) || field.escaped || isspace(*field.begin)) return false;
+
+  memcpy(buffer, field.begin, n);
+  buffer[n] = '\0';
+
+  char* endptr;
+  long tmp = strtol(buffer, &endptr, 10);
+  value = static_cast<int>(tmp);
+  return (endptr == buffer + n && tmp == value);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Call the handler for each nonempty line of a mapped range
+ *
+ * Quoted fields may not contain newlines.
+ *
+ * \return The number of lines in the range
+ */
+// ----------------------------------------------------------------------
+
+template <typename Handler>
+int scan_csv_lines(const char* begin, const char* end, int firstrow, Handler& handler)
+{
+  CsvRow row;
+  int rownum = firstrow;
+  const char* p = begin;
+  while (p < end)
+  {
+    const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+    if (eol == 0) eol = end;
+
+    const char* stop = eol;
+    if (stop > p && stop[-1] == '\r') --stop;
+
+    if (stop > p)
+    {
+      split_csv_line(p, stop, row);
+      handler(row, rownum);
+    }
+
+    ++rownum;
+    p = (eol == end ? end : eol + 1);
+  }
+  return rownum - firstrow;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A part of a mapped file ending at a newline
+ */
+// ----------------------------------------------------------------------
+
+struct CsvChunk
+{
+  size_t file;         // index to options.files
+  const char* begin;
+  const char* end;
+  int firstrow;        // known after the first pass
+  int rows;
+
+  CsvChunk(size_t theFile, const char* theBegin, const char* theEnd)
+      : file(theFile), begin(theBegin), end(theEnd), firstrow(1), rows(0)
+  {
+  }
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The memory mapped input files split into chunks
+ */
+// ----------------------------------------------------------------------
+
+struct MappedCsv
+{
+  vector<boost::shared_ptr<boost::iostreams::mapped_file_source> > files;
+  vector<CsvChunk> chunks;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Map the input files and split them into chunks
+ *
+ * Each file is split into a few chunks per thread so that the threads
+ * stay busy even if the lines are of varying length.
+ */
+// ----------------------------------------------------------------------
+
+void map_csv_files(MappedCsv& csv, unsigned int threads)
+{
+  const size_t min_chunk_size = 1024 * 1024;
+
+  for (size_t i = 0; i < options.files.size(); i++)
+  {
+    const string& filename = options.files[i];
+    if (boost::filesystem::file_size(filename) == 0) continue;
+
+    boost::shared_ptr<boost::iostreams::mapped_file_source> mapped(
+        new boost::iostreams::mapped_file_source(filename));
+    csv.files.push_back(mapped);
+
+    const char* begin = mapped->data();
+    const char* end = begin + mapped->size();
+    size_t size = mapped->size();
+
+    size_t n = (threads == 1 ? 1 : std::min<size_t>(4 * threads, size / min_chunk_size));
+    n = std::max<size_t>(1, n);
+
+    const char* p = begin;
+    for (size_t k = 1; k <= n && p < end; k++)
+    {
+      const char* stop = (k == n ? end : std::max(p, begin + size / n * k));
+      if (stop < end)
+      {
+        stop = static_cast<const char*>(memchr(stop, '\n', end - stop));
+        stop = (stop == 0 ? end : stop + 1);
+      }
+      csv.chunks.push_back(CsvChunk(i, p, stop));
+      p = stop;
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Process a single chunk with the handler of the thread
+ */
+// ----------------------------------------------------------------------
+
+template <typename Handler>
+void scan_chunk(vector<CsvChunk>* chunks,
+                vector<Handler>* handlers,
+                unsigned int thread,
+                size_t i)
+{
+  CsvChunk& chunk = (*chunks)[i];
+  Handler& handler = (*handlers)[thread];
+  try
+  {
+    handler.begin_chunk(i + 1);
+    chunk.rows = scan_csv_lines(chunk.begin, chunk.end, chunk.firstrow, handler);
+  }
+  catch (exception& e)
+  {
+    throw runtime_error(string(e.what()) + " in file '" + options.files[chunk.file] + "'");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Process the chunks in parallel
+ *
+ * There is one handler per thread. The error of the first failed
+ * chunk is thrown once all threads are done.
+ */
+// ----------------------------------------------------------------------
+
+template <typename Handler>
+void scan_chunks(vector<CsvChunk>& chunks, vector<Handler>& handlers)
+{
+  ParallelJobs parallel(chunks.size(), static_cast<unsigned int>(handlers.size()));
+  parallel.run(boost::bind(scan_chunk<Handler>, &chunks, &handlers, _1, _2));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief First pass: collect the stations, times and levels
+ */
+// ----------------------------------------------------------------------
+
+struct CsvScanner
+{
+  set<string> stations;
+  set<string> times;
+  set<int> levels;
+
+  CsvScanner()
+      : stations(), times(), levels(), columns(csv_columns()), last_station(), last_time()
+  {
+  }
+
+  void begin_chunk(unsigned int /* chunk */) {}
+
+  void operator()(const CsvRow& row, int rownum)
+  {
+    if (row.size() != columns)
+      throw runtime_error("Row " + boost::lexical_cast<string>(rownum) + " contains " +
+                          boost::lexical_cast<string>(row.size()) +
+                          " elements but should contain " + boost::lexical_cast<string>(columns));
+
+    const CsvField& station = row[options.stationcolumn];
+    if (!station.equals(last_station))
+    {
+      last_station = station.str();
+      stations.insert(last_station);
+    }
+
+    const CsvField& t = row[options.timecolumn];
+    if (!t.equals(last_time))
+    {
+      last_time = t.str();
+      times.insert(last_time);
+    }
+
+    if (options.levelcolumn >= 0)
+    {
+      int level;
+      if (!parse_number(row[options.levelcolumn], level))
+        throw runtime_error("Invalid level at row " + boost::lexical_cast<string>(rownum) + ": " +
+                            row[options.levelcolumn].str());
+      levels.insert(level);
+    }
+  }
+
+ private:
+  unsigned int columns;
+  string last_station;
+  string last_time;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Querydata indices of the stations, times and levels
+ */
+// ----------------------------------------------------------------------
+
+struct CsvIndex
+{
+  typedef boost::unordered_map<string, unsigned long> Index;
+
+  Index locations;
+  Index times;
+  map<int, unsigned long> levels;
+
+  CsvIndex(NFmiFastQueryInfo& info,
+           const CsvScanner& scanner,
+           const Stations& stations,
+           const boost::local_time::time_zone_ptr& tz)
+      : locations(), times(), levels()
+  {
+    BOOST_FOREACH (const string& id, scanner.stations)
+    {
+      info.Location(stations.find(id)->second.number);
+      locations[id] = info.LocationIndex();
+    }
+
+    BOOST_FOREACH (const string& t, scanner.times)
+    {
+      info.Time(tomettime(Fmi::TimeParser::parse(t, tz).utc_time()));
+      times[t] = info.TimeIndex();
+    }
+
+    BOOST_FOREACH (int level, scanner.levels)
+    {
+      if (!info.Level(NFmiLevel(static_cast<FmiLevelType>(options.leveltype), level)))
+        throw runtime_error("Failed to set level " + boost::lexical_cast<string>(level));
+      levels[level] = info.LevelIndex();
+    }
+  }
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Ownership of the station/time/level combinations by the chunks
+ *
+ * Rows of different chunks may have the same station, time and level.
+ * The first chunk to claim a combination writes it, the others only
+ * record the conflict. The conflicting combinations are rewritten in
+ * file order once all threads are done, hence the last row wins just
+ * like in a sequential run.
+ */
+// ----------------------------------------------------------------------
+
+struct CsvClaims
+{
+  vector<unsigned int> owners;  // chunk number + 1, zero if not claimed yet
+  boost::mutex locks[1024];
+  boost::mutex conflict_mutex;
+  set<size_t> conflicts;
+  set<unsigned int> chunks;  // chunk numbers + 1 involved in conflicts
+
+  CsvClaims(size_t size) : owners(size, 0) {}
+
+  bool claim(size_t combination, unsigned int chunk)
+  {
+    unsigned int owner;
+    {
+      boost::mutex::scoped_lock lock(locks[combination % 1024]);
+      owner = owners[combination];
+      if (owner == 0 || owner == chunk)
+      {
+        owners[combination] = chunk;
+        return true;
+      }
+    }
+
+    boost::mutex::scoped_lock lock(conflict_mutex);
+    conflicts.insert(combination);
+    chunks.insert(owner);
+    chunks.insert(chunk);
+    return false;
+  }
+
+ private:
+  CsvClaims(const CsvClaims&);
+  CsvClaims& operator=(const CsvClaims&);
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Second pass: copy the values into the querydata
+ *
+ * Stations and times are found through hash tables built from the
+ * first pass. Consecutive rows usually share both, hence the previous
+ * ones are checked first.
+ *
+ * With claims each row is first checked to be owned by this chunk.
+ * With a replay set only the rows of the listed combinations are
+ * written.
+ */
+// ----------------------------------------------------------------------
+
+struct CsvFiller
+{
+  CsvFiller(NFmiFastQueryInfo& theInfo,
+            const CsvIndex& theIndex,
+            CsvClaims* theClaims,
+            const set<size_t>* theReplay,
+            unsigned int theChunk)
+      : info(&theInfo),
+        index(&theIndex),
+        claims(theClaims),
+        replay(theReplay),
+        chunk(theChunk),
+        values(),
+        last_station(),
+        last_time()
+  {
+  }
+
+  void begin_chunk(unsigned int theChunk) { chunk = theChunk; }
+
+  void operator()(const CsvRow& row, int rownum)
+  {
+    const CsvField& t = row[options.timecolumn];
+    if (!t.equals(last_time))
+    {
+      last_time = t.str();
+      info->TimeIndex(index->times.find(last_time)->second);
+    }
+
+    const CsvField& station = row[options.stationcolumn];
+    if (!station.equals(last_station))
+    {
+      last_station = station.str();
+      info->LocationIndex(index->locations.find(last_station)->second);
+    }
+
+    if (options.levelcolumn >= 0)
+    {
+      int level = 0;
+      parse_number(row[options.levelcolumn], level);  // validated in the first pass
+      info->LevelIndex(index->levels.find(level)->second);
+    }
+
+    // Parse the full row first so that errors do not depend on the claims
+
+    values.clear();
+    for (unsigned int i = options.datacolumn; i < row.size(); i++)
+    {
+      const CsvField& field = row[i];
+      double value = kFloatMissing;
+      if (!field.equals(options.missingvalue) && !parse_number(field, value))
+        throw runtime_error("Invalid number at row " + boost::lexical_cast<string>(rownum) +
+                            ": " + field.str());
+      values.push_back(static_cast<float>(value));
+    }
+
+    if (claims != 0 || replay != 0)
+    {
+      size_t combination =
+          (info->LocationIndex() * info->SizeTimes() + info->TimeIndex()) * info->SizeLevels() +
+          info->LevelIndex();
+      if (replay != 0 && replay->find(combination) == replay->end()) return;
+      if (claims != 0 && !claims->claim(combination, chunk)) return;
+    }
+
+    for (unsigned int i = 0; i < values.size(); i++)
+    {
+      if (values[i] == kFloatMissing) continue;
+      info->ParamIndex(i);
+      info->FloatValue(values[i]);
+    }
+  }
+
+ private:
+  NFmiFastQueryInfo* info;
+  const CsvIndex* index;
+  CsvClaims* claims;
+  const set<size_t>* replay;
+  unsigned int chunk;
+  vector<float> values;
+  string last_station;
+  string last_time;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Rewrite the station/time/level combinations claimed by many chunks
+ */
+// ----------------------------------------------------------------------
+
+void resolve_conflicts(NFmiFastQueryInfo& info,
+                       const CsvIndex& index,
+                       const CsvClaims& claims,
+                       const vector<CsvChunk>& chunks)
+{
+  if (options.verbose)
+    cout << "Resolving " << claims.conflicts.size()
+         << " station/time/level combinations found in several chunks" << endl;
+
+  // Clear the values written by the threads
+
+  BOOST_FOREACH (size_t combination, claims.conflicts)
+  {
+    info.LevelIndex(combination % info.SizeLevels());
+    combination /= info.SizeLevels();
+    info.TimeIndex(combination % info.SizeTimes());
+    info.LocationIndex(combination / info.SizeTimes());
+    for (info.ResetParam(); info.NextParam();)
+      info.FloatValue(kFloatMissing);
+  }
+
+  // And write them again in file order
+
+  BOOST_FOREACH (unsigned int chunknumber, claims.chunks)
+  {
+    const CsvChunk& chunk = chunks[chunknumber - 1];
+    CsvFiller filler(info, index, 0, &claims.conflicts, chunknumber);
+    scan_csv_lines(chunk.begin, chunk.end, chunk.firstrow, filler);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Create and write querydata from memory mapped CSV files
+ *
+ * The first pass collects only the stations, times and levels, the
+ * second one parses the values directly into the querydata. Hence
+ * only the querydata itself needs to fit into memory. Both passes
+ * process the chunks of the files in parallel.
+ */
+// ----------------------------------------------------------------------
+
+void write_querydata_mapped(const Params& params, const Stations& stations)
+{
+  boost::local_time::time_zone_ptr tz =
+      Fmi::TimeZoneFactory::instance().time_zone_from_string(options.timezone);
+
+  MappedCsv csv;
+  map_csv_files(csv, options.threads);
+  vector<CsvChunk>& chunks = csv.chunks;
+
+  unsigned int nthreads =
+      std::max(1u, std::min(options.threads, static_cast<unsigned int>(chunks.size())));
+
+  if (options.verbose)
+    cout << "Processing " << chunks.size() << " chunks with " << nthreads << " threads" << endl;
+
+  // First pass
+
+  vector<CsvScanner> scanners(nthreads);
+  scan_chunks(chunks, scanners);
+
+  CsvScanner scanner;
+  BOOST_FOREACH (const CsvScanner& s, scanners)
+  {
+    scanner.stations.insert(s.stations.begin(), s.stations.end());
+    scanner.times.insert(s.times.begin(), s.times.end());
+    scanner.levels.insert(s.levels.begin(), s.levels.end());
+  }
+  scanners.clear();
+
+  for (size_t i = 1; i < chunks.size(); i++)
+  {
+    if (chunks[i].file == chunks[i - 1].file)
+      chunks[i].firstrow = chunks[i - 1].firstrow + chunks[i - 1].rows;
+  }
+
+  set<boost::posix_time::ptime> times;
+  BOOST_FOREACH (const string& t, scanner.times)
+    times.insert(Fmi::TimeParser::parse(t, tz).utc_time());
+
+  NFmiHPlaceDescriptor hdesc = make_hdesc(scanner.stations, stations);
+  NFmiVPlaceDescriptor vdesc = make_vdesc(scanner.levels);
+  NFmiParamDescriptor pdesc = create_pdesc(params);
+  NFmiTimeDescriptor tdesc = make_tdesc(times, tz);
+
+  NFmiFastQueryInfo qi(pdesc, tdesc, hdesc, vdesc);
+  auto_ptr<NFmiQueryData> data(NFmiQueryDataUtil::CreateEmptyData(qi));
+  if (data.get() == 0) throw runtime_error("Could not allocate memory for result data");
+
+  NFmiFastQueryInfo info(data.get());
+  info.SetProducer(NFmiProducer(options.producernumber, options.producername));
+
+  CsvIndex index(info, scanner, stations, tz);
+
+  // Second pass. Each thread uses an info of its own, claims are
+  // needed only if the chunks may be processed out of order.
+
+  boost::scoped_ptr<CsvClaims> claims;
+  if (nthreads > 1)
+    claims.reset(new CsvClaims(info.SizeLocations() * info.SizeTimes() * info.SizeLevels()));
+
+  info.First();
+  vector<NFmiFastQueryInfo> infos(nthreads, info);
+  vector<CsvFiller> fillers;
+  for (unsigned int i = 0; i < nthreads; i++)
+    fillers.push_back(CsvFiller(infos[i], index, claims.get(), 0, 0));
+
+  scan_chunks(chunks, fillers);
+
+  if (claims && !claims->conflicts.empty()) resolve_conflicts(info, index, *claims, chunks);
+
+  ofstream out(options.outfile.c_str());
+  out << *data;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Main program without exception handling
@@ -795,17 +1500,25 @@ int run(int argc, char* argv[])
 {
   if (!parse_options(argc, argv, options)) return 0;
 
-  Csv csv, csvparams, csvstations;
+  Csv csvparams, csvstations;
   Fmi::CsvReader::read(options.paramsfile, boost::bind(&Csv::addrow, &csvparams, _1));
   Fmi::CsvReader::read(options.stationsfile, boost::bind(&Csv::addrow, &csvstations, _1));
+
+  Params params = parse_params(csvparams.table);
+  Stations stations = parse_stations(csvstations.table);
+
+  if (options.mmap)
+  {
+    write_querydata_mapped(params, stations);
+    return 0;
+  }
+
+  Csv csv;
   BOOST_FOREACH (const string& infile, options.files)
   {
     Fmi::CsvReader::read(infile, boost::bind(&Csv::addrow, &csv, _1));
   }
 
-  Params params = parse_params(csvparams.table);
-  Stations stations = parse_stations(csvstations.table);
-
   write_querydata(csv.table, params, stations);
 
   return 0;
@@ -23,6 +23,8 @@
  *
  */
 
+#include "ParallelJobs.h"
+
 #include <newbase/NFmiQueryData.h>
 #include <newbase/NFmiStreamQueryData.h>
 #include <newbase/NFmiCmdLine.h>
@@ -30,15 +32,40 @@
 #include <newbase/NFmiTimeList.h>
 #include <newbase/NFmiStringTools.h>
 #include <newbase/NFmiQueryDataUtil.h>
+#include <newbase/NFmiAreaFactory.h>
+#include <newbase/NFmiGrid.h>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
 
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <stdexcept>
 #include <fstream>
+#include <map>
 
 bool ReadFlashFile(const std::string &theFileName,
                    int theSkipLines,
                    std::vector<std::string> &theFlashStrings);
 NFmiQueryData *CreateFlashQueryData(std::vector<std::string> &theFlashStrings,
                                     bool fMakeLocal2UtcTimeConversion);
+struct FlashGridOptions
+{
+  std::string projection;
+  int timestep;  // minuutteja
+  unsigned int threads;
+  int skiplines;
+  bool local2utc;
+};
+NFmiQueryData *CreateFlashGridData(const std::string &theFileName,
+                                   const FlashGridOptions &theOptions);
 void Usage(void);
 void Domain(int argc, const char *argv[]);
 int GetIntegerOptionValue(const NFmiCmdLine &theCmdline, char theOption);
@@ -65,7 +92,7 @@ void Domain(int argc, const char *argv[])
   int skipLines = 0;
   bool makeLocal2UtcTimeConversion = false;
 
-  NFmiCmdLine cmdline(argc, argv, "s!t");
+  NFmiCmdLine cmdline(argc, argv, "s!tp!i!j!");
 
   // Tarkistetaan optioiden oikeus:
   if (cmdline.Status().IsError())
@@ -90,12 +117,29 @@ void Domain(int argc, const char *argv[])
   if (cmdline.isOption('s')) skipLines = GetIntegerOptionValue(cmdline, 's');
   if (cmdline.isOption('t')) makeLocal2UtcTimeConversion = true;
 
-  std::vector<std::string> flashStrings;
-  if (!ReadFlashFile(flashFileName, skipLines, flashStrings))
-    throw runtime_error(std::string("salamadata-tiedostoa ") + flashFileName +
-                        std::string(" ei saatu avattua"));
+  NFmiQueryData *newData = 0;
+  if (cmdline.isOption('p'))
+  {
+    FlashGridOptions gridOptions;
+    gridOptions.projection = cmdline.OptionValue('p');
+    gridOptions.timestep = (cmdline.isOption('i') ? GetIntegerOptionValue(cmdline, 'i') : 60);
+    int threads = (cmdline.isOption('j') ? GetIntegerOptionValue(cmdline, 'j') : 1);
+    if (threads < 0)
+      throw runtime_error("Error: 'j' option value must be non-negative, exiting...");
+    gridOptions.threads = (threads == 0 ? boost::thread::hardware_concurrency() : threads);
+    gridOptions.skiplines = skipLines;
+    gridOptions.local2utc = makeLocal2UtcTimeConversion;
+    newData = CreateFlashGridData(flashFileName, gridOptions);
+  }
+  else
+  {
+    std::vector<std::string> flashStrings;
+    if (!ReadFlashFile(flashFileName, skipLines, flashStrings))
+      throw runtime_error(std::string("salamadata-tiedostoa ") + flashFileName +
+                          std::string(" ei saatu avattua"));
 
-  NFmiQueryData *newData = CreateFlashQueryData(flashStrings, makeLocal2UtcTimeConversion);
+    newData = CreateFlashQueryData(flashStrings, makeLocal2UtcTimeConversion);
+  }
   auto_ptr<NFmiQueryData> dataPtr(newData);  // tm tuhoaa dynaamisesti luodun datan
                                              // automaattisesti (vaikka return paikkoja olisi kuinka
                                              // monta)
@@ -259,15 +303,384 @@ bool ReadFlashFile(const std::string &theFileName,
   return false;
 }
 
+// ----------------------------------------------------------------------
+// Hilatuote: salamat lasketaan hilan ruutuihin aika-askeleittain.
+// Ruudun arvot ovat salamoiden lukumr, huippuvirran itseisarvon
+// maksimi ja keskiarvo sek maasalamoiden osuus. Syttmuodossa ei ole
+// erillist pilvisalaman tunnusta, joten pilvisalamaksi tulkitaan salama
+// jonka multiplicity on 0.
+// ----------------------------------------------------------------------
+
+// Hilatuotteen parametrit, joille newbasessa ei ole nimi
+const int kFlashCountParam = 1301;
+const int kFlashPeakCurrentMaxParam = 1302;
+const int kFlashPeakCurrentMeanParam = 1303;
+const int kFlashGroundRatioParam = 1304;
+
+struct FlashStrike
+{
+  long long epoch;  // sekunteja 1970-01-01 alusta
+  double lon;
+  double lat;
+  double power;
+  double multiplicity;
+};
+
+struct FlashCell
+{
+  unsigned int count;
+  unsigned int groundcount;
+  float maxcurrent;
+  double currentsum;
+
+  FlashCell() : count(0), groundcount(0), maxcurrent(0), currentsum(0) {}
+
+  void Add(const FlashCell &theOther)
+  {
+    count += theOther.count;
+    groundcount += theOther.groundcount;
+    maxcurrent = std::max(maxcurrent, theOther.maxcurrent);
+    currentsum += theOther.currentsum;
+  }
+};
+
+// avain on aika-askeleen jrjestysnumero * hilan koko + hilapisteen indeksi
+typedef boost::unordered_map<long long, FlashCell> FlashCells;
+
+// Pivien lukumr 1970-01-01 alusta gregoriaanisessa kalenterissa
+long long DaysFromCivil(int theYear, int theMonth, int theDay)
+{
+  long long y = theYear - (theMonth <= 2 ? 1 : 0);
+  long long era = (y >= 0 ? y : y - 399) / 400;
+  long long yoe = y - era * 400;
+  long long doy = (153 * (theMonth + (theMonth > 2 ? -3 : 9)) + 2) / 5 + theDay - 1;
+  long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+NFmiMetTime EpochToMetTime(long long theEpoch)
+{
+  long long z = (theEpoch >= 0 ? theEpoch : theEpoch - 86399) / 86400;
+  long long secs = theEpoch - z * 86400;
+  z += 719468;
+  long long era = (z >= 0 ? z : z - 146096) / 146097;
+  long long doe = z - era * 146097;
+  long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  long long mp = (5 * doy + 2) / 153;
+  int day = static_cast<int>(doy - (153 * mp + 2) / 5 + 1);
+  int month = static_cast<int>(mp < 10 ? mp + 3 : mp - 9);
+  int year = static_cast<int>(yoe + era * 400 + (month <= 2 ? 1 : 0));
+  return NFmiMetTime(static_cast<short>(year),
+                     static_cast<short>(month),
+                     static_cast<short>(day),
+                     static_cast<short>(secs / 3600),
+                     static_cast<short>(secs / 60 % 60),
+                     static_cast<short>(secs % 60),
+                     1);
+}
+
+// Lukee kokonaisluvun kiinten mittaisesta numerojonosta
+bool ParseDigits(const char *theStr, int theCount, int &theValue)
+{
+  theValue = 0;
+  for (int i = 0; i < theCount; i++)
+  {
+    if (!isdigit(static_cast<unsigned char>(theStr[i]))) return false;
+    theValue = 10 * theValue + (theStr[i] - '0');
+  }
+  return true;
+}
+
+// Purkaa rivin ilman muistinvarauksia, aika on paikallista jos -t on annettu
+void ParseFlashStrike(const char *theBegin, const char *theEnd, FlashStrike &theStrike)
+{
+  char buffer[256];
+  size_t n = std::min(static_cast<size_t>(theEnd - theBegin), sizeof(buffer) - 1);
+  memcpy(buffer, theBegin, n);
+  buffer[n] = '\0';
+
+  int year, month, day, hour, minute, second;
+  if (n < 14 || !ParseDigits(buffer, 4, year) || !ParseDigits(buffer + 4, 2, month) ||
+      !ParseDigits(buffer + 6, 2, day) || !ParseDigits(buffer + 8, 2, hour) ||
+      !ParseDigits(buffer + 10, 2, minute) || !ParseDigits(buffer + 12, 2, second))
+    throw runtime_error(std::string("Data rivin aika oli virheellinen: \n") + buffer);
+
+  theStrike.epoch =
+      DaysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+
+  double *values[5] = {
+      &theStrike.lon, &theStrike.lat, &theStrike.power, &theStrike.multiplicity, 0};
+  double accuracy;
+  values[4] = &accuracy;
+
+  char *ptr = buffer + 14;
+  for (int i = 0; i < 5; i++)
+  {
+    char *endptr;
+    *values[i] = strtod(ptr, &endptr);
+    if (endptr == ptr)
+      throw runtime_error(std::string("Data rivill oli vr mr arvoja: \n") + buffer);
+    ptr = endptr;
+  }
+
+  while (isspace(static_cast<unsigned char>(*ptr)))
+    ++ptr;
+  if (*ptr != '\0')
+    throw runtime_error(std::string("Data rivill oli vr mr arvoja: \n") + buffer);
+}
+
+struct FlashChunk
+{
+  const char *begin;
+  const char *end;
+};
+
+// Sikeen oma hila ja taulukko, johon se laskee salamat
+struct FlashBinner
+{
+  FlashBinner(const NFmiArea *theArea, int theWidth, int theHeight)
+      : grid(theArea, theWidth, theHeight), utcoffsets(), cells()
+  {
+  }
+  NFmiGrid grid;
+  std::map<long long, long long> utcoffsets;
+  FlashCells cells;
+};
+
+// Paikallisen ajan ero UTC-aikaan sekunteina, vlimuistissa tunneittain
+long long LocalToUtcOffset(long long theEpoch, std::map<long long, long long> &theCache)
+{
+  long long hour = (theEpoch >= 0 ? theEpoch : theEpoch - 3599) / 3600;
+  std::map<long long, long long>::const_iterator it = theCache.find(hour);
+  if (it != theCache.end()) return it->second;
+
+  // aikavyhykemuunnos ei vlttmtt ole sieturvallinen
+  static boost::mutex mutex;
+  boost::mutex::scoped_lock lock(mutex);
+
+  NFmiMetTime local = EpochToMetTime(hour * 3600);
+  NFmiMetTime utc(local.UTCTime(), 1);
+  long long offset = 60LL * utc.DifferenceInMinutes(local);
+  theCache.insert(std::make_pair(hour, offset));
+  return offset;
+}
+
+// Laskee yhden palan salamat sikeen omaan taulukkoon
+void BinFlashes(const std::vector<FlashChunk> *theChunks,
+                int theWidth,
+                int theHeight,
+                const FlashGridOptions *theOptions,
+                std::vector<FlashBinner> *theBinners,
+                unsigned int theThread,
+                std::size_t theChunk)
+{
+  const FlashChunk &chunk = (*theChunks)[theChunk];
+  FlashBinner &binner = (*theBinners)[theThread];
+  const long long ncells = static_cast<long long>(theWidth) * theHeight;
+  const long long step = 60LL * theOptions->timestep;
+
+  FlashStrike strike;
+  const char *p = chunk.begin;
+  while (p < chunk.end)
+  {
+    const char *eol = static_cast<const char *>(memchr(p, '\n', chunk.end - p));
+    if (eol == 0) eol = chunk.end;
+    const char *stop = eol;
+    if (stop > p && stop[-1] == '\r') --stop;
+
+    if (stop > p)
+    {
+      ParseFlashStrike(p, stop, strike);
+      if (theOptions->local2utc)
+        strike.epoch += LocalToUtcOffset(strike.epoch, binner.utcoffsets);
+
+      NFmiPoint xy = binner.grid.LatLonToGrid(NFmiPoint(strike.lon, strike.lat));
+      long long x = static_cast<long long>(floor(xy.X() + 0.5));
+      long long y = static_cast<long long>(floor(xy.Y() + 0.5));
+      if (x >= 0 && x < theWidth && y >= 0 && y < theHeight)
+      {
+        // salama kuuluu aika-askeleeseen, joka pttyy sen jlkeen
+        long long bin = (strike.epoch >= 0 ? strike.epoch + step - 1 : strike.epoch) / step;
+        FlashCell &cell = binner.cells[bin * ncells + y * theWidth + x];
+        float current = static_cast<float>(fabs(strike.power));
+        ++cell.count;
+        if (strike.multiplicity != 0) ++cell.groundcount;
+        cell.maxcurrent = std::max(cell.maxcurrent, current);
+        cell.currentsum += current;
+      }
+    }
+    p = (eol == chunk.end ? chunk.end : eol + 1);
+  }
+}
+
+// Jakaa tiedoston rivinvaihtojen kohdalta paloihin, ohitettavat rivit jtetn pois
+std::vector<FlashChunk> SplitFlashFile(const char *theBegin,
+                                       const char *theEnd,
+                                       int theSkipLines,
+                                       unsigned int theThreads)
+{
+  const char *p = theBegin;
+  for (int i = 0; i < theSkipLines && p < theEnd; i++)
+  {
+    const char *eol = static_cast<const char *>(memchr(p, '\n', theEnd - p));
+    p = (eol == 0 ? theEnd : eol + 1);
+  }
+
+  const std::size_t min_chunk_size = 1024 * 1024;
+  std::size_t size = theEnd - p;
+  std::size_t n = 1;
+  if (theThreads > 1)
+    n = std::max<std::size_t>(1, std::min<std::size_t>(4 * theThreads, size / min_chunk_size));
+
+  std::vector<FlashChunk> chunks;
+  const char *begin = p;
+  for (std::size_t k = 1; k <= n && p < theEnd; k++)
+  {
+    const char *stop = (k == n ? theEnd : std::max(p, begin + size / n * k));
+    if (stop < theEnd)
+    {
+      stop = static_cast<const char *>(memchr(stop, '\n', theEnd - stop));
+      stop = (stop == 0 ? theEnd : stop + 1);
+    }
+    FlashChunk chunk;
+    chunk.begin = p;
+    chunk.end = stop;
+    chunks.push_back(chunk);
+    p = stop;
+  }
+  return chunks;
+}
+
+NFmiParamDescriptor MakeGridParamDescriptor(void)
+{
+  NFmiProducer prod(1012, "flash");
+  NFmiParamBag params;
+  params.Add(NFmiDataIdent(NFmiParam(kFlashCountParam, "FlashCount"), prod));
+  params.Add(NFmiDataIdent(NFmiParam(kFlashPeakCurrentMaxParam, "FlashPeakCurrentMax"), prod));
+  params.Add(NFmiDataIdent(NFmiParam(kFlashPeakCurrentMeanParam, "FlashPeakCurrentMean"), prod));
+  params.Add(NFmiDataIdent(NFmiParam(kFlashGroundRatioParam, "FlashGroundRatio"), prod));
+  return NFmiParamDescriptor(params);
+}
+
+NFmiQueryData *CreateFlashGridData(const std::string &theFileName,
+                                   const FlashGridOptions &theOptions)
+{
+  boost::shared_ptr<NFmiArea> area = NFmiAreaFactory::Create(theOptions.projection);
+  int width = static_cast<int>(round(area->XYArea(area.get()).Width()));
+  int height = static_cast<int>(round(area->XYArea(area.get()).Height()));
+  const long long ncells = static_cast<long long>(width) * height;
+
+  if (theOptions.timestep <= 0) throw runtime_error("Aika-askeleen pit olla positiivinen");
+
+  if (!boost::filesystem::exists(theFileName))
+    throw runtime_error(std::string("salamadata-tiedostoa ") + theFileName +
+                        std::string(" ei saatu avattua"));
+
+  // Lasketaan salamat sikeittin omiin taulukoihin ja yhdistetn ne lopuksi
+
+  FlashCells cells;
+  if (boost::filesystem::file_size(theFileName) > 0)
+  {
+    boost::iostreams::mapped_file_source mapped(theFileName);
+    std::vector<FlashChunk> chunks = SplitFlashFile(
+        mapped.data(), mapped.data() + mapped.size(), theOptions.skiplines, theOptions.threads);
+
+    ParallelJobs parallel(chunks.size(), theOptions.threads);
+    std::vector<FlashBinner> binners(parallel.threads(), FlashBinner(area.get(), width, height));
+    parallel.run(boost::bind(BinFlashes, &chunks, width, height, &theOptions, &binners, _1, _2));
+
+    cells.swap(binners[0].cells);
+    for (std::size_t i = 1; i < binners.size(); i++)
+    {
+      for (FlashCells::const_iterator it = binners[i].cells.begin(); it != binners[i].cells.end();
+           ++it)
+        cells[it->first].Add(it->second);
+      FlashCells().swap(binners[i].cells);
+    }
+  }
+
+  if (cells.empty()) return 0;
+
+  // Aika-askeleet ensimmisest viimeiseen, mys tyhjt askeleet
+
+  long long firstbin = cells.begin()->first / ncells;
+  long long lastbin = firstbin;
+  for (FlashCells::const_iterator it = cells.begin(); it != cells.end(); ++it)
+  {
+    firstbin = std::min(firstbin, it->first / ncells);
+    lastbin = std::max(lastbin, it->first / ncells);
+  }
+
+  const long long step = 60LL * theOptions.timestep;
+  NFmiTimeList times;
+  for (long long bin = firstbin; bin <= lastbin; bin++)
+    times.Add(new NFmiMetTime(EpochToMetTime(bin * step)));
+
+  NFmiGrid grid(area.get(), width, height);
+  NFmiMetTime origintime;
+  NFmiQueryInfo innerInfo(MakeGridParamDescriptor(),
+                          NFmiTimeDescriptor(origintime, times),
+                          NFmiHPlaceDescriptor(grid),
+                          NFmiVPlaceDescriptor());
+  NFmiQueryData *data = NFmiQueryDataUtil::CreateEmptyData(innerInfo);
+  if (!data) return 0;
+
+  // Tyhjiss ruuduissa lukumr on 0 ja muut arvot puuttuvia
+
+  NFmiFastQueryInfo info(data);
+  info.First();
+  if (info.Param(kFlashCountParam))
+    for (info.ResetTime(); info.NextTime();)
+      for (info.ResetLocation(); info.NextLocation();)
+        info.FloatValue(0);
+
+  unsigned long countindex = info.ParamIndex();
+  info.Param(kFlashPeakCurrentMaxParam);
+  unsigned long maxindex = info.ParamIndex();
+  info.Param(kFlashPeakCurrentMeanParam);
+  unsigned long meanindex = info.ParamIndex();
+  info.Param(kFlashGroundRatioParam);
+  unsigned long ratioindex = info.ParamIndex();
+
+  for (FlashCells::const_iterator it = cells.begin(); it != cells.end(); ++it)
+  {
+    const FlashCell &cell = it->second;
+    info.TimeIndex(static_cast<unsigned long>(it->first / ncells - firstbin));
+    info.LocationIndex(static_cast<unsigned long>(it->first % ncells));
+
+    info.ParamIndex(countindex);
+    info.FloatValue(static_cast<float>(cell.count));
+    info.ParamIndex(maxindex);
+    info.FloatValue(cell.maxcurrent);
+    info.ParamIndex(meanindex);
+    info.FloatValue(static_cast<float>(cell.currentsum / cell.count));
+    info.ParamIndex(ratioindex);
+    info.FloatValue(static_cast<float>(cell.groundcount) / cell.count);
+  }
+
+  return data;
+}
+
 void Usage(void)
 {
-  cout << "Usage: flash2qd [-s lineCount] [-t] flashData > flash.sqd" << endl
+  cout << "Usage: flash2qd [-s lineCount] [-t] [-p projection [-i minutes] [-j threads]] "
+          "flashData > flash.sqd"
+       << endl
        << endl
        << "Options:" << endl
        << endl
        << "\t-s <lineCount>\tLines to skip from start of file, default = 0" << endl
        << "\t-t\tMake time conversion from local to utc, default = no conversion" << endl
+       << "\t-p <projection>\tCount the flashes into a grid, for example" << endl
+       << "\t\t'stereographic,20,90,60:6,51.3,49,70.2:100,100'" << endl
+       << "\t-i <minutes>\tTime step of the grid, default = 60" << endl
+       << "\t-j <threads>\tThreads counting the flashes, default = 1, 0 = all cores" << endl
        << "\tExample usage: flash2qd -s 1 myflashdata.txt > flash.sqd" << endl
+       << endl
+       << "The grid contains the number of flashes, the maximum and mean of the absolute" << endl
+       << "peak current and the share of ground flashes (multiplicity > 0) for each" << endl
+       << "time step ending at the given time." << endl
        << endl;
 }
 
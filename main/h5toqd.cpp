@@ -6,6 +6,8 @@
  */
 // ======================================================================
 
+#include "ParallelJobs.h"
+
 #include <MXA/HDF5/H5Lite.h>
 #include <MXA/HDF5/H5Utilities.h>
 
@@ -30,6 +32,7 @@
 
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/classification.hpp>
+#include <boost/bind.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/foreach.hpp>
@@ -37,9 +40,20 @@
 #include <boost/optional.hpp>
 #include <boost/program_options.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <hdf5.h>
+#include <unistd.h>
 
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <list>
+#include <map>
 #include <numeric>
+#include <set>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -64,6 +78,9 @@ struct Options
   std::string datasetname;   // --datasetname
   std::string producername;  // --producername
   long producernumber;       // --producernumber
+  std::string pvolcache;     // --pvolcache
+  std::vector<std::string> infiles;  // --infiles
+  unsigned int threads;              // -j --threads
 };
 
 Options options;
@@ -81,7 +98,10 @@ Options::Options()
       outfile("-"),
       datasetname("dataset"),
       producername("RADAR"),
-      producernumber(1014)
+      producernumber(1014),
+      pvolcache(),
+      infiles(),
+      threads(0)
 {
 }
 // ----------------------------------------------------------------------
@@ -109,7 +129,16 @@ bool parse_options(int argc, char *argv[])
       "datasetname", po::value(&options.datasetname), "dataset name prefix (default=dataset)")(
       "producer,p", po::value(&producerinfo), "producer number,name")(
       "producernumber", po::value(&options.producernumber), "producer number (default: 1014)")(
-      "producername", po::value(&options.producername), "producer name (default: RADAR)");
+      "producername", po::value(&options.producername), "producer name (default: RADAR)")(
+      "pvolcache",
+      po::value(&options.pvolcache),
+      "directory for cached PVOL projection tables")(
+      "infiles",
+      po::value(&options.infiles)->multitoken(),
+      "input HDF5 files to be combined into one time series, later files win on equal times")(
+      "threads,j",
+      po::value(&options.threads),
+      "number of files decoded in parallel (default: 0 = number of cores)");
 
   po::positional_options_description p;
   p.add("infile", 1);
@@ -128,20 +157,33 @@ bool parse_options(int argc, char *argv[])
   if (opt.count("help"))
   {
     std::cout << "Usage: h5toqd [options] infile outfile" << std::endl
+              << "       h5toqd [options] --infiles infile1 infile2 ... -o outfile" << std::endl
               << std::endl
               << "Converts EUMETNET OPERA radar files to querydata." << std::endl
               << "Only features in known use are supported." << std::endl
               << std::endl
+              << "If several input files have the same valid time, the data of the" << std::endl
+              << "last one on the command line is used." << std::endl
+              << std::endl
               << desc << std::endl;
     return false;
   }
 
-  if (opt.count("infile") == 0) throw std::runtime_error("Expecting input file as parameter 1");
+  if (opt.count("infile") == 0 && options.infiles.empty())
+    throw std::runtime_error("Expecting input file as parameter 1");
 
   if (opt.count("outfile") == 0) throw std::runtime_error("Expecting output file as parameter 2");
 
-  if (!fs::exists(options.infile))
-    throw std::runtime_error("Input file '" + options.infile + "' does not exist");
+  if (opt.count("infile") != 0) options.infiles.insert(options.infiles.begin(), options.infile);
+
+  BOOST_FOREACH (const std::string &infile, options.infiles)
+  {
+    if (!fs::exists(infile))
+      throw std::runtime_error("Input file '" + infile + "' does not exist");
+  }
+
+  if (!options.pvolcache.empty() && !fs::is_directory(options.pvolcache))
+    throw std::runtime_error("PVOL cache directory '" + options.pvolcache + "' does not exist");
 
   // Handle the alternative ways to define the producer
 
@@ -1322,29 +1364,539 @@ void print_hdf_information(const hid_t &hid)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Apply gain and offset
+ * \brief Numeric transformation of stored radar values
+ *
+ * Stored values are mapped to missing, to the undetect value or through
+ * gain and offset into physical values.
  */
 // ----------------------------------------------------------------------
 
-double apply_gain_offset(double value,
-                         const boost::optional<double> &gain,
-                         const boost::optional<double> &offset)
+struct ValueTransform
 {
-  if (gain) value *= *gain;
-  if (offset) value += *offset;
-  return value;
+  boost::optional<double> nodata;
+  boost::optional<double> undetect;
+  boost::optional<double> gain;
+  boost::optional<double> offset;
+
+  float apply_gain_offset(double value) const
+  {
+    if (gain) value *= *gain;
+    if (offset) value += *offset;
+    return static_cast<float>(value);
+  }
+
+  float operator()(double value) const
+  {
+    if (nodata && value == *nodata) return kFloatMissing;
+    if (undetect && value == *undetect) return apply_gain_offset(0);
+    return apply_gain_offset(value);
+  }
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read the numeric transformation from the given what-group
+ */
+// ----------------------------------------------------------------------
+
+ValueTransform get_value_transform(const hid_t &hid, const std::string &path)
+{
+  ValueTransform transform;
+  transform.nodata = get_optional_double(hid, path, "nodata");
+  transform.undetect = get_optional_double(hid, path, "undetect");
+  transform.gain = get_optional_double(hid, path, "gain");
+  transform.offset = get_optional_double(hid, path, "offset");
+  return transform;
+}
+
+ValueTransform get_value_transform(const hid_t &hid,
+                                   const std::string &parent_path,
+                                   const std::string &group_name)
+{
+  ValueTransform transform;
+  transform.nodata = get_optional_double(hid, parent_path, group_name, "nodata");
+  transform.undetect = get_optional_double(hid, parent_path, group_name, "undetect");
+  transform.gain = get_optional_double(hid, parent_path, group_name, "gain");
+  transform.offset = get_optional_double(hid, parent_path, group_name, "offset");
+  return transform;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief HDF5 identifier which is closed when going out of scope
+ */
+// ----------------------------------------------------------------------
+
+class H5Id
+{
+ public:
+  H5Id(hid_t id, herr_t (*closer)(hid_t)) : itsId(id), itsCloser(closer) {}
+  ~H5Id()
+  {
+    if (itsId >= 0) itsCloser(itsId);
+  }
+  operator hid_t() const { return itsId; }
+
+ private:
+  H5Id(const H5Id &other);
+  H5Id &operator=(const H5Id &other);
+
+  hid_t itsId;
+  herr_t (*itsCloser)(hid_t);
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Raw values of a dataset in their native HDF5 type
+ *
+ * The rows are stored in newbase order, i.e. bottom row first.
+ */
+// ----------------------------------------------------------------------
+
+struct RawGrid
+{
+  enum Type
+  {
+    kSignedChar,
+    kUnsignedChar,
+    kShort,
+    kUnsignedShort,
+    kInt,
+    kDouble
+  };
+
+  Type type;
+  std::vector<unsigned char> bytes;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read a 2D dataset in its native type with the rows in newbase order
+ *
+ * HDF5 grids start from the top row, newbase grids from the bottom row.
+ * Reading the file rows in reverse order flips the grid without any
+ * per-point index arithmetic.
+ */
+// ----------------------------------------------------------------------
+
+void read_flipped_rows(hid_t dataset,
+                       hid_t memtype,
+                       const std::string &path,
+                       unsigned long width,
+                       unsigned long height,
+                       std::vector<unsigned char> &bytes)
+{
+  H5Id filespace(H5Dget_space(dataset), H5Sclose);
+  if (filespace < 0) throw std::runtime_error("Failed to get dataspace of " + path);
+
+  hsize_t dims[2];
+  if (H5Sget_simple_extent_ndims(filespace) != 2 ||
+      H5Sget_simple_extent_dims(filespace, dims, 0) < 0)
+    throw std::runtime_error("Dataset " + path + " is not two dimensional");
+
+  if (dims[0] != height || dims[1] != width)
+    throw std::runtime_error("Dataset " + path + " size does not match the output grid size");
+
+  hsize_t rowsize = width;
+  H5Id memspace(H5Screate_simple(1, &rowsize, 0), H5Sclose);
+
+  const std::size_t rowbytes = width * H5Tget_size(memtype);
+  bytes.resize(rowbytes * height);
+
+  for (unsigned long j = 0; j < height; j++)
+  {
+    hsize_t start[2] = {height - j - 1, 0};
+    hsize_t count[2] = {1, width};
+    if (H5Sselect_hyperslab(filespace, H5S_SELECT_SET, start, 0, count, 0) < 0 ||
+        H5Dread(dataset, memtype, memspace, filespace, H5P_DEFAULT, &bytes[j * rowbytes]) < 0)
+      throw std::runtime_error("Failed to read " + path);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read a 2D dataset
+ */
+// ----------------------------------------------------------------------
+
+void read_grid(const hid_t &hid,
+               const std::string &path,
+               unsigned long width,
+               unsigned long height,
+               RawGrid &grid)
+{
+  if (options.verbose) std::cout << "Reading " << path << std::endl;
+
+  H5Id dataset(H5Dopen2(hid, path.c_str(), H5P_DEFAULT), H5Dclose);
+  if (dataset < 0) throw std::runtime_error("Failed to open " + path);
+
+  H5Id datatype(H5Dget_type(dataset), H5Tclose);
+  if (datatype < 0) throw std::runtime_error("Failed to get the data type of " + path);
+
+  const H5T_class_t typeclass = H5Tget_class(datatype);
+  const std::size_t typesize = H5Tget_size(datatype);
+  const bool is_signed = (H5Tget_sign(datatype) != H5T_SGN_NONE);
+
+  hid_t memtype;
+  if (typeclass == H5T_INTEGER && typesize == 1)
+  {
+    grid.type = (is_signed ? RawGrid::kSignedChar : RawGrid::kUnsignedChar);
+    memtype = (is_signed ? H5T_NATIVE_SCHAR : H5T_NATIVE_UCHAR);
+  }
+  else if (typeclass == H5T_INTEGER && typesize == 2)
+  {
+    grid.type = (is_signed ? RawGrid::kShort : RawGrid::kUnsignedShort);
+    memtype = (is_signed ? H5T_NATIVE_SHORT : H5T_NATIVE_USHORT);
+  }
+  else if (typeclass == H5T_INTEGER)
+  {
+    grid.type = RawGrid::kInt;
+    memtype = H5T_NATIVE_INT;
+  }
+  else if (typeclass == H5T_FLOAT)
+  {
+    grid.type = RawGrid::kDouble;
+    memtype = H5T_NATIVE_DOUBLE;
+  }
+  else
+    throw std::runtime_error("Dataset " + path + " is of unknown type");
+
+  read_flipped_rows(dataset, memtype, path, width, height, grid.bytes);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy integer data through a lookup table built once per dataset
+ *
+ * All possible stored values of 8- and 16-bit data are transformed in
+ * advance, after which each grid point is a single table lookup.
+ */
+// ----------------------------------------------------------------------
+
+template <typename T>
+void decode_table_values(const RawGrid &grid,
+                         NFmiFastQueryInfo &info,
+                         const ValueTransform &transform)
+{
+  const long minvalue = std::numeric_limits<T>::min();
+  const long maxvalue = std::numeric_limits<T>::max();
+
+  std::vector<float> table(maxvalue - minvalue + 1);
+  for (long value = minvalue; value <= maxvalue; value++)
+    table[value - minvalue] = transform(value);
+
+  const T *values = reinterpret_cast<const T *>(&grid.bytes[0]);
+  const std::size_t n = grid.bytes.size() / sizeof(T);
+
+  info.ResetLocation();
+  for (std::size_t k = 0; k < n; k++)
+  {
+    info.NextLocation();
+    info.FloatValue(table[values[k] - minvalue]);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy wider integer or floating point data value by value
+ */
+// ----------------------------------------------------------------------
+
+template <typename T>
+void decode_plain_values(const RawGrid &grid,
+                         NFmiFastQueryInfo &info,
+                         const ValueTransform &transform)
+{
+  const T *values = reinterpret_cast<const T *>(&grid.bytes[0]);
+  const std::size_t n = grid.bytes.size() / sizeof(T);
+
+  info.ResetLocation();
+  for (std::size_t k = 0; k < n; k++)
+  {
+    info.NextLocation();
+    info.FloatValue(transform(values[k]));
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy a 2D dataset into the active param, level and time
+ */
+// ----------------------------------------------------------------------
+
+void decode_grid(const RawGrid &grid, NFmiFastQueryInfo &info, const ValueTransform &transform)
+{
+  switch (grid.type)
+  {
+    case RawGrid::kSignedChar:
+      return decode_table_values<signed char>(grid, info, transform);
+    case RawGrid::kUnsignedChar:
+      return decode_table_values<unsigned char>(grid, info, transform);
+    case RawGrid::kShort:
+      return decode_table_values<short>(grid, info, transform);
+    case RawGrid::kUnsignedShort:
+      return decode_table_values<unsigned short>(grid, info, transform);
+    case RawGrid::kInt:
+      return decode_plain_values<int>(grid, info, transform);
+    case RawGrid::kDouble:
+      return decode_plain_values<double>(grid, info, transform);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Geometry of one PVOL scan
+ */
+// ----------------------------------------------------------------------
+
+struct PolarGeometry
+{
+  double lon;
+  double lat;
+  double elangle;
+  int nbins;
+  int nrays;
+  double rscale;
+  double rstart;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Polar to cartesian lookup table
+ *
+ * For each output grid point the table holds the index ray*nbins+bin of
+ * the polar bin to be copied there, or -1 if no bin maps onto the point.
+ */
+// ----------------------------------------------------------------------
+
+typedef std::vector<int> PolarLookup;
+typedef boost::shared_ptr<const PolarLookup> PolarLookupPtr;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Unique key for a scan geometry and output grid
+ *
+ * The corners alone do not identify the projection, hence the
+ * area definition is included too.
+ */
+// ----------------------------------------------------------------------
+
+std::string pvol_lookup_key(const PolarGeometry &geom, NFmiFastQueryInfo &info)
+{
+  std::ostringstream out;
+  out << std::setprecision(10) << "lon=" << geom.lon << " lat=" << geom.lat
+      << " elangle=" << geom.elangle << " nbins=" << geom.nbins << " nrays=" << geom.nrays
+      << " rscale=" << geom.rscale << " rstart=" << geom.rstart
+      << " nx=" << info.Grid()->XNumber() << " ny=" << info.Grid()->YNumber()
+      << " bl=" << info.Area()->BottomLeftLatLon().X() << ','
+      << info.Area()->BottomLeftLatLon().Y() << " tr=" << info.Area()->TopRightLatLon().X()
+      << ',' << info.Area()->TopRightLatLon().Y() << " area=" << info.Area()->AreaStr();
+  return out.str();
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Copy one dataset
+ * \brief Name of the disk cache file for the given key
+ *
+ * FNV-1a is used since unlike std::hash it is stable across builds.
  */
 // ----------------------------------------------------------------------
 
-void copy_dataset(const hid_t &hid, NFmiFastQueryInfo &info, int datanum)
+std::string pvol_cache_filename(const std::string &key)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (std::size_t i = 0; i < key.size(); i++)
+  {
+    hash ^= static_cast<unsigned char>(key[i]);
+    hash *= 1099511628211ULL;
+  }
+
+  std::ostringstream out;
+  out << "pvol_" << std::hex << std::setw(16) << std::setfill('0') << hash << ".lut";
+  return (boost::filesystem::path(options.pvolcache) / out.str()).string();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read a lookup table from the disk cache
+ *
+ * \return Empty pointer if the file does not exist or is for other geometry
+ */
+// ----------------------------------------------------------------------
+
+PolarLookupPtr read_pvol_lookup(const std::string &key, std::size_t size)
+{
+  std::ifstream in(pvol_cache_filename(key).c_str(), std::ios::in | std::ios::binary);
+  if (!in) return PolarLookupPtr();
+
+  std::string filekey;
+  std::size_t filesize = 0;
+  if (!std::getline(in, filekey) || filekey != key) return PolarLookupPtr();
+  if (!in.read(reinterpret_cast<char *>(&filesize), sizeof(filesize)) || filesize != size)
+    return PolarLookupPtr();
+
+  boost::shared_ptr<PolarLookup> lookup(new PolarLookup(size));
+  if (!in.read(reinterpret_cast<char *>(&(*lookup)[0]), size * sizeof(int)))
+    return PolarLookupPtr();
+
+  if (options.verbose) std::cout << "Read PVOL lookup table " << key << std::endl;
+
+  return lookup;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write a lookup table into the disk cache
+ *
+ * The file is written under a temporary name and then renamed so that
+ * concurrent processes never see a partial table.
+ */
+// ----------------------------------------------------------------------
+
+void write_pvol_lookup(const std::string &key, const PolarLookup &lookup)
+{
+  const std::string filename = pvol_cache_filename(key);
+  std::ostringstream tmpname;
+  tmpname << filename << '.' << getpid() << '.' << boost::this_thread::get_id() << ".tmp";
+  const std::string tmpfile = tmpname.str();
+
+  {
+    std::ofstream out(tmpfile.c_str(), std::ios::out | std::ios::binary);
+    if (!out) throw std::runtime_error("Failed to open '" + tmpfile + "' for writing");
+
+    const std::size_t size = lookup.size();
+    out << key << '\n';
+    out.write(reinterpret_cast<const char *>(&size), sizeof(size));
+    out.write(reinterpret_cast<const char *>(&lookup[0]), size * sizeof(int));
+    if (!out) throw std::runtime_error("Failed to write '" + tmpfile + "'");
+  }
+
+  boost::filesystem::rename(tmpfile, filename);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Project the bins of a scan onto the output grid
+ *
+ * See section 5.1 of the Opera specs for details. According to it we
+ * can ignore a1gate for polar volumes. If several bins map onto the same
+ * grid point, the last one is used.
+ */
+// ----------------------------------------------------------------------
+
+PolarLookupPtr create_pvol_lookup(const PolarGeometry &geom, NFmiFastQueryInfo &info)
+{
+  boost::shared_ptr<PolarLookup> lookup(new PolarLookup(info.SizeLocations(), -1));
+
+  // Center location in meters
+
+  NFmiPoint center = info.Area()->LatLonToWorldXY(NFmiPoint(geom.lon, geom.lat));
+
+  const double pi = 3.14159265358979323;
+
+  for (int ray = 0; ray < geom.nrays; ray++)
+  {
+    // Angle of the ray in degrees and then in radians.
+    // 0.5 is added since the first scan represents angle starting from 0,
+    // not centered around it
+
+    double angle = 360 * (ray + 0.5) / geom.nrays;
+    double alpha = angle * pi / 180;
+
+    for (int bin = 0; bin < geom.nbins; ++bin)
+    {
+      // Distance along the ray, taking elevation into account
+      // 0.5 moves us into the center of the bin
+      double r = (1000 * geom.rstart + (bin + 0.5) * geom.rscale) * cos(geom.elangle * pi / 180);
+
+      // Respective world XY coordinate
+      NFmiPoint p(center.X() + r * sin(alpha), center.Y() + r * cos(alpha));
+
+      // And latlon
+      NFmiPoint latlon = info.Area()->WorldXYToLatLon(p);
+
+      if (info.NearestPoint(latlon)) (*lookup)[info.LocationIndex()] = ray * geom.nbins + bin;
+    }
+  }
+
+  return lookup;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Get the lookup table for a scan
+ *
+ * Radar sites and their elevation sets rarely change, hence the tables
+ * are cached in memory and optionally on disk.
+ */
+// ----------------------------------------------------------------------
+
+PolarLookupPtr get_pvol_lookup(const PolarGeometry &geom, NFmiFastQueryInfo &info)
+{
+  typedef std::map<std::string, PolarLookupPtr> PolarLookupCache;
+  static PolarLookupCache cache;
+  static boost::mutex mutex;
+
+  const std::string key = pvol_lookup_key(geom, info);
+
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    PolarLookupCache::const_iterator it = cache.find(key);
+    if (it != cache.end()) return it->second;
+  }
+
+  PolarLookupPtr lookup;
+  if (!options.pvolcache.empty()) lookup = read_pvol_lookup(key, info.SizeLocations());
+
+  if (!lookup)
+  {
+    lookup = create_pvol_lookup(geom, info);
+    if (!options.pvolcache.empty()) write_pvol_lookup(key, *lookup);
+  }
+
+  boost::mutex::scoped_lock lock(mutex);
+  cache[key] = lookup;
+  return lookup;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief One dataset read from the HDF5 file, waiting to be decoded
+ *
+ * Reading must be serialized since the HDF5 library is not thread
+ * safe, decoding into the querydata can be done in parallel.
+ */
+// ----------------------------------------------------------------------
+
+struct DatasetSlice
+{
+  unsigned long paramindex;
+  unsigned long levelindex;
+  unsigned long timeindex;
+  ValueTransform transform;
+
+  bool pvol;
+  RawGrid grid;                   // cartesian data
+  PolarGeometry geom;             // PVOL data
+  std::vector<int> polarvalues;  // PVOL data
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read one dataset
+ */
+// ----------------------------------------------------------------------
+
+void read_dataset(const hid_t &hid,
+                  NFmiFastQueryInfo &info,
+                  int datanum,
+                  std::list<DatasetSlice> &slices)
 {
   std::string prefix = options.datasetname + boost::lexical_cast<std::string>(datanum);
 
+  const unsigned long width = info.Grid()->XNumber();
+  const unsigned long height = info.Grid()->YNumber();
+
   // Set level
 
   info.FirstLevel();  // default
@@ -1370,13 +1922,6 @@ void copy_dataset(const hid_t &hid, NFmiFastQueryInfo &info, int datanum)
           throw std::runtime_error("Failed to activate correct level in output querydata");
       }
 
-      // Establish numeric transformation
-
-      auto nodata = get_optional_double(hid, iprefix, "what", "nodata");
-      auto undetect = get_optional_double(hid, iprefix, "what", "undetect");
-      auto gain = get_optional_double(hid, iprefix, "what", "gain");
-      auto offset = get_optional_double(hid, iprefix, "what", "offset");
-
       FmiParameterName id = opera_name_to_newbase(product, quantity, hid, iprefix + "/what");
 
       if (!info.Param(id))
@@ -1391,40 +1936,18 @@ void copy_dataset(const hid_t &hid, NFmiFastQueryInfo &info, int datanum)
         std::cout << "Copying dataset " << datanum << " part " << i << " with valid time " << t
                   << std::endl;
 
-      std::vector<int> values;
-
-      if (options.verbose) std::cout << "Reading " << iprefix << "/data" << std::endl;
-
-      if (H5Lite::readVectorDataset(hid, iprefix + "/data", values) != 0)
-        throw std::runtime_error("Failed to read " + iprefix + "/data");
+      slices.push_back(DatasetSlice());
+      DatasetSlice &slice = slices.back();
+      slice.paramindex = info.ParamIndex();
+      slice.levelindex = info.LevelIndex();
+      slice.timeindex = info.TimeIndex();
+      slice.pvol = false;
 
-      const unsigned long width = info.Grid()->XNumber();
-      const unsigned long height = info.Grid()->YNumber();
+      // Establish numeric transformation
 
-      unsigned long pos = 0;
+      slice.transform = get_value_transform(hid, iprefix, "what");
 
-      for (info.ResetLocation(); info.NextLocation();)
-      {
-        // Newbase grid location
-        unsigned long i = pos % width;
-        unsigned long j = pos / width;
-        // HDF5 grid location is inverted
-        j = height - j - 1;
-        // Respective vector position
-        unsigned long k = i + width * j;
-
-        // And copy the value
-        int value = values[k];
-
-        if (nodata && value == *nodata)
-          info.FloatValue(kFloatMissing);
-        else if (undetect && value == *undetect)
-          info.FloatValue(apply_gain_offset(0, gain, offset));
-        else
-          info.FloatValue(apply_gain_offset(value, gain, offset));
-
-        ++pos;
-      }
+      read_grid(hid, iprefix + "/data", width, height, slice.grid);
     }
   }
   else
@@ -1443,93 +1966,37 @@ void copy_dataset(const hid_t &hid, NFmiFastQueryInfo &info, int datanum)
         throw std::runtime_error("Failed to activate correct level in output querydata");
     }
 
-    // Establish numeric transformation
-
-    auto nodata = get_optional_double(hid, prefix, "what", "nodata");
-    auto undetect = get_optional_double(hid, prefix, "what", "undetect");
-    auto gain = get_optional_double(hid, prefix, "what", "gain");
-    auto offset = get_optional_double(hid, prefix, "what", "offset");
-
     FmiParameterName id = opera_name_to_newbase(product, quantity, hid, "/" + prefix + "/what");
 
     if (!info.Param(id))
       throw std::runtime_error("Failed to activate product " + product +
                                " in output querydata with id " + converter.ToString(id));
-// Copy the values
-
-#if 0
-	  // Crashes in RHEL6
-	  int32_t htype;
-	  H5Utilities::getObjectType(hid,prefix+"/data",&htype);
-	  
-	  if(options.verbose)
-		std::cout << "Reading " << prefix+"/data of type " << H5Lite::StringForHDFType(htype) << std::endl;
-#endif
 
-    std::vector<int> values;
+    slices.push_back(DatasetSlice());
+    DatasetSlice &slice = slices.back();
+    slice.paramindex = info.ParamIndex();
+    slice.levelindex = info.LevelIndex();
+    slice.timeindex = info.TimeIndex();
+    slice.pvol = false;
 
-    if (options.verbose) std::cout << "Reading " << prefix + "/data" << std::endl;
-
-    if (H5Lite::readVectorDataset(hid, prefix + "/data", values) != 0)
-      throw std::runtime_error("Failed to read " + prefix + "/data");
-
-// Copy values into querydata. Unfortunately a simple loop
-// will not do, the data would go upside down. Hence we need
-// to index the data directly.
-
-#if 1
-    const unsigned long width = info.Grid()->XNumber();
-    const unsigned long height = info.Grid()->YNumber();
-
-    unsigned long pos = 0;
+    // Establish numeric transformation
 
-    for (info.ResetLocation(); info.NextLocation();)
-    {
-      // Newbase grid location
-      unsigned long i = pos % width;
-      unsigned long j = pos / width;
-      // HDF5 grid location is inverted
-      j = height - j - 1;
-      // Respective vector position
-      unsigned long k = i + width * j;
-
-      // And copy the value
-      int value = values[k];
-
-      if (nodata && value == *nodata)
-        info.FloatValue(kFloatMissing);
-      else if (undetect && value == *undetect)
-        info.FloatValue(apply_gain_offset(0, gain, offset));
-      else
-        info.FloatValue(apply_gain_offset(value, gain, offset));
-
-      ++pos;
-    }
-#else
-    // Does not work
-    info.ResetLocation();
+    slice.transform = get_value_transform(hid, prefix, "what");
 
-    BOOST_FOREACH (int value, values)
-    {
-      info.NextLocation();
-      if (nodata && value == *nodata)
-        info.FloatValue(kFloatMissing);
-      else if (undetect && value == *undetect)
-        info.FloatValue(apply_gain_offset(0, gain, offset));
-      else
-        info.FloatValue(apply_gain_offset(value, gain, offset));
-    }
-#endif
+    read_grid(hid, "/" + prefix + "/data", width, height, slice.grid);
   }
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Copy one PVOL dataset
+ * \brief Read one PVOL dataset
  */
 // ----------------------------------------------------------------------
 
-void copy_dataset_pvol(const hid_t &hid, NFmiFastQueryInfo &info, int datanum)
+void read_dataset_pvol(const hid_t &hid,
+                       NFmiFastQueryInfo &info,
+                       int datanum,
+                       std::list<DatasetSlice> &slices)
 {
   std::string prefix = options.datasetname + boost::lexical_cast<std::string>(datanum);
 
@@ -1555,24 +2022,29 @@ void copy_dataset_pvol(const hid_t &hid, NFmiFastQueryInfo &info, int datanum)
   for (int level = 0; level < datanum; level++)
     info.NextLevel();
 
+  slices.push_back(DatasetSlice());
+  DatasetSlice &slice = slices.back();
+  slice.paramindex = info.ParamIndex();
+  slice.levelindex = info.LevelIndex();
+  slice.timeindex = info.TimeIndex();
+  slice.pvol = true;
+
   // Establish numeric transformation
 
-  auto nodata = get_optional_double(hid, prefix + "/data1/what", "nodata");
-  auto undetect = get_optional_double(hid, prefix + "/data1/what", "undetect");
-  auto gain = get_optional_double(hid, prefix + "/data1/what", "gain");
-  auto offset = get_optional_double(hid, prefix + "/data1/what", "offset");
+  slice.transform = get_value_transform(hid, prefix + "/data1/what");
 
   // Establish measurement details
 
-  double lat = get_attribute_value<double>(hid, "/where", "lat");
-  double lon = get_attribute_value<double>(hid, "/where", "lon");
+  PolarGeometry &geom = slice.geom;
+  geom.lat = get_attribute_value<double>(hid, "/where", "lat");
+  geom.lon = get_attribute_value<double>(hid, "/where", "lon");
 
   // int a1gate     = get_attribute_value<int>(hid,prefix+"/where","a1gate");
-  double elangle = get_attribute_value<double>(hid, prefix + "/where", "elangle");
-  int nbins = get_attribute_value<int>(hid, prefix + "/where", "nbins");
-  int nrays = get_attribute_value<int>(hid, prefix + "/where", "nrays");
-  double rscale = get_attribute_value<double>(hid, prefix + "/where", "rscale");
-  double rstart = get_attribute_value<double>(hid, prefix + "/where", "rstart");
+  geom.elangle = get_attribute_value<double>(hid, prefix + "/where", "elangle");
+  geom.nbins = get_attribute_value<int>(hid, prefix + "/where", "nbins");
+  geom.nrays = get_attribute_value<int>(hid, prefix + "/where", "nrays");
+  geom.rscale = get_attribute_value<double>(hid, prefix + "/where", "rscale");
+  geom.rstart = get_attribute_value<double>(hid, prefix + "/where", "rstart");
 
 // Copy the values
 
@@ -1587,104 +2059,264 @@ void copy_dataset_pvol(const hid_t &hid, NFmiFastQueryInfo &info, int datanum)
   if (options.verbose) std::cout << "Reading " << prefix + "/data1/data" << std::endl;
 #endif
 
-  std::vector<int> values;
-
-  if (H5Lite::readVectorDataset(hid, prefix + "/data1/data", values) != 0)
+  if (H5Lite::readVectorDataset(hid, prefix + "/data1/data", slice.polarvalues) != 0)
     throw std::runtime_error("Failed to read " + prefix + "/data");
 
-  // Center location in meters
+  if (slice.polarvalues.size() < static_cast<std::size_t>(geom.nrays) * geom.nbins)
+    throw std::runtime_error("Size of " + prefix + "/data1/data is less than nrays*nbins");
+}
 
-  NFmiPoint center = info.Area()->LatLonToWorldXY(NFmiPoint(lon, lat));
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read all HDF datasets
+ *
+ * We iterate through all the datasets, find the time, param etc info
+ * and read the data to be decoded later on.
+ */
+// ----------------------------------------------------------------------
 
-  // Copy values into querydata. See section 5.1 of the Opera specs for details.
-  // According to it we can ignore a1gate for polar volumes
+void read_datasets(const hid_t &hid, NFmiFastQueryInfo &info, std::list<DatasetSlice> &slices)
+{
+  std::string obj = get_attribute_value<std::string>(hid, "/what", "object");
 
-  const double pi = 3.14159265358979323;
+  const int n = count_datasets(hid);
+  for (int i = 1; i <= n; i++)
+  {
+    if (obj == "PVOL")
+      read_dataset_pvol(hid, info, i, slices);
+    else
+      read_dataset(hid, info, i, slices);
+  }
+}
 
-  for (int ray = 0; ray < nrays; ray++)
+// ----------------------------------------------------------------------
+/*!
+ * \brief Decode one dataset into querydata
+ */
+// ----------------------------------------------------------------------
+
+void decode_slice(const DatasetSlice &slice, NFmiFastQueryInfo &info)
+{
+  info.ParamIndex(slice.paramindex);
+  info.LevelIndex(slice.levelindex);
+  info.TimeIndex(slice.timeindex);
+
+  if (!slice.pvol)
   {
-    // Angle of the ray in degrees and then in radians.
-    // 0.5 is added since the first scan represents angle starting from 0,
-    // not centered around it
+    decode_grid(slice.grid, info, slice.transform);
+    return;
+  }
 
-    double angle = 360 * (ray + 0.5) / nrays;
-    double alpha = angle * pi / 180;
+  // Copy values into querydata with a pure gather
 
-    for (int bin = 0; bin < nbins; ++bin)
-    {
-      // Distance along the ray, taking elevation into account
-      // 0.5 moves us into the center of the bin
-      double r = (1000 * rstart + (bin + 0.5) * rscale) * cos(elangle * pi / 180);
+  PolarLookupPtr lookup = get_pvol_lookup(slice.geom, info);
 
-      // Respective world XY coordinate
-      NFmiPoint p(center.X() + r * sin(alpha), center.Y() + r * cos(alpha));
+  unsigned long pos = 0;
+  for (info.ResetLocation(); info.NextLocation(); ++pos)
+  {
+    int k = (*lookup)[pos];
+    if (k >= 0) info.FloatValue(slice.transform(slice.polarvalues[k]));
+  }
+}
 
-      // And latlon
-      NFmiPoint latlon = info.Area()->WorldXYToLatLon(p);
+// ----------------------------------------------------------------------
+/*!
+ * \brief Open an Opera HDF5 file
+ */
+// ----------------------------------------------------------------------
 
-      if (info.NearestPoint(latlon))
-      {
-        // And copy the value
-        int value = values[ray * nbins + bin];
-
-        if (nodata && value == *nodata)
-          info.FloatValue(kFloatMissing);
-        else if (undetect && value == *undetect)
-          info.FloatValue(apply_gain_offset(0, gain, offset));
-        else
-          info.FloatValue(apply_gain_offset(value, gain, offset));
-      }
-      else
-        std::runtime_error("Internal error when projecting PVOL data to cartesian coordinates");
-    }
+hid_t open_hdf(const std::string &filename)
+{
+  if (options.verbose) std::cout << "Opening file '" << filename << "'" << std::endl;
+
+  hid_t hid = H5Utilities::openFile(filename, true);  // true = read only
+  if (hid < 0) throw std::runtime_error("Failed to open '" + filename + "' for reading");
+
+  // Check that the data looks like Opera radar HDF data
+
+  validate_hdf(hid);
+
+  return hid;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Merge the times of several time descriptors
+ *
+ * The latest origin time is used for the combined data.
+ */
+// ----------------------------------------------------------------------
+
+NFmiTimeDescriptor merge_tdescs(const std::vector<NFmiTimeDescriptor> &tdescs)
+{
+  std::set<NFmiMetTime> times;
+  NFmiMetTime origintime = tdescs.front().OriginTime();
+
+  BOOST_FOREACH (NFmiTimeDescriptor tdesc, tdescs)
+  {
+    if (tdesc.OriginTime() > origintime) origintime = tdesc.OriginTime();
+    for (tdesc.Reset(); tdesc.Next();)
+      times.insert(tdesc.ValidTime());
   }
+
+  NFmiTimeList tlist;
+  BOOST_FOREACH (const NFmiMetTime &t, times)
+    tlist.Add(new NFmiMetTime(t));
+
+  return NFmiTimeDescriptor(origintime, tlist);
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Copy HDF values into querydata
+ * \brief Shared state of the batch workers
+ */
+// ----------------------------------------------------------------------
+
+struct BatchState
+{
+  BatchState() : replaced() {}
+  std::vector<std::set<NFmiMetTime> > replaced;  // times provided also by a later file
+  boost::mutex hdf5mutex;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Convert an input file into its time slots of the output
  *
- * We iterate through all the datasets, find the time, param etc info,
- * activate it in the info object, and copy the grid.
+ * The file is read while holding the HDF5 lock, and its datasets are
+ * then decoded into the querydata without the lock. Times replaced by
+ * a later file are skipped so that the result does not depend on the
+ * order in which the threads finish.
  */
 // ----------------------------------------------------------------------
 
-void copy_datasets(const hid_t &hid, NFmiFastQueryInfo &info)
+void batch_job(std::vector<NFmiFastQueryInfo> *infos,
+               BatchState *state,
+               unsigned int thread,
+               std::size_t fileindex)
 {
-  std::string obj = get_attribute_value<std::string>(hid, "/what", "object");
+  NFmiFastQueryInfo &info = (*infos)[thread];
+  const std::string &filename = options.infiles[fileindex];
+  const std::set<NFmiMetTime> &replaced = state->replaced[fileindex];
 
-  const int n = count_datasets(hid);
-  for (int i = 1; i <= n; i++)
+  try
   {
-    if (obj == "PVOL")
-      copy_dataset_pvol(hid, info, i);
-    else
-      copy_dataset(hid, info, i);
+    std::list<DatasetSlice> slices;
+    {
+      boost::mutex::scoped_lock lock(state->hdf5mutex);
+      hid_t hid = open_hdf(filename);
+      try
+      {
+        read_datasets(hid, info, slices);
+      }
+      catch (...)
+      {
+        H5Utilities::closeFile(hid);
+        throw;
+      }
+      H5Utilities::closeFile(hid);
+    }
+
+    BOOST_FOREACH (const DatasetSlice &slice, slices)
+    {
+      info.TimeIndex(slice.timeindex);
+      if (replaced.find(info.ValidTime()) == replaced.end()) decode_slice(slice, info);
+    }
+  }
+  catch (std::exception &e)
+  {
+    throw std::runtime_error(filename + ": " + e.what());
+  }
+  catch (...)
+  {
+    throw std::runtime_error(filename + ": unknown exception");
   }
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Main program without exception handling
+ * \brief Create the output data for the given files
+ *
+ * All files must share the same parameters, levels and grid. Their
+ * valid times are merged into one time series. If several files have
+ * the same valid time, a warning is printed and the last file wins.
  */
 // ----------------------------------------------------------------------
 
-int run(int argc, char *argv[])
+boost::shared_ptr<NFmiQueryData> create_batch_data(BatchState &state)
 {
-  if (!parse_options(argc, argv)) return 0;
+  std::vector<NFmiTimeDescriptor> tdescs;
+  boost::shared_ptr<NFmiParamDescriptor> pdesc;
+  boost::shared_ptr<NFmiVPlaceDescriptor> vdesc;
+  boost::shared_ptr<NFmiHPlaceDescriptor> hdesc;
 
-  if (options.verbose) std::cout << "Opening file '" << options.infile << "'" << std::endl;
+  BOOST_FOREACH (const std::string &filename, options.infiles)
+  {
+    hid_t hid = open_hdf(filename);
+    try
+    {
+      // Print information on the data in verbose mode
 
-  hid_t hid = H5Utilities::openFile(options.infile, true);  // true = read only
-  if (hid < 0) throw std::runtime_error("Failed to open '" + options.infile + "' for reading");
+      if (options.verbose) print_hdf_information(hid);
 
-  // Check that the data looks like Opera radar HDF data
+      tdescs.push_back(create_tdesc(hid));
+      NFmiParamDescriptor p = create_pdesc(hid);
+      NFmiVPlaceDescriptor v = create_vdesc(hid);
+      NFmiHPlaceDescriptor h = create_hdesc(hid);
 
-  validate_hdf(hid);
+      if (!pdesc)
+      {
+        pdesc.reset(new NFmiParamDescriptor(p));
+        vdesc.reset(new NFmiVPlaceDescriptor(v));
+        hdesc.reset(new NFmiHPlaceDescriptor(h));
+      }
+      else if (!(p == *pdesc) || !(v == *vdesc) || !(h == *hdesc))
+        throw std::runtime_error("Parameters, levels or the grid of '" + filename +
+                                 "' differ from those of '" + options.infiles.front() + "'");
+    }
+    catch (...)
+    {
+      H5Utilities::closeFile(hid);
+      throw;
+    }
+    H5Utilities::closeFile(hid);
+  }
+
+  // Mark the times replaced by later files
 
-  // Print information on the data in verbose mode
+  state.replaced.resize(tdescs.size());
+  for (std::size_t i = 0; i < tdescs.size(); i++)
+    for (tdescs[i].Reset(); tdescs[i].Next();)
+      for (std::size_t j = tdescs.size() - 1; j > i; j--)
+        if (tdescs[j].Time(tdescs[i].ValidTime()))
+        {
+          std::cerr << "Warning: valid time "
+                    << tdescs[i].ValidTime().ToStr(kYYYYMMDDHHMM).CharPtr() << " of '"
+                    << options.infiles[i] << "' is replaced by '" << options.infiles[j] << "'"
+                    << std::endl;
+          state.replaced[i].insert(tdescs[i].ValidTime());
+          break;
+        }
 
-  if (options.verbose) print_hdf_information(hid);
+  NFmiTimeDescriptor tdesc = merge_tdescs(tdescs);
+
+  NFmiFastQueryInfo qi(*pdesc, tdesc, *hdesc, *vdesc);
+  boost::shared_ptr<NFmiQueryData> data(NFmiQueryDataUtil::CreateEmptyData(qi));
+
+  if (data.get() == 0) throw std::runtime_error("Could not allocate memory for result data");
+
+  return data;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Main program without exception handling
+ */
+// ----------------------------------------------------------------------
+
+int run(int argc, char *argv[])
+{
+  if (!parse_options(argc, argv)) return 0;
 
   // Create the output projection if there is one. We do it before doing any
   // work so that the user gets a fast response to a possible syntax error
@@ -1692,22 +2324,19 @@ int run(int argc, char *argv[])
   boost::shared_ptr<NFmiArea> area;
   if (!options.projection.empty()) area = NFmiAreaFactory::Create(options.projection);
 
-  // Create query data descriptors
+  // Create query data from the descriptors of all the input files
 
-  NFmiTimeDescriptor tdesc = create_tdesc(hid);
-  NFmiParamDescriptor pdesc = create_pdesc(hid);
-  NFmiVPlaceDescriptor vdesc = create_vdesc(hid);
-  NFmiHPlaceDescriptor hdesc = create_hdesc(hid);
+  BatchState state;
+  boost::shared_ptr<NFmiQueryData> data = create_batch_data(state);
 
-  NFmiFastQueryInfo qi(pdesc, tdesc, hdesc, vdesc);
-  boost::shared_ptr<NFmiQueryData> data(NFmiQueryDataUtil::CreateEmptyData(qi));
   NFmiFastQueryInfo info(data.get());
-
-  if (data.get() == 0) throw std::runtime_error("Could not allocate memory for result data");
-
   info.SetProducer(NFmiProducer(options.producernumber, options.producername));
 
-  copy_datasets(hid, info);
+  // Read and decode the files in parallel
+
+  ParallelJobs parallel(options.infiles.size(), options.threads);
+  std::vector<NFmiFastQueryInfo> infos(parallel.threads(), info);
+  parallel.run(boost::bind(batch_job, &infos, &state, _1, _2));
 
   // Reproject if so requested
 
@@ -22,16 +22,20 @@ RJTT 242030Z 36010KT 6000 -RA FEW007 SCT010 BKN015 12/11 Q1008 RMK
 #pragma warning(disable : 4109 4068 4996)  // Disables many warnings that MSVC++ 7.1 generates
 #endif
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <utility>
+#include <vector>
 
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/regex.hpp>
+#include <boost/thread.hpp>
 
 #include <newbase/NFmiCmdLine.h>
 #include <newbase/NFmiFastQueryInfo.h>
@@ -44,6 +48,9 @@ RJTT 242030Z 36010KT 6000 -RA FEW007 SCT010 BKN015 12/11 Q1008 RMK
 #include <newbase/NFmiTimeList.h>
 #include <smarttools/NFmiAviationStationInfoSystem.h>
 
+#include "ObservationAppend.h"
+#include "ParallelJobs.h"
+
 extern "C" {
 #include "metar_structs.h"
 void print_decoded_metar(Decoded_METAR *);
@@ -57,6 +64,10 @@ static void run(int argc, const char *argv[]);
 static bool fVerboseMode = false;
 static bool fIgnoreBadStations = false;
 
+// mdsplib:n decode_metar ei ole uudelleenkutsuttava (se pilkkoo sanoman
+// staattisiin puskureihin), joten kutsut tehdn yksi kerrallaan.
+static boost::mutex decodemutex;
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Report a problem with coordinates
@@ -529,35 +540,16 @@ void Usage(const std::string &theExecutableName)
        << "\t-r <round_time_in_minutes>\tUse messages time rounding, default value is 30 minutes."
        << endl
        << "\t-n <NOAA-format=false>\tTry reading NOAA metar format files." << endl
+       << "\t-j <threads>\tNumber of threads used to decode files, default 1, 0 = all cores."
+       << endl
+       << "\t-a <previous.sqd>\tAppend mode: merge new messages into the previous output." << endl
+       << "\t\tWrite the output to a new file and rename it over the previous one." << endl
+       << "\t-m <manifest>\tFile listing already consumed input files, only new files are read."
+       << endl
+       << "\t-w <hours>\tLength of the time window kept in append mode, default 48." << endl
        << endl;
 }
 
-// ----------------------------------------------------------------------
-/*!
- * \brief Extract next METAR token
- */
-// ----------------------------------------------------------------------
-
-static std::string GetStringAndAdvance(boost::sregex_token_iterator &it, bool mustExist)
-{
-  boost::sregex_token_iterator end;
-  if (it != end)
-  {
-    std::string str;
-    do
-    {
-      str = *it;
-      ++it;  // advance iterator
-    } while (str.empty() &&
-             it != end);  // joskus tulee tyhji stringej ennen loppua, jotka pit ohittaa
-    return str;
-  }
-  if (mustExist)
-    throw runtime_error(
-        "Error: The header-section was incomplete in input data, stopping program...");
-  return string();  // muutoin palauta tyhj stringi
-}
-
 // ----------------------------------------------------------------------
 /*!
  * \brief This is some platform specific logging system
@@ -589,6 +581,42 @@ class StationErrorStrings : public set<string>
 
 static const NFmiMetTime missingTime(1900, 1, 1, 0);
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Extract the next whitespace separated word
+ *
+ * Korvaa aiemman "\\s+" regex-splittauksen, pos siirtyy sanan pern.
+ */
+// ----------------------------------------------------------------------
+
+static bool NextWord(const string &theStr, string::size_type &thePos, string &theWord)
+{
+  const string::size_type n = theStr.size();
+  while (thePos < n && ::isspace(static_cast<unsigned char>(theStr[thePos])))
+    ++thePos;
+  if (thePos >= n) return false;
+
+  string::size_type start = thePos;
+  while (thePos < n && !::isspace(static_cast<unsigned char>(theStr[thePos])))
+    ++thePos;
+  theWord.assign(theStr, start, thePos - start);
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether the word is a header time stamp (exactly six digits)
+ */
+// ----------------------------------------------------------------------
+
+static bool IsHeaderTimeWord(const string &theWord)
+{
+  if (theWord.size() != 6) return false;
+  for (size_t i = 0; i < theWord.size(); i++)
+    if (theWord[i] < '0' || theWord[i] > '9') return false;
+  return true;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Identify an empty METAR
@@ -597,25 +625,16 @@ static const NFmiMetTime missingTime(1900, 1, 1, 0);
 
 static bool IsMetarNilOrEmptyReport(const string &str)
 {
-  boost::regex reg(
-      "\\s+");  // splittaa yksittiset sanat, oli niiss yksi tai useampia spaceja vliss
-  boost::sregex_token_iterator it(str.begin(), str.end(), reg, -1);
-  boost::sregex_token_iterator end;
-  for (int i = 0; it != end; ++it, i++)
+  string::size_type pos = 0;
+  string aWord;
+  for (int i = 0; ::NextWord(str, pos, aWord); i++)
   {
-    if (i > 3)  // jos ollaan menossa jo 4 sanaan, voidaan tarkastelu lopettaa
-      break;
-    else
-    {
-      string aWord = *it;
-      NFmiStringTools::UpperCase(aWord);
-      if (aWord == "NIL") return true;
-    }
+    if (i > 3)  // jos ollaan menossa jo 5. sanaan, sanoma ei ole tyhj
+      return false;
+    NFmiStringTools::UpperCase(aWord);
+    if (aWord == "NIL") return true;
   }
-  if (it != end)
-    return false;
-  else
-    return true;
+  return true;
 }
 
 // ----------------------------------------------------------------------
@@ -1008,7 +1027,7 @@ static void InitWWSymbols(map<string, float> &ww_symbols)
 // ----------------------------------------------------------------------
 
 static bool FindWeatherValue(const string &theWord,
-                             map<string, float> &ww_symbols,
+                             const map<string, float> &ww_symbols,
                              float &value,
                              bool fDoLowerBoundSearch)
 {
@@ -1019,7 +1038,7 @@ static bool FindWeatherValue(const string &theWord,
     // sanasta edes osana.
     // Tm siksi ett joskus metareissa on jotain viilauksia ja standardi sanojen perss voi olla
     // jotain maa kohtaisia virityksi.
-    map<string, float>::iterator lb = ww_symbols.lower_bound(theWord);
+    map<string, float>::const_iterator lb = ww_symbols.lower_bound(theWord);
     if (lb != ww_symbols.end() && !(ww_symbols.key_comp()(theWord, lb->first)))
     {
       // avain lytyi heti, otetaan sen arvo kyttn
@@ -1045,7 +1064,7 @@ static bool FindWeatherValue(const string &theWord,
   }
   else
   {
-    map<string, float>::iterator it = ww_symbols.find(theWord);
+    map<string, float>::const_iterator it = ww_symbols.find(theWord);
     if (it != ww_symbols.end())
     {
       value = (*it).second;
@@ -1062,7 +1081,7 @@ static bool FindWeatherValue(const string &theWord,
 // ----------------------------------------------------------------------
 
 static void FillMetarDataWeatherSection2(MetarData &data,
-                                         map<string, float> &ww_symbols,
+                                         const map<string, float> &ww_symbols,
                                          const string &theWWStr,
                                          size_t theParamVectorIndex,
                                          const string &theMetarStr,
@@ -1095,18 +1114,20 @@ static void FillMetarDataWeatherSection2(MetarData &data,
  */
 // ----------------------------------------------------------------------
 
+static map<string, float> MakeWWSymbols()
+{
+  map<string, float> ww_symbols;
+  ::InitWWSymbols(ww_symbols);
+  return ww_symbols;
+}
+
 static void FillMetarDataWeatherSection(MetarData &data,
                                         const Decoded_METAR &metarStruct,
                                         const string &theMetarStr,
                                         const string &theMetarFileName)
 {
-  static map<string, float> ww_symbols;
-  static bool ww_symbols_initialized = false;
-  if (ww_symbols_initialized == false)
-  {
-    ww_symbols_initialized = true;
-    ::InitWWSymbols(ww_symbols);
-  }
+  // Staattisen muuttujan alustus on sieturvallinen, tiedostoja puretaan rinnakkain
+  static const map<string, float> ww_symbols = ::MakeWWSymbols();
 
   ::FillMetarDataWeatherSection2(data,
                                  ww_symbols,
@@ -1176,8 +1197,8 @@ static void InitCloudSymbols(map<string, float> &cloudCover_symbols,
 // ----------------------------------------------------------------------
 
 static void FillMetarDataCloudSection2(MetarData &data,
-                                       map<string, float> &cloudCover_symbols,
-                                       map<string, float> &cloudType_symbols,
+                                       const map<string, float> &cloudCover_symbols,
+                                       const map<string, float> &cloudType_symbols,
                                        const Cloud_Conditions &cloud_Conditions,
                                        int clCoverIndex,
                                        int clBaseIndex,
@@ -1243,19 +1264,23 @@ static void FillMetarDataCloudSection2(MetarData &data,
  */
 // ----------------------------------------------------------------------
 
+struct CloudSymbols
+{
+  map<string, float> cover;
+  map<string, float> type;
+
+  CloudSymbols() : cover(), type() { ::InitCloudSymbols(cover, type); }
+};
+
 static void FillMetarDataCloudSection(MetarData &data,
                                       const Decoded_METAR &metarStruct,
                                       const string &theMetarStr,
                                       const string &theMetarFileName)
 {
-  static map<string, float> cloudCover_symbols;
-  static map<string, float> cloudType_symbols;
-  static bool cloud_symbols_initialized = false;
-  if (cloud_symbols_initialized == false)
-  {
-    cloud_symbols_initialized = true;
-    ::InitCloudSymbols(cloudCover_symbols, cloudType_symbols);
-  }
+  // Staattisen muuttujan alustus on sieturvallinen, tiedostoja puretaan rinnakkain
+  static const CloudSymbols cloud_symbols;
+  const map<string, float> &cloudCover_symbols = cloud_symbols.cover;
+  const map<string, float> &cloudType_symbols = cloud_symbols.type;
 
   ::FillMetarDataCloudSection2(data,
                                cloudCover_symbols,
@@ -1319,8 +1344,12 @@ static void DecodeMetar(NFmiAviationStationInfoSystem &theStationInfoSystem,
     return;
 
   Decoded_METAR metarStruct;
-  if (decode_metar(const_cast<char *>(theMetarStr.c_str()), &metarStruct) ==
-      0)  // DcdMETAR palauttaa 0:n jos ok
+  int status;
+  {
+    boost::mutex::scoped_lock lock(decodemutex);
+    status = decode_metar(const_cast<char *>(theMetarStr.c_str()), &metarStruct);
+  }
+  if (status == 0)  // DcdMETAR palauttaa 0:n jos ok
   {
     string icaoStr = metarStruct.stnid;
     NFmiAviationStation *aviationStation = theStationInfoSystem.FindStation(icaoStr);
@@ -1425,31 +1454,44 @@ static bool CheckIsOldMessageMachineStartWord(const string &theStr)
 
 static bool DoNewHeaderStartHere(const string &theLineStr)
 {
-  boost::regex reg(
-      "\\s+");  // splittaa yksittiset sanat, oli niiss yksi tai useampia spaceja vliss
-  boost::sregex_token_iterator it(theLineStr.begin(), theLineStr.end(), reg, -1);
-  boost::sregex_token_iterator end;
-
-  string tmpStr = *it;
+  string::size_type pos = 0;
+  string tmpStr;
+  ::NextWord(theLineStr, pos, tmpStr);
   bool isHeaderStartWord = ::CheckIsOldMessageMachineStartWord(tmpStr);
   return isHeaderStartWord;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Remove extra control characters from the message
+ * \brief Split the file into =-terminated messages
+ *
+ * Yhdell lpikynnill pilkotaan sanomat =-merkkien kohdalta ja poistetaan
+ * samalla ylimriset kontrollimerkit (white spacet jtetn).
  */
 // ----------------------------------------------------------------------
 
-static std::string RemoveControlCharacters(const std::string &theOrigStr)
+static void SplitMetarMessages(const std::string &theFileStr,
+                               std::vector<std::string> &theMessages)
 {
-  std::string strippedStr;
-  for (size_t i = 0; i < theOrigStr.size(); i++)
+  theMessages.clear();
+  std::string::size_type start = 0;
+  while (start <= theFileStr.size())
   {
-    unsigned char ch = (unsigned char)(theOrigStr[i]);
-    if (isspace(ch) || iscntrl(ch) == 0) strippedStr += theOrigStr[i];
+    std::string::size_type end = theFileStr.find('=', start);
+    if (end == std::string::npos) end = theFileStr.size();
+
+    theMessages.push_back(std::string());
+    std::string &msg = theMessages.back();
+    msg.reserve(end - start);
+    for (std::string::size_type i = start; i < end; i++)
+    {
+      unsigned char ch = static_cast<unsigned char>(theFileStr[i]);
+      if (isspace(ch) || iscntrl(ch) == 0) msg += theFileStr[i];
+    }
+
+    if (end == theFileStr.size()) break;
+    start = end + 1;
   }
-  return strippedStr;
 }
 
 // ----------------------------------------------------------------------
@@ -1561,20 +1603,19 @@ static void MakeDataBlocks(NFmiAviationStationInfoSystem &theStationInfoSystem,
                            int theTimeRoundingResolution,
                            std::set<std::string> &theIcaoIdUnknownSetOut)
 {
-  // kydn data lpi rivi kerrallaan
-  boost::regex reg("=");  // METARit on eroteltu =-merkill
-  boost::sregex_token_iterator it(theMetarFileStr.begin(), theMetarFileStr.end(), reg, -1);
-  boost::sregex_token_iterator end;
+  // kydn data lpi sanoma kerrallaan, METARit on eroteltu =-merkill
+  std::vector<std::string> messages;
+  ::SplitMetarMessages(theMetarFileStr, messages);
   std::string lineStr;
+  std::string word;
   int counter = 0;
   NFmiMetTime headerTime = missingTime;
-  for (; it != end; ++it)
+  for (size_t m = 0; m < messages.size(); m++)
   {
     try
     {
       counter++;
-      lineStr = *it;
-      lineStr = ::RemoveControlCharacters(lineStr);
+      lineStr.swap(messages[m]);
       NFmiStringTools::TrimAll(lineStr, true);
       if (lineStr.empty()) continue;
 
@@ -1584,46 +1625,38 @@ static void MakeDataBlocks(NFmiAviationStationInfoSystem &theStationInfoSystem,
       if (newHeaderStarts)  // siis 1. ja jos useita metar sanomia samassa paketissa,
       // headerin alussa sanoman kohdalla pit lukea ohi header osio
       {
-        boost::regex reg2(
-            "\\s+");  // splittaa yksittiset sanat, oli niiss yksi tai useampia spaceja vliss
-        boost::sregex_token_iterator it2(lineStr.begin(), lineStr.end(), reg2, -1);
-        boost::sregex_token_iterator end2;
-
-        boost::regex expression("([0-9]{6})");  // etsitn 1. sana miss tsmlleen kuusi numeroa
-                                                // eli metar-sanomien aikaleima
-        string tmpStr = *it2;
-        int headerWordCounter = 0;
-        do
+        std::string::size_type wordPos = 0;
+        bool metarFound = false;
+        while (::NextWord(lineStr, wordPos, word))
         {
-          string tmpStr = *it2;
-          ++it2;
-          boost::cmatch what;
-          if (boost::regex_match(tmpStr.c_str(), what, expression))
+          if (::IsHeaderTimeWord(word))
           {  // otetaan headerissa oleva aikaleima talteen, koska jossain metareissa ei ole omaa
              // aikaleimaa
             try
             {
               headerTime =
-                  ::GetTime(tmpStr, lineStr, theMetarFileName, true, theTimeRoundingResolution);
+                  ::GetTime(word, lineStr, theMetarFileName, true, theTimeRoundingResolution);
             }
             catch (...)
             {
               // ei tehd mitn
             }
           }
-          headerWordCounter++;
-          NFmiStringTools::UpperCase(tmpStr);
-          if (tmpStr == gMetarWord)
-            break;  // aloitetaan metar sanomien purkaminen, 1. metarissa on aina mukana mys
-                    // headeri osa, joka loppuu METAR sanaan
-          if (tmpStr == gSpeciWord)
+          NFmiStringTools::UpperCase(word);
+          if (word == gMetarWord || word == gNilWord)
+          {
+            // aloitetaan metar sanomien purkaminen, 1. metarissa on aina mukana mys
+            // headeri osa, joka loppuu METAR sanaan. Jos NIL tulee ennen METAR/SPECI:,
+            // lopetetaan kanssa, kyseess tyhj sanomatiedosto
+            metarFound = true;
+            break;
+          }
+          if (word == gSpeciWord)
             return;  // Mutta ei viel toistaiseksi oteta huomioon SPECI sanomia
-          if (tmpStr == gNilWord)
-            break;  // Jos NIL tulee ennen METAR/SPECI:, lopetetaan kanssa, kyseess tyhj
-                    // sanomatiedosto
-        } while (it2 != end2);
+        }
 
-        if (it2 == end2)
+        std::string::size_type restPos = wordPos;
+        if (!metarFound || !::NextWord(lineStr, restPos, word))
           continue;  // joskus on virheellisi sanoma tiedostoja, eik METAR/SPECI/NIL sanoja lydy,
                      // ja tss pit silloin breakata
 
@@ -1631,12 +1664,11 @@ static void MakeDataBlocks(NFmiAviationStationInfoSystem &theStationInfoSystem,
         // header osio
         // loput metarit tulevat splittauksesta sellaisenaan.
         string tmpMetarStr;
-        do
+        while (::NextWord(lineStr, wordPos, word))
         {
-          tmpMetarStr += *it2;
+          tmpMetarStr += word;
           tmpMetarStr += " ";
-          ::GetStringAndAdvance(it2, false);
-        } while (it2 != end2);
+        }
 
         lineStr = tmpMetarStr;
       }
@@ -1738,6 +1770,103 @@ list<string> SortMetarFiles(const list<string> &metarfiles)
   return outfiles;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Decoded contents of one METAR file
+ */
+// ----------------------------------------------------------------------
+
+struct MetarFileResult
+{
+  vector<MetarData> dataBlocks;
+  std::set<std::string> icaoIdUnknownSet;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Decode one METAR file
+ */
+// ----------------------------------------------------------------------
+
+static void DecodeMetarFile(NFmiAviationStationInfoSystem &theStationInfoSystem,
+                            const string &theFileName,
+                            bool tryNoaaFileFormat,
+                            int theTimeRoundingResolution,
+                            MetarFileResult &theResult)
+{
+  if (tryNoaaFileFormat)
+  {
+    if (::DoNoaaFormatRead(theStationInfoSystem,
+                           theResult.dataBlocks,
+                           theFileName,
+                           theTimeRoundingResolution,
+                           theResult.icaoIdUnknownSet))
+      return;  // jos tiedosto oli NOAA formaattia, se luettiin jo
+  }
+  string metarFileContent;
+  if (NFmiFileSystem::ReadFile2String(theFileName, metarFileContent) == false)
+    cerr << "Failed to read file: " << theFileName.c_str() << endl
+         << "Continuing with other files..." << endl;
+  else
+  {
+    ::MakeDataBlocks(theStationInfoSystem,
+                     metarFileContent,
+                     theResult.dataBlocks,
+                     theFileName,
+                     theTimeRoundingResolution,
+                     theResult.icaoIdUnknownSet);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Decode a single file in a thread
+ *
+ * Jokainen tiedosto puretaan omaan tulokseensa, jotta tulokset voidaan
+ * yhdist lopuksi tiedostojen ksittelyjrjestyksess. Rinnakkain tehdn
+ * vain tiedostojen luku, pilkkominen ja tulosten jlkiksittely, itse
+ * decode_metar-kutsut tehdn yksi kerrallaan.
+ */
+// ----------------------------------------------------------------------
+
+static void DecodeMetarFileJob(NFmiAviationStationInfoSystem *theStationInfoSystem,
+                               const vector<string> *theFiles,
+                               bool tryNoaaFileFormat,
+                               int theTimeRoundingResolution,
+                               vector<MetarFileResult> *theResults,
+                               ParallelJobs *theParallel,
+                               unsigned int theThread,
+                               size_t theFile)
+{
+  if (fVerboseMode)
+  {
+    boost::mutex::scoped_lock lock(theParallel->mutex());
+    std::cerr << "Processing file no: " << theFile + 1 << " (" << (*theFiles)[theFile] << ")"
+              << std::endl;
+  }
+
+  ::DecodeMetarFile(*theStationInfoSystem,
+                    (*theFiles)[theFile],
+                    tryNoaaFileFormat,
+                    theTimeRoundingResolution,
+                    (*theResults)[theFile]);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Sort order for merged METAR data
+ *
+ * Sorting must be stable so that files processed later override
+ * earlier ones just like in sequential processing.
+ */
+// ----------------------------------------------------------------------
+
+static bool MetarTimeStationLess(const MetarData &theData1, const MetarData &theData2)
+{
+  if (theData1.itsTime != theData2.itsTime) return theData1.itsTime < theData2.itsTime;
+  return theData1.itsStationId < theData2.itsStationId;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Main program without error catching
@@ -1749,7 +1878,7 @@ void run(int argc, const char *argv[])
   // HUOM!! VC++ 2012 (Update 3) -versiolla x64-debug versio toimii debuggerissa ihan oudosti,
   // ohjelman steppaus ei mene oikein (win32 debug kyttytyy oikein).
   // Ohjelma tuottaa kuitenkin oikean tuloksen kaikilla kombinaatioilla win32/x64 + debug/release
-  NFmiCmdLine cmdline(argc, argv, "s!vFr!n");
+  NFmiCmdLine cmdline(argc, argv, "s!vFr!nj!a!m!w!");
 
   // Tarkistetaan optioiden oikeus:
   if (cmdline.Status().IsError())
@@ -1782,6 +1911,19 @@ void run(int argc, const char *argv[])
   bool tryNoaaFileFormat = false;
   if (cmdline.isOption('n')) tryNoaaFileFormat = true;
 
+  std::string previousFile;
+  if (cmdline.isOption('a')) previousFile = cmdline.OptionValue('a');
+
+  std::string manifestFile;
+  if (cmdline.isOption('m')) manifestFile = cmdline.OptionValue('m');
+
+  int windowHours = 48;
+  if (cmdline.isOption('w')) windowHours = NFmiStringTools::Convert<int>(cmdline.OptionValue('w'));
+
+  unsigned int threadCount = 1;
+  if (cmdline.isOption('j'))
+    threadCount = NFmiStringTools::Convert<unsigned int>(cmdline.OptionValue('j'));
+
   NFmiAviationStationInfoSystem stationInfoSystem(false, fVerboseMode);
 
 #ifdef UNIX
@@ -1824,59 +1966,111 @@ void run(int argc, const char *argv[])
 
   metarfiles = SortMetarFiles(metarfiles);
 
-  // Process them
+  // Skip files consumed by previous runs, the manifest keeps only files still present
+
+  std::set<std::string> consumedFiles;
+  if (!manifestFile.empty())
+  {
+    std::set<std::string> oldConsumedFiles = ObservationAppend::ReadManifest(manifestFile);
+    list<string> newfiles;
+    BOOST_FOREACH (const string &filename, metarfiles)
+    {
+      consumedFiles.insert(filename);
+      if (oldConsumedFiles.find(filename) == oldConsumedFiles.end()) newfiles.push_back(filename);
+    }
+    if (fVerboseMode)
+      cerr << "Skipping " << metarfiles.size() - newfiles.size() << " already consumed files"
+           << endl;
+    metarfiles.swap(newfiles);
+  }
+
+  // Process them, each file into its own result
+
+  vector<string> files(metarfiles.begin(), metarfiles.end());
+  vector<MetarFileResult> results(files.size());
+
+  ParallelJobs parallel(files.size(), threadCount);
+  parallel.run(boost::bind(::DecodeMetarFileJob,
+                           &stationInfoSystem,
+                           &files,
+                           tryNoaaFileFormat,
+                           timeRoundingResolution,
+                           &results,
+                           &parallel,
+                           _1,
+                           _2));
+
+  // Merge the results in processing order and then by time and station
 
   std::set<std::string> icaoIdUnknownSet;  // thn kertn kaikki tuntemattomat icao-id:t jotka
                                            // ovat tulleet metar-sanomista
   vector<MetarData> dataBlocks;
 
-  int debugCounter = 0;
-  BOOST_FOREACH (const string &filename, metarfiles)
+  size_t blockCount = 0;
+  for (size_t i = 0; i < results.size(); i++)
+    blockCount += results[i].dataBlocks.size();
+  dataBlocks.reserve(blockCount);
+
+  for (size_t i = 0; i < results.size(); i++)
   {
-    if (fVerboseMode)
-      std::cerr << "Processing file no: " << ++debugCounter << " (" << filename << ")" << std::endl;
-    if (tryNoaaFileFormat)
-    {
-      if (::DoNoaaFormatRead(
-              stationInfoSystem, dataBlocks, filename, timeRoundingResolution, icaoIdUnknownSet))
-        continue;  // jos tiedosto oli NOAA formaattia, se luettiin jo, mennn seuraavaan
-                   // tiedostoon
-    }
-    string metarFileContent;
-    if (NFmiFileSystem::ReadFile2String(filename, metarFileContent) == false)
-      cerr << "Failed to read file: " << filename.c_str() << endl
-           << "Continuing with other files..." << endl;
-    else
-    {
-      ::MakeDataBlocks(stationInfoSystem,
-                       metarFileContent,
-                       dataBlocks,
-                       filename,
-                       timeRoundingResolution,
-                       icaoIdUnknownSet);
-    }
+    dataBlocks.insert(
+        dataBlocks.end(), results[i].dataBlocks.begin(), results[i].dataBlocks.end());
+    icaoIdUnknownSet.insert(results[i].icaoIdUnknownSet.begin(),
+                            results[i].icaoIdUnknownSet.end());
+    vector<MetarData>().swap(results[i].dataBlocks);
   }
 
+  std::stable_sort(dataBlocks.begin(), dataBlocks.end(), ::MetarTimeStationLess);
+
   // Build querydata from the contents
 
-  NFmiQueryData *newQData = ::MakeQueryDataFromBlocks(params, stationInfoSystem, dataBlocks);
-  auto_ptr<NFmiQueryData> newQDataPtr(newQData);
-  if (newQData == 0)
-    throw runtime_error("Error: Unable to create querydata from METAR data, stopping program...");
+  NFmiQueryData *newQDataWithTotalWind = 0;
 
-  // tehdn dataan viel totalwind parametri WS, WD ja WGustin avulla
-  NFmiFastQueryInfo tempInfo(newQData);
-  NFmiQueryData *newQDataWithTotalWind = NFmiQueryDataUtil::MakeCombineParams(
-      tempInfo, 7, false, true, false, kFmiWindGust, std::vector<int>(), false, 0, false, false);
-  if (newQDataWithTotalWind == 0)
-    throw runtime_error(
-        "Error: Unable to create querydata with totalWind-parameter, stopping program...");
+  // Append modessa ei ole virhe, jos uusia sanomia ei tullut
+  if (!dataBlocks.empty() || previousFile.empty())
+  {
+    NFmiQueryData *newQData = ::MakeQueryDataFromBlocks(params, stationInfoSystem, dataBlocks);
+    auto_ptr<NFmiQueryData> newQDataPtr(newQData);
+    if (newQData == 0)
+      throw runtime_error("Error: Unable to create querydata from METAR data, stopping program...");
+
+    // tehdn dataan viel totalwind parametri WS, WD ja WGustin avulla
+    NFmiFastQueryInfo tempInfo(newQData);
+    newQDataWithTotalWind = NFmiQueryDataUtil::MakeCombineParams(
+        tempInfo, 7, false, true, false, kFmiWindGust, std::vector<int>(), false, 0, false, false);
+    if (newQDataWithTotalWind == 0)
+      throw runtime_error(
+          "Error: Unable to create querydata with totalWind-parameter, stopping program...");
+  }
+
+  // Yhdistetn uudet havainnot edellisen ajon aikaikkunaan. Vanhoja arvoja ei
+  // korvata, kuten ei tiedostoja jrjestyksess luettaessakaan, paitsi jos uusi
+  // sanoma on korjaus (COR).
+  if (!previousFile.empty())
+  {
+    ObservationAppend::Corrections corrections;
+    for (size_t i = 0; i < dataBlocks.size(); i++)
+      if (dataBlocks[i].fIsCorrected)
+        corrections.insert(
+            make_pair(NFmiStringTools::Convert(dataBlocks[i].itsStationId), dataBlocks[i].itsTime));
+
+    auto_ptr<NFmiQueryData> previousData(ObservationAppend::ReadPreviousData(previousFile));
+    auto_ptr<NFmiQueryData> newDataPtr(newQDataWithTotalWind);
+    newQDataWithTotalWind = ObservationAppend::Merge(
+        previousData.get(), newDataPtr.get(), windowHours, false, false, corrections);
+  }
 
   cerr << "\nStoring data to file." << endl;
   NFmiStreamQueryData sQOutData(newQDataWithTotalWind);  // tm mys tuhoaa qdatan
   if (!sQOutData.WriteCout())
     throw runtime_error("Error: Couldn't write combined qdata to stdout.");
 
+  // Manifesti kirjoitetaan vasta kun data on varmasti tallessa
+  cout.flush();
+  if (!cout) throw runtime_error("Error: Couldn't write combined qdata to stdout.");
+
+  if (!manifestFile.empty()) ObservationAppend::WriteManifest(manifestFile, consumedFiles);
+
   if (fVerboseMode && icaoIdUnknownSet.size())
   {
     cerr << "\nWarning, there were " << icaoIdUnknownSet.size()
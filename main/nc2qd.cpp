@@ -11,6 +11,7 @@
 #include <newbase/NFmiProducer.h>
 #include <newbase/NFmiStreamQueryData.h>
 #include <newbase/NFmiStringTools.h>
+#include <boost/thread.hpp>
 
 static void Usage(const std::string &theExecutableName)
 {
@@ -23,6 +24,8 @@ static void Usage(const std::string &theExecutableName)
             << "Options:" << std::endl
             << std::endl
             << "\t-p producer <default=1201,ncprod>\tSets producer id and name." << std::endl
+            << "\t-t threads <default=1>\tNumber of threads filling the parameters, 0 = all cores."
+            << std::endl
             << std::endl;
 }
 
@@ -40,7 +43,7 @@ static NFmiProducer GetProducer(const std::string &theProdStr)
 
 static void Domain(int argc, const char *argv[])
 {
-  NFmiCmdLine cmdLine(argc, argv, "p!");
+  NFmiCmdLine cmdLine(argc, argv, "p!t!");
   if (cmdLine.NumberofParameters() < 2)
   {
     Usage(argv[0]);
@@ -53,12 +56,20 @@ static void Domain(int argc, const char *argv[])
   NFmiProducer producer(1201, "ncprod");
   if (cmdLine.isOption('p')) producer = ::GetProducer(cmdLine.OptionValue('p'));
 
+  unsigned int threadCount = 1;
+  if (cmdLine.isOption('t'))
+  {
+    threadCount = NFmiStringTools::Convert<unsigned int>(cmdLine.OptionValue('t'));
+    if (threadCount == 0) threadCount = boost::thread::hardware_concurrency();
+  }
+
   std::cerr << "starting the " << argv[0] << " execution" << std::endl;
 
   NFmiMilliSecondTimer debugTimer;
   debugTimer.StartTimer();
   FmiNetCdfQueryData nc2QdFilter;
   nc2QdFilter.Producer(producer);
+  nc2QdFilter.ThreadCount(threadCount);
   std::vector<NFmiQueryData *> qDatas = nc2QdFilter.CreateQueryDatas(ncFileIn);
   if (qDatas.size() == 0) throw std::runtime_error(nc2QdFilter.ErrorMessage());
   debugTimer.StopTimer();
@@ -19,13 +19,25 @@
  *  qdpoint -w -q havainnot.sqd -n 1
  *  qdpoint -p Helsinki -N 10 -d 100 -q havainnot.sqd -n 1
  *  qdpoint -u "mst.weatherproof.fi/gram.php" -p Helsinki -q ennuste.sqd
+ *  qdpoint --server /tmp/qdpoint.sock -j 8
+ *  echo "-p Helsinki -q hirlam.sqd" | qdpoint --server -
  *
  * \endcode
  *
+ * In the server mode the program keeps the querydata, coordinates and
+ * timezones in memory and answers requests read from the given Unix
+ * socket, or from stdin if the socket is '-'. Each request is a line
+ * with the same options as the command line, and each reply ends with
+ * the line "# OK" or "# Error: message". The requests are answered in
+ * parallel by a pool of threads, but each client gets its replies in
+ * request order. Querydata files modified after they were read are
+ * read again.
+ *
  */
 // ======================================================================
 
 #include "MoonPhase.h"
+#include "ParallelJobs.h"
 #include "QueryDataManager.h"
 #include "TimeTools.h"
 
@@ -37,10 +49,12 @@
 #include <newbase/NFmiIndexMask.h>
 #include <newbase/NFmiIndexMaskTools.h>
 #include <newbase/NFmiFileSystem.h>
+#include <newbase/NFmiGrid.h>
 #include <newbase/NFmiLocation.h>
 #include <newbase/NFmiLocationFinder.h>
 #include <newbase/NFmiMetMath.h>
 #include <newbase/NFmiPreProcessor.h>
+#include <newbase/NFmiQueryData.h>
 #include <newbase/NFmiSettings.h>
 #include <newbase/NFmiValueString.h>
 
@@ -48,16 +62,31 @@
 #include <macgyver/WorldTimeZones.h>
 
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/optional.hpp>
 #include <boost/program_options.hpp>
-
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
 #include <list>
+#include <map>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -118,6 +147,8 @@ LocationList read_locationlist(const string& theFile)
   return ret;
 }
 
+struct MetaFunctionInfo;
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Command line options
@@ -138,6 +169,7 @@ struct Options
   int rows;
   int max_missing_gap;
   vector<string> params;
+  vector<const MetaFunctionInfo*> metafunctions;  // for each param, 0 if not a meta function
   vector<string> places;
   vector<int> stations;
   bool all_stations;
@@ -146,16 +178,16 @@ struct Options
   bool validate;
   bool future;
   bool multimode;
+  unsigned int memory_limit;
   double max_distance;
   int nearest_stations;
   string locationfile;
-  LocationList locations;
   string missingvalue;
   string uid;
+  string server;
+  unsigned int threads;
 };
 
-Options options;
-
 // ----------------------------------------------------------------------
 /*!
  * \brief Default options
@@ -175,6 +207,7 @@ Options::Options()
       rows(-1),
       max_missing_gap(-1),
       params(),
+      metafunctions(),
       places(),
       stations(),
       all_stations(false),
@@ -183,13 +216,15 @@ Options::Options()
       validate(false),
       future(false),
       multimode(false),
+      memory_limit(0),
       max_distance(100)  // km
       ,
       nearest_stations(1),
       locationfile(""),
-      locations(),
       missingvalue("-"),
-      uid()
+      uid(),
+      server(),
+      threads(0)
 {
 }
 
@@ -216,13 +251,18 @@ vector<int> parse_stations(const std::string& str)
   return ret;
 }
 
+vector<const MetaFunctionInfo*> ResolveMetaFunctions(const vector<string>& params);
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Parse the command line options
+ *
+ * The same syntax is used for the requests of the server mode, hence
+ * the arguments do not include the program name.
  */
 // ----------------------------------------------------------------------
 
-bool parse_options(int argc, char* argv[])
+bool parse_options(const vector<string>& args, Options& options, ostream& out)
 {
   namespace po = boost::program_options;
   namespace fs = boost::filesystem;
@@ -237,6 +277,9 @@ bool parse_options(int argc, char* argv[])
                                                                       "display version number")(
       "querydata,q", po::value(&options.queryfile), "input querydata (qdpoint::querydata_file)")(
       "multidata,Q", po::bool_switch(&options.multimode), "use all files from input directories")(
+      "memorylimit",
+      po::value(&options.memory_limit),
+      "maximum size of simultaneously open querydata in MB (default: 0 = unlimited)")(
       "coordinatefile,c",
       po::value(&options.coordinatefile),
       "location configuration file (qdpoint::coordinates or "
@@ -271,38 +314,43 @@ bool parse_options(int argc, char* argv[])
       po::value(&options.max_missing_gap),
       "maximum time gap in minutes to fill with interpolation")(
       "future,F", po::bool_switch(&options.future), "print only times in the future")(
-      "uid,u", po::value(&options.uid), "unused legacy option");
+      "uid,u", po::value(&options.uid), "unused legacy option")(
+      "server",
+      po::value(&options.server),
+      "answer requests read from the given Unix socket, or from stdin if '-'")(
+      "threads,j",
+      po::value(&options.threads),
+      "number of threads (default: 0 = number of cores)");
 
   po::positional_options_description p;
   p.add("querydata", 1);
 
   po::variables_map opt;
-  po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), opt);
+  po::store(po::command_line_parser(args).options(desc).positional(p).run(), opt);
 
   po::notify(opt);
 
   if (opt.count("version") != 0)
   {
-    std::cout << "qdpoint v 2.0 (" << __DATE__ << ' ' << __TIME__ << ')' << std::endl;
+    out << "qdpoint v 2.0 (" << __DATE__ << ' ' << __TIME__ << ')' << std::endl;
   }
 
   if (opt.count("help"))
   {
-    std::cout << "Usage: qdpoint [options] querydata" << std::endl
-              << std::endl
-              << "Extract a timeseries from the input data" << std::endl
-              << std::endl
-              << desc << std::endl;
+    out << "Usage: qdpoint [options] querydata" << std::endl
+        << std::endl
+        << "Extract a timeseries from the input data" << std::endl
+        << std::endl
+        << desc << std::endl;
   }
 
-  if (!options.locationfile.empty()) options.locations = read_locationlist(options.locationfile);
-
   if (opt_stations == "all")
     options.all_stations = true;
   else
     options.stations = parse_stations(opt_stations);
 
   options.params = NFmiStringTools::Split(opt_params);
+  options.metafunctions = ResolveMetaFunctions(options.params);
   options.places = NFmiStringTools::Split(opt_places);
 
   return true;
@@ -322,19 +370,12 @@ bool IsBad(const NFmiPoint& thePoint)
 // ----------------------------------------------------------------------
 
 std::map<std::string, NFmiPoint> FindPlaces(const std::vector<std::string>& thePlaces,
-                                            const std::string& theCoordFile,
+                                            NFmiLocationFinder& locfinder,
                                             bool theForceFlag)
 {
   typedef std::map<std::string, NFmiPoint> ReturnType;
   ReturnType ret;
 
-  if (!NFmiFileSystem::FileExists(theCoordFile))
-    throw std::runtime_error("File '" + theCoordFile + "' does not exist");
-
-  NFmiLocationFinder locfinder;
-  if (!locfinder.AddFile(theCoordFile, false))
-    throw std::runtime_error("Reading file " + theCoordFile + " failed");
-
   for (vector<string>::const_iterator it = thePlaces.begin(); it != thePlaces.end(); ++it)
   {
     NFmiPoint lonlat = locfinder.Find(it->c_str());
@@ -351,66 +392,27 @@ std::map<std::string, NFmiPoint> FindPlaces(const std::vector<std::string>& theP
 }
 
 // ----------------------------------------------------------------------
-// Is it DST time?
-// ----------------------------------------------------------------------
-
-bool IsDst(NFmiFastQueryInfo& qd)
-{
-  NFmiMetTime t = qd.ValidTime();
-
-  struct ::tm utc;
-  utc.tm_sec = t.GetSec();
-  utc.tm_min = t.GetMin();
-  utc.tm_hour = t.GetHour();
-  utc.tm_mday = t.GetDay();
-  utc.tm_mon = t.GetMonth() - 1;     // tm months start from 0
-  utc.tm_year = t.GetYear() - 1900;  // tm years start from 1900
-  utc.tm_wday = -1;
-  utc.tm_yday = -1;
-  utc.tm_isdst = -1;
-
-  ::time_t epochtime = NFmiStaticTime::my_timegm(&utc);
-  struct ::tm tlocal;
-
-#ifdef _MSC_VER
-  // OBS! There are no thread safe localtime(_r) or gmtime(_r) functions in MSVC++ 2008 (or before).
-  // Closest things available are some what safer (but not thread safe) and with almost same
-  // function
-  // definitions are the localtime_s and gmtime_s -functions. Parameters are ordered otherway round
-  // and their return value is success status, not struct tm pointer.
-  ::localtime_s(&tlocal, &epochtime);
-#else
-  ::localtime_r(&epochtime, &tlocal);
-#endif
-
-  return (tlocal.tm_isdst == 1);
-}
-
-// ----------------------------------------------------------------------
-// Laskee, onko annetussa pisteess annettuun aikaan pime
+// Laskee, onko auringon nousukulman perusteella pime
 // ----------------------------------------------------------------------
 
-bool IsDark(const NFmiPoint& theLatLon, const NFmiTime& theTime)
+bool IsDark(double theElevationAngle)
 {
   // Seuraava pllitty NFmiLocation.cpp tiedostosta
 
   const double kRefractCorr = -0.0145386;
-  NFmiLocation loc(theLatLon.X(), theLatLon.Y());
-  NFmiMetTime t(theTime, 1);
-  double angle = loc.ElevationAngle(t);
-  return (angle < kRefractCorr);
+  return (theElevationAngle < kRefractCorr);
 }
 
 // ----------------------------------------------------------------------
 // Laskee auringon nousukulman
 // ----------------------------------------------------------------------
 
-double ElevationAngle(const NFmiPoint& theLatLon, const NFmiTime& theTime)
+double ElevationAngle(const NFmiPoint& theLatLon, const NFmiTime& theTime, int theTimeStep = 1)
 {
   // Seuraava pllitty NFmiLocation.cpp tiedostosta
 
   NFmiLocation loc(theLatLon.X(), theLatLon.Y());
-  NFmiMetTime t(theTime, 1);
+  NFmiMetTime t(theTime, theTimeStep);
   double angle = loc.ElevationAngle(t);
   return angle;
 }
@@ -686,14 +688,11 @@ float MoonIlluminatedFraction(const NFmiTime& theTime)
 }
 
 // ----------------------------------------------------------------------
-// Keskimrinen steily pinnalla
+// Keskimrinen steily pinnalla auringon nousukulman perusteella
 // ----------------------------------------------------------------------
 
-float SurfaceRadiation(const NFmiTime& theTime, const NFmiPoint& theLatLon)
+float SurfaceRadiation(const NFmiTime& theTime, double elev)
 {
-  NFmiLocation loc(theLatLon);
-  double elev = loc.ElevationAngle(theTime);
-
   const int month = theTime.GetMonth();
   const int day = theTime.GetDay();
 
@@ -705,73 +704,213 @@ float SurfaceRadiation(const NFmiTime& theTime, const NFmiPoint& theLatLon)
 }
 
 // ----------------------------------------------------------------------
-// Laskee metafunktion arvon
-// ----------------------------------------------------------------------
-
-float MetaFunction(NFmiFastQueryInfo& qd, const string& name, NFmiPoint lonlat)
-{
-  if (name == "MetaIsDark")
-    return IsDark(lonlat, qd.ValidTime());
-  else if (name == "MetaElevationAngle")
-    return static_cast<float>(ElevationAngle(lonlat, qd.ValidTime()));
-  else if (name == "MetaRainProbability")
-    return RainProbability(qd, lonlat);
-  else if (name == "MetaWindChill")
-    return WindChill(qd, lonlat);
-  else if (name == "MetaN")
-    return CloudinessN(qd, lonlat);
-  else if (name == "MetaNN")
-    return CloudinessNN(qd, lonlat);
-  else if (name == "MetaMoonIlluminatedFraction")
-    return MoonIlluminatedFraction(qd.ValidTime());
-  else if (name == "MetaSnowProb")
-    return SnowProb(qd, lonlat);
-  else if (name == "MetaSurfaceRadiation")
-    return SurfaceRadiation(qd.ValidTime(), lonlat);
-  else if (name == "MetaThetaE")
-    return ThetaE(qd, lonlat);
-  else if (name == "MetaDST")
-    return IsDst(qd);
-  else if (name == "MetaFeelsLike")
-    return FeelsLike(qd, lonlat);
-  else if (name == "MetaSummerSimmer")
-    return SummerSimmer(qd, lonlat);
-  else
-    return kFloatMissing;
+/*!
+ * \brief Time-only meta function values for each time step of a data
+ *
+ * The values are calculated once per time step instead of once per
+ * time step of every point, and only if some column needs them.
+ */
+// ----------------------------------------------------------------------
+
+class MetaTimes
+{
+ public:
+  MetaTimes() : itsData(), itsMoon() {}
+  void update(const Options& options, const boost::shared_ptr<NFmiQueryData>& data);
+  float MoonIlluminatedFraction(unsigned long theTimeIndex) const { return itsMoon[theTimeIndex]; }
+
+ private:
+  boost::shared_ptr<NFmiQueryData> itsData;
+  vector<float> itsMoon;  // by time index
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The point for which meta functions are calculated
+ *
+ * The solar elevation angle is calculated once per time step of the
+ * point, no matter how many columns need it. MetaSurfaceRadiation has
+ * always used the angle at the nearest full hour, hence it is kept
+ * separately.
+ */
+// ----------------------------------------------------------------------
+
+class MetaPoint
+{
+ public:
+  MetaPoint(const NFmiPoint& theLonLat, const string& theZone, const MetaTimes& theTimes)
+      : lonlat(theLonLat),
+        tz(theZone),
+        times(theTimes),
+        itsElevationTime(static_cast<unsigned long>(-1)),
+        itsElevationAngle(0),
+        itsHourlyElevationTime(static_cast<unsigned long>(-1)),
+        itsHourlyElevationAngle(0)
+  {
+  }
+
+  double ElevationAngle(NFmiFastQueryInfo& qd)
+  {
+    if (qd.TimeIndex() != itsElevationTime)
+    {
+      itsElevationAngle = ::ElevationAngle(lonlat, qd.ValidTime());
+      itsElevationTime = qd.TimeIndex();
+    }
+    return itsElevationAngle;
+  }
+
+  double HourlyElevationAngle(NFmiFastQueryInfo& qd)
+  {
+    if (qd.TimeIndex() != itsHourlyElevationTime)
+    {
+      itsHourlyElevationAngle = ::ElevationAngle(lonlat, qd.ValidTime(), 60);
+      itsHourlyElevationTime = qd.TimeIndex();
+    }
+    return itsHourlyElevationAngle;
+  }
+
+  const NFmiPoint lonlat;
+  const string tz;
+  const MetaTimes& times;
+
+ private:
+  unsigned long itsElevationTime;
+  double itsElevationAngle;
+  unsigned long itsHourlyElevationTime;
+  double itsHourlyElevationAngle;
+};
+
+// ----------------------------------------------------------------------
+// Metafunktiot asetetulle ajalle
+// ----------------------------------------------------------------------
+
+typedef float (*MetaFunction)(NFmiFastQueryInfo& qd, MetaPoint& point);
+
+float MetaIsDark(NFmiFastQueryInfo& qd, MetaPoint& point)
+{
+  return IsDark(point.ElevationAngle(qd));
+}
+
+float MetaElevationAngle(NFmiFastQueryInfo& qd, MetaPoint& point)
+{
+  return static_cast<float>(point.ElevationAngle(qd));
+}
+
+float MetaRainProbability(NFmiFastQueryInfo& qd, MetaPoint& point)
+{
+  return RainProbability(qd, point.lonlat);
+}
+
+float MetaWindChill(NFmiFastQueryInfo& qd, MetaPoint& point)
+{
+  return WindChill(qd, point.lonlat);
+}
+
+float MetaN(NFmiFastQueryInfo& qd, MetaPoint& point)
+{
+  return CloudinessN(qd, point.lonlat);
+}
+
+float MetaNN(NFmiFastQueryInfo& qd, MetaPoint& point)
+{
+  return CloudinessNN(qd, point.lonlat);
+}
+
+float MetaMoonIlluminatedFraction(NFmiFastQueryInfo& qd, MetaPoint& point)
+{
+  return point.times.MoonIlluminatedFraction(qd.TimeIndex());
+}
+
+float MetaSnowProb(NFmiFastQueryInfo& qd, MetaPoint& point)
+{
+  return SnowProb(qd, point.lonlat);
+}
+
+float MetaSurfaceRadiation(NFmiFastQueryInfo& qd, MetaPoint& point)
+{
+  return SurfaceRadiation(qd.ValidTime(), point.HourlyElevationAngle(qd));
+}
+
+float MetaThetaE(NFmiFastQueryInfo& qd, MetaPoint& point)
+{
+  return ThetaE(qd, point.lonlat);
+}
+
+float MetaDST(NFmiFastQueryInfo& qd, MetaPoint& point)
+{
+  return TimeTools::is_dst(qd.ValidTime(), point.tz);
+}
+
+float MetaFeelsLike(NFmiFastQueryInfo& qd, MetaPoint& point)
+{
+  return FeelsLike(qd, point.lonlat);
+}
+
+float MetaSummerSimmer(NFmiFastQueryInfo& qd, MetaPoint& point)
+{
+  return SummerSimmer(qd, point.lonlat);
+}
+
+float MetaUnknown(NFmiFastQueryInfo& qd, MetaPoint& point)
+{
+  return kFloatMissing;
 }
 
 // ----------------------------------------------------------------------
-// Palauttaa metafunktion tarkkuuden
-// ----------------------------------------------------------------------
-
-const char* MetaPrecision(const string& name)
-{
-  if (name == "MetaIsDark")
-    return "%g";
-  else if (name == "MetaElevationAngle")
-    return "%.3f";
-  else if (name == "MetaWindChill")
-    return "%.1f";
-  else if (name == "MetaN")
-    return "%.0f";
-  else if (name == "MetaNN")
-    return "%.0f";
-  else if (name == "MetaMoonIlluminatedFraction")
-    return "%.1f";
-  else if (name == "MetaSnowProb")
-    return "%.1f";
-  else if (name == "MetaSurfaceRadiation")
-    return "%1.f";
-  else if (name == "MetaThetaE")
-    return "%.1f";
-  else if (name == "MetaFeelsLike")
-    return "%.1f";
-  else if (name == "SummerSimmer")
-    return "%.1f";
-  else if (name == "MetaDST")
-    return "%g";
-  else
-    return "%f";
+/*!
+ * \brief Meta functions and the precisions of their values
+ */
+// ----------------------------------------------------------------------
+
+struct MetaFunctionInfo
+{
+  const char* name;
+  MetaFunction function;
+  const char* precision;
+};
+
+const MetaFunctionInfo metafunctions[] = {
+    {"MetaIsDark", MetaIsDark, "%g"},
+    {"MetaElevationAngle", MetaElevationAngle, "%.3f"},
+    {"MetaRainProbability", MetaRainProbability, "%f"},
+    {"MetaWindChill", MetaWindChill, "%.1f"},
+    {"MetaN", MetaN, "%.0f"},
+    {"MetaNN", MetaNN, "%.0f"},
+    {"MetaMoonIlluminatedFraction", MetaMoonIlluminatedFraction, "%.1f"},
+    {"MetaSnowProb", MetaSnowProb, "%.1f"},
+    {"MetaSurfaceRadiation", MetaSurfaceRadiation, "%1.f"},
+    {"MetaThetaE", MetaThetaE, "%.1f"},
+    {"MetaDST", MetaDST, "%g"},
+    {"MetaFeelsLike", MetaFeelsLike, "%.1f"},
+    {"MetaSummerSimmer", MetaSummerSimmer, "%f"}};
+
+const MetaFunctionInfo unknownmetafunction = {"", MetaUnknown, "%f"};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate the time-only values needed by the columns
+ */
+// ----------------------------------------------------------------------
+
+void MetaTimes::update(const Options& options, const boost::shared_ptr<NFmiQueryData>& data)
+{
+  if (data == itsData) return;
+  itsData = data;
+  itsMoon.clear();
+
+  bool moon = false;
+  for (size_t i = 0; i < options.metafunctions.size(); i++)
+  {
+    const MetaFunctionInfo* info = options.metafunctions[i];
+    if (info && info->function == MetaMoonIlluminatedFraction) moon = true;
+  }
+
+  if (!moon) return;
+
+  NFmiFastQueryInfo qi(data.get());
+  itsMoon.resize(qi.SizeTimes(), kFloatMissing);
+  for (qi.ResetTime(); qi.NextTime();)
+    itsMoon[qi.TimeIndex()] = ::MoonIlluminatedFraction(qi.ValidTime());
 }
 
 // ----------------------------------------------------------------------
@@ -818,15 +957,58 @@ long ParamLevel(const string& theParam)
   return NFmiStringTools::Convert<long>(parts[1]);
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Resolve the meta functions of the parameters
+ *
+ * Unknown meta functions produce missing values, other parameters
+ * are marked with a null pointer.
+ */
+// ----------------------------------------------------------------------
+
+vector<const MetaFunctionInfo*> ResolveMetaFunctions(const vector<string>& params)
+{
+  vector<const MetaFunctionInfo*> ret;
+  for (size_t i = 0; i < params.size(); i++)
+  {
+    string name = ParamName(params[i]);
+    const MetaFunctionInfo* info = 0;
+    if (name.substr(0, 4) == "Meta")
+    {
+      info = &unknownmetafunction;
+      for (size_t j = 0; j < sizeof(metafunctions) / sizeof(metafunctions[0]); j++)
+        if (name == metafunctions[j].name) info = &metafunctions[j];
+    }
+    ret.push_back(info);
+  }
+  return ret;
+}
+
+// ----------------------------------------------------------------------
+// Laskee gridin arvon annettuun koordinaattiin. Jos pisteen
+// interpolointipainot on laskettu valmiiksi, arvo lasketaan niill
+// suoraan datasta. Aliparametrit lasketaan aina tavalliseen tapaan.
+// ----------------------------------------------------------------------
+
+float GridValue(NFmiFastQueryInfo& qd, const NFmiPoint& lonlat, const NFmiLocationCache* cache)
+{
+  if (cache == 0 || qd.IsSubParamUsed()) return qd.InterpolatedValue(lonlat);
+  return qd.CachedInterpolation(*cache);
+}
+
 // ----------------------------------------------------------------------
 // Testaa ovatko asetetun sijainnin ja ajan halutut parametrit valideja.
 // Yksi ainoa validi arvo riitt.
 // ----------------------------------------------------------------------
 
-bool ValidRow(NFmiFastQueryInfo& qd,
+bool ValidRow(const Options& options,
+              NFmiFastQueryInfo& qd,
               bool ignoresubs,
-              NFmiPoint lonlat = NFmiPoint(kFloatMissing, kFloatMissing))
+              MetaPoint& point,
+              const NFmiLocationCache* cache = 0)
 {
+  const NFmiPoint& lonlat = point.lonlat;
+
   bool valid = false;
 
   qd.ResetParam();
@@ -841,7 +1023,7 @@ bool ValidRow(NFmiFastQueryInfo& qd,
     {
       if (!qd.NextParam(ignoresubs)) break;
       if (qd.IsGrid())
-        value = qd.InterpolatedValue(lonlat);
+        value = GridValue(qd, lonlat, cache);
       else
         value = qd.FloatValue();
     }
@@ -866,7 +1048,8 @@ bool ValidRow(NFmiFastQueryInfo& qd,
       }
       else
       {
-        if (name.substr(0, 4) != "Meta")
+        const MetaFunctionInfo* meta = options.metafunctions[iter - options.params.begin()];
+        if (!meta)
         {
           if (!qd.Param(ParamEnum(name)))
           {
@@ -875,12 +1058,12 @@ bool ValidRow(NFmiFastQueryInfo& qd,
           ++iter;
 
           if (qd.IsGrid())
-            value = qd.InterpolatedValue(lonlat);
+            value = GridValue(qd, lonlat, cache);
           else
             value = qd.FloatValue();
         }
         else
-          value = MetaFunction(qd, name, lonlat);
+          value = meta->function(qd, point);
       }
     }
 
@@ -938,9 +1121,12 @@ int MissingGap(NFmiFastQueryInfo& qd,
 // Laskee interpoloidun arvon annettuun koordinaaattiin
 // ----------------------------------------------------------------------
 
-float InterpolatedValue(NFmiFastQueryInfo& qd, int maxmissminutes, const NFmiPoint& lonlat)
+float InterpolatedValue(NFmiFastQueryInfo& qd,
+                        int maxmissminutes,
+                        const NFmiPoint& lonlat,
+                        const NFmiLocationCache* cache)
 {
-  float value = qd.InterpolatedValue(lonlat);
+  float value = GridValue(qd, lonlat, cache);
   if (maxmissminutes <= 0 || value != kFloatMissing) return value;
 
   // Try to interpolate the value
@@ -968,16 +1154,33 @@ float InterpolatedValue(NFmiFastQueryInfo& qd, int maxmissminutes)
   return qd.InterpolatedValue(qd.ValidTime(), maxmissminutes);
 }
 
+// ----------------------------------------------------------------------
+// Palauttaa pisteen aikavyhykkeen. Vyhyke selvitetn kerran pistett
+// kohden eik jokaiselle riville erikseen.
+// ----------------------------------------------------------------------
+
+const string PointTimeZone(const Options& options,
+                           const Fmi::WorldTimeZones& zones,
+                           const NFmiPoint& lonlat)
+{
+  if (options.timezone == "local") return zones.zone_name(lonlat.X(), lonlat.Y());
+  return options.timezone;
+}
+
 // ----------------------------------------------------------------------
 // Tulosta asetetun sijainnin ja ajan halutut parametrit. Annettu boolean
 // mr, tulostetaanko wmo numero.
 // ----------------------------------------------------------------------
 
-void PrintRow(NFmiFastQueryInfo& qd,
+void PrintRow(ostream& out,
+              const Options& options,
+              NFmiFastQueryInfo& qd,
               bool ignoresubs,
-              const Fmi::WorldTimeZones& zones,
-              NFmiPoint lonlat = NFmiPoint(kFloatMissing, kFloatMissing))
+              MetaPoint& point,
+              const NFmiLocationCache* cache = 0)
 {
+  const NFmiPoint& lonlat = point.lonlat;
+
   // Kello nyt UTC-ajassa minuutin tarkkuudella
 
   NFmiMetTime now(1);
@@ -992,28 +1195,9 @@ void PrintRow(NFmiFastQueryInfo& qd,
 
   // Rivi nytetn
 
-  NFmiTime t;
-
-  if (options.timezone == "local")
-  {
-#if 0
-	  // Do not use LocalTime approximations if the point seems to be in Finland
-	  if(lonlat.X() > 19 &&
-		 lonlat.X() < 32 &&
-		 lonlat.Y() > 59 &&
-		 lonlat.Y() < 71)
-		t = utctime.CorrectLocalTime();
-	  else
-		t = utctime.LocalTime(static_cast<float>(lonlat.X()));
-#else
-    string tz = zones.zone_name(lonlat.X(), lonlat.Y());
-    t = TimeTools::timezone_time(utctime, tz);
-#endif
-  }
-  else
-    t = TimeTools::timezone_time(utctime, options.timezone);
+  NFmiTime t = TimeTools::timezone_time(utctime, point.tz);
 
-  cout << t.ToStr(kYYYYMMDDHHMM).CharPtr();
+  out << t.ToStr(kYYYYMMDDHHMM).CharPtr();
 
   qd.ResetParam();
 
@@ -1030,7 +1214,7 @@ void PrintRow(NFmiFastQueryInfo& qd,
       precision = qd.Param().GetParam()->Precision();
 
       if (qd.IsGrid())
-        value = InterpolatedValue(qd, options.max_missing_gap, lonlat);
+        value = InterpolatedValue(qd, options.max_missing_gap, lonlat, cache);
       else
         value = InterpolatedValue(qd, options.max_missing_gap);
     }
@@ -1040,6 +1224,7 @@ void PrintRow(NFmiFastQueryInfo& qd,
 
       string name = ParamName(*iter);
       long level = ParamLevel(*iter);
+      const MetaFunctionInfo* meta = options.metafunctions[iter - options.params.begin()];
 
       if (level < 0)
         qd.FirstLevel();
@@ -1053,7 +1238,7 @@ void PrintRow(NFmiFastQueryInfo& qd,
       {
         value = kFloatMissing;
       }
-      else if (name.substr(0, 4) != "Meta")
+      else if (!meta)
       {
         FmiParameterName p = ParamEnum(name);
         if (!qd.Param(p))
@@ -1064,14 +1249,14 @@ void PrintRow(NFmiFastQueryInfo& qd,
         precision = qd.Param().GetParam()->Precision();
 
         if (qd.IsGrid())
-          value = InterpolatedValue(qd, options.max_missing_gap, lonlat);
+          value = InterpolatedValue(qd, options.max_missing_gap, lonlat, cache);
         else
           value = InterpolatedValue(qd, options.max_missing_gap);
       }
       else
       {
-        value = MetaFunction(qd, name, lonlat);
-        precision = MetaPrecision(name);
+        value = meta->function(qd, point);
+        precision = meta->precision;
       }
       ++iter;
     }
@@ -1085,9 +1270,9 @@ void PrintRow(NFmiFastQueryInfo& qd,
     else
       tmp = NFmiValueString(value, precision);
 
-    cout << " " << tmp.CharPtr();
+    out << " " << tmp.CharPtr();
   }
-  cout << endl;
+  out << endl;
 }
 
 // ----------------------------------------------------------------------
@@ -1097,7 +1282,8 @@ void PrintRow(NFmiFastQueryInfo& qd,
  */
 // ----------------------------------------------------------------------
 
-void PrintLocationInfo(QueryDataManager& theMgr,
+void PrintLocationInfo(ostream& out,
+                       QueryDataManager& theMgr,
                        bool printdist = false,
                        const NFmiPoint lonlat = NFmiPoint(kFloatMissing, kFloatMissing))
 {
@@ -1105,13 +1291,13 @@ void PrintLocationInfo(QueryDataManager& theMgr,
 
   const char separator = '\t';
   string wmostr = NFmiValueString(static_cast<long>(qd.Location()->GetIdent()), "%05d").CharPtr();
-  cout << "# StationName" << separator << wmostr << separator << qd.Location()->GetName().CharPtr()
-       << endl;
-  cout << "# StationLoc" << separator << wmostr << separator << qd.Location()->GetLongitude()
-       << separator << qd.Location()->GetLatitude() << endl;
+  out << "# StationName" << separator << wmostr << separator << qd.Location()->GetName().CharPtr()
+      << endl;
+  out << "# StationLoc" << separator << wmostr << separator << qd.Location()->GetLongitude()
+      << separator << qd.Location()->GetLatitude() << endl;
   if (printdist)
-    cout << "# StationDist" << separator << wmostr << separator
-         << qd.Location()->Distance(lonlat) / 1000 << endl;
+    out << "# StationDist" << separator << wmostr << separator
+        << qd.Location()->Distance(lonlat) / 1000 << endl;
 }
 
 // ----------------------------------------------------------------------
@@ -1122,7 +1308,7 @@ void PrintLocationInfo(QueryDataManager& theMgr,
  */
 // ----------------------------------------------------------------------
 
-void ReportTimes(QueryDataManager& theMgr)
+void ReportTimes(ostream& out, QueryDataManager& theMgr)
 {
   if (!theMgr.isset()) return;
 
@@ -1141,29 +1327,33 @@ void ReportTimes(QueryDataManager& theMgr)
 
   NFmiTime t2 = qd.Time().CorrectLocalTime();
 
-  cout << "# TimeStart" << separator << t1.ToStr(kYYYYMMDDHHMM).CharPtr() << endl
-       << "# TimeEnd" << separator << t2.ToStr(kYYYYMMDDHHMM).CharPtr() << endl
-       << "# TimeStep" << separator << qd.TimeResolution() << endl
-       << "# TimeSteps" << separator << qd.SizeTimes() << endl;
+  out << "# TimeStart" << separator << t1.ToStr(kYYYYMMDDHHMM).CharPtr() << endl
+      << "# TimeEnd" << separator << t2.ToStr(kYYYYMMDDHHMM).CharPtr() << endl
+      << "# TimeStep" << separator << qd.TimeResolution() << endl
+      << "# TimeSteps" << separator << qd.SizeTimes() << endl;
 }
 
 // ----------------------------------------------------------------------
 // Print location info for the user
 // ----------------------------------------------------------------------
 
-void ReportStations(QueryDataManager& theMgr, const vector<int> theWmos, const NFmiPoint& theLonLat)
+void ReportStations(ostream& out,
+                    const Options& options,
+                    QueryDataManager& theMgr,
+                    const vector<int> theWmos,
+                    const NFmiPoint& theLonLat)
 {
   if (theWmos.empty())
-    PrintLocationInfo(theMgr, !IsBad(theLonLat), theLonLat);
+    PrintLocationInfo(out, theMgr, !IsBad(theLonLat), theLonLat);
   else
   {
-    if (options.verbose) cout << "# Stations " << theWmos.size() << endl;
+    if (options.verbose) out << "# Stations " << theWmos.size() << endl;
     vector<int>::const_iterator begin = theWmos.begin();
     vector<int>::const_iterator end = theWmos.end();
     for (vector<int>::const_iterator iter = begin; iter != end; ++iter)
     {
       theMgr.setstation(*iter);
-      PrintLocationInfo(theMgr, !IsBad(theLonLat), theLonLat);
+      PrintLocationInfo(out, theMgr, !IsBad(theLonLat), theLonLat);
     }
   }
 }
@@ -1172,15 +1362,16 @@ void ReportStations(QueryDataManager& theMgr, const vector<int> theWmos, const N
 // Printtaa tietoa parametreista
 // ----------------------------------------------------------------------
 
-void ReportParams(QueryDataManager& theMgr,
+void ReportParams(ostream& out,
+                  QueryDataManager& theMgr,
                   const vector<int>& theWmos,
                   const vector<string>& theParams)
 {
   if (!theMgr.isset()) return;
 
   int sarake = 1;
-  if (!theWmos.empty()) cout << "# Column " << sarake++ << ": WMO-number" << endl;
-  cout << "# Column " << sarake++ << ": Local time" << endl;
+  if (!theWmos.empty()) out << "# Column " << sarake++ << ": WMO-number" << endl;
+  out << "# Column " << sarake++ << ": Local time" << endl;
 
   NFmiFastQueryInfo& qd = theMgr.info();
 
@@ -1199,8 +1390,8 @@ void ReportParams(QueryDataManager& theMgr,
       NFmiString name = qd.Param().GetParamName();
       long ident = qd.Param().GetParamIdent();
       string name2 = converter.ToString(ident);
-      cout << "# Column " << sarake++ << ": " << name.CharPtr() << " ( kFmi" << name2.c_str()
-           << " = " << ident << " )" << endl;
+      out << "# Column " << sarake++ << ": " << name.CharPtr() << " ( kFmi" << name2.c_str()
+          << " = " << ident << " )" << endl;
       i++;
     }
   }
@@ -1230,84 +1421,347 @@ void ReportParams(QueryDataManager& theMgr,
         ident = qd.Param().GetParamIdent();
         name2 = "kFmi" + converter.ToString(ident);
       }
-      cout << "# Column " << sarake++ << ": " << name << " ( " << name2 << " = " << ident << " )"
-           << endl;
+      out << "# Column " << sarake++ << ": " << name << " ( " << name2 << " = " << ident << " )"
+          << endl;
       i++;
     }
   }
 }
 
 // ----------------------------------------------------------------------
-// Paaohjelma
-//
-// 1. Luetaan optiot
-// 2. Konvertoidaan mahdollinen paikannimi koordinaateiksi
-// 3. Tarkistetaan koordinaattien jarkevyys
-// 4. Luetaan data
+// Tulostaa asetetun pisteen rivit. Etuliite tulostetaan jokaisen
+// rivin alkuun.
 // ----------------------------------------------------------------------
 
-int run(int argc, char* argv[])
+void PrintPoint(ostream& out,
+                const Options& options,
+                NFmiFastQueryInfo& qi,
+                bool ignoresubs,
+                const Fmi::WorldTimeZones& zones,
+                const MetaTimes& times,
+                const string& prefix,
+                const NFmiPoint& lonlat,
+                const NFmiLocationCache* cache)
 {
-  if (!parse_options(argc, argv)) return 0;
+  MetaPoint point(lonlat, PointTimeZone(options, zones, lonlat), times);
 
-  typedef map<string, NFmiPoint> PlacesType;
-  PlacesType places;
+  qi.FirstLevel();
+  if (options.rows < 0)
+  {
+    qi.ResetTime();
+    while (qi.NextTime())
+    {
+      out << prefix;
+      PrintRow(out, options, qi, ignoresubs, point, cache);
+    }
+  }
+  else
+  {
+    while (qi.NextTime())
+      ;
+    qi.PreviousTime();
+    // qi.LastTime()
+    int rows = options.rows;
+    do
+    {
+      if (options.max_missing_gap > 0 || ValidRow(options, qi, ignoresubs, point, cache))
+      {
+        out << prefix;
+        PrintRow(out, options, qi, ignoresubs, point, cache);
+        --rows;
+      }
+    } while (rows > 0 && qi.PreviousTime());
+    if (rows > 0 && options.verbose)
+      out << "# Warning: " << rows << " missing rows due to insufficient data in the queryfile"
+          << endl;
+  }
+}
 
-  // Initialize the querydata manager
+// ----------------------------------------------------------------------
+/*!
+ * \brief A point whose rows are printed from an already chosen data
+ */
+// ----------------------------------------------------------------------
 
-  QueryDataManager qmgr;
-  qmgr.searchpath(NFmiSettings::Optional<string>("qdpoint::querydata_path", "."));
-  qmgr.addfiles(NFmiStringTools::Split(options.queryfile));
+struct PointJob
+{
+  string header;                // printed once before the rows
+  string prefix;                // printed before each row
+  NFmiPoint lonlat;             // the point
+  unsigned long locationindex;  // the location chosen by the manager
+  string output;                // the printed rows
+  string error;                 // error message, if printing failed
+};
 
-  if (options.multimode) qmgr.multimode();
+// ----------------------------------------------------------------------
+/*!
+ * \brief Print the rows of a single point
+ *
+ * Each thread has its own info. For grids the interpolation weights
+ * of the point are calculated once, and all parameters and times
+ * are then interpolated directly from the data with them.
+ *
+ * Errors are stored into the job so that the rows of the preceding
+ * points can still be printed in order.
+ */
+// ----------------------------------------------------------------------
 
-  // Initialize timezone finder
+void PrintPointJob(const Options* options,
+                   vector<NFmiFastQueryInfo>* infos,
+                   bool ignoresubs,
+                   const Fmi::WorldTimeZones* zones,
+                   const MetaTimes* times,
+                   vector<PointJob>* jobs,
+                   unsigned int thread,
+                   size_t i)
+{
+  NFmiFastQueryInfo& qi = (*infos)[thread];
+  PointJob& job = (*jobs)[i];
+  try
+  {
+    ostringstream out;
+    qi.LocationIndex(job.locationindex);
+    if (qi.IsGrid())
+    {
+      NFmiLocationCache cache = qi.CalcLocationCache(job.lonlat);
+      PrintPoint(out, *options, qi, ignoresubs, *zones, *times, job.prefix, job.lonlat, &cache);
+    }
+    else
+      PrintPoint(out, *options, qi, ignoresubs, *zones, *times, job.prefix, job.lonlat, 0);
+    job.output = out.str();
+  }
+  catch (const std::exception& e)
+  {
+    job.error = e.what();
+  }
+  catch (...)
+  {
+    job.error = "An unknown exception occurred";
+  }
+}
 
-  Fmi::WorldTimeZones zones(options.timezonefile);
+// ----------------------------------------------------------------------
+/*!
+ * \brief Print the rows of points sharing the same data
+ *
+ * The points are processed in parallel, and printed in their
+ * original order. The jobs are cleared for the next batch.
+ */
+// ----------------------------------------------------------------------
 
-  // Muodostetaan paikka -x ja -y koordinaateista
+void PrintPoints(ostream& out,
+                 const Options& options,
+                 const boost::shared_ptr<NFmiQueryData>& data,
+                 bool ignoresubs,
+                 const Fmi::WorldTimeZones& zones,
+                 vector<PointJob>& jobs)
+{
+  if (jobs.empty()) return;
 
-  if (options.longitude != kFloatMissing && options.latitude != kFloatMissing)
-    places.insert(PlacesType::value_type("-", NFmiPoint(options.longitude, options.latitude)));
-  else if (options.longitude != kFloatMissing || options.latitude != kFloatMissing)
-    throw std::runtime_error("Both longitude and latitude must be given");
+  MetaTimes times;
+  times.update(options, data);
 
-  // Muunnetaan mahdolliset placename optiot koordinaateiksi
+  ParallelJobs parallel(jobs.size(), options.threads);
+  vector<NFmiFastQueryInfo> infos(parallel.threads(), NFmiFastQueryInfo(data.get()));
+  parallel.run(boost::bind(
+      PrintPointJob, &options, &infos, ignoresubs, &zones, &times, &jobs, _1, _2));
 
-  if (!options.places.empty())
+  for (size_t i = 0; i < jobs.size(); i++)
   {
-    // Muuttujalle coordfile annetaan oletusarvo, eli tassa on
-    // ylivarmistusta.
+    out << jobs[i].header;
+    if (!jobs[i].error.empty()) throw runtime_error(jobs[i].error);
+    out << jobs[i].output;
+  }
 
-    if (options.coordinatefile.empty())
-      throw runtime_error("Places defined but no coordinates file is set");
+  jobs.clear();
+}
 
-    places = FindPlaces(options.places, options.coordinatefile, options.force);
+// ----------------------------------------------------------------------
+/*!
+ * \brief Timezone tables shared by all requests
+ *
+ * The tables are not modified once they have been read, hence the
+ * server threads may share them.
+ */
+// ----------------------------------------------------------------------
 
-    if (options.verbose)
-    {
-      for (map<string, NFmiPoint>::const_iterator it = places.begin(); it != places.end(); ++it)
-        cout << "# Location: " << it->first << endl
-             << "# Coordinate: " << it->second.X() << ' ' << it->second.Y() << endl;
-    }
+class TimeZoneCache
+{
+ public:
+  const Fmi::WorldTimeZones& get(const string& theFile)
+  {
+    boost::lock_guard<boost::mutex> lock(itsMutex);
+    boost::shared_ptr<Fmi::WorldTimeZones>& zones = itsZones[theFile];
+    if (!zones) zones.reset(new Fmi::WorldTimeZones(theFile));
+    return *zones;
   }
 
-  // Referenssipiste lhimpi pisteit haettaessa
+ private:
+  boost::mutex itsMutex;
+  map<string, boost::shared_ptr<Fmi::WorldTimeZones> > itsZones;
+};
 
-  NFmiPoint referencelonlat(kFloatMissing, kFloatMissing);
-  if (options.nearest_stations >= 1 && places.size() == 1) referencelonlat = places.begin()->second;
+// ----------------------------------------------------------------------
+/*!
+ * \brief Data kept resident between the requests of a single thread
+ *
+ * Query data managers and location finders are not thread safe, hence
+ * in the server mode each worker thread has its own resources. In the
+ * normal mode they are used for a single request only.
+ */
+// ----------------------------------------------------------------------
 
-  // Listataan kaikki asemat tarvittaessa
+class Resources
+{
+ public:
+  explicit Resources(TimeZoneCache& theZones) : itsZones(theZones) {}
+
+  QueryDataManager& manager(const Options& theOptions);
+  NFmiLocationFinder& finder(const string& theFile);
+  const LocationList& locations(const string& theFile);
+  const Fmi::WorldTimeZones& zones(const string& theFile) { return itsZones.get(theFile); }
+
+ private:
+  TimeZoneCache& itsZones;
+  map<string, boost::shared_ptr<QueryDataManager> > itsManagers;
+  map<string, boost::shared_ptr<NFmiLocationFinder> > itsFinders;
+  map<string, LocationList> itsLocations;
+};
 
-  if (options.all_stations)
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the querydata manager for the given options
+ *
+ * A manager used earlier is refreshed so that modified files are
+ * read again.
+ */
+// ----------------------------------------------------------------------
+
+QueryDataManager& Resources::manager(const Options& theOptions)
+{
+  string key = theOptions.queryfile + (theOptions.multimode ? "\nQ" : "");
+  boost::shared_ptr<QueryDataManager>& qmgr = itsManagers[key];
+
+  if (!qmgr)
   {
-    std::set<int> stats = qmgr.stations();
-    std::copy(stats.begin(), stats.end(), back_inserter(options.stations));
+    qmgr.reset(new QueryDataManager);
+    qmgr->searchpath(NFmiSettings::Optional<string>("qdpoint::querydata_path", "."));
+    qmgr->addfiles(NFmiStringTools::Split(theOptions.queryfile));
+    if (theOptions.multimode) qmgr->multimode();
   }
-  // Listataan kaikki lhimmat asemat tarvittaessa
+  else
+    qmgr->refresh();
 
-  else if (options.nearest_stations > 1 || options.validate)
-  {
+  qmgr->memorylimit(static_cast<size_t>(theOptions.memory_limit) << 20);
+  return *qmgr;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the location finder for the given coordinates file
+ */
+// ----------------------------------------------------------------------
+
+NFmiLocationFinder& Resources::finder(const string& theFile)
+{
+  boost::shared_ptr<NFmiLocationFinder>& locfinder = itsFinders[theFile];
+
+  if (!locfinder)
+  {
+    if (!NFmiFileSystem::FileExists(theFile))
+      throw std::runtime_error("File '" + theFile + "' does not exist");
+
+    boost::shared_ptr<NFmiLocationFinder> tmp(new NFmiLocationFinder);
+    if (!tmp->AddFile(theFile, false))
+      throw std::runtime_error("Reading file " + theFile + " failed");
+    locfinder = tmp;
+  }
+
+  return *locfinder;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the locations listed in the given file
+ */
+// ----------------------------------------------------------------------
+
+const LocationList& Resources::locations(const string& theFile)
+{
+  map<string, LocationList>::iterator it = itsLocations.find(theFile);
+  if (it == itsLocations.end())
+    it = itsLocations.insert(make_pair(theFile, read_locationlist(theFile))).first;
+  return it->second;
+}
+
+// ----------------------------------------------------------------------
+// Vastaa yhteen kyselyyn
+//
+// 1. Konvertoidaan mahdollinen paikannimi koordinaateiksi
+// 2. Tarkistetaan koordinaattien jarkevyys
+// 3. Luetaan data
+// ----------------------------------------------------------------------
+
+int query(Options& options, Resources& theResources, ostream& out)
+{
+  LocationList nolocations;
+  const LocationList& locations =
+      (options.locationfile.empty() ? nolocations : theResources.locations(options.locationfile));
+
+  typedef map<string, NFmiPoint> PlacesType;
+  PlacesType places;
+
+  // Initialize the querydata manager
+
+  QueryDataManager& qmgr = theResources.manager(options);
+
+  // Initialize timezone finder
+
+  const Fmi::WorldTimeZones& zones = theResources.zones(options.timezonefile);
+
+  // Muodostetaan paikka -x ja -y koordinaateista
+
+  if (options.longitude != kFloatMissing && options.latitude != kFloatMissing)
+    places.insert(PlacesType::value_type("-", NFmiPoint(options.longitude, options.latitude)));
+  else if (options.longitude != kFloatMissing || options.latitude != kFloatMissing)
+    throw std::runtime_error("Both longitude and latitude must be given");
+
+  // Muunnetaan mahdolliset placename optiot koordinaateiksi
+
+  if (!options.places.empty())
+  {
+    // Muuttujalle coordfile annetaan oletusarvo, eli tassa on
+    // ylivarmistusta.
+
+    if (options.coordinatefile.empty())
+      throw runtime_error("Places defined but no coordinates file is set");
+
+    places = FindPlaces(options.places, theResources.finder(options.coordinatefile), options.force);
+
+    if (options.verbose)
+    {
+      for (map<string, NFmiPoint>::const_iterator it = places.begin(); it != places.end(); ++it)
+        out << "# Location: " << it->first << endl
+            << "# Coordinate: " << it->second.X() << ' ' << it->second.Y() << endl;
+    }
+  }
+
+  // Referenssipiste lhimpi pisteit haettaessa
+
+  NFmiPoint referencelonlat(kFloatMissing, kFloatMissing);
+  if (options.nearest_stations >= 1 && places.size() == 1) referencelonlat = places.begin()->second;
+
+  // Listataan kaikki asemat tarvittaessa
+
+  if (options.all_stations)
+  {
+    std::set<int> stats = qmgr.stations();
+    std::copy(stats.begin(), stats.end(), back_inserter(options.stations));
+  }
+  // Listataan kaikki lhimmat asemat tarvittaessa
+
+  else if (options.nearest_stations > 1 || options.validate)
+  {
     if (places.size() != 1)
       throw runtime_error("Must specify exactly 1 reference point for -N or -C");
 
@@ -1325,7 +1779,7 @@ int run(int argc, char* argv[])
   // (Halutaan joko wmo-numerot tai koordinaatit)
 
   if (options.stations.empty() && !options.all_stations && places.empty() &&
-      options.locations.empty())
+      locations.empty())
     throw runtime_error("No valid coordinates given");
 
   // Nytetn asemat, jos -v tai -s on annettu
@@ -1333,16 +1787,16 @@ int run(int argc, char* argv[])
   if (options.list_stations || options.verbose)
   {
     if (!places.empty()) qmgr.setpoint(places.begin()->second, 1000 * options.max_distance);
-    ReportStations(qmgr, options.stations, referencelonlat);
+    ReportStations(out, options, qmgr, options.stations, referencelonlat);
   }
 
   // Nytetn aika-askeleet, jos -v on annettu
 
-  if (options.verbose) ReportTimes(qmgr);
+  if (options.verbose) ReportTimes(out, qmgr);
 
   // Nytetn parametrinimet, jos -v on annettu
 
-  if (options.verbose) ReportParams(qmgr, options.stations, options.params);
+  if (options.verbose) ReportParams(out, qmgr, options.stations, options.params);
 
   // Jos options.rows > 0, halutaan N viimeisint aikaa, muutoin kaikki ajat
 
@@ -1352,6 +1806,7 @@ int run(int argc, char* argv[])
 
   if (!options.stations.empty())
   {
+    MetaTimes times;
     vector<int>::const_iterator begin = options.stations.begin();
     vector<int>::const_iterator end = options.stations.end();
     for (vector<int>::const_iterator iter = begin; iter != end; ++iter)
@@ -1364,6 +1819,8 @@ int run(int argc, char* argv[])
       if (!qi->Location(*iter)) continue;
 
       NFmiPoint lonlat = qi->Location()->GetLocation();
+      times.update(options, qmgr.data());
+      MetaPoint point(lonlat, PointTimeZone(options, zones, lonlat), times);
 
       if (options.rows < 0)
       {
@@ -1372,8 +1829,8 @@ int run(int argc, char* argv[])
         {
           // Taaksepin yhteensopivuus vaatii, ett
           // tulostetaan WMO-numero vain kun niit on useita
-          if (options.stations.size() > 1) cout << NFmiValueString(*iter, "%05d").CharPtr() << ' ';
-          PrintRow(*qi, ignoresubs, zones, lonlat);
+          if (options.stations.size() > 1) out << NFmiValueString(*iter, "%05d").CharPtr() << ' ';
+          PrintRow(out, options, *qi, ignoresubs, point);
         }
       }
       else
@@ -1386,116 +1843,526 @@ int run(int argc, char* argv[])
         int rows = options.rows;
         do
         {
-          if (options.max_missing_gap > 0 || ValidRow(*qi, ignoresubs))
+          if (options.max_missing_gap > 0 || ValidRow(options, *qi, ignoresubs, point))
           {
-            cout << NFmiValueString(*iter, "%05d").CharPtr() << ' ';
-            PrintRow(*qi, ignoresubs, zones, lonlat);
+            out << NFmiValueString(*iter, "%05d").CharPtr() << ' ';
+            PrintRow(out, options, *qi, ignoresubs, point);
             --rows;
           }
         } while (rows > 0 && qi->PreviousTime());
         if (rows > 0 && options.verbose)
-          cout << "# Warning: " << rows << " missing rows for WMO-number " << *iter
-               << " due to insufficient data in the queryfile" << endl;
+          out << "# Warning: " << rows << " missing rows for WMO-number " << *iter
+              << " due to insufficient data in the queryfile" << endl;
       }
     }
   }
-  else if (!options.locations.empty())
+  else
   {
-    for (LocationList::const_iterator it = options.locations.begin(); it != options.locations.end();
-         ++it)
+    // Pisteet tulostetaan eriss, joiden pisteill on sama data
+
+    vector<PointJob> points;
+    if (!locations.empty())
     {
-      NFmiPoint lonlat = it->latlon;
+      for (LocationList::const_iterator it = locations.begin(); it != locations.end(); ++it)
+      {
+        PointJob job;
+        job.prefix = it->name + ' ';
+        job.lonlat = it->latlon;
+        points.push_back(job);
+      }
+    }
+    else
+    {
+      for (PlacesType::const_iterator it = places.begin(); it != places.end(); ++it)
+      {
+        PointJob job;
+        if (places.size() > 1) job.header = "Location: " + it->first + "\n";
+        job.lonlat = it->second;
+        points.push_back(job);
+      }
+    }
+
+    boost::shared_ptr<NFmiQueryData> data;
+    vector<PointJob> jobs;
+
+    for (size_t i = 0; i < points.size(); i++)
+    {
+      PointJob& job = points[i];
       try
       {
-        qmgr.setpoint(lonlat, 1000 * options.max_distance);
-        qi = &qmgr.info();
+        qmgr.setpoint(job.lonlat, 1000 * options.max_distance);
       }
       catch (...)
       {
+        PrintPoints(out, options, data, ignoresubs, zones, jobs);
+        out << job.header;
         if (options.force) continue;
         throw;
       }
 
-      qi->FirstLevel();
-      if (options.rows < 0)
+      if (qmgr.data() != data)
       {
-        qi->ResetTime();
-        while (qi->NextTime())
-        {
-          cout << it->name << ' ';
-          PrintRow(*qi, ignoresubs, zones, lonlat);
-        }
-      }
-      else
-      {
-        while (qi->NextTime())
-          ;
-        qi->PreviousTime();
-        // qi->LastTime()
-        int rows = options.rows;
-        do
-        {
-          if (options.max_missing_gap > 0 || ValidRow(*qi, ignoresubs, lonlat))
-          {
-            cout << it->name << ' ';
-            PrintRow(*qi, ignoresubs, zones, lonlat);
-            --rows;
-          }
-        } while (rows > 0 && qi->PreviousTime());
-        if (rows > 0 && options.verbose)
-          cout << "# Warning: " << rows << " missing rows due to insufficient data in the queryfile"
-               << endl;
+        PrintPoints(out, options, data, ignoresubs, zones, jobs);
+        data = qmgr.data();
       }
+
+      job.locationindex = qmgr.info().LocationIndex();
+      jobs.push_back(job);
     }
+
+    PrintPoints(out, options, data, ignoresubs, zones, jobs);
   }
-  else
+
+  return 0;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Answer a single request of the server mode
+ *
+ * The request uses the same syntax as the command line. The reply is
+ * terminated by a line "# OK", or by "# Error: message" if the request
+ * failed.
+ */
+// ----------------------------------------------------------------------
+
+string AnswerRequest(const string& theRequest, Resources& theResources)
+{
+  ostringstream out;
+  try
   {
-    for (PlacesType::const_iterator it = places.begin(); it != places.end(); ++it)
+    Options options;
+    if (parse_options(boost::program_options::split_unix(theRequest), options, out))
     {
-      if (places.size() > 1) cout << "Location: " << it->first << endl;
+      if (!options.server.empty())
+        throw runtime_error("Option --server is not allowed in requests");
 
-      NFmiPoint lonlat = it->second;
-      try
-      {
-        qmgr.setpoint(lonlat, 1000 * options.max_distance);
-        qi = &qmgr.info();
-      }
-      catch (...)
-      {
-        if (options.force) continue;
-        throw;
-      }
+      // The requests are already answered in parallel
+      options.threads = 1;
+      query(options, theResources, out);
+    }
+    out << "# OK" << endl;
+  }
+  catch (const std::exception& e)
+  {
+    out << "# Error: " << e.what() << endl;
+  }
+  catch (...)
+  {
+    out << "# Error: An unknown exception occurred" << endl;
+  }
+  return out.str();
+}
 
-      qi->FirstLevel();
-      if (options.rows < 0)
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether a request line is empty
+ */
+// ----------------------------------------------------------------------
+
+bool IsBlank(const string& theLine)
+{
+  return theLine.find_first_not_of(" \t\r") == string::npos;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Queue of jobs waiting for the server threads
+ */
+// ----------------------------------------------------------------------
+
+template <typename T>
+class JobQueue
+{
+ public:
+  JobQueue() : itsClosed(false) {}
+
+  void push(const T& theJob)
+  {
+    boost::lock_guard<boost::mutex> lock(itsMutex);
+    itsJobs.push_back(theJob);
+    itsCondition.notify_one();
+  }
+
+  // No more jobs will be pushed
+  void close()
+  {
+    boost::lock_guard<boost::mutex> lock(itsMutex);
+    itsClosed = true;
+    itsCondition.notify_all();
+  }
+
+  // Returns false once the queue is closed and empty
+  bool pop(T& theJob)
+  {
+    boost::unique_lock<boost::mutex> lock(itsMutex);
+    while (itsJobs.empty() && !itsClosed)
+      itsCondition.wait(lock);
+    if (itsJobs.empty()) return false;
+    theJob = itsJobs.front();
+    itsJobs.pop_front();
+    return true;
+  }
+
+ private:
+  boost::mutex itsMutex;
+  boost::condition_variable itsCondition;
+  list<T> itsJobs;
+  bool itsClosed;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write all of the given text to a socket
+ *
+ * \return False if the client has disconnected
+ */
+// ----------------------------------------------------------------------
+
+bool WriteAll(int fd, const string& theText)
+{
+  string::size_type pos = 0;
+  while (pos < theText.size())
+  {
+    ssize_t n = ::write(fd, theText.data() + pos, theText.size() - pos);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    pos += n;
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Writes replies in the order of the requests
+ *
+ * The replies go either to a stream or to a client socket, which is
+ * closed when the last request of the client has been answered. Once
+ * the client has disconnected the rest of its replies are discarded.
+ */
+// ----------------------------------------------------------------------
+
+class ReplyWriter
+{
+ public:
+  explicit ReplyWriter(ostream& theOutput)
+      : itsOutput(&theOutput), itsSocket(-1), itsConnected(true), itsNext(0)
+  {
+  }
+
+  explicit ReplyWriter(int theSocket)
+      : itsOutput(0), itsSocket(theSocket), itsConnected(true), itsNext(0)
+  {
+  }
+
+  ~ReplyWriter()
+  {
+    if (itsSocket >= 0) ::close(itsSocket);
+  }
+
+  bool connected() const
+  {
+    boost::lock_guard<boost::mutex> lock(itsMutex);
+    return itsConnected;
+  }
+
+  void write(unsigned long theNumber, const string& theReply)
+  {
+    boost::lock_guard<boost::mutex> lock(itsMutex);
+    itsReplies.insert(make_pair(theNumber, theReply));
+    while (!itsReplies.empty() && itsReplies.begin()->first == itsNext)
+    {
+      if (itsConnected)
       {
-        qi->ResetTime();
-        while (qi->NextTime())
-          PrintRow(*qi, ignoresubs, zones, lonlat);
+        if (itsOutput != 0)
+          *itsOutput << itsReplies.begin()->second;
+        else
+          itsConnected = WriteAll(itsSocket, itsReplies.begin()->second);
       }
-      else
+      itsReplies.erase(itsReplies.begin());
+      ++itsNext;
+    }
+    if (itsOutput != 0) *itsOutput << flush;
+  }
+
+ private:
+  ReplyWriter(const ReplyWriter&);
+  ReplyWriter& operator=(const ReplyWriter&);
+
+  mutable boost::mutex itsMutex;
+  ostream* itsOutput;
+  int itsSocket;
+  bool itsConnected;
+  unsigned long itsNext;
+  map<unsigned long, string> itsReplies;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A single request and the writer of its reply
+ */
+// ----------------------------------------------------------------------
+
+struct Request
+{
+  boost::shared_ptr<ReplyWriter> writer;
+  unsigned long number;
+  string text;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Server thread answering queued requests
+ *
+ * Requests of disconnected clients are skipped.
+ */
+// ----------------------------------------------------------------------
+
+void RequestWorker(JobQueue<Request>* theQueue, TimeZoneCache* theZones)
+{
+  Resources resources(*theZones);
+  Request request;
+  while (theQueue->pop(request))
+  {
+    if (request.writer->connected())
+      request.writer->write(request.number, AnswerRequest(request.text, resources));
+    else
+      request.writer->write(request.number, "");
+    request.writer.reset();
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A client connected to the socket
+ *
+ * Complete request lines are queued as soon as they have been read.
+ * A final request without a terminating newline is queued once the
+ * client closes its end of the connection. A client sending a line
+ * longer than max_request_length is disconnected without answering
+ * it, so that a client can not make the server buffer unlimited data.
+ * The replies to its earlier requests are still written.
+ */
+// ----------------------------------------------------------------------
+
+const string::size_type max_request_length = 64 * 1024;
+
+class Client
+{
+ public:
+  explicit Client(int theSocket) : itsWriter(new ReplyWriter(theSocket)), itsNumber(0) {}
+
+  void push(const string& theText, JobQueue<Request>& theQueue)
+  {
+    if (IsBlank(theText)) return;
+    Request request;
+    request.writer = itsWriter;
+    request.number = itsNumber++;
+    request.text = theText;
+    theQueue.push(request);
+  }
+
+  // Returns false once the client has closed the connection
+  bool read(int fd, JobQueue<Request>& theQueue)
+  {
+    char chunk[4096];
+    ssize_t n = ::read(fd, chunk, sizeof(chunk));
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return true;
+
+    if (n <= 0)
+    {
+      push(itsBuffer, theQueue);
+      return false;
+    }
+
+    itsBuffer.append(chunk, n);
+    string::size_type pos;
+    while ((pos = itsBuffer.find('\n')) != string::npos)
+    {
+      if (pos > max_request_length) break;
+      push(itsBuffer.substr(0, pos), theQueue);
+      itsBuffer.erase(0, pos + 1);
+    }
+
+    if (itsBuffer.size() > max_request_length)
+    {
+      cerr << "Warning: closing a connection sending a request longer than "
+           << max_request_length << " bytes" << endl;
+      itsBuffer.clear();
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  boost::shared_ptr<ReplyWriter> itsWriter;
+  unsigned long itsNumber;
+  string itsBuffer;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Create a listening Unix socket
+ *
+ * A socket left behind by a previous server is removed, other
+ * files are never replaced.
+ */
+// ----------------------------------------------------------------------
+
+int ListenSocket(const string& thePath)
+{
+  struct sockaddr_un addr;
+  if (thePath.size() >= sizeof(addr.sun_path))
+    throw runtime_error("Socket path '" + thePath + "' is too long");
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, thePath.c_str());
+
+  struct stat st;
+  if (::stat(thePath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) ::unlink(thePath.c_str());
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) throw runtime_error(string("Failed to create socket: ") + strerror(errno));
+
+  if (::bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      ::listen(fd, SOMAXCONN) != 0)
+  {
+    string err = strerror(errno);
+    ::close(fd);
+    throw runtime_error("Failed to listen on socket '" + thePath + "': " + err);
+  }
+
+  return fd;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Run the server mode
+ *
+ * Requests are read either from stdin, in which case the replies are
+ * written to stdout in the order of the requests, or from clients of
+ * a Unix socket, each of which gets the replies to its own requests
+ * in order. The connections are read by the main thread, which queues
+ * the individual requests, so idle clients do not tie up any threads.
+ * The requests are answered in parallel by a pool of threads, each
+ * keeping its querydata and location tables resident. The timezone
+ * tables are read only once and shared by the threads.
+ */
+// ----------------------------------------------------------------------
+
+int serve(const Options& options)
+{
+  unsigned int threads = options.threads;
+  if (threads == 0) threads = max(1u, boost::thread::hardware_concurrency());
+
+  TimeZoneCache zones;
+  zones.get(options.timezonefile);
+
+  JobQueue<Request> queue;
+  boost::thread_group workers;
+  for (unsigned int i = 0; i < threads; i++)
+    workers.add_thread(new boost::thread(RequestWorker, &queue, &zones));
+
+  if (options.server == "-")
+  {
+    boost::shared_ptr<ReplyWriter> writer(new ReplyWriter(cout));
+
+    unsigned long number = 0;
+    string line;
+    while (getline(cin, line))
+    {
+      if (IsBlank(line)) continue;
+      Request request;
+      request.writer = writer;
+      request.number = number++;
+      request.text = line;
+      queue.push(request);
+    }
+
+    queue.close();
+    workers.join_all();
+    return 0;
+  }
+
+  int fd = ListenSocket(options.server);
+
+  // Clients disconnecting early must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  // The connections are read here, only the requests occupy the threads
+
+  map<int, boost::shared_ptr<Client> > clients;
+  vector<struct pollfd> fds;
+
+  while (true)
+  {
+    fds.clear();
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    fds.push_back(pfd);
+    for (map<int, boost::shared_ptr<Client> >::const_iterator it = clients.begin();
+         it != clients.end();
+         ++it)
+    {
+      pfd.fd = it->first;
+      fds.push_back(pfd);
+    }
+
+    if (::poll(&fds[0], fds.size(), -1) < 0)
+    {
+      if (errno == EINTR) continue;
+      string err = strerror(errno);
+      queue.close();
+      workers.join_all();
+      ::close(fd);
+      throw runtime_error("Failed to wait for requests: " + err);
+    }
+
+    for (std::size_t i = 1; i < fds.size(); i++)
+    {
+      if (fds[i].revents == 0) continue;
+      map<int, boost::shared_ptr<Client> >::iterator it = clients.find(fds[i].fd);
+      // The socket is closed once the pending replies have been written
+      if (!it->second->read(fds[i].fd, queue)) clients.erase(it);
+    }
+
+    if (fds[0].revents != 0)
+    {
+      int client = ::accept(fd, 0, 0);
+      if (client >= 0)
+        clients.insert(make_pair(client, boost::shared_ptr<Client>(new Client(client))));
+      else if (errno != EINTR && errno != ECONNABORTED)
       {
-        while (qi->NextTime())
-          ;
-        qi->PreviousTime();
-        // qi->LastTime()
-        int rows = options.rows;
-        do
-        {
-          if (options.max_missing_gap > 0 || ValidRow(*qi, ignoresubs, lonlat))
-          {
-            PrintRow(*qi, ignoresubs, zones, lonlat);
-            --rows;
-          }
-        } while (rows > 0 && qi->PreviousTime());
-        if (rows > 0 && options.verbose)
-          cout << "# Warning: " << rows << " missing rows due to insufficient data in the queryfile"
-               << endl;
+        string err = strerror(errno);
+        queue.close();
+        workers.join_all();
+        ::close(fd);
+        throw runtime_error("Failed to accept connections: " + err);
       }
     }
   }
+}
 
-  return 0;
+// ----------------------------------------------------------------------
+// Paaohjelma
+//
+// 1. Luetaan optiot
+// 2. Joko palvellaan kyselyja tai vastataan yhteen kyselyyn
+// ----------------------------------------------------------------------
+
+int run(int argc, char* argv[])
+{
+  Options options;
+  if (!parse_options(vector<string>(argv + 1, argv + argc), options, cout)) return 0;
+
+  if (!options.server.empty()) return serve(options);
+
+  TimeZoneCache zones;
+  Resources resources(zones);
+  return query(options, resources, cout);
 }
 
 // ----------------------------------------------------------------------
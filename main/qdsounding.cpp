@@ -25,9 +25,14 @@
  *   - -t [zone] for selecting the timezone (default is Europe/Helsinki)
  *   - -c [coordfile] for selecting a coordinate file
  *   - -z for printing level value after level index
+ *   - -j [threads] for the number of threads used for locations
+ *
+ * The soundings of the locations are extracted in parallel, but
+ * printed in the order of the locations.
  */
 // ======================================================================
 
+#include "ParallelJobs.h"
 #include "TimeTools.h"
 
 #include <newbase/NFmiCmdLine.h>
@@ -40,11 +45,14 @@
 #include <newbase/NFmiSettings.h>
 #include <newbase/NFmiStringTools.h>
 
+#include <boost/bind.hpp>
+
+#include <algorithm>
+#include <cstdio>
 #include <ctime>
 #include <iostream>
 #include <memory>
 #include <stdexcept>
-#include <sstream>
 #include <vector>
 
 using namespace std;
@@ -70,6 +78,7 @@ struct Options
   string timezone;
   string coordfile;
   bool printlevelvalue;
+  unsigned int threads;
 
   Options()
       : inputfile(),
@@ -79,7 +88,8 @@ struct Options
         timezone(NFmiSettings::Optional<string>("qdpoint::timezone", "Europe/Helsinki")),
         coordfile(NFmiSettings::Optional<string>("qdpoint::coordinates",
                                                  "/smartmet/share/coordinates/default.txt")),
-        printlevelvalue(false)
+        printlevelvalue(false),
+        threads(0)
   {
   }
 };
@@ -123,6 +133,7 @@ void usage()
        << "\t-t [zone]\t\tthe time zone, default is Europe/Helsinki" << endl
        << "\t-c [file]\t\tthe coordinate file" << endl
        << "\t-z\t\t\tprint level value after level index" << endl
+       << "\t-j [threads]\t\tnumber of threads, default is the number of cores" << endl
        << endl
        << "The default is to print the soundings for all stations if the data is point data."
        << endl
@@ -143,7 +154,7 @@ void usage()
 
 bool parse_command_line(int argc, const char *argv[])
 {
-  NFmiCmdLine cmdline(argc, argv, "hw!p!P!t!c!zx!y!");
+  NFmiCmdLine cmdline(argc, argv, "hw!p!P!t!c!zx!y!j!");
 
   if (cmdline.Status().IsError()) throw runtime_error(cmdline.Status().ErrorLog().CharPtr());
 
@@ -200,6 +211,9 @@ bool parse_command_line(int argc, const char *argv[])
 
   if (cmdline.isOption('z')) options.printlevelvalue = true;
 
+  if (cmdline.isOption('j'))
+    options.threads = NFmiStringTools::Convert<unsigned int>(cmdline.OptionValue('j'));
+
   if (!options.locations.empty() && !options.stations.empty())
     throw runtime_error("Options -p and -w are not allowed simultaneously");
 
@@ -218,6 +232,105 @@ const string format_date(const NFmiTime &theTime)
   return localtime.ToStr(kYYYYMMDDHHMM).CharPtr();
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Format the dates of all times of the data
+ *
+ * The dates are indexed by the time index.
+ */
+// ----------------------------------------------------------------------
+
+const vector<string> format_dates(NFmiFastQueryInfo &theQ)
+{
+  vector<string> dates;
+  for (theQ.ResetTime(); theQ.NextTime();)
+    dates.push_back(format_date(theQ.ValidTime()));
+  return dates;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Check that the parameters are available in the data
+ */
+// ----------------------------------------------------------------------
+
+void check_parameters(NFmiFastQueryInfo &theQ)
+{
+  for (vector<FmiParameterName>::const_iterator it = options.parameters.begin();
+       it != options.parameters.end();
+       ++it)
+  {
+    if (!theQ.Param(*it))
+      throw runtime_error("Parameter '" + converter.ToString(*it) +
+                          "' is not available in the query data");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Buffered output
+ *
+ * The rows are formatted directly into a buffer, which is written
+ * to the output in large blocks. Numbers are formatted the same way
+ * as by an ostream with the default settings. A row can be dropped
+ * by returning to its start.
+ */
+// ----------------------------------------------------------------------
+
+class OutputBuffer
+{
+ public:
+  explicit OutputBuffer(ostream *theOutput = 0) : itsOutput(theOutput), itsBuffer() {}
+  ~OutputBuffer() { flush(); }
+
+  OutputBuffer &operator<<(const string &theText)
+  {
+    itsBuffer += theText;
+    return *this;
+  }
+
+  OutputBuffer &operator<<(char theChar)
+  {
+    itsBuffer += theChar;
+    return *this;
+  }
+
+  OutputBuffer &operator<<(long theValue) { return format("%ld", theValue); }
+  OutputBuffer &operator<<(unsigned long theValue) { return format("%lu", theValue); }
+  OutputBuffer &operator<<(float theValue) { return format("%g", static_cast<double>(theValue)); }
+
+  size_t size() const { return itsBuffer.size(); }
+  void rewind(size_t theSize) { itsBuffer.resize(theSize); }
+  const string &str() const { return itsBuffer; }
+
+  void endrow()
+  {
+    itsBuffer += '\n';
+    if (itsOutput && itsBuffer.size() >= 65536) flush();
+  }
+
+  void flush()
+  {
+    if (!itsOutput) return;
+    itsOutput->write(itsBuffer.data(), itsBuffer.size());
+    itsOutput->flush();
+    itsBuffer.clear();
+  }
+
+ private:
+  template <typename T>
+  OutputBuffer &format(const char *theFormat, T theValue)
+  {
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), theFormat, theValue);
+    itsBuffer += tmp;
+    return *this;
+  }
+
+  ostream *itsOutput;
+  string itsBuffer;
+};
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Find coordinates for places
@@ -273,6 +386,121 @@ const vector<NFmiPoint> find_places(const vector<string> & /* theNames */)
   return coords;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief The sounding of a single location
+ */
+// ----------------------------------------------------------------------
+
+struct SoundingJob
+{
+  string name;       // the location name
+  NFmiPoint lonlat;  // the coordinate
+  string output;     // the printed rows
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The info and value buffer of a single thread
+ */
+// ----------------------------------------------------------------------
+
+struct SoundingWorker
+{
+  SoundingWorker(const NFmiFastQueryInfo &theQ, size_t theSize) : q(theQ), values(theSize) {}
+  NFmiFastQueryInfo q;
+  vector<float> values;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Level index and value printed on the rows of each level
+ */
+// ----------------------------------------------------------------------
+
+vector<string> format_levels(NFmiFastQueryInfo &theQ)
+{
+  vector<string> levels;
+  for (theQ.ResetLevel(); theQ.NextLevel();)
+  {
+    OutputBuffer level;
+    level << ' ' << theQ.LevelIndex();
+    if (options.printlevelvalue) level << ' ' << theQ.Level()->LevelValue();
+    levels.push_back(level.str());
+  }
+  return levels;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Extract the sounding of a single location
+ *
+ * The interpolation weights of the location are calculated once, and
+ * the values of each parameter are then taken for all times and
+ * levels in one sweep. The rows are formatted only after that.
+ */
+// ----------------------------------------------------------------------
+
+void sounding_job(const vector<string> *theDates,
+                  const vector<string> *theLevels,
+                  vector<SoundingWorker> *theWorkers,
+                  vector<SoundingJob> *theJobs,
+                  unsigned int theThread,
+                  size_t theJob)
+{
+  NFmiFastQueryInfo &q = (*theWorkers)[theThread].q;
+  vector<float> &values = (*theWorkers)[theThread].values;
+  SoundingJob &job = (*theJobs)[theJob];
+
+  const size_t ntimes = theDates->size();
+  const size_t nlevels = theLevels->size();
+  const size_t nparams = options.parameters.size();
+
+  NFmiLocationCache cache = q.CalcLocationCache(job.lonlat);
+
+  for (size_t p = 0; p < nparams; p++)
+  {
+    q.Param(options.parameters[p]);
+    const bool subparam = q.IsSubParamUsed();
+    size_t t = 0;
+    for (q.ResetTime(); q.NextTime(); ++t)
+    {
+      size_t l = 0;
+      for (q.ResetLevel(); q.NextLevel(); ++l)
+      {
+        values[(t * nlevels + l) * nparams + p] =
+            (subparam ? q.InterpolatedValue(job.lonlat) : q.CachedInterpolation(cache));
+      }
+    }
+  }
+
+  OutputBuffer out;
+  for (size_t t = 0; t < ntimes; t++)
+    for (size_t l = 0; l < nlevels; l++)
+    {
+      size_t start = out.size();
+      out << job.name << ' ' << (*theDates)[t] << (*theLevels)[l];
+
+      bool foundvalid = false;
+      const float *row = &values[(t * nlevels + l) * nparams];
+      for (size_t p = 0; p < nparams; p++)
+      {
+        if (row[p] == kFloatMissing)
+          out << " -";
+        else
+        {
+          out << ' ' << row[p];
+          foundvalid = true;
+        }
+      }
+      if (foundvalid)
+        out.endrow();
+      else
+        out.rewind(start);
+    }
+  job.output = out.str();
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Print named locations from gridded data
@@ -285,39 +513,26 @@ void print_locations(NFmiFastQueryInfo &theQ)
 
   const vector<NFmiPoint> coords = find_places(options.locations);
 
+  check_parameters(theQ);
+  const vector<string> dates = format_dates(theQ);
+
+  vector<SoundingJob> jobs(coords.size());
   for (vector<NFmiPoint>::size_type i = 0; i < coords.size(); i++)
   {
-    for (theQ.ResetTime(); theQ.NextTime();)
-      for (theQ.ResetLevel(); theQ.NextLevel();)
-      {
-        ostringstream out;
-        out << options.locations[i] << ' ' << format_date(theQ.ValidTime()) << ' '
-            << theQ.LevelIndex();
-
-        if (options.printlevelvalue) out << ' ' << theQ.Level()->LevelValue();
+    jobs[i].name = options.locations[i];
+    jobs[i].lonlat = coords[i];
+  }
 
-        bool foundvalid = false;
+  const vector<string> levels = format_levels(theQ);
+  const size_t nvalues = dates.size() * levels.size() * options.parameters.size();
 
-        for (vector<FmiParameterName>::const_iterator it = options.parameters.begin();
-             it != options.parameters.end();
-             ++it)
-        {
-          if (!theQ.Param(*it))
-            throw runtime_error("Parameter '" + converter.ToString(*it) +
-                                "' is not available in the query data");
+  ParallelJobs parallel(jobs.size(), options.threads);
+  vector<SoundingWorker> workers(parallel.threads(), SoundingWorker(theQ, nvalues));
+  parallel.run(boost::bind(sounding_job, &dates, &levels, &workers, &jobs, _1, _2));
 
-          float value = theQ.InterpolatedValue(coords[i]);
-          if (value == kFloatMissing)
-            out << " -";
-          else
-          {
-            out << ' ' << value;
-            foundvalid = true;
-          }
-        }
-        if (foundvalid) cout << out.str() << endl;
-      }
-  }
+  for (vector<SoundingJob>::const_iterator it = jobs.begin(); it != jobs.end(); ++it)
+    cout << it->output;
+  cout.flush();
 }
 
 // ----------------------------------------------------------------------
@@ -330,6 +545,10 @@ void print_stations(NFmiFastQueryInfo &theQ)
 {
   if (theQ.IsGrid()) throw runtime_error("Cannot use option -w for grid data");
 
+  check_parameters(theQ);
+  const vector<string> dates = format_dates(theQ);
+  OutputBuffer out(&cout);
+
   for (vector<int>::const_iterator wt = options.stations.begin(); wt != options.stations.end();
        ++wt)
   {
@@ -340,8 +559,8 @@ void print_stations(NFmiFastQueryInfo &theQ)
     for (theQ.ResetTime(); theQ.NextTime();)
       for (theQ.ResetLevel(); theQ.NextLevel();)
       {
-        ostringstream out;
-        out << theQ.Location()->GetIdent() << ' ' << format_date(theQ.ValidTime()) << ' '
+        size_t start = out.size();
+        out << theQ.Location()->GetIdent() << ' ' << dates[theQ.TimeIndex()] << ' '
             << theQ.LevelIndex();
 
         if (options.printlevelvalue) out << ' ' << theQ.Level()->LevelValue();
@@ -352,10 +571,7 @@ void print_stations(NFmiFastQueryInfo &theQ)
              it != options.parameters.end();
              ++it)
         {
-          if (!theQ.Param(*it))
-            throw runtime_error("Parameter '" + converter.ToString(*it) +
-                                "' is not available in the query data");
-
+          theQ.Param(*it);
           float value = theQ.FloatValue();
           if (value == kFloatMissing)
             out << " -";
@@ -365,7 +581,10 @@ void print_stations(NFmiFastQueryInfo &theQ)
             foundvalid = true;
           }
         }
-        if (foundvalid) cout << out.str() << endl;
+        if (foundvalid)
+          out.endrow();
+        else
+          out.rewind(start);
       }
   }
 }
@@ -380,12 +599,16 @@ void print_all_stations(NFmiFastQueryInfo &theQ)
 {
   if (theQ.IsGrid()) throw runtime_error("Must use option -p for grid data");
 
+  check_parameters(theQ);
+  const vector<string> dates = format_dates(theQ);
+  OutputBuffer out(&cout);
+
   for (theQ.ResetLocation(); theQ.NextLocation();)
     for (theQ.ResetTime(); theQ.NextTime();)
       for (theQ.ResetLevel(); theQ.NextLevel();)
       {
-        ostringstream out;
-        out << theQ.Location()->GetIdent() << ' ' << format_date(theQ.ValidTime()) << ' '
+        size_t start = out.size();
+        out << theQ.Location()->GetIdent() << ' ' << dates[theQ.TimeIndex()] << ' '
             << theQ.LevelIndex();
 
         if (options.printlevelvalue) out << ' ' << theQ.Level()->LevelValue();
@@ -396,10 +619,7 @@ void print_all_stations(NFmiFastQueryInfo &theQ)
              it != options.parameters.end();
              ++it)
         {
-          if (!theQ.Param(*it))
-            throw runtime_error("Parameter '" + converter.ToString(*it) +
-                                "' is not available in the query data");
-
+          theQ.Param(*it);
           float value = theQ.FloatValue();
           if (value == kFloatMissing)
             out << " -";
@@ -409,7 +629,10 @@ void print_all_stations(NFmiFastQueryInfo &theQ)
             foundvalid = true;
           }
         }
-        if (foundvalid) cout << out.str() << endl;
+        if (foundvalid)
+          out.endrow();
+        else
+          out.rewind(start);
       }
 }
 
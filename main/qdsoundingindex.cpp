@@ -1,15 +1,30 @@
 
 
+#include "ParallelJobs.h"
+
 #include <newbase/NFmiQueryData.h>
 #include <newbase/NFmiQueryDataUtil.h>
 #include <newbase/NFmiCmdLine.h>
+#include <newbase/NFmiFastQueryInfo.h>
 #include <newbase/NFmiMilliSecondTimer.h>
 #include <newbase/NFmiFileString.h>
+#include <newbase/NFmiStringTools.h>
+#include <newbase/NFmiTimeDescriptor.h>
+#include <newbase/NFmiTimeList.h>
 #include <smarttools/NFmiSoundingIndexCalculator.h>
 #include <smarttools/NFmiSoundingFunctions.h>
+#include <macgyver/TimeParser.h>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <set>
+#include <stdexcept>
+#include <vector>
 
 static void Usage(const std::string& theExecutableName)
 {
@@ -22,12 +37,201 @@ static void Usage(const std::string& theExecutableName)
             << "Options:" << std::endl
             << std::endl
             << "\t-n producer-name <default=qdin-producer-name>\tSets producer name." << std::endl
+            << "\t-j threads <default=number of cores>\tNumber of threads used in the"
+            << " calculation." << std::endl
+            << "\t-t time1,time2,...\tCalculate only the given UTC times (YYYYMMDDHHMI)."
+            << std::endl
+            << std::endl
+            << "Without -t the whole data is calculated in one go. With -t the time steps"
+            << std::endl
+            << "are calculated separately, -j of them simultaneously." << std::endl
             << std::endl;
 }
 
+// Laskettava aika-askel ja sen tulos
+
+struct TimeStep
+{
+  NFmiMetTime time;
+  boost::shared_ptr<NFmiQueryData> result;
+};
+
+static NFmiMetTime ToMetTime(const boost::posix_time::ptime& t)
+{
+  return NFmiMetTime(t.date().year(),
+                     t.date().month(),
+                     t.date().day(),
+                     t.time_of_day().hours(),
+                     t.time_of_day().minutes(),
+                     t.time_of_day().seconds(),
+                     1);
+}
+
+// Valitsee lasketut aika-askeleet, oletuksena kaikki
+
+static std::vector<TimeStep> SelectTimes(NFmiFastQueryInfo& theInfo, const std::string& theTimes)
+{
+  std::set<NFmiMetTime> wanted;
+  const std::vector<std::string> parts = NFmiStringTools::Split(theTimes);
+  for (std::vector<std::string>::const_iterator it = parts.begin(); it != parts.end(); ++it)
+  {
+    NFmiMetTime t = ToMetTime(Fmi::TimeParser::parse(*it));
+    if (!theInfo.Time(t))
+      throw std::runtime_error("Time " + *it + " is not available in the querydata");
+    wanted.insert(t);
+  }
+
+  std::vector<TimeStep> steps;
+  for (theInfo.ResetTime(); theInfo.NextTime();)
+  {
+    if (!wanted.empty() && wanted.find(theInfo.ValidTime()) == wanted.end()) continue;
+    TimeStep step;
+    step.time = theInfo.ValidTime();
+    steps.push_back(step);
+  }
+  return steps;
+}
+
+// Kopioi asetetun aika-askeleen arvot. Datoissa on samat parametrit, tasot ja paikat.
+
+static void CopyTimeStep(NFmiFastQueryInfo& theSource, NFmiFastQueryInfo& theTarget)
+{
+  for (theSource.ResetParam(), theTarget.ResetParam();
+       theSource.NextParam() && theTarget.NextParam();)
+    for (theSource.ResetLevel(), theTarget.ResetLevel();
+         theSource.NextLevel() && theTarget.NextLevel();)
+      for (theSource.ResetLocation(), theTarget.ResetLocation();
+           theSource.NextLocation() && theTarget.NextLocation();)
+        theTarget.FloatValue(theSource.FloatValue());
+}
+
+// Tekee annetuista aika-askeleista uuden datan
+
+static boost::shared_ptr<NFmiQueryData> MakeData(NFmiFastQueryInfo& theInfo,
+                                                 const std::vector<TimeStep>& theSteps)
+{
+  NFmiTimeList times;
+  for (std::vector<TimeStep>::const_iterator it = theSteps.begin(); it != theSteps.end(); ++it)
+    times.Add(new NFmiMetTime(it->time));
+
+  NFmiFastQueryInfo info(theInfo.ParamDescriptor(),
+                         NFmiTimeDescriptor(theInfo.OriginTime(), times),
+                         theInfo.HPlaceDescriptor(),
+                         theInfo.VPlaceDescriptor(),
+                         theInfo.InfoVersion());
+
+  boost::shared_ptr<NFmiQueryData> data(NFmiQueryDataUtil::CreateEmptyData(info));
+  if (data.get() == 0) throw std::runtime_error("Could not allocate memory for result data");
+  return data;
+}
+
+// Laskee yhden aika-askeleen indeksit. Laskenta lukee lhdedatan tiedostosta,
+// joten aika-askel kirjoitetaan ensin vliaikaiseen tiedostoon. Yhden aika-askeleen
+// kirjoitus ja luku on pieni kustannus itse indeksilaskentaan verrattuna, mutta
+// se kuluttaa levytilaa vliaikaishakemistossa. Kirjaston oma rinnakkaistus
+// kielletn, koska aika-askelia lasketaan jo rinnakkain omissa sikeissn.
+
+static boost::shared_ptr<NFmiQueryData> CalculateTimeStep(NFmiQueryData& theData,
+                                                          const TimeStep& theStep,
+                                                          const std::string& theProducerName)
+{
+  NFmiFastQueryInfo source(&theData);
+  boost::shared_ptr<NFmiQueryData> stepdata(MakeData(source, std::vector<TimeStep>(1, theStep)));
+  NFmiFastQueryInfo target(stepdata.get());
+  source.Time(theStep.time);
+  target.FirstTime();
+  CopyTimeStep(source, target);
+
+  boost::filesystem::path tmpfile =
+      boost::filesystem::temp_directory_path() /
+      boost::filesystem::unique_path("qdsoundingindex-%%%%-%%%%-%%%%-%%%%.sqd");
+
+  boost::shared_ptr<NFmiQueryData> result;
+  try
+  {
+    stepdata->Write(tmpfile.string());
+    stepdata.reset();
+    result = NFmiSoundingIndexCalculator::CreateNewSoundingIndexData(
+        tmpfile.string(), theProducerName, false, 0, true);
+  }
+  catch (...)
+  {
+    boost::system::error_code ec;
+    boost::filesystem::remove(tmpfile, ec);
+    throw;
+  }
+  boost::system::error_code ec;
+  boost::filesystem::remove(tmpfile, ec);
+
+  if (!result) throw std::runtime_error("Sounding index calculation failed");
+  return result;
+}
+
+// Laskee yhden aika-askeleen ja raportoi sen keston
+
+static void CalculateJob(NFmiQueryData* theData,
+                         const std::string* theProducerName,
+                         std::vector<TimeStep>* theSteps,
+                         ParallelJobs* theParallel,
+                         unsigned int theThread,
+                         std::size_t theStep)
+{
+  TimeStep& step = (*theSteps)[theStep];
+  NFmiMilliSecondTimer timer;
+  timer.StartTimer();
+  step.result = CalculateTimeStep(*theData, step, *theProducerName);
+  timer.StopTimer();
+
+  const unsigned long points = NFmiFastQueryInfo(theData).SizeLocations();
+  const double seconds = std::max(0.001, timer.TimeDiffInMSeconds() / 1000.0);
+
+  boost::mutex::scoped_lock lock(theParallel->mutex());
+  std::cerr << "time step " << step.time.ToStr(kYYYYMMDDHHMM).CharPtr() << " (" << theStep + 1
+            << "/" << theSteps->size() << ") lasted " << timer.EasyTimeDiffStr() << ", "
+            << static_cast<long>(points / seconds) << " points/s" << std::endl;
+}
+
+// Laskee indeksit aika-askel kerrallaan annetulla mrll sikeit
+
+static boost::shared_ptr<NFmiQueryData> CalculateTimeSteps(const std::string& theFile,
+                                                           const std::string& theProducerName,
+                                                           const std::string& theTimes,
+                                                           unsigned int theThreads)
+{
+  NFmiQueryData data(theFile);
+  NFmiFastQueryInfo info(&data);
+
+  std::vector<TimeStep> steps = SelectTimes(info, theTimes);
+  if (steps.empty()) throw std::runtime_error("No time steps to calculate");
+
+  ParallelJobs parallel(steps.size(), theThreads);
+
+  std::cerr << "calculating " << steps.size() << " time steps of " << info.SizeLocations()
+            << " points using " << parallel.threads() << " threads" << std::endl;
+
+  parallel.run(boost::bind(CalculateJob, &data, &theProducerName, &steps, &parallel, _1, _2));
+
+  // Yhdistetn aika-askelten tulokset
+
+  NFmiFastQueryInfo first(steps[0].result.get());
+  boost::shared_ptr<NFmiQueryData> result = MakeData(first, steps);
+  NFmiFastQueryInfo target(result.get());
+
+  for (std::vector<TimeStep>::iterator it = steps.begin(); it != steps.end(); ++it)
+  {
+    NFmiFastQueryInfo source(it->result.get());
+    source.FirstTime();
+    target.Time(it->time);
+    CopyTimeStep(source, target);
+    it->result.reset();
+  }
+
+  return result;
+}
+
 static void run(int argc, const char* argv[])
 {
-  NFmiCmdLine cmdLine(argc, argv, "n!");
+  NFmiCmdLine cmdLine(argc, argv, "n!j!t!");
   if (cmdLine.NumberofParameters() < 2)
   {
     Usage(argv[0]);
@@ -40,12 +244,23 @@ static void run(int argc, const char* argv[])
   std::string producerName;
   if (cmdLine.isOption('n')) producerName = cmdLine.OptionValue('n');
 
+  unsigned int threads = 0;
+  if (cmdLine.isOption('j'))
+    threads = NFmiStringTools::Convert<unsigned int>(cmdLine.OptionValue('j'));
+
+  std::string times;
+  if (cmdLine.isOption('t')) times = cmdLine.OptionValue('t');
+
   std::cerr << "starting the " << argv[0] << " execution" << std::endl;
 
   NFmiMilliSecondTimer debugTimer;
   debugTimer.StartTimer();
-  boost::shared_ptr<NFmiQueryData> data =
-      NFmiSoundingIndexCalculator::CreateNewSoundingIndexData(fileIn, producerName, true, 0, false);
+  boost::shared_ptr<NFmiQueryData> data;
+  if (cmdLine.isOption('t'))
+    data = CalculateTimeSteps(fileIn, producerName, times, threads);
+  else
+    data = NFmiSoundingIndexCalculator::CreateNewSoundingIndexData(
+        fileIn, producerName, true, 0, false, threads);
   debugTimer.StopTimer();
 
   std::string debugStr("Making ");
@@ -54,6 +269,12 @@ static void run(int argc, const char* argv[])
   debugStr += debugTimer.EasyTimeDiffStr();
   std::cerr << debugStr << std::endl;
 
+  NFmiFastQueryInfo info(data.get());
+  const double points = static_cast<double>(info.SizeLocations()) * info.SizeTimes();
+  const double seconds = std::max(0.001, debugTimer.TimeDiffInMSeconds() / 1000.0);
+  std::cerr << "calculated " << static_cast<long>(points / seconds) << " points/s, "
+            << seconds / info.SizeTimes() << " s per time step" << std::endl;
+
   data->Write(fileOut);
   std::cerr << "stored data to file: " << fileOut << std::endl;
 }
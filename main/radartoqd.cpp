@@ -35,6 +35,9 @@
 
 #include <fstream>
 #include <limits>
+#include <list>
+#include <map>
+#include <set>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -147,8 +150,8 @@ struct img_t
   boost::optional<varfl> clear_air_attenuation_correction;
   boost::optional<varfl> precipitation_attenuation_correction;
 
-  // Parsed image data
-  unsigned short *data;
+  // Parsed image data, allocated by libbufr
+  boost::shared_ptr<unsigned short> data;
 };
 
 /* Projection information */
@@ -178,14 +181,21 @@ struct radar_data_t
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Global instance of the structure
+ * \brief The structure being filled by the BUFR callback
  *
- * The decoder uses a call back technique which is easiest to implement
- * using a global. Using boost::bind would be an alternative.
+ * The libbufr callback has no user data argument, hence the structure
+ * of the file being decoded must be made available through a global.
+ * libbufr itself keeps its state in globals too, so files must be
+ * decoded one at a time.
  */
 // ----------------------------------------------------------------------
 
-radar_data_t radar_data;
+radar_data_t *current_radar_data = NULL;
+
+// Sequence state of the callback
+
+int in_seq = 0;       /* flag to indicate sequences */
+int first_in_seq = 0; /* flag to indicate first element in sequence */
 
 // ----------------------------------------------------------------------
 /*!
@@ -282,9 +292,8 @@ std::string projection_type(const boost::optional<int> type)
  */
 // ----------------------------------------------------------------------
 
-void print_metadata()
+void print_metadata(const radar_data_t &b)
 {
-  const radar_data_t &b = radar_data;
   const proj_t &p = b.proj;
   const meta_t &m = b.meta;
   const img_t &i = b.img;
@@ -371,6 +380,7 @@ struct Options
   bool allow_overflow;       // --allow-overflow
   std::string tabdir;        // -t --tables
   std::string infile;        // -i --infile
+  std::vector<std::string> infiles;  // --infiles
   std::string outfile;       // -o --outfile
   std::string parameter;     // -p --param
   std::string projection;    // -P --projection
@@ -393,6 +403,7 @@ Options::Options()
       allow_overflow(false),
       tabdir(default_tabdir),
       infile("-"),
+      infiles(),
       outfile("-"),
       parameter(),
       projection(),
@@ -427,6 +438,9 @@ bool parse_options(int argc, char *argv[], Options &options)
       "allow overflow in packed intensities")(
       "tabdir,t", po::value(&options.tabdir), tab_msg.c_str())(
       "infile,i", po::value(&options.infile), "input BUFR file")(
+      "infiles",
+      po::value(&options.infiles)->multitoken(),
+      "input BUFR files to be combined into one time series, later files win on equal times")(
       "outfile,o", po::value(&options.outfile), "output querydata file")(
       "param", po::value(&options.parameter), "parameter name for output")(
       "projection,P", po::value(&options.projection), "output projection")(
@@ -451,21 +465,30 @@ bool parse_options(int argc, char *argv[], Options &options)
   if (opt.count("help"))
   {
     std::cout << "Usage: radartoqd [options] infile outfile" << std::endl
+              << "       radartoqd [options] --infiles infile1 infile2 ... -o outfile" << std::endl
               << std::endl
               << "Converts Opera BUFR radar data to querydata." << std::endl
               << std::endl
+              << "If several input files have the same valid time, the data of the" << std::endl
+              << "last one on the command line is used." << std::endl
+              << std::endl
               << desc << std::endl
               << std::endl;
     return false;
   }
 
-  if (opt.count("infile") == 0)
+  if (opt.count("infile") == 0 && options.infiles.empty())
     throw std::runtime_error("Expecting input BUFR file as parameter 1");
 
   if (opt.count("outfile") == 0) throw std::runtime_error("Expecting output file as parameter 2");
 
-  if (!fs::exists(options.infile))
-    throw std::runtime_error("Input BUFR '" + options.infile + "' does not exist");
+  if (opt.count("infile") != 0) options.infiles.insert(options.infiles.begin(), options.infile);
+
+  BOOST_FOREACH (const std::string &infile, options.infiles)
+  {
+    if (!fs::exists(infile))
+      throw std::runtime_error("Input BUFR '" + infile + "' does not exist");
+  }
 
   // Handle the alternative ways to define the producer
 
@@ -530,8 +553,7 @@ void byteswap64(unsigned char *buf, int n)
 
 static int bufr_callback(varfl val, int ind)
 {
-  static int in_seq = 0;   /* flag to indicate sequences */
-  static int first_in_seq; /* flag to indicate first element in sequence */
+  radar_data_t &radar_data = *current_radar_data;
 
   std::string imgfile = "bufr_image";
 
@@ -776,12 +798,14 @@ static int bufr_callback(varfl val, int ind)
       // Decode vals to our output array
       int nvals, nrows, ncols;
 
-      if (!rldec_to_mem(vals->vals, &(radar_data.img.data), &nvals, &nrows, &ncols))
+      unsigned short *image = NULL;
+      if (!rldec_to_mem(vals->vals, &image, &nvals, &nrows, &ncols))
       {
         bufr_close_val_array();
         fprintf(stderr, "Error during runlength-decompression.\n");
         return 0;
       }
+      radar_data.img.data.reset(image, free);
 
       if (options.debug)
         std::cerr << " image of size " << nrows << 'x' << ncols << " from " << nvals << " values\n";
@@ -816,21 +840,21 @@ static int bufr_callback(varfl val, int ind)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Read the BUFR data into the global radar_data structure
+ * \brief Read the BUFR data into the given radar_data structure
  */
 // ----------------------------------------------------------------------
 
-void read_bufr()
+void read_bufr(const std::string &infile, radar_data_t &radar_data)
 {
   // Read the BUFR message.
 
   bufr_t bufr_msg;
   memset(&bufr_msg, 0, sizeof(bufr_t));
 
-  if (!bufr_read_file(&bufr_msg, options.infile.c_str()))
+  if (!bufr_read_file(&bufr_msg, infile.c_str()))
   {
     bufr_free_data(&bufr_msg);
-    throw std::runtime_error("Failed to read BUFR message from '" + options.infile + "'");
+    throw std::runtime_error("Failed to read BUFR message from '" + infile + "'");
   }
 
   // Decode section 1
@@ -840,7 +864,7 @@ void read_bufr()
   if (!bufr_decode_sections01(&s1, &bufr_msg))
   {
     bufr_free_data(&bufr_msg);
-    throw std::runtime_error("Failed to decode BUFR section 1 from '" + options.infile + "'");
+    throw std::runtime_error("Failed to decode BUFR section 1 from '" + infile + "'");
   }
 
   // Read descriptor tables
@@ -855,7 +879,10 @@ void read_bufr()
 
   // Decode data descriptor and data section into a radar data structure
 
-  memset(&radar_data, 0, sizeof(radar_data_t));
+  radar_data = radar_data_t();
+  current_radar_data = &radar_data;
+  in_seq = 0;
+  first_in_seq = 0;
 
   // Open bitstreams for section 3 and 4
 
@@ -891,6 +918,7 @@ void read_bufr()
 
   bufr_free_data(&bufr_msg);
   free_descs();
+  current_radar_data = NULL;
 }
 
 // ----------------------------------------------------------------------
@@ -902,7 +930,7 @@ void read_bufr()
  */
 // ----------------------------------------------------------------------
 
-NFmiParamDescriptor create_pdesc()
+NFmiParamDescriptor create_pdesc(const radar_data_t &radar_data)
 {
   NFmiParamBag pbag;
 
@@ -945,7 +973,7 @@ NFmiParamDescriptor create_pdesc()
  */
 // ----------------------------------------------------------------------
 
-NFmiVPlaceDescriptor create_vdesc()
+NFmiVPlaceDescriptor create_vdesc(const radar_data_t &radar_data)
 {
   if (!radar_data.img.heights.empty())
     throw std::runtime_error("Heights list is not empty: this format is not supported yet");
@@ -962,7 +990,7 @@ NFmiVPlaceDescriptor create_vdesc()
  */
 // ----------------------------------------------------------------------
 
-NFmiHPlaceDescriptor create_hdesc()
+NFmiHPlaceDescriptor create_hdesc(const radar_data_t &radar_data)
 {
   if (!radar_data.proj.type) throw std::runtime_error("Projection type not set in BUFR");
 
@@ -1050,7 +1078,7 @@ NFmiHPlaceDescriptor create_hdesc()
  */
 // ----------------------------------------------------------------------
 
-NFmiTimeDescriptor create_tdesc()
+NFmiTimeDescriptor create_tdesc(const radar_data_t &radar_data)
 {
   if (!radar_data.meta.year) throw std::runtime_error("Year has not been set in the BUFR metadata");
   if (!radar_data.meta.month)
@@ -1075,73 +1103,101 @@ NFmiTimeDescriptor create_tdesc()
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Decode a BUFR bitmap value
+ * \brief Decoding table for BUFR bitmap values
+ *
+ * Values at or above the overflow limit are beyond the end of the legend.
+ * With --allow-overflow their table value is the last legend value.
  */
 // ----------------------------------------------------------------------
 
-float decode_value(unsigned short value)
+struct decode_table_t
 {
-  float ret = kFloatMissing;
+  std::vector<float> values;
+  unsigned int overflow;
+  std::size_t legendsize;
+};
 
-  if (value == std::numeric_limits<unsigned short>::max())
-    ;
+// ----------------------------------------------------------------------
+/*!
+ * \brief Build the decoding table for all possible bitmap values
+ */
+// ----------------------------------------------------------------------
+
+decode_table_t create_decode_table(const radar_data_t &radar_data)
+{
+  const unsigned int n = std::numeric_limits<unsigned short>::max() + 1;
+
+  decode_table_t table;
+  table.values.resize(n, kFloatMissing);
+  table.overflow = n;
+  table.legendsize = 0;
 
-  else if (!!radar_data.img.scale.offset && !!radar_data.img.scale.increment)
-    ret = *radar_data.img.scale.offset + value * *radar_data.img.scale.increment;
+  // The largest value is always missing
 
-  else if (!radar_data.img.scale.dbz_values.empty())
+  if (!!radar_data.img.scale.offset && !!radar_data.img.scale.increment)
   {
-    auto n = radar_data.img.scale.dbz_values.size();
-
-    if (value == 0)
-      ret = -32;
-    else if (static_cast<size_t>(value - 1) < n)
-      ret = radar_data.img.scale.dbz_values[value - 1];
-    else if (!options.allow_overflow)
-      throw std::runtime_error("Overflow index " + boost::lexical_cast<std::string>(value) +
-                               ", size of legend is " + boost::lexical_cast<std::string>(n));
-    else
-    {
-      ret = radar_data.img.scale.dbz_values[n - 1];
-      if (!options.quiet)
-        std::cerr << "Warning: Overflow index " << value << ", size of legend is only " << n
-                  << std::endl;
-    }
+    for (unsigned int value = 0; value < n - 1; value++)
+      table.values[value] = *radar_data.img.scale.offset + value * *radar_data.img.scale.increment;
+    return table;
+  }
+
+  const std::vector<varfl> *legend = NULL;
+
+  if (!radar_data.img.scale.dbz_values.empty())
+  {
+    legend = &radar_data.img.scale.dbz_values;
+    table.values[0] = -32;
   }
   else if (!radar_data.img.scale.intensity_values.empty())
   {
-    auto n = radar_data.img.scale.intensity_values.size();
-
-    if (value == 0)
-      ret = 0;
-    else if (static_cast<size_t>(value - 1) < n)
-      ret = radar_data.img.scale.intensity_values[value - 1];
-    else if (!options.allow_overflow)
-      throw std::runtime_error("Overflow index " + boost::lexical_cast<std::string>(value) +
-                               ", size of legend is " + boost::lexical_cast<std::string>(n));
-    else
-    {
-      ret = radar_data.img.scale.intensity_values[n - 1];
-      if (!options.quiet)
-        std::cerr << "Warning: Overflow index " << value << ", size of legend is only " << n
-                  << std::endl;
-    }
+    legend = &radar_data.img.scale.intensity_values;
+    table.values[0] = 0;
   }
   else
     throw std::runtime_error("No known method for decoding the bitmap values has been set");
 
-  return ret;
+  table.legendsize = legend->size();
+  table.overflow = std::min(n - 1, static_cast<unsigned int>(legend->size() + 1));
+
+  for (unsigned int value = 1; value < n - 1; value++)
+  {
+    if (value < table.overflow)
+      table.values[value] = (*legend)[value - 1];
+    else
+      table.values[value] = legend->back();
+  }
+
+  return table;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle a bitmap value beyond the end of the legend
+ */
+// ----------------------------------------------------------------------
+
+void handle_overflow(unsigned short value, const decode_table_t &table)
+{
+  if (value == std::numeric_limits<unsigned short>::max()) return;
+
+  if (!options.allow_overflow)
+    throw std::runtime_error("Overflow index " + boost::lexical_cast<std::string>(value) +
+                             ", size of legend is " +
+                             boost::lexical_cast<std::string>(table.legendsize));
+  if (!options.quiet)
+    std::cerr << "Warning: Overflow index " << value << ", size of legend is only "
+              << table.legendsize << std::endl;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Copy the raw data into the querydata
+ * \brief Copy the raw data into the active time of the querydata
  */
 // ----------------------------------------------------------------------
 
-void copy_data(NFmiFastQueryInfo &info)
+void copy_data(const radar_data_t &radar_data, NFmiFastQueryInfo &info)
 {
-  if (radar_data.img.data == NULL) throw std::runtime_error("No radar data found from the image");
+  if (!radar_data.img.data) throw std::runtime_error("No radar data found from the image");
 
   // Horizontal descriptor has been made so this is safe
 
@@ -1153,16 +1209,23 @@ void copy_data(NFmiFastQueryInfo &info)
   if (radar_data.img.ns_organisation) throw std::runtime_error("North-South view not supported");
   if (radar_data.img.ew_organisation) throw std::runtime_error("East-West view not supported");
 
-  info.First();
-  long pos = 0;
-  for (info.ResetLocation(); info.NextLocation();)
+  const decode_table_t table = create_decode_table(radar_data);
+
+  info.FirstParam();
+  info.FirstLevel();
+  info.ResetLocation();
+
+  for (int j = 0; j < ny; j++)
   {
-    int j = pos / nx;
-    int i = pos % nx;
-    float value =
-        decode_value(radar_data.img.data[i + (ny - j - 1) * nx]);  // flip data in Y-direction
-    info.FloatValue(value);
-    ++pos;
+    // flip data in Y-direction
+    const unsigned short *row = radar_data.img.data.get() + (ny - j - 1) * nx;
+    for (int i = 0; i < nx; i++)
+    {
+      const unsigned short value = row[i];
+      if (value >= table.overflow) handle_overflow(value, table);
+      info.NextLocation();
+      info.FloatValue(table.values[value]);
+    }
   }
 }
 
@@ -1174,7 +1237,7 @@ void copy_data(NFmiFastQueryInfo &info)
  */
 // ----------------------------------------------------------------------
 
-void check_corners()
+void check_corners(radar_data_t &radar_data)
 {
   if (radar_data.img.se.lon && radar_data.img.sw.lon)
   {
@@ -1200,9 +1263,37 @@ void check_corners()
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Create querydata from the input BUFR
+ * \brief Merge the valid times of all input files
+ *
+ * The latest time is used as the origin time.
+ */
+// ----------------------------------------------------------------------
+
+NFmiTimeDescriptor create_tdesc(const std::list<radar_data_t> &radar_datas)
+{
+  std::set<NFmiMetTime> times;
+
+  BOOST_FOREACH (const radar_data_t &radar_data, radar_datas)
+  {
+    NFmiTimeDescriptor tdesc = create_tdesc(radar_data);
+    times.insert(tdesc.OriginTime());
+  }
+
+  NFmiTimeList tlist;
+  BOOST_FOREACH (const NFmiMetTime &t, times)
+    tlist.Add(new NFmiMetTime(t));
+
+  return NFmiTimeDescriptor(*times.rbegin(), tlist);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Create querydata from the input BUFRs
  *
- *  See Opera sample apisample.c in libbufr for original sample code
+ *  See Opera sample apisample.c in libbufr for original sample code.
+ *  All files must have the same parameter and grid, their times are
+ *  combined into one time series. If several files have the same
+ *  time, a warning is printed and the last file wins.
  */
 // ----------------------------------------------------------------------
 
@@ -1216,22 +1307,42 @@ boost::shared_ptr<NFmiQueryData> make_querydata()
 
   // Parse the BUFR data
 
-  read_bufr();
+  std::list<radar_data_t> radar_datas;
+
+  BOOST_FOREACH (const std::string &infile, options.infiles)
+  {
+    radar_datas.push_back(radar_data_t());
+    radar_data_t &radar_data = radar_datas.back();
+
+    read_bufr(infile, radar_data);
 
-  // Check corners
+    // Check corners
 
-  check_corners();
+    check_corners(radar_data);
 
-  // Print metadata
+    // Print metadata
 
-  if (options.debug || options.verbose) print_metadata();
+    if (options.debug || options.verbose) print_metadata(radar_data);
+  }
 
   // Build descriptors from parsed BUFR
 
-  NFmiParamDescriptor pdesc = create_pdesc();
-  NFmiVPlaceDescriptor vdesc = create_vdesc();
-  NFmiTimeDescriptor tdesc = create_tdesc();
-  NFmiHPlaceDescriptor hdesc = create_hdesc();
+  const radar_data_t &first = radar_datas.front();
+
+  NFmiParamDescriptor pdesc = create_pdesc(first);
+  NFmiVPlaceDescriptor vdesc = create_vdesc(first);
+  NFmiTimeDescriptor tdesc = create_tdesc(radar_datas);
+  NFmiHPlaceDescriptor hdesc = create_hdesc(first);
+
+  std::list<radar_data_t>::const_iterator it = radar_datas.begin();
+  std::vector<std::string>::const_iterator name = options.infiles.begin();
+  for (++it, ++name; it != radar_datas.end(); ++it, ++name)
+  {
+    if (!(create_pdesc(*it) == pdesc) || !(create_hdesc(*it) == hdesc))
+      throw std::runtime_error("Parameter or grid of '" + *name + "' differs from that of '" +
+                               options.infiles.front() + "'");
+    create_vdesc(*it);
+  }
 
   // Initialize output data
 
@@ -1242,9 +1353,30 @@ boost::shared_ptr<NFmiQueryData> make_querydata()
   NFmiFastQueryInfo info(qd.get());
   info.SetProducer(NFmiProducer(options.producernumber, options.producername));
 
-  // Copy the raw data
+  // Copy the raw data, later files overwrite earlier ones
 
-  copy_data(info);
+  std::map<NFmiMetTime, std::string> copied;
+
+  name = options.infiles.begin();
+  for (it = radar_datas.begin(); it != radar_datas.end(); ++it, ++name)
+  {
+    const NFmiMetTime t = create_tdesc(*it).OriginTime();
+    if (!info.Time(t))
+      throw std::runtime_error("Failed to activate correct valid time in output querydata");
+
+    std::map<NFmiMetTime, std::string>::iterator old = copied.find(t);
+    if (old == copied.end())
+      copied.insert(std::make_pair(t, *name));
+    else
+    {
+      if (!options.quiet)
+        std::cerr << "Warning: valid time " << t.ToStr(kYYYYMMDDHHMM).CharPtr() << " of '"
+                  << old->second << "' is replaced by '" << *name << "'" << std::endl;
+      old->second = *name;
+    }
+
+    copy_data(*it, info);
+  }
 
   if (area)
   {
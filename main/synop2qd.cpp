@@ -21,7 +21,14 @@
 #include <smarttools/NFmiAviationStationInfoSystem.h>
 #include <smarttools/NFmiSoundingFunctions.h>
 
+#include "ObservationAppend.h"
+#include "ParallelJobs.h"
+
+#include <boost/bind.hpp>
+
+#include <algorithm>
 #include <fstream>
+#include <list>
 
 using namespace std;
 
@@ -964,6 +971,13 @@ void Usage(void)
        << "\t-v \tVerbose mode, reports more about errors encountered." << endl
        << "\t-S \tUse this to convert SHIP-messages to qd (not with B-option)." << endl
        << "\t-B \tUse this to convert BUOY-messages to qd (not with S-option)." << endl
+       << "\t-a <previous.sqd>\tAppend mode: merge new messages into the previous output." << endl
+       << "\t\tWrite the output to a new file and rename it over the previous one." << endl
+       << "\t-m <manifest>\tFile listing already consumed input files, only new files are read."
+       << endl
+       << "\t-w <hours>\tLength of the time window kept in append mode, default 48." << endl
+       << "\t-j <threads>\tNumber of threads used to decode bulletins, default 1, 0 = all cores."
+       << endl
        << endl
        << "Note: qdconversion comes with a SYNOP stations file stored in" << endl
        << endl
@@ -1556,15 +1570,29 @@ static bool GetPossibleNextSynopBlockInfo(const std::string &synopFileBlockStr,
   return false;
 }
 
-void FillSynopCodeDataVectorFromSYNOPStr(std::vector<NFmiSynopCode> &theSynopCodeVector,
-                                         const std::string &theSYNOPStr,
-                                         NFmiAviationStationInfoSystem &theAviStations,
-                                         bool fRoundTimesToNearestSynopticTimes,
-                                         bool verbose,
-                                         bool fDoShipMessages,
-                                         bool fDoBuoyMessages,
-                                         std::set<unsigned long> &theUnknownWmoIdsInOut,
-                                         const std::string &theFileName)
+// Yksi AAXX/BBXX/ZZYY-sanalla alkava bulletiini-lohko ja sen tiedosto.
+struct SynopBlock
+{
+  std::string block;
+  bool usePossibleSynopTime;
+  bool firstInFile;
+  const std::string *fileName;
+};
+
+// Yhden lohkon purkutulos, lohkot puretaan rinnakkain omiin tuloksiinsa.
+struct SynopBlockResult
+{
+  std::vector<NFmiSynopCode> synops;
+  std::set<unsigned long> unknownWmoIds;
+  bool ok;
+};
+
+// Jaetaan tiedoston sislt lohkoihin yhdell lpikynnill.
+static void SplitSynopBlocks(const std::string &theSYNOPStr,
+                             bool fDoShipMessages,
+                             bool fDoBuoyMessages,
+                             const std::string &theFileName,
+                             std::vector<SynopBlock> &theBlocks)
 {
   // AAXX = maa havainto ja BBXX = poiju/laiva, jotka skipataan tss vaiheessa
   string codeStr = fDoShipMessages ? "BBXX" : "AAXX";
@@ -1583,65 +1611,172 @@ void FillSynopCodeDataVectorFromSYNOPStr(std::vector<NFmiSynopCode> &theSynopCod
     if (aaCodeBlocks.size() <= 1) return;
   }
 
-  NFmiMetTime possibleSynoptime = NFmiMetTime::gMissingTime;
-  std::string possibleCorrectionField;
-  for (int j = 0; j < static_cast<int>(aaCodeBlocks.size());
+  for (size_t j = 0; j < aaCodeBlocks.size();
        j++)  // Huom! 1. stringi ei oteta, koska se on turha headeri osa
   {
+    SynopBlock synopBlock;
     string usedSynopBlock = aaCodeBlocks[j];
     usedSynopBlock = NFmiStringTools::TrimL(usedSynopBlock);
-    bool usePossibleSynopTime = false;
+    synopBlock.usePossibleSynopTime = false;
     if (usedSynopBlock.size() > 1 && (usedSynopBlock[0] == '\r' || usedSynopBlock[0] == '\n'))
-      usePossibleSynopTime = true;
-    usedSynopBlock =
+      synopBlock.usePossibleSynopTime = true;
+    synopBlock.block =
         ::TrimFromExtraSpaces(usedSynopBlock);  // pit trimmata alku ja loppu spaceista, muuten
                                                 // aika stringin sijainti laskut voivat menn
                                                 // pieleen, kun reallyUsedSynopBlock-stringi
                                                 // lasketaan
-    const size_t kMaxErrorStrSize = 100;  // tmn verran laitetaan synop-blockin alusta cerr:iin
-    try
+    synopBlock.firstInFile = (j == 0);
+    synopBlock.fileName = &theFileName;
+    theBlocks.push_back(synopBlock);
+  }
+}
+
+// Puretaan yksi lohko, palauttaa false jos lohkon ksittely keskeytyi virheeseen.
+static bool ParseSynopBlock(const SynopBlock &theBlock,
+                            NFmiAviationStationInfoSystem &theAviStations,
+                            bool fRoundTimesToNearestSynopticTimes,
+                            bool verbose,
+                            bool fDoShipMessages,
+                            bool fDoBuoyMessages,
+                            const NFmiMetTime &thePossibleSynoptime,
+                            const std::string &thePossibleCorrectionField,
+                            SynopBlockResult &theResult)
+{
+  const size_t kMaxErrorStrSize = 100;  // tmn verran laitetaan synop-blockin alusta cerr:iin
+  try
+  {
+    ::MakeSynopCodeDataFromSYNOPStr(theBlock.block,
+                                    theAviStations,
+                                    fRoundTimesToNearestSynopticTimes,
+                                    verbose,
+                                    fDoShipMessages,
+                                    fDoBuoyMessages,
+                                    theResult.synops,
+                                    theResult.unknownWmoIds,
+                                    theBlock.usePossibleSynopTime,
+                                    thePossibleSynoptime,
+                                    thePossibleCorrectionField);
+    return true;
+  }
+  catch (std::exception &e)
+  {
+    if (verbose)
     {
-      size_t oldSynopCodeVecSize = theSynopCodeVector.size();
-      ::MakeSynopCodeDataFromSYNOPStr(usedSynopBlock,
-                                      theAviStations,
-                                      fRoundTimesToNearestSynopticTimes,
-                                      verbose,
-                                      fDoShipMessages,
-                                      fDoBuoyMessages,
-                                      theSynopCodeVector,
-                                      theUnknownWmoIdsInOut,
-                                      usePossibleSynopTime,
-                                      possibleSynoptime,
-                                      possibleCorrectionField);
-      if (oldSynopCodeVecSize == theSynopCodeVector.size())
-      {
-        if (::GetPossibleNextSynopBlockInfo(
-                usedSynopBlock, possibleSynoptime, possibleCorrectionField))
-          continue;  // otetaan talteen mahdollinen synop-aika seuraavaa blokkia varten
-      }
+      std::string startOfBlock = ::GetMaxNCharsFromStart(theBlock.block, kMaxErrorStrSize);
+      cerr << std::string(e.what()) +
+                  "\nin current synop-block (showing 100 chars from start), continuing...\n" +
+                  startOfBlock
+           << "\nIn file: " << *theBlock.fileName << endl;
     }
-    catch (std::exception &e)
+  }
+  catch (...)
+  {
+    if (verbose)
     {
-      if (verbose)
-      {
-        std::string startOfBlock = ::GetMaxNCharsFromStart(usedSynopBlock, kMaxErrorStrSize);
-        cerr << std::string(e.what()) +
-                    "\nin current synop-block (showing 100 chars from start), continuing...\n" +
-                    startOfBlock
-             << "\nIn file: " << theFileName << endl;
-      }
+      std::string startOfBlock = ::GetMaxNCharsFromStart(theBlock.block, kMaxErrorStrSize);
+      cerr << std::string(
+                  "Unknown error in current synop block (showing 100 chars from start), "
+                  "continuing anyway...\n") +
+                  startOfBlock
+           << "\nIn file: " << *theBlock.fileName << endl;
     }
-    catch (...)
+  }
+  return false;
+}
+
+// Puretaan yksi lohko ilman edellisest lohkosta mahdollisesti saatavaa aikaa.
+static void ParseSynopBlockJob(const std::vector<SynopBlock> *theBlocks,
+                               std::vector<SynopBlockResult> *theResults,
+                               NFmiAviationStationInfoSystem *theAviStations,
+                               bool fRoundTimesToNearestSynopticTimes,
+                               bool verbose,
+                               bool fDoShipMessages,
+                               bool fDoBuoyMessages,
+                               unsigned int theThread,
+                               size_t theBlock)
+{
+  const std::string noCorrectionField;
+  SynopBlockResult &result = (*theResults)[theBlock];
+  result.ok = ::ParseSynopBlock((*theBlocks)[theBlock],
+                                *theAviStations,
+                                fRoundTimesToNearestSynopticTimes,
+                                verbose,
+                                fDoShipMessages,
+                                fDoBuoyMessages,
+                                NFmiMetTime::gMissingTime,
+                                noCorrectionField,
+                                result);
+}
+
+// Puretaan lohkot rinnakkain ja yhdistetn tulokset alkuperisess jrjestyksess.
+// Koska synop ja muut blokit on jaettu lohkoihin AAXX, BBXX ja ZZXX sanojen mukaan,
+// edellisen lohkon lopussa voi olla seuraavan lohkon aika ja korjauskentt. Nm selvivt
+// vasta kun edellinen lohko on purettu, joten ne harvat lohkot joihin tieto vaikuttaa
+// puretaan lopuksi uudestaan jrjestyksess.
+void ParseSynopBlocks(const std::vector<SynopBlock> &theBlocks,
+                      std::vector<NFmiSynopCode> &theSynopCodeVector,
+                      NFmiAviationStationInfoSystem &theAviStations,
+                      bool fRoundTimesToNearestSynopticTimes,
+                      bool verbose,
+                      bool fDoShipMessages,
+                      bool fDoBuoyMessages,
+                      std::set<unsigned long> &theUnknownWmoIdsInOut,
+                      unsigned int theThreadCount)
+{
+  std::vector<SynopBlockResult> results(theBlocks.size());
+
+  ParallelJobs parallel(theBlocks.size(), theThreadCount);
+  parallel.run(boost::bind(::ParseSynopBlockJob,
+                           &theBlocks,
+                           &results,
+                           &theAviStations,
+                           fRoundTimesToNearestSynopticTimes,
+                           verbose,
+                           fDoShipMessages,
+                           fDoBuoyMessages,
+                           _1,
+                           _2));
+
+  NFmiMetTime possibleSynoptime = NFmiMetTime::gMissingTime;
+  std::string possibleCorrectionField;
+  for (size_t j = 0; j < theBlocks.size(); j++)
+  {
+    const SynopBlock &synopBlock = theBlocks[j];
+    SynopBlockResult &result = results[j];
+
+    if (synopBlock.firstInFile)
     {
-      if (verbose)
-      {
-        std::string startOfBlock = ::GetMaxNCharsFromStart(usedSynopBlock, kMaxErrorStrSize);
-        cerr << std::string(
-                    "Unknown error in current synop block (showing 100 chars from start), "
-                    "continuing anyway...\n") +
-                    startOfBlock
-             << "\nIn file: " << theFileName << endl;
-      }
+      possibleSynoptime = NFmiMetTime::gMissingTime;
+      possibleCorrectionField.clear();
+    }
+
+    // Edellisen lohkon tiedot vaikuttavat vain aikaan ja korjauskenttn
+    bool dependsOnPrevious =
+        !possibleCorrectionField.empty() ||
+        (synopBlock.usePossibleSynopTime && !fDoBuoyMessages &&
+         possibleSynoptime != NFmiMetTime::gMissingTime);
+    if (dependsOnPrevious)
+    {
+      result = SynopBlockResult();
+      result.ok = ::ParseSynopBlock(synopBlock,
+                                    theAviStations,
+                                    fRoundTimesToNearestSynopticTimes,
+                                    verbose,
+                                    fDoShipMessages,
+                                    fDoBuoyMessages,
+                                    possibleSynoptime,
+                                    possibleCorrectionField,
+                                    result);
+    }
+
+    theSynopCodeVector.insert(theSynopCodeVector.end(), result.synops.begin(), result.synops.end());
+    theUnknownWmoIdsInOut.insert(result.unknownWmoIds.begin(), result.unknownWmoIds.end());
+
+    if (result.ok && result.synops.empty())
+    {
+      if (::GetPossibleNextSynopBlockInfo(
+              synopBlock.block, possibleSynoptime, possibleCorrectionField))
+        continue;  // otetaan talteen mahdollinen synop-aika seuraavaa blokkia varten
     }
     possibleSynoptime = NFmiMetTime::gMissingTime;
     possibleCorrectionField.clear();
@@ -1792,7 +1927,7 @@ void Domain(int argc, const char *argv[])
 {
   NFmiMilliSecondTimer timer;
 
-  NFmiCmdLine cmdline(argc, argv, "s!p!tvSBf");
+  NFmiCmdLine cmdline(argc, argv, "s!p!tvSBfa!m!w!j!");
 
   // Tarkistetaan optioiden oikeus:
 
@@ -1860,6 +1995,24 @@ void Domain(int argc, const char *argv[])
   bool roundTimesToNearestSynopticTimes = false;
   if (cmdline.isOption('t')) roundTimesToNearestSynopticTimes = true;
 
+  std::string previousFile;
+  if (cmdline.isOption('a')) previousFile = cmdline.OptionValue('a');
+
+  std::string manifestFile;
+  if (cmdline.isOption('m')) manifestFile = cmdline.OptionValue('m');
+
+  int windowHours = 48;
+  if (cmdline.isOption('w')) windowHours = NFmiStringTools::Convert<int>(cmdline.OptionValue('w'));
+
+  unsigned int threadCount = 1;
+  if (cmdline.isOption('j'))
+    threadCount = NFmiStringTools::Convert<unsigned int>(cmdline.OptionValue('j'));
+
+  // Jo luetut tiedostot ohitetaan, manifestiin jvt vain viel olemassa olevat tiedostot
+  std::set<std::string> oldConsumedFiles;
+  std::set<std::string> consumedFiles;
+  if (!manifestFile.empty()) oldConsumedFiles = ObservationAppend::ReadManifest(manifestFile);
+
   //	1. Lue n kpl filefiltereit listaan
   vector<string> fileFilterList;
   for (int i = 1; i <= numOfParams; i++)
@@ -1870,6 +2023,8 @@ void Domain(int argc, const char *argv[])
   std::set<unsigned long> unknownWmoIdsInOut;
   bool foundAnyFiles = false;
   std::vector<NFmiSynopCode> synopCodeVector;
+  std::list<std::string> blockFileNames;  // lohkot viittaavat nihin nimiin
+  std::vector<SynopBlock> synopBlocks;
   for (unsigned int j = 0; j < fileFilterList.size(); j++)
   {
     //	2. Hae jokaista filefilteri vastaavat tiedostonimet omaan listaan
@@ -1878,23 +2033,20 @@ void Domain(int argc, const char *argv[])
     list<string> fileList = NFmiFileSystem::PatternFiles(filePatternStr);
     for (list<string>::iterator it = fileList.begin(); it != fileList.end(); ++it)
     {
-      //	3. Lue listan tiedostot vuorollaan sisn ja tulkitse siit sanomat
-      // synopCode-vektoriin
+      //	3. Lue listan tiedostot vuorollaan sisn ja jaa ne bulletiini-lohkoihin
       std::string finalFileName = usedPath + *it;
       foundAnyFiles = true;
+      if (!manifestFile.empty())
+      {
+        consumedFiles.insert(finalFileName);
+        if (oldConsumedFiles.find(finalFileName) != oldConsumedFiles.end()) continue;
+      }
       string synopFileContent;
       if (NFmiFileSystem::ReadFile2String(finalFileName, synopFileContent))
       {
-        string errorStr;
-        ::FillSynopCodeDataVectorFromSYNOPStr(synopCodeVector,
-                                              synopFileContent,
-                                              aviStationInfoSystem,
-                                              roundTimesToNearestSynopticTimes,
-                                              verbose,
-                                              doShipMessages,
-                                              doBuoyMessages,
-                                              unknownWmoIdsInOut,
-                                              *it);
+        blockFileNames.push_back(*it);
+        ::SplitSynopBlocks(
+            synopFileContent, doShipMessages, doBuoyMessages, blockFileNames.back(), synopBlocks);
       }
       else
         cerr << "Warning, couldn't read the file: '" << finalFileName
@@ -1902,7 +2054,18 @@ void Domain(int argc, const char *argv[])
     }
   }
   if (foundAnyFiles == false) throw runtime_error("Error: Didn't find any files to read.");
-  if (synopCodeVector.empty())
+
+  //	4. Tulkitse lohkojen sanomat synopCode-vektoriin
+  ::ParseSynopBlocks(synopBlocks,
+                     synopCodeVector,
+                     aviStationInfoSystem,
+                     roundTimesToNearestSynopticTimes,
+                     verbose,
+                     doShipMessages,
+                     doBuoyMessages,
+                     unknownWmoIdsInOut,
+                     threadCount);
+  if (synopCodeVector.empty() && previousFile.empty())
     throw runtime_error("Error: Couldn't decode any synops from any files.");
   if (verbose && unknownWmoIdsInOut.size() > 0)
   {
@@ -1915,8 +2078,20 @@ void Domain(int argc, const char *argv[])
     cerr << endl;
   }
   //	6. Tee synopCode-vektorista lopullinen data kerralla
-  NFmiQueryData *data = ::MakeQueryDataFromSynopCodeDataVector(
-      synopCodeVector, wantedProducer, doShipMessages, doBuoyMessages);
+  NFmiQueryData *data = 0;
+  if (!synopCodeVector.empty())
+    data = ::MakeQueryDataFromSynopCodeDataVector(
+        synopCodeVector, wantedProducer, doShipMessages, doBuoyMessages);
+
+  // Append modessa uudet havainnot yhdistetn edellisen ajon aikaikkunaan. Uudet arvot
+  // korvaavat vanhat kuten FillData:ssa, laivat tunnistetaan nimest.
+  if (!previousFile.empty())
+  {
+    std::auto_ptr<NFmiQueryData> previousData(ObservationAppend::ReadPreviousData(previousFile));
+    std::auto_ptr<NFmiQueryData> newData(data);
+    data = ObservationAppend::Merge(
+        previousData.get(), newData.get(), windowHours, true, doShipMessages);
+  }
 
   //	7. talleta querydata output:iin
   if (data)
@@ -1924,8 +2099,13 @@ void Domain(int argc, const char *argv[])
     NFmiStreamQueryData sQOutData(data);
     if (!sQOutData.WriteCout())
       throw runtime_error("Error: Couldn't write combined qdata to stdout.");
-    else
-      cerr << "Completing the task, data was created and written to a file (stdout)." << endl;
+
+    // Manifesti kirjoitetaan vasta kun data on varmasti tallessa
+    cout.flush();
+    if (!cout) throw runtime_error("Error: Couldn't write combined qdata to stdout.");
+    cerr << "Completing the task, data was created and written to a file (stdout)." << endl;
+
+    if (!manifestFile.empty()) ObservationAppend::WriteManifest(manifestFile, consumedFiles);
   }
   else
     throw runtime_error("Error CombineQueryDatas: coudn't combine datas.");
@@ -3,7 +3,10 @@
 // lytyvt TEMP-luotaus koodit tulkitaan ja niist muodostetaan
 // querydata, miss on yhdistettyn kaikki tulkitut luotaukset.
 
+#include <algorithm>
 #include <iostream>
+#include <set>
+#include <vector>
 
 #include <newbase/NFmiCmdLine.h>
 #include <newbase/NFmiAreaFactory.h>
@@ -70,31 +73,103 @@ struct PointerDestroyer
   }
 };
 
+// Asemat lajitellaan samalla vertailulla kuin std::set<NFmiStation>:ssa,
+// jolloin niit voidaan hakea puolitushaulla.
+typedef vector<pair<NFmiStation, unsigned long> > StationIndexes;
+
+struct StationIndexLess
+{
+  bool operator()(const StationIndexes::value_type &a, const StationIndexes::value_type &b) const
+  {
+    return a.first < b.first;
+  }
+};
+
+struct StationEquivalent
+{
+  bool operator()(const NFmiStation &a, const NFmiStation &b) const
+  {
+    return !(a < b) && !(b < a);
+  }
+};
+
+// Tehdn kohdedatan asemista hakutaulu asema -> location-indeksi.
+static StationIndexes MakeStationIndexes(NFmiFastQueryInfo &theInfo)
+{
+  StationIndexes stations;
+  for (theInfo.ResetLocation(); theInfo.NextLocation();)
+    stations.push_back(make_pair(*(static_cast<const NFmiStation *>(theInfo.Location())),
+                                 theInfo.LocationIndex()));
+  stable_sort(stations.begin(), stations.end(), StationIndexLess());
+  return stations;
+}
+
+// Lasketaan lhdedatan location-indekseille vastineet kohdedatassa.
+static vector<pair<unsigned long, unsigned long> > MakeLocationIndexes(
+    NFmiFastQueryInfo &theSource, const StationIndexes &theStations)
+{
+  vector<pair<unsigned long, unsigned long> > locations;
+  for (theSource.ResetLocation(); theSource.NextLocation();)
+  {
+    StationIndexes::value_type key(*(static_cast<const NFmiStation *>(theSource.Location())), 0);
+    StationIndexes::const_iterator it =
+        lower_bound(theStations.begin(), theStations.end(), key, StationIndexLess());
+    if (it != theStations.end() && !(key.first < it->first))
+      locations.push_back(make_pair(theSource.LocationIndex(), it->second));
+  }
+  return locations;
+}
+
 static void FillCombinedSoundingData(vector<NFmiQueryData *> &theDataList,
                                      NFmiFastQueryInfo &theInfo)
 {
+  // Asemia ei etsit jokaiselle arvolle erikseen theInfo.Location:illa (lineaarinen haku),
+  // vaan jokaiselle lhdedatalle lasketaan kerran param-, aika- ja asemaindeksien vastineet.
+  StationIndexes stations = ::MakeStationIndexes(theInfo);
+
   for (unsigned int i = 0; i < theDataList.size(); i++)
   {
     NFmiFastQueryInfo sourceInfo(theDataList[i]);
+
+    vector<pair<unsigned long, unsigned long> > params;
+    for (sourceInfo.ResetParam(); sourceInfo.NextParam();)
+    {
+      if (theInfo.Param(*(sourceInfo.Param().GetParam())))
+        params.push_back(make_pair(sourceInfo.ParamIndex(), theInfo.ParamIndex()));
+    }
+
+    vector<pair<unsigned long, unsigned long> > times;
     for (sourceInfo.ResetTime(); sourceInfo.NextTime();)
     {
       if (theInfo.Time(sourceInfo.Time()))
+        times.push_back(make_pair(sourceInfo.TimeIndex(), theInfo.TimeIndex()));
+    }
+
+    vector<pair<unsigned long, unsigned long> > locations =
+        ::MakeLocationIndexes(sourceInfo, stations);
+
+    // Levelit vastaavat toisiaan jrjestyksess
+    unsigned long levelCount = min(sourceInfo.SizeLevels(), theInfo.SizeLevels());
+
+    // Kopioidaan datan tallennusjrjestyksess (param, location, level, time),
+    // jolloin kunkin aseman luotauksen levelit ja ajat kydn lpi yhtenisen lohkona.
+    for (size_t p = 0; p < params.size(); p++)
+    {
+      sourceInfo.ParamIndex(params[p].first);
+      theInfo.ParamIndex(params[p].second);
+      for (size_t l = 0; l < locations.size(); l++)
       {
-        for (sourceInfo.ResetParam(); sourceInfo.NextParam();)
+        sourceInfo.LocationIndex(locations[l].first);
+        theInfo.LocationIndex(locations[l].second);
+        for (unsigned long lev = 0; lev < levelCount; lev++)
         {
-          if (theInfo.Param(*(sourceInfo.Param().GetParam())))
+          sourceInfo.LevelIndex(lev);
+          theInfo.LevelIndex(lev);
+          for (size_t t = 0; t < times.size(); t++)
           {
-            for (sourceInfo.ResetLevel(), theInfo.ResetLevel();
-                 sourceInfo.NextLevel() && theInfo.NextLevel();)
-            {
-              for (sourceInfo.ResetLocation(); sourceInfo.NextLocation();)
-              {
-                if (theInfo.Location(*sourceInfo.Location()))
-                {
-                  theInfo.FloatValue(sourceInfo.FloatValue());
-                }
-              }
-            }
+            sourceInfo.TimeIndex(times[t].first);
+            theInfo.TimeIndex(times[t].second);
+            theInfo.FloatValue(sourceInfo.FloatValue());
           }
         }
       }
@@ -111,7 +186,7 @@ static NFmiQueryInfo MakeCombinedInnerInfo(vector<NFmiQueryData *> &theDataList,
   if (theDataList.size() == 1) return *(theDataList[0]->Info());
 
   set<NFmiMetTime> allTimes;
-  set<NFmiStation> allStations;
+  vector<NFmiStation> allStations;
   unsigned int maxLevelSize = 0;
 
   const NFmiVPlaceDescriptor *maxLevelVPlaceDesc =
@@ -125,7 +200,7 @@ static NFmiQueryInfo MakeCombinedInnerInfo(vector<NFmiQueryData *> &theDataList,
     for (info.ResetTime(); info.NextTime();)
       allTimes.insert(info.Time());
     for (info.ResetLocation(); info.NextLocation();)
-      allStations.insert(*(static_cast<const NFmiStation *>(info.Location())));
+      allStations.push_back(*(static_cast<const NFmiStation *>(info.Location())));
 
     if (maxLevelSize < info.SizeLevels())
     {
@@ -145,8 +220,13 @@ static NFmiQueryInfo MakeCombinedInnerInfo(vector<NFmiQueryData *> &theDataList,
   NFmiParamDescriptor paramDesc(theDataList[0]->Info()->ParamDescriptor());
   paramDesc.SetProducer(theWantedProducer);
 
+  // Asemat samaan jrjestykseen kuin std::set:ss, ensimminen samoista j voimaan
+  stable_sort(allStations.begin(), allStations.end());
+  allStations.erase(unique(allStations.begin(), allStations.end(), StationEquivalent()),
+                    allStations.end());
+
   NFmiLocationBag locationBag;
-  for (set<NFmiStation>::iterator it2 = allStations.begin(); it2 != allStations.end(); ++it2)
+  for (vector<NFmiStation>::iterator it2 = allStations.begin(); it2 != allStations.end(); ++it2)
     locationBag.AddLocation(*it2, false);
   NFmiHPlaceDescriptor hplaceDesc(locationBag);
 
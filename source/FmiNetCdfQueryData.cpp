@@ -1,6 +1,7 @@
 // FmiNetCdfQueryData.cpp
 
 #include "FmiNetCdfQueryData.h"
+#include "ParallelJobs.h"
 #include <newbase/NFmiAreaFactory.h>
 #include <newbase/NFmiFastQueryInfo.h>
 #include <newbase/NFmiLatLonArea.h>
@@ -10,6 +11,10 @@
 #include <netcdfcpp.h>
 
 #include <boost/algorithm/string/case_conv.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <algorithm>
 
 void FmiTDimVarInfo::CalcTimeList(void)
 {
@@ -94,55 +99,116 @@ FmiNetCdfQueryData::FmiNetCdfQueryData(void)
       itsSurfaceMetaData(true),
       itsHeightLevelMetaData(false),
       itsPressureLevelMetaData(false),
-      itsHybridLevelMetaData(false)
+      itsHybridLevelMetaData(false),
+      itsThreadCount(1)
 {
 }
 
 FmiNetCdfQueryData::~FmiNetCdfQueryData(void) {}
+// netCDF-kirjasto (mys sen C++ rajapinta) ei ole thread safe edes eri NcFile-olioita
+// kytettess, joten kaikki netCDF-kutsut tehdn tmn lukon takana. Rinnakkain ajetaan
+// vain luettujen arvojen tarkistus ja sijoitus qData:an.
+static boost::mutex ncMutex;
+
+// Tytt yhden parametrin kaikki arvot annetusta nc-tiedostosta qData:an.
+// Tiedostosta luetaan lukon takana aika-askel kerrallaan samaan float-puskuriin,
+// qData:an tytt tehdn lukon ulkopuolella.
+static void FillParam(NcFile &theNcFile, NFmiFastQueryInfo &theInfo, const FmiVarInfo &theVarInfo)
+{
+  NcVar *varPtr = 0;
+  std::vector<long> counts;
+  {
+    boost::mutex::scoped_lock lock(ncMutex);
+    varPtr = theNcFile.get_var(theVarInfo.itsIndex);
+    if (varPtr)
+    {
+      long *edges = varPtr->edges();
+      counts.assign(edges, edges + varPtr->num_dims());
+      delete[] edges;
+    }
+  }
+  if (varPtr == 0 || counts.empty()) return;  // Pitisi lyty!!
+
+  // NetCDF conventioiden mukaan juoksu jrjestys on:
+  // aika, level, y-dim, x-dim
+  counts[0] = 1;
+  long recordSize = 1;
+  for (size_t i = 0; i < counts.size(); i++)
+    recordSize *= counts[i];
+  if (recordSize < static_cast<long>(theInfo.SizeLevels() * theInfo.SizeLocations()))
+    throw std::runtime_error("Error in FillParam - too few values in variable " +
+                             theVarInfo.itsVarName);
+
+  std::vector<float> values(recordSize);
+  long timeInd = 0;
+  for (theInfo.ResetTime(); theInfo.NextTime(); timeInd++)  // juoksutetaan aika dimensiota
+  {
+    {
+      boost::mutex::scoped_lock lock(ncMutex);
+      if (!varPtr->set_cur(timeInd) || !varPtr->get(&values[0], &counts[0]))
+        throw std::runtime_error("Error in FillParam - failed to read variable " +
+                                 theVarInfo.itsVarName);
+    }
+    long counter = 0;
+    for (theInfo.ResetLevel(); theInfo.NextLevel();)  // juoksutetaan level dimensiota
+    {
+      for (theInfo.ResetLocation(); theInfo.NextLocation();)
+      {
+        float value = values[counter];
+        // jos ei ole fill-value, laitetaan arvo queryDataan, jos oli, jtetn qDatan missing
+        // arvo voimaan (data luodan alustettuna puuttuvilla arvoilla)
+        if (value != theVarInfo.itsFillValue) theInfo.FloatValue(value);
+        counter++;
+      }
+    }
+  }
+}
+
+// Yhden parametrin tytt threadin omalla infolla. Parametrit ovat eri kohdissa samaa
+// qDataa, joten ne voi tytt rinnakkain.
+static void FillParamJob(NcFile *theNcFile,
+                         std::vector<NFmiFastQueryInfo> *theInfos,
+                         const std::vector<FmiVarInfo> *theVarInfos,
+                         const std::vector<size_t> *theVarIndexes,
+                         unsigned int theThread,
+                         size_t theWork)
+{
+  NFmiFastQueryInfo &fInfo = (*theInfos)[theThread];
+  const FmiVarInfo &varInfo = (*theVarInfos)[(*theVarIndexes)[theWork]];
+  if (fInfo.Param(static_cast<FmiParameterName>(varInfo.itsParId)))
+    ::FillParam(*theNcFile, fInfo, varInfo);
+}
+
 static NFmiQueryData *MakeQueryData(NcFile &theNcFile,
-                                    NFmiQueryInfo &theMetaInfo,
-                                    std::vector<FmiVarInfo> &theVarInfos)
+                                    NFmiQueryInfo *theMetaInfo,
+                                    std::vector<FmiVarInfo> &theVarInfos,
+                                    unsigned int theThreadCount)
 {
-  if (&theMetaInfo == 0) return 0;
+  if (theMetaInfo == 0) return 0;
 
-  NFmiQueryData *qData = NFmiQueryDataUtil::CreateEmptyData(theMetaInfo);
+  NFmiQueryData *qData = NFmiQueryDataUtil::CreateEmptyData(*theMetaInfo);
   NFmiFastQueryInfo fInfo(qData);
 
+  // theVarInfos:issa on kaikki parametrit surface ja level paramit, joten pit tarkistaa,
+  // lytyyk tst datasta erikseen
+  std::vector<size_t> varIndexes;
   for (size_t i = 0; i < theVarInfos.size(); i++)
   {
-    if (fInfo.Param(static_cast<FmiParameterName>(theVarInfos[i].itsParId)))  // theVarInfos:issa on
-                                                                              // kaikki parametrit
-                                                                              // surface ja level
-                                                                              // paramit, joten
-                                                                              // pit tarkistaa,
-                                                                              // lytyyk tst
-                                                                              // datasta erikseen
-    {
-      NcVar *varPtr = theNcFile.get_var(theVarInfos[i].itsIndex);
-      if (varPtr)  // Pitisi lyty!!
-      {
-        // NetCDF conventioiden mukaan juoksu jrjestys on:
-        // aika, level, y-dim, x-dim
-        int timeInd = 0;
-        for (fInfo.ResetTime(); fInfo.NextTime(); timeInd++)  // juoksutetaan aika dimensiota
-        {
-          NcValues *vals = varPtr->get_rec(timeInd);
-          long counter = 0;
-          for (fInfo.ResetLevel(); fInfo.NextLevel();)  // juoksutetaan level dimensiota
-          {
-            for (fInfo.ResetLocation(); fInfo.NextLocation();)
-            {
-              float value = vals->as_float(counter);
-              // jos ei ole fill-value, laitetaan arvo queryDataan, jos oli, jtetn qDatan missing
-              // arvo voimaan (data luodan alustettuna puuttuvilla arvoilla)
-              if (value != theVarInfos[i].itsFillValue) fInfo.FloatValue(value);
-              counter++;
-            }
-          }
-          delete vals;
-        }
-      }
-    }
+    if (fInfo.Param(static_cast<FmiParameterName>(theVarInfos[i].itsParId)))
+      varIndexes.push_back(i);
+  }
+
+  ParallelJobs parallel(varIndexes.size(), theThreadCount);
+  std::vector<NFmiFastQueryInfo> infos(parallel.threads(), fInfo);
+  try
+  {
+    parallel.run(
+        boost::bind(::FillParamJob, &theNcFile, &infos, &theVarInfos, &varIndexes, _1, _2));
+  }
+  catch (...)
+  {
+    delete qData;
+    throw;
   }
   return qData;
 }
@@ -166,17 +232,26 @@ std::vector<NFmiQueryData *> FmiNetCdfQueryData::CreateQueryDatas(const std::str
     {
       fDataOk = true;
       InitMetaInfo(ncFile);
-      ::AddToVector(
-          qDatas, ::MakeQueryData(ncFile, *(itsSurfaceMetaData.itsMetaInfo), itsNormalParameters));
-      ::AddToVector(
-          qDatas,
-          ::MakeQueryData(ncFile, *(itsHeightLevelMetaData.itsMetaInfo), itsNormalParameters));
-      ::AddToVector(
-          qDatas,
-          ::MakeQueryData(ncFile, *(itsPressureLevelMetaData.itsMetaInfo), itsNormalParameters));
-      ::AddToVector(
-          qDatas,
-          ::MakeQueryData(ncFile, *(itsHybridLevelMetaData.itsMetaInfo), itsNormalParameters));
+      ::AddToVector(qDatas,
+                    ::MakeQueryData(ncFile,
+                                    itsSurfaceMetaData.itsMetaInfo,
+                                    itsNormalParameters,
+                                    itsThreadCount));
+      ::AddToVector(qDatas,
+                    ::MakeQueryData(ncFile,
+                                    itsHeightLevelMetaData.itsMetaInfo,
+                                    itsNormalParameters,
+                                    itsThreadCount));
+      ::AddToVector(qDatas,
+                    ::MakeQueryData(ncFile,
+                                    itsPressureLevelMetaData.itsMetaInfo,
+                                    itsNormalParameters,
+                                    itsThreadCount));
+      ::AddToVector(qDatas,
+                    ::MakeQueryData(ncFile,
+                                    itsHybridLevelMetaData.itsMetaInfo,
+                                    itsNormalParameters,
+                                    itsThreadCount));
     }
     else
       throw std::runtime_error(std::string("Error nc-file is not valid netCdf: ") + theNcFileName);
@@ -0,0 +1,308 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of the LocationTree class
+ */
+// ======================================================================
+
+#include "LocationTree.h"
+
+#include <newbase/NFmiGlobals.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+// Maximum number of locations in a leaf node
+const std::size_t leaf_size = 8;
+
+// Relative tolerance in distance comparisons
+const double distance_tolerance = 1e-9;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Convert a coordinate to a point on the unit sphere
+ */
+// ----------------------------------------------------------------------
+
+void unitvector(const NFmiPoint &theLonLat, double *theXYZ)
+{
+  const double lon = theLonLat.X() * kPii / 180;
+  const double lat = theLonLat.Y() * kPii / 180;
+  theXYZ[0] = std::cos(lat) * std::cos(lon);
+  theXYZ[1] = std::cos(lat) * std::sin(lon);
+  theXYZ[2] = std::sin(lat);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Convert a great circle distance to a squared chord length
+ *
+ * Negative distances are not reachable, hence -1 is returned for them.
+ */
+// ----------------------------------------------------------------------
+
+double squaredchord(double theDistance)
+{
+  if (theDistance < 0) return -1;
+  const double angle = std::min(kPii, theDistance / kRearth);
+  const double chord = 2 * std::sin(angle / 2);
+  return chord * chord * (1 + distance_tolerance);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Squared distance between two points
+ */
+// ----------------------------------------------------------------------
+
+double squareddistance(const double *theA, const double *theB)
+{
+  double dx = theA[0] - theB[0];
+  double dy = theA[1] - theB[1];
+  double dz = theA[2] - theB[2];
+  return dx * dx + dy * dy + dz * dz;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Order location indexes by a single coordinate
+ */
+// ----------------------------------------------------------------------
+
+struct CoordinateLess
+{
+  CoordinateLess(const std::vector<double> &thePoints, int theAxis)
+      : itsPoints(thePoints), itsAxis(theAxis)
+  {
+  }
+
+  bool operator()(std::size_t theA, std::size_t theB) const
+  {
+    return itsPoints[3 * theA + itsAxis] < itsPoints[3 * theB + itsAxis];
+  }
+
+  const std::vector<double> &itsPoints;
+  int itsAxis;
+};
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Constructor
+ *
+ * \param theLonLats The coordinates of the locations
+ */
+// ----------------------------------------------------------------------
+
+LocationTree::LocationTree(const std::vector<NFmiPoint> &theLonLats)
+    : itsPoints(3 * theLonLats.size()), itsOrder(theLonLats.size()), itsNodes()
+{
+  for (std::size_t i = 0; i < theLonLats.size(); i++)
+  {
+    unitvector(theLonLats[i], &itsPoints[3 * i]);
+    itsOrder[i] = i;
+  }
+
+  if (!itsOrder.empty())
+  {
+    itsNodes.reserve(2 * itsOrder.size() / leaf_size + 1);
+    build(0, itsOrder.size());
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Build the subtree for the given range of locations
+ *
+ * The range is split at the median of the coordinate with the
+ * largest extent.
+ *
+ * \return The number of the created node
+ */
+// ----------------------------------------------------------------------
+
+std::size_t LocationTree::build(std::size_t theBegin, std::size_t theEnd)
+{
+  std::size_t n = itsNodes.size();
+  itsNodes.push_back(Node());
+
+  Node node;
+  node.begin = theBegin;
+  node.end = theEnd;
+  node.left = 0;
+  node.right = 0;
+
+  for (int axis = 0; axis < 3; axis++)
+  {
+    node.min[axis] = node.max[axis] = itsPoints[3 * itsOrder[theBegin] + axis];
+    for (std::size_t i = theBegin + 1; i < theEnd; i++)
+    {
+      double value = itsPoints[3 * itsOrder[i] + axis];
+      node.min[axis] = std::min(node.min[axis], value);
+      node.max[axis] = std::max(node.max[axis], value);
+    }
+  }
+
+  if (theEnd - theBegin > leaf_size)
+  {
+    int axis = 0;
+    for (int i = 1; i < 3; i++)
+      if (node.max[i] - node.min[i] > node.max[axis] - node.min[axis]) axis = i;
+
+    std::size_t middle = theBegin + (theEnd - theBegin) / 2;
+    std::nth_element(itsOrder.begin() + theBegin,
+                     itsOrder.begin() + middle,
+                     itsOrder.begin() + theEnd,
+                     CoordinateLess(itsPoints, axis));
+
+    node.left = build(theBegin, middle);
+    node.right = build(middle, theEnd);
+  }
+
+  itsNodes[n] = node;
+  return n;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find all locations within the given distance
+ *
+ * \param theLonLat The coordinate
+ * \param theMaxDistance The maximum distance in meters
+ * \return The location indexes in increasing distance order
+ */
+// ----------------------------------------------------------------------
+
+std::vector<std::size_t> LocationTree::within(const NFmiPoint &theLonLat,
+                                              double theMaxDistance) const
+{
+  return nearest(theLonLat, 0, theMaxDistance);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find the nearest locations
+ *
+ * \param theLonLat The coordinate
+ * \param theMaxNumber The maximum number of locations, or 0 for all
+ * \param theMaxDistance The maximum distance in meters
+ * \return The location indexes in increasing distance order
+ */
+// ----------------------------------------------------------------------
+
+std::vector<std::size_t> LocationTree::nearest(const NFmiPoint &theLonLat,
+                                               std::size_t theMaxNumber,
+                                               double theMaxDistance) const
+{
+  std::vector<std::size_t> ret;
+  Search search(*this, theLonLat, theMaxDistance);
+  std::size_t index;
+  while ((theMaxNumber == 0 || ret.size() < theMaxNumber) && search.next(index))
+    ret.push_back(index);
+  return ret;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Priority queue order of search entries
+ *
+ * The queue returns its largest element first, hence the order is
+ * reversed: smaller distances first, nodes before locations at equal
+ * distances so that all equally distant locations are queued before
+ * any of them is returned, and then smaller location indexes first.
+ */
+// ----------------------------------------------------------------------
+
+bool LocationTree::Search::Entry::operator<(const Entry &theOther) const
+{
+  if (dist != theOther.dist) return dist > theOther.dist;
+  if (point != theOther.point) return point;
+  return item > theOther.item;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Start a search
+ *
+ * \param theTree The tree to search
+ * \param theLonLat The coordinate
+ * \param theMaxDistance The maximum distance in meters
+ */
+// ----------------------------------------------------------------------
+
+LocationTree::Search::Search(const LocationTree &theTree,
+                             const NFmiPoint &theLonLat,
+                             double theMaxDistance)
+    : itsTree(theTree), itsMaxDist(squaredchord(theMaxDistance)), itsQueue()
+{
+  unitvector(theLonLat, itsPoint);
+
+  if (!itsTree.itsNodes.empty() && itsMaxDist >= 0)
+  {
+    Entry root = {0, false, 0};
+    itsQueue.push(root);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the next nearest location
+ *
+ * \param theIndex The location index is stored here
+ * \return False, if there are no more locations within the distance
+ */
+// ----------------------------------------------------------------------
+
+bool LocationTree::Search::next(std::size_t &theIndex)
+{
+  while (!itsQueue.empty())
+  {
+    Entry entry = itsQueue.top();
+    itsQueue.pop();
+
+    if (entry.point)
+    {
+      theIndex = entry.item;
+      return true;
+    }
+
+    const Node &node = itsTree.itsNodes[entry.item];
+
+    if (node.left == 0)
+    {
+      for (std::size_t i = node.begin; i < node.end; i++)
+      {
+        std::size_t index = itsTree.itsOrder[i];
+        double dist = squareddistance(itsPoint, &itsTree.itsPoints[3 * index]);
+        if (dist > itsMaxDist) continue;
+        Entry location = {dist, true, index};
+        itsQueue.push(location);
+      }
+    }
+    else
+    {
+      const std::size_t children[2] = {node.left, node.right};
+      for (int c = 0; c < 2; c++)
+      {
+        // Distance to the bounding box is a lower bound for the distances of its locations
+        const Node &child = itsTree.itsNodes[children[c]];
+        double dist = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+          double d = std::max(0.0, std::max(child.min[axis] - itsPoint[axis],
+                                            itsPoint[axis] - child.max[axis]));
+          dist += d * d;
+        }
+        if (dist > itsMaxDist) continue;
+        Entry subtree = {dist, false, children[c]};
+        itsQueue.push(subtree);
+      }
+    }
+  }
+  return false;
+}
+
+// ======================================================================
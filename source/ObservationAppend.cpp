@@ -0,0 +1,308 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of namespace ObservationAppend
+ */
+// ======================================================================
+
+#include "ObservationAppend.h"
+
+#include <newbase/NFmiFastQueryInfo.h>
+#include <newbase/NFmiFileSystem.h>
+#include <newbase/NFmiLocationBag.h>
+#include <newbase/NFmiQueryData.h>
+#include <newbase/NFmiQueryDataUtil.h>
+#include <newbase/NFmiStringTools.h>
+#include <newbase/NFmiTimeList.h>
+
+#include <boost/shared_ptr.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Key identifying a station in both the old and the new data
+ *
+ * Ships are identified by their name, other stations by their ident.
+ */
+// ----------------------------------------------------------------------
+
+string location_key(const NFmiLocation &theLocation, bool fMatchByName)
+{
+  if (fMatchByName) return theLocation.GetName().CharPtr();
+  return NFmiStringTools::Convert(theLocation.GetIdent());
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether the location has valid values at the given times
+ */
+// ----------------------------------------------------------------------
+
+bool has_values(NFmiFastQueryInfo &theInfo, const set<NFmiMetTime> &theTimes)
+{
+  theInfo.FirstLevel();
+  for (theInfo.ResetTime(); theInfo.NextTime();)
+  {
+    if (theTimes.find(theInfo.Time()) == theTimes.end()) continue;
+    for (theInfo.ResetParam(); theInfo.NextParam();)
+      if (theInfo.FloatValue() != kFloatMissing) return true;
+  }
+  return false;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy the valid values of one data into the merged data
+ *
+ * Existing values are replaced if fOverride is true or if the station
+ * and time are listed in theCorrections.
+ */
+// ----------------------------------------------------------------------
+
+void copy_values(NFmiFastQueryInfo &theSource,
+                 NFmiFastQueryInfo &theTarget,
+                 const map<string, unsigned long> &theLocations,
+                 bool fMatchByName,
+                 bool fOverride,
+                 const ObservationAppend::Corrections &theCorrections)
+{
+  // Main parameters only, combined parameters are copied as such
+
+  map<unsigned long, unsigned long> targetparams;
+  for (theTarget.ResetParam(); theTarget.NextParam();)
+    targetparams.insert(make_pair(theTarget.Param().GetParamIdent(), theTarget.ParamIndex()));
+
+  vector<pair<unsigned long, unsigned long> > params;
+  for (theSource.ResetParam(); theSource.NextParam();)
+  {
+    map<unsigned long, unsigned long>::const_iterator it =
+        targetparams.find(theSource.Param().GetParamIdent());
+    if (it != targetparams.end()) params.push_back(make_pair(theSource.ParamIndex(), it->second));
+  }
+
+  // Times outside the window are not in the target
+
+  vector<pair<unsigned long, unsigned long> > times;
+  for (theSource.ResetTime(); theSource.NextTime();)
+  {
+    if (theTarget.Time(theSource.Time()))
+      times.push_back(make_pair(theSource.TimeIndex(), theTarget.TimeIndex()));
+  }
+
+  theSource.FirstLevel();
+  theTarget.FirstLevel();
+
+  for (theSource.ResetLocation(); theSource.NextLocation();)
+  {
+    const string key = location_key(*theSource.Location(), fMatchByName);
+    map<string, unsigned long>::const_iterator loc = theLocations.find(key);
+    if (loc == theLocations.end()) continue;
+    theTarget.LocationIndex(loc->second);
+
+    for (size_t t = 0; t < times.size(); t++)
+    {
+      theSource.TimeIndex(times[t].first);
+      theTarget.TimeIndex(times[t].second);
+
+      const bool replace =
+          (fOverride ||
+           (!theCorrections.empty() &&
+            theCorrections.find(make_pair(key, theSource.Time())) != theCorrections.end()));
+
+      for (size_t p = 0; p < params.size(); p++)
+      {
+        theSource.ParamIndex(params[p].first);
+        float value = theSource.FloatValue();
+        if (value == kFloatMissing) continue;
+
+        theTarget.ParamIndex(params[p].second);
+        if (replace || theTarget.FloatValue() == kFloatMissing) theTarget.FloatValue(value);
+      }
+    }
+  }
+}
+}  // namespace
+
+namespace ObservationAppend
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read the names of the already consumed input files
+ *
+ * A missing manifest is not an error, it simply means nothing
+ * has been consumed yet.
+ */
+// ----------------------------------------------------------------------
+
+set<string> ReadManifest(const string &theFile)
+{
+  set<string> files;
+  ifstream in(theFile.c_str());
+  if (!in) return files;
+
+  string line;
+  while (getline(in, line))
+  {
+    if (!line.empty()) files.insert(line);
+  }
+  return files;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write the names of the consumed input files
+ *
+ * The manifest is replaced atomically so that an interrupted run
+ * does not lose the information on the previous runs.
+ */
+// ----------------------------------------------------------------------
+
+void WriteManifest(const string &theFile, const set<string> &theFiles)
+{
+  string tmpfile = theFile + ".tmp";
+  {
+    ofstream out(tmpfile.c_str());
+    if (!out) throw runtime_error("Error: Failed to open manifest '" + tmpfile + "' for writing");
+    for (set<string>::const_iterator it = theFiles.begin(); it != theFiles.end(); ++it)
+      out << *it << '\n';
+    if (!out) throw runtime_error("Error: Failed to write manifest '" + tmpfile + "'");
+  }
+
+  if (std::rename(tmpfile.c_str(), theFile.c_str()) != 0)
+    throw runtime_error("Error: Failed to rename '" + tmpfile + "' to '" + theFile + "'");
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read the output of the previous run, if there is one
+ */
+// ----------------------------------------------------------------------
+
+NFmiQueryData *ReadPreviousData(const string &theFile)
+{
+  if (!NFmiFileSystem::FileExists(theFile)) return 0;
+  return new NFmiQueryData(theFile);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Merge new observations into the previous rolling window
+ *
+ * The stations and times of both datas are combined, and times older
+ * than theWindowHours from the latest time are dropped. Stations with
+ * no valid values within the window are dropped too. The parameters
+ * are those of the new data if there is one. New values replace old ones
+ * if fNewOverrides is true, otherwise they only fill in missing values
+ * unless the observation is listed in theCorrections.
+ *
+ * \param theOldData The previous output, may be null
+ * \param theNewData The data made from new input files, may be null
+ * \param theWindowHours Length of the time window, 0 keeps all times
+ * \param fNewOverrides True if new values replace old ones
+ * \param fMatchByName True if stations are matched by name instead of ident
+ * \param theCorrections Corrected observations in the new data
+ * \return The merged data, owned by the caller
+ */
+// ----------------------------------------------------------------------
+
+NFmiQueryData *Merge(NFmiQueryData *theOldData,
+                     NFmiQueryData *theNewData,
+                     int theWindowHours,
+                     bool fNewOverrides,
+                     bool fMatchByName,
+                     const Corrections &theCorrections)
+{
+  if (!theOldData && !theNewData) throw runtime_error("Error: No data to merge");
+
+  boost::shared_ptr<NFmiFastQueryInfo> oldinfo;
+  boost::shared_ptr<NFmiFastQueryInfo> newinfo;
+  if (theOldData) oldinfo.reset(new NFmiFastQueryInfo(theOldData));
+  if (theNewData) newinfo.reset(new NFmiFastQueryInfo(theNewData));
+
+  NFmiFastQueryInfo &base = (newinfo ? *newinfo : *oldinfo);
+  NFmiFastQueryInfo *infos[2] = {oldinfo.get(), newinfo.get()};
+
+  // Times within the window
+
+  set<NFmiMetTime> times;
+  NFmiMetTime origintime = base.OriginTime();
+  for (int i = 0; i < 2; i++)
+  {
+    if (!infos[i]) continue;
+    for (infos[i]->ResetTime(); infos[i]->NextTime();)
+      times.insert(infos[i]->Time());
+  }
+
+  if (times.empty()) throw runtime_error("Error: No times to merge");
+
+  NFmiMetTime cutoff = *times.rbegin();
+  cutoff.ChangeByHours(-theWindowHours);
+
+  set<NFmiMetTime> windowtimes;
+  NFmiTimeList timelist;
+  for (set<NFmiMetTime>::const_iterator it = times.begin(); it != times.end(); ++it)
+  {
+    if (theWindowHours <= 0 || !(*it < cutoff))
+    {
+      windowtimes.insert(*it);
+      timelist.Add(new NFmiMetTime(*it));
+    }
+  }
+
+  // Stations with values in the window, those of the old data first
+
+  set<string> validkeys;
+  for (int i = 0; i < 2; i++)
+  {
+    if (!infos[i]) continue;
+    for (infos[i]->ResetLocation(); infos[i]->NextLocation();)
+      if (has_values(*infos[i], windowtimes))
+        validkeys.insert(location_key(*infos[i]->Location(), fMatchByName));
+  }
+
+  // All stations are kept if none has values so that the data is not empty
+
+  NFmiLocationBag locations;
+  map<string, unsigned long> locationindexes;
+  for (int i = 0; i < 2; i++)
+  {
+    if (!infos[i]) continue;
+    for (infos[i]->ResetLocation(); infos[i]->NextLocation();)
+    {
+      const NFmiLocation *loc = infos[i]->Location();
+      string key = location_key(*loc, fMatchByName);
+      if (!validkeys.empty() && validkeys.find(key) == validkeys.end()) continue;
+      if (locationindexes.find(key) != locationindexes.end()) continue;
+      locationindexes.insert(make_pair(key, locationindexes.size()));
+      locations.AddLocation(*loc, false);
+    }
+  }
+
+  NFmiQueryInfo qi(base.ParamDescriptor(),
+                   NFmiTimeDescriptor(origintime, timelist),
+                   NFmiHPlaceDescriptor(locations),
+                   base.VPlaceDescriptor());
+
+  NFmiQueryData *data = NFmiQueryDataUtil::CreateEmptyData(qi);
+  if (!data) throw runtime_error("Error: Unable to create merged querydata");
+
+  NFmiFastQueryInfo info(data);
+  if (oldinfo) copy_values(*oldinfo, info, locationindexes, fMatchByName, true, Corrections());
+  if (newinfo)
+    copy_values(*newinfo, info, locationindexes, fMatchByName, fNewOverrides, theCorrections);
+
+  return data;
+}
+
+}  // namespace ObservationAppend
+
+// ======================================================================
@@ -0,0 +1,114 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of the ParallelJobs class
+ */
+// ======================================================================
+
+#include "ParallelJobs.h"
+
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Constructor
+ *
+ * The number of threads is limited to the number of jobs.
+ *
+ * \param theJobs The number of jobs
+ * \param theThreads The number of threads, 0 meaning all cores
+ */
+// ----------------------------------------------------------------------
+
+ParallelJobs::ParallelJobs(std::size_t theJobs, unsigned int theThreads)
+    : itsThreads(theThreads), itsNextJob(0), itsFailed(false), itsErrors(theJobs)
+{
+  if (itsThreads == 0) itsThreads = boost::thread::hardware_concurrency();
+  if (itsThreads > theJobs) itsThreads = static_cast<unsigned int>(theJobs);
+  itsThreads = std::max(1u, itsThreads);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Process all the jobs
+ *
+ * \param theJob The function processing a single job
+ */
+// ----------------------------------------------------------------------
+
+void ParallelJobs::run(const Job& theJob)
+{
+  if (itsThreads == 1)
+    worker(&theJob, 0);
+  else
+  {
+    boost::thread_group workers;
+    for (unsigned int i = 0; i < itsThreads; i++)
+      workers.add_thread(new boost::thread(&ParallelJobs::worker, this, &theJob, i));
+    workers.join_all();
+  }
+
+  for (std::size_t i = 0; i < itsErrors.size(); i++)
+    if (!itsErrors[i].empty()) throw std::runtime_error(itsErrors[i]);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Process jobs in a single thread until there are none left
+ */
+// ----------------------------------------------------------------------
+
+void ParallelJobs::worker(const Job* theJob, unsigned int theThread)
+{
+  std::size_t i;
+  while (next(i))
+  {
+    try
+    {
+      (*theJob)(theThread, i);
+    }
+    catch (std::exception& e)
+    {
+      fail(i, e.what());
+    }
+    catch (...)
+    {
+      fail(i, "An unknown exception occurred");
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Take the next job
+ *
+ * \param theJob The index of the taken job
+ * \return False if all jobs have been taken or a job has failed
+ */
+// ----------------------------------------------------------------------
+
+bool ParallelJobs::next(std::size_t& theJob)
+{
+  boost::mutex::scoped_lock lock(itsMutex);
+  if (itsFailed || itsNextJob >= itsErrors.size()) return false;
+  theJob = itsNextJob++;
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Store the error of a failed job
+ */
+// ----------------------------------------------------------------------
+
+void ParallelJobs::fail(std::size_t theJob, const std::string& theError)
+{
+  boost::mutex::scoped_lock lock(itsMutex);
+  itsFailed = true;
+  itsErrors[theJob] = (theError.empty() ? "An unknown exception occurred" : theError);
+}
+
+// ======================================================================
@@ -19,9 +19,11 @@
 #include <newbase/NFmiQueryDataUtil.h>
 #include <newbase/NFmiFastQueryInfo.h>
 
+#include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/shared_ptr.hpp>
 
 #include <fstream>
+#include <vector>
 
 using namespace std;
 
@@ -163,21 +165,19 @@ NFmiMetTime str2time(const std::string &theStamp)
   return ret;
 }
 
-static NFmiQueryInfo MakeQdInfo(const PgmHeaderInfo &thePgmHeaderInfo,
-                                int width,
-                                int height,
-                                const PgmReadOptions &theOptions,
-                                std::ostream &theReportStream)
+static bool MakePgmFileInfo(const PgmHeaderInfo &thePgmHeaderInfo,
+                            const PgmReadOptions &theOptions,
+                            std::ostream &theReportStream,
+                            PgmFileInfo &theFileInfo)
 {
   std::string projname = *thePgmHeaderInfo.projections.names().begin();
   const Projection &proj = thePgmHeaderInfo.projections.projection(projname);
-  boost::shared_ptr<NFmiArea> area = proj.area(width, height);
+  boost::shared_ptr<NFmiArea> area = proj.area(theFileInfo.width, theFileInfo.height);
 
-  NFmiMetTime origtime = str2time(thePgmHeaderInfo.obstime);
-
-  NFmiMetTime starttime =
-      (thePgmHeaderInfo.fortime.empty() ? origtime : str2time(thePgmHeaderInfo.fortime));
-  NFmiMetTime endtime = starttime;
+  theFileInfo.origintime = str2time(thePgmHeaderInfo.obstime);
+  theFileInfo.validtime =
+      (thePgmHeaderInfo.fortime.empty() ? theFileInfo.origintime
+                                        : str2time(thePgmHeaderInfo.fortime));
 
   NFmiEnumConverter converter;
   FmiParameterName paramnum = FmiParameterName(converter.ToEnum(thePgmHeaderInfo.param));
@@ -189,89 +189,159 @@ static NFmiQueryInfo MakeQdInfo(const PgmHeaderInfo &thePgmHeaderInfo,
                       << endl;
   }
 
-  NFmiParamBag pbag;
   NFmiParam p(paramnum, thePgmHeaderInfo.param);
   p.InterpolationMethod(kLinearly);
-  pbag.Add(NFmiDataIdent(p));
+  theFileInfo.param = NFmiDataIdent(p);
+
+  NFmiGrid tmpgrid(area.get(), theFileInfo.width, theFileInfo.height);
+  theFileInfo.hdesc = NFmiHPlaceDescriptor(tmpgrid);
+
+  theFileInfo.level = thePgmHeaderInfo.level;
+  theFileInfo.scale = thePgmHeaderInfo.scale;
+  theFileInfo.base = thePgmHeaderInfo.base;
+  return true;
+}
+
+static NFmiQueryInfo MakeQdInfo(const PgmFileInfo &theFileInfo)
+{
+  NFmiParamBag pbag;
+  pbag.Add(theFileInfo.param);
   NFmiParamDescriptor pdesc(pbag);
 
-  NFmiGrid tmpgrid(area.get(), width, height);
-  NFmiHPlaceDescriptor hdesc(tmpgrid);
   NFmiVPlaceDescriptor vdesc;
-  if (!thePgmHeaderInfo.level.IsMissing())
+  if (!theFileInfo.level.IsMissing())
   {
     NFmiLevelBag levBag;
-    levBag.AddLevel(thePgmHeaderInfo.level);
+    levBag.AddLevel(theFileInfo.level);
     vdesc = NFmiVPlaceDescriptor(levBag);
   }
 
-  NFmiTimeBag tbag(starttime, endtime, 5);
-  NFmiTimeDescriptor tdesc(origtime, tbag);
-  return NFmiQueryInfo(pdesc, tdesc, hdesc, vdesc);
+  NFmiTimeBag tbag(theFileInfo.validtime, theFileInfo.validtime, 5);
+  NFmiTimeDescriptor tdesc(theFileInfo.origintime, tbag);
+  return NFmiQueryInfo(pdesc, tdesc, theFileInfo.hdesc, vdesc);
 }
 
-static bool FillQueryData(NFmiQueryData &theData,
-                          const PgmHeaderInfo &thePgmHeaderInfo,
-                          const std::string &theFileName,
-                          const PgmReadOptions &theOptions,
-                          std::ostream &theReportStream,
-                          int bytes,
-                          int valid_size1,
-                          int header_end_pos)
+// Muuntaa yhden PGM-rivin arvoiksi. Rivi on big endian, tavujen vaihto
+// tehdn siirroilla jotta kntj voi vektoroida silmukan.
+static void DecodePgmRow(const unsigned char *theRow,
+                         int theWidth,
+                         int theBytes,
+                         const std::vector<float> &theTable,
+                         float theScale,
+                         float theBase,
+                         std::vector<float> &theValues)
 {
-  NFmiFastQueryInfo info(&theData);
-  info.First();
-  NFmiGrid grid(info.Area());
-
-  int bytesize = (bytes == valid_size1 ? 1 : 2);
-  bool xfirst = true;
-  bool littleendian = false;  // pgm is always big endian!!!
-  bool issigned = false;
-  string skipstring = "";
-
-  double beforemissing = bytes;  // = -1
-  float aftermissing = kFloatMissing;
-
-  if (!grid.Init(theFileName,
-                 info.GridXNumber(),
-                 info.GridYNumber(),
-                 bytesize,
-                 littleendian,
-                 header_end_pos,
-                 skipstring,
-                 kTopLeft,
-                 xfirst,
-                 beforemissing,
-                 aftermissing,
-                 issigned,
-                 thePgmHeaderInfo.scale,
-                 thePgmHeaderInfo.base))
+  const int valid_size1 = (1 << 8) - 1;
+
+  if (theBytes == valid_size1)
+  {
+    for (int i = 0; i < theWidth; i++)
+      theValues[i] = theTable[theRow[i]];
+  }
+  else
+  {
+    const unsigned int missing = static_cast<unsigned int>(theBytes);
+    for (int i = 0; i < theWidth; i++)
+    {
+      unsigned int raw = (static_cast<unsigned int>(theRow[2 * i]) << 8) | theRow[2 * i + 1];
+      float value = theScale * raw + theBase;
+      theValues[i] = (raw == missing ? kFloatMissing : value);
+    }
+  }
+}
+
+// Tytt PGM-tiedoston rasterin annetun infon aktiiviseen parametriin, leveliin ja aikaan.
+// Tiedosto luetaan muistikuvauksena suoraan querydataan, skaalaus ja puuttuva arvo
+// ksitelln samalla kertaa.
+bool FillQueryData(NFmiFastQueryInfo &theInfo,
+                   const PgmFileInfo &theFileInfo,
+                   const PgmReadOptions &theOptions,
+                   std::ostream &theReportStream)
+{
+  const int valid_size1 = (1 << 8) - 1;
+  const int bytesize = (theFileInfo.bytes == valid_size1 ? 1 : 2);
+  const int width = theFileInfo.width;
+  const int height = theFileInfo.height;
+
+  if (static_cast<int>(theInfo.GridXNumber()) != width ||
+      static_cast<int>(theInfo.GridYNumber()) != height)
   {
-    if (theOptions.verbose) theReportStream << "Failed to read " << theFileName << endl;
+    if (theOptions.verbose)
+      theReportStream << "Grid size mismatch in " << theFileInfo.filename << endl;
     return false;
   }
 
-  if (!info.Grid2Info(grid))
+  boost::iostreams::mapped_file_source mapped;
+  try
   {
-    if (theOptions.verbose) theReportStream << "Failed to make grid from " << theFileName << endl;
+    mapped.open(theFileInfo.filename);
+  }
+  catch (const std::exception &e)
+  {
+    if (theOptions.verbose)
+      theReportStream << "Failed to read " << theFileInfo.filename << endl
+                      << " --> " << e.what() << endl;
     return false;
   }
 
-  // Finally set the desired producer
-  info.SetProducer(NFmiProducer(theOptions.producer_number, theOptions.producer_name));
+  const std::size_t rowsize = static_cast<std::size_t>(width) * bytesize;
+  if (mapped.size() < theFileInfo.header_end_pos + rowsize * height)
+  {
+    if (theOptions.verbose)
+      theReportStream << "Failed to read " << theFileInfo.filename << endl
+                      << " --> file is too short" << endl;
+    return false;
+  }
+
+  // 8-bit data is converted through a table, pgm maxval is the missing value
+
+  std::vector<float> table;
+  if (bytesize == 1)
+  {
+    table.resize(valid_size1 + 1);
+    for (int i = 0; i < valid_size1; i++)
+      table[i] = theFileInfo.scale * i + theFileInfo.base;
+    table[valid_size1] = kFloatMissing;
+  }
+
+  // The first pgm row is the top row, querydata starts from the bottom
+
+  const unsigned char *raster =
+      reinterpret_cast<const unsigned char *>(mapped.data()) + theFileInfo.header_end_pos;
+  std::vector<float> values(width);
+
+  theInfo.ResetLocation();
+  for (int j = height - 1; j >= 0; j--)
+  {
+    DecodePgmRow(raster + j * rowsize,
+                 width,
+                 theFileInfo.bytes,
+                 table,
+                 theFileInfo.scale,
+                 theFileInfo.base,
+                 values);
+
+    for (int i = 0; i < width; i++)
+    {
+      theInfo.NextLocation();
+      theInfo.FloatValue(values[i]);
+    }
+  }
+
   return true;
 }
 
-// Luetaan annetusta PGM-tiedostosta data ja muutetaan se queryDataksi.
-NFmiQueryData *Pgm2QueryData(const std::string &theFileName,
-                             const PgmReadOptions &theOptions,
-                             std::ostream &theReportStream)
+// Luetaan annetun PGM-tiedoston header-tiedot ilman itse dataa.
+bool ReadPgmFileInfo(const std::string &theFileName,
+                     const PgmReadOptions &theOptions,
+                     std::ostream &theReportStream,
+                     PgmFileInfo &theFileInfo)
 {
   // Skip the file if it has the wrong suffix
   if (NFmiStringTools::Suffix(theFileName) != "pgm")
   {
     if (theOptions.verbose) theReportStream << "Skipping non .pgm file " << theFileName << endl;
-    return 0;
+    return false;
   }
 
   // Establish the output name from the header of the file
@@ -280,7 +350,7 @@ NFmiQueryData *Pgm2QueryData(const std::string &theFileName,
   if (!NFmiFileSystem::FileReadable(theFileName))
   {
     if (theOptions.verbose) theReportStream << "Skipping nonexistent " << theFileName << endl;
-    return 0;
+    return false;
   }
 
   // Skip the file if it is too old
@@ -292,7 +362,7 @@ NFmiQueryData *Pgm2QueryData(const std::string &theFileName,
     {
       if (theOptions.verbose)
         theReportStream << "Skipping " << theFileName << " as too old" << endl;
-      return 0;
+      return false;
     }
   }
 
@@ -301,7 +371,7 @@ NFmiQueryData *Pgm2QueryData(const std::string &theFileName,
   if (!infile)
   {
     if (theOptions.verbose) theReportStream << "Could not open " << theFileName << endl;
-    return 0;
+    return false;
   }
 
   std::string line;
@@ -312,7 +382,7 @@ NFmiQueryData *Pgm2QueryData(const std::string &theFileName,
   {
     infile.close();
     if (theOptions.verbose) theReportStream << "Skipping non-pgm file " << theFileName << endl;
-    return 0;
+    return false;
   }
 
   // Read all comment lines, strip the comments away on the fly
@@ -339,7 +409,7 @@ NFmiQueryData *Pgm2QueryData(const std::string &theFileName,
     if (theOptions.verbose)
       theReportStream << "Invalid header in file " << theFileName << endl
                       << " --> " << e.what() << endl;
-    return 0;
+    return false;
   }
 
   // Read the P5 specs
@@ -350,7 +420,7 @@ NFmiQueryData *Pgm2QueryData(const std::string &theFileName,
     infile.close();
     if (theOptions.verbose)
       theReportStream << "Failed to read pgm width, height and bytes from " << theFileName << endl;
-    return 0;
+    return false;
   }
 
   // Skip the rest of the line after the bytesize indicator
@@ -361,7 +431,7 @@ NFmiQueryData *Pgm2QueryData(const std::string &theFileName,
   {
     infile.close();
     if (theOptions.verbose) theReportStream << "Nonnegative size fields in " << theFileName << endl;
-    return 0;
+    return false;
   }
 
   const int valid_size1 = (1 << 8) - 1;
@@ -372,7 +442,7 @@ NFmiQueryData *Pgm2QueryData(const std::string &theFileName,
     infile.close();
     if (theOptions.verbose)
       theReportStream << "Invalid bytesize " << bytes << " in " << theFileName << endl;
-    return 0;
+    return false;
   }
 
   // Establish the position so that newbase can skip to this
@@ -385,45 +455,59 @@ NFmiQueryData *Pgm2QueryData(const std::string &theFileName,
   {
     if (theOptions.verbose)
       theReportStream << "Observation time is missing in " << theFileName << endl;
-    return 0;
+    return false;
   }
 
   // Must have parameter name
   if (pgmHeaderInfo.param.empty())
   {
     if (theOptions.verbose) theReportStream << "Parameter missing from " << theFileName << endl;
-    return 0;
+    return false;
   }
 
   // Establish the projection
   if (pgmHeaderInfo.projections.names().size() == 0)
   {
     theReportStream << "Header does not contain projection in " << theFileName << endl;
-    return 0;
+    return false;
   }
 
   if (pgmHeaderInfo.projections.names().size() > 1)
   {
     theReportStream << "Header contains multiple projections in " << theFileName << endl;
-    return 0;
+    return false;
   }
 
-  NFmiQueryInfo tmpinfo = MakeQdInfo(pgmHeaderInfo, width, height, theOptions, theReportStream);
+  theFileInfo.filename = theFileName;
+  theFileInfo.width = width;
+  theFileInfo.height = height;
+  theFileInfo.bytes = bytes;
+  theFileInfo.header_end_pos = header_end_pos;
+
+  return MakePgmFileInfo(pgmHeaderInfo, theOptions, theReportStream, theFileInfo);
+}
+
+// Luetaan annetusta PGM-tiedostosta data ja muutetaan se queryDataksi.
+NFmiQueryData *Pgm2QueryData(const std::string &theFileName,
+                             const PgmReadOptions &theOptions,
+                             std::ostream &theReportStream)
+{
+  PgmFileInfo fileInfo;
+  if (!ReadPgmFileInfo(theFileName, theOptions, theReportStream, fileInfo)) return 0;
+
+  NFmiQueryInfo tmpinfo = MakeQdInfo(fileInfo);
 
   NFmiQueryData *data = NFmiQueryDataUtil::CreateEmptyData(tmpinfo);
-  if (!FillQueryData(*data,
-                     pgmHeaderInfo,
-                     theFileName,
-                     theOptions,
-                     theReportStream,
-                     bytes,
-                     valid_size1,
-                     header_end_pos))
+  NFmiFastQueryInfo info(data);
+  info.First();
+  if (!FillQueryData(info, fileInfo, theOptions, theReportStream))
   {
-    infile.close();
+    delete data;
     return 0;
   }
-  infile.close();
+
+  // Finally set the desired producer
+  info.SetProducer(NFmiProducer(theOptions.producer_number, theOptions.producer_name));
 
   return data;
 }
@@ -10,10 +10,15 @@
 #endif
 
 #include "QueryDataManager.h"
+#include "LocationTree.h"
 
 #include <newbase/NFmiFileSystem.h>
 #include <newbase/NFmiQueryData.h>
 
+#include <boost/filesystem/operations.hpp>
+
+#include <fstream>
+#include <limits>
 #include <sstream>
 #include <stdexcept>
 
@@ -47,6 +52,54 @@ bool locationvalid(NFmiFastQueryInfo& theQD)
   }
   return false;
 }
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find the querydata file of the given name
+ *
+ * The name is completed with the search path, and a directory is
+ * resolved to the newest querydata in it.
+ */
+// ----------------------------------------------------------------------
+
+std::string resolve(const std::string& theName, const std::string& theSearchPath)
+{
+  return NFmiFileSystem::FindQueryData(NFmiFileSystem::FileComplete(theName, theSearchPath));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether the querydata file is compressed
+ *
+ * Compressed files cannot be memory mapped nor can their header be
+ * read without decompressing, hence they are read fully.
+ */
+// ----------------------------------------------------------------------
+
+bool compressed(const std::string& theFile)
+{
+  const std::string ext = boost::filesystem::path(theFile).extension().string();
+  return (ext == ".gz" || ext == ".bz2");
+}
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Construct the information on a single file
+ */
+// ----------------------------------------------------------------------
+
+QueryDataManager::value_type::value_type(const std::string& theName)
+    : name(theName),
+      filename(),
+      modified(0),
+      header(0),
+      data(),
+      info(0),
+      tree(0),
+      size(0),
+      lastuse(0)
+{
 }
 
 // ----------------------------------------------------------------------
@@ -57,7 +110,16 @@ bool locationvalid(NFmiFastQueryInfo& theQD)
  */
 // ----------------------------------------------------------------------
 
-QueryDataManager::QueryDataManager() : itsSearchPath(), itsData(), itsCurrentData()
+QueryDataManager::QueryDataManager()
+    : itsSearchPath(),
+      itsMultiMode(false),
+      itsData(),
+      itsCurrentData(),
+      itsStations(),
+      itsStationsKnown(false),
+      itsMemoryLimit(0),
+      itsMemoryUsed(0),
+      itsUseCounter(0)
 {
   itsCurrentData = itsData.end();
 }
@@ -75,8 +137,9 @@ QueryDataManager::~QueryDataManager()
 {
   for (storage_type::iterator it = itsData.begin(); it != itsData.end(); ++it)
   {
-    delete it->get<1>();  // querydata
-    delete it->get<2>();  // fastqueryinfo
+    delete it->header;
+    delete it->info;
+    delete it->tree;
   }
 }
 
@@ -113,7 +176,68 @@ void QueryDataManager::searchpath(const std::string& theSearchPath)
 
 void QueryDataManager::addfile(const std::string& theFile)
 {
-  itsData.push_back(value_type(theFile, 0));
+  itsData.push_back(value_type(theFile));
+  itsStationsKnown = false;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the maximum total size of simultaneously open datas
+ *
+ * The least recently used datas are closed when the limit is exceeded.
+ * The data of the current location is never closed.
+ *
+ * \param theBytes The limit in bytes, or 0 for no limit
+ */
+// ----------------------------------------------------------------------
+
+void QueryDataManager::memorylimit(std::size_t theBytes)
+{
+  itsMemoryLimit = theBytes;
+  enforcelimit(itsData.end());
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Prepare for a new query
+ *
+ * The current location is forgotten, and the files which have been
+ * modified or removed since they were found are closed so that they
+ * will be found and read again when needed. A directory is closed
+ * when a newer querydata has appeared in it.
+ */
+// ----------------------------------------------------------------------
+
+void QueryDataManager::refresh()
+{
+  itsCurrentData = itsData.end();
+
+  for (storage_type::iterator it = itsData.begin(); it != itsData.end(); ++it)
+  {
+    if (it->filename.empty()) continue;
+
+    boost::system::error_code ec;
+    std::time_t modified = boost::filesystem::last_write_time(it->filename, ec);
+    if (!ec && modified == it->modified)
+    {
+      try
+      {
+        if (resolve(it->name, itsSearchPath) == it->filename) continue;
+      }
+      catch (...)
+      {
+        // filename() reports the error when the data is needed again
+      }
+    }
+
+    release(it);
+    delete it->header;
+    delete it->tree;
+    it->header = 0;
+    it->tree = 0;
+    it->filename.clear();
+    itsStationsKnown = false;
+  }
 }
 
 // ----------------------------------------------------------------------
@@ -156,11 +280,191 @@ bool QueryDataManager::isset(void) const { return (itsCurrentData != itsData.end
 
 NFmiFastQueryInfo& QueryDataManager::info(void) const
 {
-  if (isset()) return *itsCurrentData->get<2>();
+  if (isset()) return *itsCurrentData->info;
 
   throw std::runtime_error("Trying to access querydata before setting a location");
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the current querydata
+ *
+ * The data remains valid even if the manager closes it later on,
+ * hence it may be used for example by other threads while the
+ * manager is searching for other locations.
+ *
+ * The method will throw if there is no active query data.
+ */
+// ----------------------------------------------------------------------
+
+boost::shared_ptr<NFmiQueryData> QueryDataManager::data() const
+{
+  if (isset()) return itsCurrentData->data;
+
+  throw std::runtime_error("Trying to access querydata before setting a location");
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the full name of the given file
+ *
+ * The name is completed with the search path, and a directory is
+ * resolved to the newest querydata in it.
+ */
+// ----------------------------------------------------------------------
+
+const std::string& QueryDataManager::filename(storage_type::iterator it)
+{
+  if (it->filename.empty())
+  {
+    it->filename = resolve(it->name, itsSearchPath);
+    boost::system::error_code ec;
+    it->modified = boost::filesystem::last_write_time(it->filename, ec);
+  }
+  return it->filename;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the header of the given file, reading it if necessary
+ *
+ * Only the descriptors are read, which is enough for searching
+ * stations and coordinates without reading the data. A compressed
+ * file is read fully, and the descriptors are copied from the data.
+ */
+// ----------------------------------------------------------------------
+
+NFmiQueryInfo& QueryDataManager::header(storage_type::iterator it)
+{
+  if (!it->header && compressed(filename(it)))
+  {
+    NFmiFastQueryInfo& qi = require(it);
+    it->header = new NFmiQueryInfo(qi.ParamDescriptor(),
+                                   qi.TimeDescriptor(),
+                                   qi.HPlaceDescriptor(),
+                                   qi.VPlaceDescriptor(),
+                                   qi.InfoVersion());
+  }
+  else if (!it->header)
+  {
+    std::ifstream in(filename(it).c_str(), std::ios::binary);
+    if (!in) throw std::runtime_error("Failed to open querydata '" + it->filename + "'");
+
+    NFmiQueryInfo* qi = new NFmiQueryInfo;
+    in >> *qi;
+    if (in.fail())
+    {
+      delete qi;
+      throw std::runtime_error("Failed to read querydata header from '" + it->filename + "'");
+    }
+    it->header = qi;
+  }
+
+  return *(it->header);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the query info of the given file, opening it if necessary
+ *
+ * The data is memory mapped unless it is compressed. Opening a data
+ * may close other least recently used datas if the memory limit is
+ * exceeded.
+ */
+// ----------------------------------------------------------------------
+
+NFmiFastQueryInfo& QueryDataManager::require(storage_type::iterator it)
+{
+  if (!it->info)
+  {
+    const std::string& name = filename(it);
+    const bool packed = compressed(name);
+    it->data.reset(new NFmiQueryData(name, !packed));
+    it->info = new NFmiFastQueryInfo(it->data.get());
+    if (packed)
+      it->size = it->info->Size() * sizeof(float);
+    else
+      it->size = boost::filesystem::file_size(name);
+    itsMemoryUsed += it->size;
+  }
+
+  it->lastuse = ++itsUseCounter;
+  enforcelimit(it);
+
+  return *(it->info);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Close the data of the given file
+ *
+ * The header and the location tree are kept.
+ */
+// ----------------------------------------------------------------------
+
+void QueryDataManager::release(storage_type::iterator it)
+{
+  if (!it->info) return;
+
+  delete it->info;
+  it->info = 0;
+  it->data.reset();
+  itsMemoryUsed -= it->size;
+  it->size = 0;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Close least recently used datas until the memory limit is met
+ *
+ * \param theKept A data which must not be closed, in addition to the current one
+ */
+// ----------------------------------------------------------------------
+
+void QueryDataManager::enforcelimit(storage_type::iterator theKept)
+{
+  if (itsMemoryLimit == 0) return;
+
+  while (itsMemoryUsed > itsMemoryLimit)
+  {
+    storage_type::iterator oldest = itsData.end();
+    for (storage_type::iterator it = itsData.begin(); it != itsData.end(); ++it)
+    {
+      if (!it->info || it == theKept || it == itsCurrentData) continue;
+      if (oldest == itsData.end() || it->lastuse < oldest->lastuse) oldest = it;
+    }
+
+    if (oldest == itsData.end()) return;
+    release(oldest);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the location tree of the given file, building it if necessary
+ *
+ * The tree is needed only for nearest station searches, hence it is
+ * not built when the header is read.
+ */
+// ----------------------------------------------------------------------
+
+const LocationTree& QueryDataManager::tree(storage_type::iterator it)
+{
+  if (!it->tree)
+  {
+    NFmiQueryInfo& qi = header(it);
+
+    std::vector<NFmiPoint> lonlats;
+    lonlats.reserve(qi.SizeLocations());
+    for (qi.ResetLocation(); qi.NextLocation();)
+      lonlats.push_back(qi.LatLon());
+
+    it->tree = new LocationTree(lonlats);
+  }
+
+  return *(it->tree);
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Set location based on a WMO-number
@@ -178,16 +482,9 @@ void QueryDataManager::setstation(int theWmoNumber)
 
   for (storage_type::iterator it = itsData.begin(); it != itsData.end(); ++it)
   {
-    if (!it->get<1>())
-    {
-      std::string filename = NFmiFileSystem::FileComplete(it->get<0>(), itsSearchPath);
-      NFmiQueryData* qd = new NFmiQueryData(filename);
-      it->get<1>() = qd;
-      it->get<2>() = new NFmiFastQueryInfo(qd);
-    }
-
-    if (it->get<2>()->Location(theWmoNumber))
+    if (header(it).Location(theWmoNumber))
     {
+      require(it).Location(theWmoNumber);
       itsCurrentData = it;
       return;
     }
@@ -217,24 +514,37 @@ void QueryDataManager::setpoint(const NFmiPoint& theLonLat, double theMaxDistanc
 
   for (storage_type::iterator it = itsData.begin(); it != itsData.end(); ++it)
   {
-    if (!it->get<1>())
+    double distance = 0;
+
+    if (header(it).IsGrid())
     {
-      std::string filename = NFmiFileSystem::FileComplete(it->get<0>(), itsSearchPath);
-      NFmiQueryData* qd = new NFmiQueryData(filename);
-      it->get<1>() = qd;
-      it->get<2>() = new NFmiFastQueryInfo(qd);
+      NFmiFastQueryInfo& qi = require(it);
+      if (qi.NearestLocation(theLonLat, theMaxDistance))
+      {
+        itsCurrentData = it;
+        return;
+      }
+
+      qi.NearestPoint(theLonLat);
+      distance = qi.Location()->Distance(theLonLat);
     }
-
-    NFmiFastQueryInfo& qi = *(it->get<2>());
-
-    if (qi.NearestLocation(theLonLat, theMaxDistance))
+    else
     {
-      itsCurrentData = it;
-      return;
+      std::vector<std::size_t> indexes =
+          tree(it).nearest(theLonLat, 1, std::numeric_limits<double>::max());
+      if (indexes.empty()) continue;
+
+      NFmiQueryInfo& qi = header(it);
+      qi.LocationIndex(indexes[0]);
+      distance = qi.Location()->Distance(theLonLat);
+      if (distance <= theMaxDistance)
+      {
+        require(it).LocationIndex(indexes[0]);
+        itsCurrentData = it;
+        return;
+      }
     }
 
-    qi.NearestPoint(theLonLat);
-    double distance = qi.Location()->Distance(theLonLat);
     if (smallest_distance < 0)
       smallest_distance = distance;
     else
@@ -258,19 +568,13 @@ void QueryDataManager::setpoint(const NFmiPoint& theLonLat, double theMaxDistanc
 
 std::set<int> QueryDataManager::stations()
 {
+  if (itsStationsKnown) return itsStations;
+
   std::set<int> ret;
 
   for (storage_type::iterator it = itsData.begin(); it != itsData.end(); ++it)
   {
-    if (!it->get<1>())
-    {
-      std::string filename = NFmiFileSystem::FileComplete(it->get<0>(), itsSearchPath);
-      NFmiQueryData* qd = new NFmiQueryData(filename);
-      it->get<1>() = qd;
-      it->get<2>() = new NFmiFastQueryInfo(qd);
-    }
-
-    NFmiFastQueryInfo& qi = *(it->get<2>());
+    NFmiQueryInfo& qi = header(it);
 
     qi.ResetLocation();
     while (qi.NextLocation())
@@ -280,7 +584,9 @@ std::set<int> QueryDataManager::stations()
     }
   }
 
-  return ret;
+  itsStations.swap(ret);
+  itsStationsKnown = true;
+  return itsStations;
 }
 
 // ----------------------------------------------------------------------
@@ -309,28 +615,38 @@ std::map<double, int> QueryDataManager::nearest(const NFmiPoint& theLonLat,
 
   for (storage_type::iterator it = itsData.begin(); it != itsData.end(); ++it)
   {
-    if (!it->get<1>())
-    {
-      std::string filename = NFmiFileSystem::FileComplete(it->get<0>(), itsSearchPath);
-      NFmiQueryData* qd = new NFmiQueryData(filename);
-      it->get<1>() = qd;
-      it->get<2>() = new NFmiFastQueryInfo(qd);
-    }
-
-    NFmiFastQueryInfo& qi = *(it->get<2>());
+    NFmiQueryInfo& qi = header(it);
 
     // Won't find nearest points from grids
     if (qi.IsGrid()) continue;
 
-    qi.ResetLocation();
-    while (qi.NextLocation())
+    // The stations come in increasing distance order, hence the search
+    // can stop once enough distinct distances have been found. Only
+    // those candidates are checked for valid data. Of equally distant
+    // stations the first one in the data is kept.
+
+    ReturnType found;
+    LocationTree::Search search(tree(it), theLonLat, theMaxDistance);
+    std::size_t index;
+    while (search.next(index))
     {
-      int wmo = qi.Location()->GetIdent();
+      qi.LocationIndex(index);
       double dist = qi.Location()->Distance(theLonLat);
-      if (dist <= theMaxDistance)
-        if (!theCheckingFlag || locationvalid(qi))
-          ret.insert(std::map<double, int>::value_type(dist, wmo));
+      if (dist > theMaxDistance) continue;
+
+      if (theCheckingFlag)
+      {
+        NFmiFastQueryInfo& data = require(it);
+        data.LocationIndex(index);
+        if (!locationvalid(data)) continue;
+      }
+
+      found.insert(ReturnType::value_type(dist, qi.Location()->GetIdent()));
+      if (theMaxNumber > 0 && found.size() >= static_cast<unsigned long>(theMaxNumber)) break;
     }
+
+    // Stations of earlier files are preferred at equal distances
+    ret.insert(found.begin(), found.end());
   }
 
   if (theMaxNumber > 0 && ret.size() > static_cast<unsigned long>(theMaxNumber))
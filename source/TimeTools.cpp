@@ -6,10 +6,525 @@
 // ======================================================================
 
 #include "TimeTools.h"
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <algorithm>
+#include <cctype>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <vector>
 
 using namespace std;
 
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Seconds since epoch of a time given as UTC
+ */
+// ----------------------------------------------------------------------
+
+::time_t epoch_time(const NFmiTime &theTime)
+{
+  struct ::tm utc;
+  utc.tm_sec = theTime.GetSec();
+  utc.tm_min = theTime.GetMin();
+  utc.tm_hour = theTime.GetHour();
+  utc.tm_mday = theTime.GetDay();
+  utc.tm_mon = theTime.GetMonth() - 1;     // tm months start from 0
+  utc.tm_year = theTime.GetYear() - 1900;  // tm years start from 1900
+  utc.tm_wday = -1;
+  utc.tm_yday = -1;
+  utc.tm_isdst = -1;
+
+  return NFmiStaticTime::my_timegm(&utc);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Days since epoch of the given date in the proleptic Gregorian calendar
+ */
+// ----------------------------------------------------------------------
+
+long days_since_epoch(int theYear, int theMonth, int theDay)
+{
+  const int y = theYear - (theMonth <= 2 ? 1 : 0);
+  const int era = (y >= 0 ? y : y - 399) / 400;
+  const int yoe = y - era * 400;
+  const int doy = (153 * (theMonth + (theMonth > 2 ? -3 : 9)) + 2) / 5 + theDay - 1;
+  const int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097L + doe - 719468;
+}
+
+bool is_leap(int theYear)
+{
+  return (theYear % 4 == 0 && theYear % 100 != 0) || theYear % 400 == 0;
+}
+
+int month_days(int theYear, int theMonth)
+{
+  static const int days[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+  return days[theMonth - 1] + (theMonth == 2 && is_leap(theYear) ? 1 : 0);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Local time types and transitions of a single time zone
+ *
+ * The zone is read from the compiled tz database the same way glibc
+ * reads it for localtime_r, but without setting TZ, which is process
+ * global. Times after the last transition of the file follow the
+ * POSIX TZ rule in its footer. A name which is not found in the
+ * database is parsed as a POSIX TZ rule, and if that fails too the
+ * zone is UTC, as in glibc. Leap second corrections are ignored.
+ *
+ * The tables are immutable once built, a conversion is a binary
+ * search in the transitions or a calculation of the two rule based
+ * changes of the year.
+ */
+// ----------------------------------------------------------------------
+
+class ZoneTable
+{
+ public:
+  explicit ZoneTable(const string &theZone);
+
+  long offset(::time_t theTime, bool &isdst) const;
+
+ private:
+  struct LocalType
+  {
+    long offset;  // UTC offset in seconds
+    bool isdst;   // is the offset daylight saving time
+  };
+
+  struct Transition
+  {
+    ::time_t time;   // UTC time of the transition
+    LocalType type;  // local time type after the transition
+
+    bool operator<(const Transition &theOther) const { return time < theOther.time; }
+  };
+
+  // Jn, n or Mm.w.d change date of a POSIX rule and the local time of the change
+  struct ChangeRule
+  {
+    char type;  // 'J', 'N' or 'M'
+    int month;
+    int week;
+    int day;
+    long time;
+  };
+
+  bool read_tzfile(const string &theFile);
+  bool parse_rule(const string &theRule);
+  ::time_t change_time(const ChangeRule &theRule, int theYear, long theOffset) const;
+  LocalType rule_type(::time_t theTime) const;
+
+  LocalType itsInitialType;  // before the first transition
+  vector<Transition> itsTransitions;
+
+  bool itsHasRule;
+  bool itsHasDst;
+  LocalType itsStd;
+  LocalType itsDst;
+  ChangeRule itsStart;
+  ChangeRule itsEnd;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read the zone from the tz database or parse it as a POSIX rule
+ */
+// ----------------------------------------------------------------------
+
+ZoneTable::ZoneTable(const string &theZone)
+    : itsInitialType(), itsTransitions(), itsHasRule(false), itsHasDst(false)
+{
+  itsInitialType.offset = 0;
+  itsInitialType.isdst = false;
+
+  string name = (!theZone.empty() && theZone[0] == ':' ? theZone.substr(1) : theZone);
+  if (name.empty()) return;
+
+  string file = name;
+  if (file[0] != '/')
+  {
+    const char *tzdir = getenv("TZDIR");
+    file = string(tzdir != 0 && *tzdir != '\0' ? tzdir : "/usr/share/zoneinfo") + "/" + name;
+  }
+
+  if (read_tzfile(file)) return;
+
+  itsTransitions.clear();
+  if (parse_rule(name))
+    itsInitialType = itsStd;
+  else
+    itsHasRule = false;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read a compiled tz database file
+ *
+ * Version 2 and later files repeat the data with 64-bit times, and
+ * end with the POSIX TZ rule for times after the last transition.
+ */
+// ----------------------------------------------------------------------
+
+bool ZoneTable::read_tzfile(const string &theFile)
+{
+  ifstream in(theFile.c_str(), ios::in | ios::binary);
+  if (!in) return false;
+  const string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+  const unsigned char *const begin = reinterpret_cast<const unsigned char *>(data.data());
+  const unsigned char *const end = begin + data.size();
+  const unsigned char *p = begin;
+
+  struct Reader
+  {
+    static long long get(const unsigned char *&p, int theBytes)
+    {
+      unsigned long long value = 0;
+      for (int i = 0; i < theBytes; i++)
+        value = (value << 8) | *p++;
+      if (theBytes == 4) return static_cast<int>(static_cast<unsigned int>(value));
+      return static_cast<long long>(value);
+    }
+  };
+
+  // The 32-bit block is skipped if there is a 64-bit one after it
+
+  int timesize = 4;
+  for (int block = 0; block < 2; block++)
+  {
+    if (end - p < 44 || data.compare(p - begin, 4, "TZif") != 0) return false;
+    const unsigned char version = p[4];
+    p += 20;
+    const long isutcnt = static_cast<long>(Reader::get(p, 4));
+    const long isstdcnt = static_cast<long>(Reader::get(p, 4));
+    const long leapcnt = static_cast<long>(Reader::get(p, 4));
+    const long timecnt = static_cast<long>(Reader::get(p, 4));
+    const long typecnt = static_cast<long>(Reader::get(p, 4));
+    const long charcnt = static_cast<long>(Reader::get(p, 4));
+
+    if (typecnt <= 0 || isutcnt < 0 || isstdcnt < 0 || leapcnt < 0 || timecnt < 0 || charcnt < 0)
+      return false;
+
+    const long size = timecnt * timesize + timecnt + typecnt * 6 + charcnt +
+                      leapcnt * (timesize + 4) + isstdcnt + isutcnt;
+    if (end - p < size) return false;
+
+    if (block == 0 && version >= '2')
+    {
+      p += size;
+      timesize = 8;
+      continue;
+    }
+
+    const unsigned char *times = p;
+    const unsigned char *indexes = times + timecnt * timesize;
+    const unsigned char *types = indexes + timecnt;
+
+    vector<LocalType> localtypes;
+    for (long i = 0; i < typecnt; i++)
+    {
+      const unsigned char *q = types + 6 * i;
+      LocalType type;
+      type.offset = static_cast<long>(Reader::get(q, 4));
+      type.isdst = (*q != 0);
+      localtypes.push_back(type);
+    }
+
+    for (long i = 0; i < timecnt; i++)
+    {
+      if (indexes[i] >= typecnt) return false;
+      Transition transition;
+      transition.time = static_cast<::time_t>(Reader::get(times, timesize));
+      transition.type = localtypes[indexes[i]];
+      itsTransitions.push_back(transition);
+    }
+
+    // Before the first transition the first standard time type is used
+
+    itsInitialType = localtypes[0];
+    for (long i = 0; i < typecnt; i++)
+      if (!localtypes[i].isdst)
+      {
+        itsInitialType = localtypes[i];
+        break;
+      }
+
+    p += size;
+    break;
+  }
+
+  // The rule is between newlines after the 64-bit data
+
+  if (timesize == 8 && p < end && *p == '\n')
+  {
+    const unsigned char *stop = find(p + 1, end, '\n');
+    const string rule(p + 1, stop);
+    if (!rule.empty() && !parse_rule(rule)) itsHasRule = false;
+  }
+
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Parse a POSIX TZ rule such as EET-2EEST,M3.5.0/3,M10.5.0/4
+ *
+ * Offsets in the rule are positive west of Greenwich. A daylight
+ * saving time without change rules uses the US rules, as glibc does.
+ */
+// ----------------------------------------------------------------------
+
+bool ZoneTable::parse_rule(const string &theRule)
+{
+  const char *p = theRule.c_str();
+
+  struct Parser
+  {
+    static bool name(const char *&p)
+    {
+      const char *start = p;
+      if (*p == '<')
+      {
+        const char *stop = strchr(p, '>');
+        if (stop == 0 || stop - p - 1 < 3) return false;
+        p = stop + 1;
+        return true;
+      }
+      while (isalpha(static_cast<unsigned char>(*p)))
+        ++p;
+      return p - start >= 3;
+    }
+
+    static bool number(const char *&p, long &theValue)
+    {
+      if (!isdigit(static_cast<unsigned char>(*p))) return false;
+      theValue = 0;
+      while (isdigit(static_cast<unsigned char>(*p)))
+        theValue = 10 * theValue + (*p++ - '0');
+      return true;
+    }
+
+    static bool time(const char *&p, long &theSeconds)
+    {
+      long sign = 1;
+      if (*p == '+' || *p == '-') sign = (*p++ == '-' ? -1 : 1);
+      long hours = 0, minutes = 0, seconds = 0;
+      if (!number(p, hours)) return false;
+      if (*p == ':' && !number(++p, minutes)) return false;
+      if (*p == ':' && !number(++p, seconds)) return false;
+      theSeconds = sign * (hours * 3600 + minutes * 60 + seconds);
+      return true;
+    }
+
+    static bool change(const char *&p, ChangeRule &theRule)
+    {
+      long a = 0, b = 0, c = 0;
+      if (*p == 'J')
+      {
+        theRule.type = 'J';
+        if (!number(++p, a) || a < 1 || a > 365) return false;
+        theRule.day = static_cast<int>(a);
+      }
+      else if (*p == 'M')
+      {
+        theRule.type = 'M';
+        if (!number(++p, a) || *p != '.' || !number(++p, b) || *p != '.' || !number(++p, c))
+          return false;
+        if (a < 1 || a > 12 || b < 1 || b > 5 || c > 6) return false;
+        theRule.month = static_cast<int>(a);
+        theRule.week = static_cast<int>(b);
+        theRule.day = static_cast<int>(c);
+      }
+      else
+      {
+        theRule.type = 'N';
+        if (!number(p, a) || a > 365) return false;
+        theRule.day = static_cast<int>(a);
+      }
+      theRule.time = 2 * 3600;
+      if (*p == '/') return time(++p, theRule.time);
+      return true;
+    }
+  };
+
+  long offset = 0;
+  if (!Parser::name(p) || !Parser::time(p, offset)) return false;
+  itsStd.offset = -offset;
+  itsStd.isdst = false;
+  itsHasRule = true;
+  itsHasDst = false;
+  if (*p == '\0') return true;
+
+  if (!Parser::name(p)) return false;
+  itsDst.offset = itsStd.offset + 3600;
+  itsDst.isdst = true;
+  if (*p != ',' && *p != '\0')
+  {
+    if (!Parser::time(p, offset)) return false;
+    itsDst.offset = -offset;
+  }
+
+  if (*p == '\0')
+  {
+    const ChangeRule start = {'M', 3, 2, 0, 2 * 3600};
+    const ChangeRule stop = {'M', 11, 1, 0, 2 * 3600};
+    itsStart = start;
+    itsEnd = stop;
+  }
+  else if (*p++ != ',' || !Parser::change(p, itsStart) || *p++ != ',' ||
+           !Parser::change(p, itsEnd) || *p != '\0')
+    return false;
+
+  itsHasDst = true;
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief UTC time of a rule based change in the given year
+ *
+ * \param theOffset The UTC offset in effect before the change
+ */
+// ----------------------------------------------------------------------
+
+::time_t ZoneTable::change_time(const ChangeRule &theRule, int theYear, long theOffset) const
+{
+  long days = days_since_epoch(theYear, 1, 1);
+
+  if (theRule.type == 'J')
+    days += theRule.day - 1 + (theRule.day >= 60 && is_leap(theYear) ? 1 : 0);
+  else if (theRule.type == 'N')
+    days += theRule.day;
+  else
+  {
+    // Day of the month of the first wanted weekday, then the wanted week,
+    // week 5 meaning the last one
+
+    const long first = days_since_epoch(theYear, theRule.month, 1);
+    const int weekday = static_cast<int>(((first + 4) % 7 + 7) % 7);  // 1970-01-01 was Thursday
+    int day = (theRule.day - weekday + 7) % 7;
+    for (int week = 1; week < theRule.week && day + 7 < month_days(theYear, theRule.month); week++)
+      day += 7;
+    days = first + day;
+  }
+
+  return static_cast<::time_t>(days) * 24 * 3600 + theRule.time - theOffset;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Local time type given by the POSIX rule
+ *
+ * The changes are those of the UTC year of the time. Like glibc, the
+ * changes of 1970 are used for earlier years. On the southern
+ * hemisphere daylight saving time continues over the new year.
+ */
+// ----------------------------------------------------------------------
+
+ZoneTable::LocalType ZoneTable::rule_type(::time_t theTime) const
+{
+  if (!itsHasDst) return itsStd;
+
+  struct ::tm utc;
+  ::gmtime_r(&theTime, &utc);
+  const int year = max(utc.tm_year + 1900, 1970);
+
+  const ::time_t start = change_time(itsStart, year, itsStd.offset);
+  const ::time_t stop = change_time(itsEnd, year, itsDst.offset);
+
+  bool isdst;
+  if (start > stop)
+    isdst = (theTime < stop || theTime >= start);
+  else
+    isdst = (theTime >= start && theTime < stop);
+  return (isdst ? itsDst : itsStd);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The UTC offset in seconds at the given UTC time
+ */
+// ----------------------------------------------------------------------
+
+long ZoneTable::offset(::time_t theTime, bool &isdst) const
+{
+  LocalType type = itsInitialType;
+
+  if (itsTransitions.empty() || theTime < itsTransitions.front().time)
+  {
+    if (itsTransitions.empty() && itsHasRule) type = rule_type(theTime);
+  }
+  else if (theTime >= itsTransitions.back().time)
+  {
+    type = (itsHasRule ? rule_type(theTime) : itsTransitions.back().type);
+  }
+  else
+  {
+    Transition key;
+    key.time = theTime;
+    vector<Transition>::const_iterator it =
+        upper_bound(itsTransitions.begin(), itsTransitions.end(), key);
+    type = (--it)->type;
+  }
+
+  isdst = type.isdst;
+  return type.offset;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The tables of the zones used so far
+ *
+ * The map is shared by all threads, hence it is accessed only while
+ * holding the mutex. The tables themselves are never modified once
+ * built and can be used without locking.
+ */
+// ----------------------------------------------------------------------
+
+boost::mutex zonemutex;
+map<string, boost::shared_ptr<ZoneTable> > zonetables;
+
+const ZoneTable &zone_table(const string &theZone)
+{
+  boost::lock_guard<boost::mutex> lock(zonemutex);
+  boost::shared_ptr<ZoneTable> &table = zonetables[theZone];
+  if (table) return *table;
+
+  string zone = theZone;
+  if (theZone == "fin")
+    zone = "Europe/Helsinki";
+  else if (theZone == "utc")
+    zone = "UTC";
+
+  table.reset(new ZoneTable(zone));
+  return *table;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The UTC offset of the zone at the given UTC time
+ */
+// ----------------------------------------------------------------------
+
+long utc_offset(::time_t theTime, const string &theZone, bool &isdst)
+{
+  return zone_table(theZone).offset(theTime, isdst);
+}
+
+}  // namespace
+
 namespace TimeTools
 {
 // ----------------------------------------------------------------------
@@ -23,19 +538,7 @@ namespace TimeTools
 
 const NFmiTime toLocalTime(const NFmiTime &theUtcTime)
 {
-  // The UTC time
-  struct ::tm utc;
-  utc.tm_sec = theUtcTime.GetSec();
-  utc.tm_min = theUtcTime.GetMin();
-  utc.tm_hour = theUtcTime.GetHour();
-  utc.tm_mday = theUtcTime.GetDay();
-  utc.tm_mon = theUtcTime.GetMonth() - 1;     // tm months start from 0
-  utc.tm_year = theUtcTime.GetYear() - 1900;  // tm years start from 1900
-  utc.tm_wday = -1;
-  utc.tm_yday = -1;
-  utc.tm_isdst = -1;
-
-  ::time_t epochtime = NFmiStaticTime::my_timegm(&utc);
+  ::time_t epochtime = epoch_time(theUtcTime);
 
   struct ::tm local;
   ::localtime_r(&epochtime, &local);
@@ -60,21 +563,42 @@ const NFmiTime toLocalTime(const NFmiTime &theUtcTime)
  *  utc = UTC
  *  local = coordinate based approximation
  *
+ * Vyhykkeen tiedot luetaan jrjestelmn aikavyhyketietokannasta
+ * TZ-ymprist muuttamatta, joten funktiota voi kutsua useasta sikeest.
  */
 // ----------------------------------------------------------------------
 
 const NFmiTime timezone_time(const NFmiTime &theUTCTime, const string &theZone)
 {
-  string zone = theZone;
-  if (theZone == "fin")
-    zone = "Europe/Helsinki";
-  else if (theZone == "utc")
-    zone = "UTC";
+  bool isdst;
+  ::time_t epochtime = epoch_time(theUTCTime);
+  epochtime += utc_offset(epochtime, theZone, isdst);
 
-  static string tzvalue = "TZ=" + zone;
-  putenv(const_cast<char *>(tzvalue.c_str()));
-  tzset();
+  struct ::tm local;
+  ::gmtime_r(&epochtime, &local);
 
-  return toLocalTime(theUTCTime);
+  NFmiTime out(local.tm_year + 1900,
+               local.tm_mon + 1,
+               local.tm_mday,
+               local.tm_hour,
+               local.tm_min,
+               local.tm_sec);
+
+  return out;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether daylight saving time is in effect in the time zone
+ *
+ * The zone names are as in timezone_time.
+ */
+// ----------------------------------------------------------------------
+
+bool is_dst(const NFmiTime &theUTCTime, const string &theZone)
+{
+  bool isdst;
+  utc_offset(epoch_time(theUTCTime), theZone, isdst);
+  return isdst;
 }
 }